@@ -1,10 +1,204 @@
 #include "event_queue.h"
 
+#include <algorithm>
 #include <thread>
 
 namespace ncode {
 using namespace std::chrono;
 
+constexpr size_t TimingWheelEventScheduler::kLevelCount;
+constexpr size_t TimingWheelEventScheduler::kSlotCount;
+
+void HeapEventScheduler::Push(const ScheduledEvent& event) {
+  queue_.emplace(event);
+}
+
+void HeapEventScheduler::EvictConsumer(EventConsumer* consumer) {
+  std::vector<ScheduledEvent> events;
+  while (!queue_.empty()) {
+    events.emplace_back(queue_.PopTop());
+  }
+
+  // The events keep their sequence numbers, so the relative order of events
+  // for the same time is preserved.
+  for (const ScheduledEvent& event : events) {
+    if (event.consumer != consumer) {
+      queue_.emplace(event);
+    }
+  }
+}
+
+// Order of events in a slot of the timing wheel.
+static bool EnqueuedBefore(const ScheduledEvent& lhs,
+                           const ScheduledEvent& rhs) {
+  if (lhs.enqueued_at != rhs.enqueued_at) {
+    return lhs.enqueued_at < rhs.enqueued_at;
+  }
+
+  return lhs.sequence < rhs.sequence;
+}
+
+void TimingWheelEventScheduler::Insert(const ScheduledEvent& event) {
+  uint64_t time = event.at.Raw();
+  DCHECK(time >= cursor_);
+  size_t level_index = TimingWheelLevel(time, cursor_);
+  size_t slot_index = TimingWheelSlot(time, level_index);
+
+  Level* level = &levels_[level_index];
+  Slot* slot = &level->slots[slot_index];
+  std::vector<ScheduledEvent>& events = slot->events;
+  if (events.empty()) {
+    level->occupied.Set(slot_index);
+  }
+
+  // Events are almost always enqueued at the current time, so will usually
+  // end up last. If not, the slot is sorted when it becomes the first one.
+  if (events.size() > slot->head && EnqueuedBefore(event, events.back())) {
+    slot->sorted = false;
+  }
+  events.emplace_back(event);
+
+  // Events in higher levels are always after events in the lowest level.
+  if (level_index == 0 && first_slot_ != nullptr && slot < first_slot_) {
+    first_slot_ = nullptr;
+  }
+}
+
+void TimingWheelEventScheduler::Push(const ScheduledEvent& event) {
+  if (event.at.Raw() < cursor_) {
+    past_.Push(event);
+    return;
+  }
+
+  Insert(event);
+  ++size_;
+}
+
+TimingWheelEventScheduler::Slot* TimingWheelEventScheduler::FirstSlot() {
+  DCHECK(size_ > 0);
+  if (first_slot_ == nullptr) {
+    first_slot_ = FindFirstSlot();
+  }
+
+  if (!first_slot_->sorted) {
+    std::vector<ScheduledEvent>& events = first_slot_->events;
+    std::sort(events.begin() + first_slot_->head, events.end(),
+              EnqueuedBefore);
+    first_slot_->sorted = true;
+  }
+
+  return first_slot_;
+}
+
+TimingWheelEventScheduler::Slot* TimingWheelEventScheduler::FindFirstSlot() {
+  while (true) {
+    size_t slot_index = levels_[0].occupied.FirstSet(
+        TimingWheelSlot(cursor_, 0));
+    if (slot_index != kSlotCount) {
+      return &levels_[0].slots[slot_index];
+    }
+
+    // The lowest level is empty, will cascade the first non-empty slot from
+    // the next non-empty level. All events in that slot are before events in
+    // other slots or in higher levels. The cursor moves to the earliest event
+    // in the slot, which will end up in the lowest level.
+    size_t level_index = 1;
+    while ((slot_index = levels_[level_index].occupied.FirstSet(0)) ==
+           kSlotCount) {
+      ++level_index;
+      CHECK(level_index < kLevelCount);
+    }
+
+    Level* level = &levels_[level_index];
+    Slot* slot = &level->slots[slot_index];
+    std::vector<ScheduledEvent>& slot_events = slot->events;
+    uint64_t min_time = slot_events.front().at.Raw();
+    for (const ScheduledEvent& event : slot_events) {
+      min_time = std::min(min_time, event.at.Raw());
+    }
+    cursor_ = min_time;
+
+    std::vector<ScheduledEvent> events;
+    std::swap(events, slot_events);
+    slot->sorted = true;
+    level->occupied.Clear(slot_index);
+    for (const ScheduledEvent& event : events) {
+      Insert(event);
+    }
+
+    // Will reuse the slot's memory.
+    events.clear();
+    std::swap(events, slot_events);
+  }
+}
+
+const ScheduledEvent& TimingWheelEventScheduler::Top() {
+  // Events before the cursor are before all events in the wheel.
+  if (!past_.empty()) {
+    return past_.Top();
+  }
+
+  Slot* slot = FirstSlot();
+  return slot->events[slot->head];
+}
+
+void TimingWheelEventScheduler::Pop() {
+  if (!past_.empty()) {
+    past_.Pop();
+    return;
+  }
+
+  Slot* slot = FirstSlot();
+  --size_;
+  if (++slot->head != slot->events.size()) {
+    return;
+  }
+
+  slot->events.clear();
+  slot->head = 0;
+  slot->sorted = true;
+  size_t slot_index = slot - levels_[0].slots;
+  levels_[0].occupied.Clear(slot_index);
+  first_slot_ = nullptr;
+}
+
+void TimingWheelEventScheduler::EvictConsumer(EventConsumer* consumer) {
+  past_.EvictConsumer(consumer);
+  for (size_t level_index = 0; level_index < kLevelCount; ++level_index) {
+    Level* level = &levels_[level_index];
+    for (size_t slot_index = 0; slot_index < kSlotCount; ++slot_index) {
+      Slot* slot = &level->slots[slot_index];
+      std::vector<ScheduledEvent>& events = slot->events;
+      auto it = std::remove_if(events.begin() + slot->head, events.end(),
+                               [consumer](const ScheduledEvent& event) {
+                                 return event.consumer == consumer;
+                               });
+      size_ -= std::distance(it, events.end());
+      events.erase(it, events.end());
+      if (events.size() == slot->head) {
+        events.clear();
+        slot->head = 0;
+        slot->sorted = true;
+        level->occupied.Clear(slot_index);
+      }
+    }
+  }
+
+  first_slot_ = nullptr;
+}
+
+std::unique_ptr<EventScheduler> EventQueue::NewScheduler(SchedulerType type) {
+  switch (type) {
+    case HEAP_SCHEDULER:
+      return make_unique<HeapEventScheduler>();
+    case TIMING_WHEEL_SCHEDULER:
+      return make_unique<TimingWheelEventScheduler>();
+  }
+
+  LOG(FATAL) << "Bad scheduler type";
+  return nullptr;
+}
+
 EventConsumer::~EventConsumer() {
   if (outstanding_event_count_ > 0) {
     LOG(INFO)
@@ -20,6 +214,17 @@ void EventConsumer::EnqueueAt(EventQueueTime at) {
   parent_event_queue_->Enqueue(at, this);
 }
 
+void EventConsumer::EnqueueAt(EventQueueTime at, EventQueueTime enqueued_at) {
+  ++outstanding_event_count_;
+  parent_event_queue_->Enqueue(at, enqueued_at, this);
+}
+
+void EventConsumer::EnqueueAt(EventQueueTime at, EventQueueTime enqueued_at,
+                              uint64_t sequence) {
+  ++outstanding_event_count_;
+  parent_event_queue_->Enqueue(at, enqueued_at, sequence, this);
+}
+
 void EventConsumer::EnqueueIn(EventQueueTime in) {
   ++outstanding_event_count_;
   parent_event_queue_->Enqueue(parent_event_queue_->CurrentTime() + in, this);
@@ -31,14 +236,14 @@ void EventConsumer::HandleEventPublic() {
 }
 
 void EventQueue::Run() {
-  while (!queue_.empty()) {
-    ScheduledEvent* next_event = NextEvent();
+  while (!scheduler_->empty()) {
+    const ScheduledEvent& next_event = NextEvent();
     EventQueueTime now = CurrentTime();
     if (now >= stop_time_) {
       break;
     }
 
-    EventConsumer* consumer = next_event->consumer;
+    EventConsumer* consumer = next_event.consumer;
     PopEvent();
     consumer->HandleEventPublic();
   }
@@ -53,7 +258,17 @@ void EventQueue::StopIn(std::chrono::nanoseconds ms) {
 }
 
 void EventQueue::Enqueue(EventQueueTime at, EventConsumer* consumer) {
-  queue_.emplace(at, consumer);
+  Enqueue(at, CurrentTime(), consumer);
+}
+
+void EventQueue::Enqueue(EventQueueTime at, EventQueueTime enqueued_at,
+                         EventConsumer* consumer) {
+  Enqueue(at, enqueued_at, next_sequence_++, consumer);
+}
+
+void EventQueue::Enqueue(EventQueueTime at, EventQueueTime enqueued_at,
+                         uint64_t sequence, EventConsumer* consumer) {
+  scheduler_->Push({at, enqueued_at, sequence, consumer});
 }
 
 void EventQueue::Enqueue(EventConsumer* consumer) {
@@ -69,24 +284,22 @@ uint64_t EventQueue::TimeToRawMillis(EventQueueTime duration) const {
   return duration_cast<milliseconds>(nanos).count();
 }
 
-EventQueue::ScheduledEvent* EventQueue::NextEvent() {
-  // Very ugly, but should be fine, since we will pop the element immediately.
-  ScheduledEvent* next_event = const_cast<ScheduledEvent*>(&(queue_.top()));
-  AdvanceTimeTo(next_event->at);
+const ScheduledEvent& EventQueue::NextEvent() {
+  const ScheduledEvent& next_event = scheduler_->Top();
+  AdvanceTimeTo(next_event.at);
   return next_event;
 }
 
-void EventQueue::EvictConsumer(EventConsumer* consumer) {
-  std::vector<ScheduledEvent> events;
-  while (!queue_.empty()) {
-    events.emplace_back(queue_.PopTop());
+EventQueueTime EventQueue::NextEventTime() {
+  if (scheduler_->empty()) {
+    return EventQueueTime::MaxTime();
   }
 
-  for (const ScheduledEvent& event : events) {
-    if (event.consumer != consumer) {
-      queue_.emplace(event.at, event.consumer);
-    }
-  }
+  return scheduler_->Top().at;
+}
+
+void EventQueue::EvictConsumer(EventConsumer* consumer) {
+  scheduler_->EvictConsumer(consumer);
 }
 
 EventQueueTime RealTimeEventQueue::CurrentTime() const {
@@ -5,12 +5,14 @@
 #include <cstdint>
 #include <iostream>
 #include <limits>
+#include <memory>
 #include <queue>
 #include <ratio>
 #include <vector>
 
 #include "common.h"
 #include "logging.h"
+#include "timing_wheel.h"
 
 namespace ncode {
 
@@ -86,6 +88,163 @@ class EventQueueTime {
 };
 
 class EventQueue;
+class EventConsumer;
+
+// An event that is scheduled to trigger at a given time. If the event is late
+// 'at' will be less than the current time of the queue.
+struct ScheduledEvent {
+  ScheduledEvent(EventQueueTime at, EventQueueTime enqueued_at,
+                 uint64_t sequence, EventConsumer* consumer)
+      : at(at),
+        enqueued_at(enqueued_at),
+        sequence(sequence),
+        consumer(consumer) {}
+
+  EventQueueTime at;
+
+  // The time the event was enqueued at. Events for the same time are ordered
+  // by this.
+  EventQueueTime enqueued_at;
+
+  // Orders events for the same time that were enqueued at the same time. The
+  // event queue assigns increasing sequence numbers as events are added.
+  uint64_t sequence;
+
+  EventConsumer* consumer;
+};
+
+// Keeps track of scheduled events for an EventQueue and returns them in time
+// order. Events scheduled for the same time are returned in the order they
+// were enqueued at, and in sequence order if they were enqueued at the same
+// time. No two events should have the same sequence number.
+class EventScheduler {
+ public:
+  virtual ~EventScheduler() {}
+
+  // Adds an event.
+  virtual void Push(const ScheduledEvent& event) = 0;
+
+  // The earliest event. The scheduler should not be empty.
+  virtual const ScheduledEvent& Top() = 0;
+
+  // Removes the earliest event. The scheduler should not be empty.
+  virtual void Pop() = 0;
+
+  // Removes all events for a consumer.
+  virtual void EvictConsumer(EventConsumer* consumer) = 0;
+
+  // Number of scheduled events.
+  virtual size_t size() const = 0;
+
+  bool empty() const { return size() == 0; }
+
+ protected:
+  EventScheduler() {}
+
+ private:
+  DISALLOW_COPY_AND_ASSIGN(EventScheduler);
+};
+
+// A scheduler that keeps all events in a binary heap. Enqueue and dequeue are
+// O(log n) in the number of scheduled events.
+class HeapEventScheduler : public EventScheduler {
+ public:
+  HeapEventScheduler() {}
+
+  void Push(const ScheduledEvent& event) override;
+  const ScheduledEvent& Top() override { return queue_.top(); }
+  void Pop() override { queue_.pop(); }
+  void EvictConsumer(EventConsumer* consumer) override;
+  size_t size() const override { return queue_.size(); }
+
+ private:
+  struct Comparator {
+    bool operator()(const ScheduledEvent& lhs, const ScheduledEvent& rhs) {
+      if (lhs.at != rhs.at) {
+        return lhs.at > rhs.at;
+      }
+
+      if (lhs.enqueued_at != rhs.enqueued_at) {
+        return lhs.enqueued_at > rhs.enqueued_at;
+      }
+
+      return lhs.sequence > rhs.sequence;
+    }
+  };
+
+  VectorPriorityQueue<ScheduledEvent, Comparator> queue_;
+};
+
+// A hierarchical timing wheel. There are 8 levels of 256 slots, one level per
+// byte of the time. An event is placed in the level of the most significant
+// byte in which its time differs from the wheel's cursor, and in the slot
+// given by the value of that byte. When the lowest level runs out of events
+// the first non-empty slot of the next non-empty level is cascaded down and
+// the cursor moves to the earliest event in that slot. All events in a slot of
+// the lowest level are for the same time. Each event is moved at most 7 times,
+// so enqueue and dequeue are O(1) amortized. Events scheduled before the
+// cursor (in the past) are kept in a separate heap.
+class TimingWheelEventScheduler : public EventScheduler {
+ public:
+  static constexpr size_t kLevelCount = kTimingWheelLevelCount;
+  static constexpr size_t kSlotCount = kTimingWheelSlotCount;
+
+  TimingWheelEventScheduler() : first_slot_(nullptr), cursor_(0), size_(0) {}
+
+  void Push(const ScheduledEvent& event) override;
+  const ScheduledEvent& Top() override;
+  void Pop() override;
+  void EvictConsumer(EventConsumer* consumer) override;
+  size_t size() const override { return size_ + past_.size(); }
+
+ private:
+  struct Slot {
+    Slot() : head(0), sorted(true) {}
+
+    // Events in the slot, ordered by the time they were enqueued at and by
+    // sequence number if 'sorted' is set. Only events from 'head' onwards are
+    // valid. The head is only advanced in the lowest level, other levels are
+    // always cascaded in full.
+    std::vector<ScheduledEvent> events;
+    size_t head;
+
+    // False if events were added out of order. The slot is sorted when it
+    // becomes the first one.
+    bool sorted;
+  };
+
+  struct Level {
+    Slot slots[kSlotCount];
+
+    TimingWheelBitmap occupied;
+  };
+
+  // Adds an event, assumes that it is not before the cursor.
+  void Insert(const ScheduledEvent& event);
+
+  // Returns the slot in the lowest level that contains the earliest event,
+  // sorted. The wheel should not be empty.
+  Slot* FirstSlot();
+
+  // Finds the first non-empty slot in the lowest level, cascading events from
+  // higher levels if needed.
+  Slot* FindFirstSlot();
+
+  Level levels_[kLevelCount];
+
+  // The slot last returned by FirstSlot, or null if it is not known.
+  Slot* first_slot_;
+
+  // All events in the wheel are at or after this time.
+  uint64_t cursor_;
+
+  // Number of events in the wheel.
+  size_t size_;
+
+  // Events before the cursor. Happens when an event is scheduled in the past,
+  // or before the earliest event after the wheel has moved to it.
+  HeapEventScheduler past_;
+};
 
 // An entity that knows how to process events.
 class EventConsumer {
@@ -105,6 +264,16 @@ class EventConsumer {
   // Enqueues an event for this consumer at a given time from the current time.
   void EnqueueIn(EventQueueTime in);
 
+  // Like EnqueueAt, but the event is ordered among other events for the same
+  // time as if it was enqueued at 'enqueued_at' instead of the current time.
+  // Useful when an event is scheduled some time after it was caused.
+  void EnqueueAt(EventQueueTime at, EventQueueTime enqueued_at);
+
+  // Like EnqueueAt, but the event is also ordered as if it was added when
+  // 'sequence' was returned by EventQueue::ReserveSequence.
+  void EnqueueAt(EventQueueTime at, EventQueueTime enqueued_at,
+                 uint64_t sequence);
+
   // Should be called by the event queue.
   void HandleEventPublic();
 
@@ -176,12 +345,40 @@ class EventQueue {
     Run();
   }
 
+  // Runs all events that are scheduled before a given time.
+  void RunUntil(EventQueueTime time) {
+    stop_time_ = time;
+    Run();
+  }
+
+  // The time of the earliest scheduled event, or MaxTime if there are no
+  // events.
+  EventQueueTime NextEventTime();
+
+  // Returns the sequence number the next event added to the queue would get.
+  // An event that is added later with this sequence number is ordered among
+  // events for the same time that were enqueued at the same time as if it was
+  // added now.
+  uint64_t ReserveSequence() { return next_sequence_++; }
+
   // Evicts from the queue all events for a given consumer. This is slow, do not
   // call often.
   void EvictConsumer(EventConsumer* consumer);
 
+  // The type of scheduler used to keep track of events.
+  enum SchedulerType {
+    HEAP_SCHEDULER = 0,
+    TIMING_WHEEL_SCHEDULER = 1,
+  };
+
+  // Returns a new scheduler of a given type.
+  static std::unique_ptr<EventScheduler> NewScheduler(SchedulerType type);
+
  protected:
-  EventQueue() : stop_time_(EventQueueTime::MaxTime()) {}
+  explicit EventQueue(SchedulerType scheduler_type = HEAP_SCHEDULER)
+      : stop_time_(EventQueueTime::MaxTime()),
+        next_sequence_(0),
+        scheduler_(NewScheduler(scheduler_type)) {}
 
   // Converts from nanoseconds to EventQueueTime. Implementation-dependent.
   virtual EventQueueTime NanosToTime(
@@ -197,6 +394,10 @@ class EventQueue {
  private:
   // Schedules an EventConsumer to get an event at some point in time.
   void Enqueue(EventQueueTime at, EventConsumer* consumer);
+  void Enqueue(EventQueueTime at, EventQueueTime enqueued_at,
+               EventConsumer* consumer);
+  void Enqueue(EventQueueTime at, EventQueueTime enqueued_at,
+               uint64_t sequence, EventConsumer* consumer);
 
   // Schedules an EventConsumer to get an event as soon as possible.
   void Enqueue(EventConsumer* consumer);
@@ -204,34 +405,20 @@ class EventQueue {
   // Sets the time the queue will be closed.
   void StopIn(std::chrono::nanoseconds ms);
 
-  // The time the next event was scheduled to execute and the event itself. If
-  // the event is late the first element in the pair will be less than
-  // CurrentTime().
-  struct ScheduledEvent {
-    ScheduledEvent(EventQueueTime at, EventConsumer* consumer)
-        : at(at), consumer(consumer) {}
-
-    EventQueueTime at;
-    EventConsumer* consumer;
-  };
-
-  struct Comparator {
-    bool operator()(const ScheduledEvent& lhs, const ScheduledEvent& rhs) {
-      return lhs.at > rhs.at;
-    }
-  };
-
   // Returns the next pending event.
-  ScheduledEvent* NextEvent();
+  const ScheduledEvent& NextEvent();
 
   // Pops the most recent event.
-  void PopEvent() { queue_.pop(); }
+  void PopEvent() { scheduler_->Pop(); }
 
   // When to stop executing events.
   EventQueueTime stop_time_;
 
-  // The queue itself.
-  VectorPriorityQueue<ScheduledEvent, Comparator> queue_;
+  // The sequence number of the next event.
+  uint64_t next_sequence_;
+
+  // Keeps track of all events.
+  std::unique_ptr<EventScheduler> scheduler_;
 
   friend class EventConsumer;
 
@@ -250,13 +437,16 @@ class RealTimeEventQueue : public EventQueue {
   void AdvanceTimeTo(EventQueueTime at) override;
 };
 
-// An event queue implementation that runs on simulated time.
+// An event queue implementation that runs on simulated time. The timing wheel
+// scheduler is faster than the default heap when there are many outstanding
+// events.
 class SimTimeEventQueue : public EventQueue {
  public:
   typedef std::ratio<1l, 1000000000000l> pico;
   typedef std::chrono::duration<uint64_t, pico> picoseconds;
 
-  SimTimeEventQueue() : time_(0) {}
+  explicit SimTimeEventQueue(SchedulerType scheduler_type = HEAP_SCHEDULER)
+      : EventQueue(scheduler_type), time_(0) {}
   EventQueueTime CurrentTime() const override { return time_; }
   EventQueueTime NanosToTime(std::chrono::nanoseconds duration) const override;
   std::chrono::nanoseconds TimeToNanos(EventQueueTime duration) const override;
@@ -0,0 +1,76 @@
+#include <stddef.h>
+#include <chrono>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <vector>
+
+#include "common.h"
+#include "event_queue.h"
+
+using namespace std::chrono;
+static constexpr size_t kTotalEvents = 10000000;
+
+// A consumer that keeps rescheduling itself after a random delay, like a
+// packet source or a pipe would.
+class HoldConsumer : public ncode::EventConsumer {
+ public:
+  HoldConsumer(ncode::EventQueue* event_queue, size_t event_count,
+               std::mt19937* rnd)
+      : ncode::EventConsumer("Hold", event_queue),
+        rnd_(rnd),
+        delay_dist_(event_queue->ToTime(nanoseconds(100)).Raw(),
+                    event_queue->ToTime(milliseconds(1)).Raw()),
+        events_remaining_(event_count) {}
+
+  void Schedule() {
+    EnqueueIn(ncode::EventQueueTime(delay_dist_(*rnd_)));
+  }
+
+  void HandleEvent() override {
+    if (--events_remaining_ > 0) {
+      Schedule();
+    }
+  }
+
+ private:
+  std::mt19937* rnd_;
+  std::uniform_int_distribution<uint64_t> delay_dist_;
+  size_t events_remaining_;
+};
+
+// Runs the hold model with a given number of outstanding events.
+static uint64_t TimeHold(ncode::EventQueue::SchedulerType scheduler_type,
+                         size_t outstanding_events) {
+  ncode::SimTimeEventQueue event_queue(scheduler_type);
+  std::mt19937 rnd(1);
+  std::vector<std::unique_ptr<HoldConsumer>> consumers;
+  for (size_t i = 0; i < outstanding_events; ++i) {
+    consumers.emplace_back(ncode::make_unique<HoldConsumer>(
+        &event_queue, kTotalEvents / outstanding_events, &rnd));
+    consumers.back()->Schedule();
+  }
+
+  auto start = high_resolution_clock::now();
+  event_queue.RunAndStopIn(hours(1));
+  auto end = high_resolution_clock::now();
+  auto duration = duration_cast<milliseconds>(end - start);
+  return duration.count();
+}
+
+int main(int argc, char** argv) {
+  ncode::Unused(argc);
+  ncode::Unused(argv);
+
+  // Will compare the heap vs the timing wheel for different numbers of events
+  // in the queue. The total number of events is the same in all cases.
+  for (size_t outstanding_events : {1000, 10000, 100000, 1000000}) {
+    uint64_t heap_ms =
+        TimeHold(ncode::EventQueue::HEAP_SCHEDULER, outstanding_events);
+    uint64_t wheel_ms =
+        TimeHold(ncode::EventQueue::TIMING_WHEEL_SCHEDULER, outstanding_events);
+    std::cout << outstanding_events << " outstanding events\n";
+    std::cout << "Heap " << heap_ms << "ms\n";
+    std::cout << "Timing wheel " << wheel_ms << "ms\n";
+  }
+}
@@ -4,6 +4,7 @@
 #include <cassert>
 #include <functional>
 #include <memory>
+#include <random>
 #include <thread>
 
 #include <gtest/gtest.h>
@@ -169,22 +170,25 @@ TEST_F(PeriodicRunnerFixture, DISABLED_AverageRate) {
   ASSERT_NEAR(200, i, 5);
 }
 
-class SimEventQueueFixture : public ::testing::Test {
+class SimEventQueueFixture
+    : public ::testing::TestWithParam<EventQueue::SchedulerType> {
  protected:
+  SimEventQueueFixture() : queue_(GetParam()) {}
+
   SimTimeEventQueue queue_;
 };
 
-TEST_F(SimEventQueueFixture, Init) {
+TEST_P(SimEventQueueFixture, Init) {
   ASSERT_EQ(EventQueueTime::ZeroTime(), queue_.CurrentTime());
   ASSERT_EQ(EventQueueTime::MaxTime(), queue_.StopTime());
 }
 
-TEST_F(SimEventQueueFixture, RunUntil) {
+TEST_P(SimEventQueueFixture, RunUntil) {
   queue_.RunAndStopIn(milliseconds(100));
   ASSERT_EQ(queue_.TimeToNanos(queue_.CurrentTime()), milliseconds(100));
 }
 
-TEST_F(SimEventQueueFixture, ScheduleAt) {
+TEST_P(SimEventQueueFixture, ScheduleAt) {
   bool tmp = false;
   DummyConsumer consumer(&queue_, [&tmp] { tmp = true; });
   consumer.EnqueueAt(queue_.ToTime(milliseconds(500)));
@@ -194,7 +198,7 @@ TEST_F(SimEventQueueFixture, ScheduleAt) {
   ASSERT_EQ(queue_.TimeToNanos(queue_.CurrentTime()), milliseconds(1000));
 }
 
-TEST_F(SimEventQueueFixture, ScheduleAtTooShort) {
+TEST_P(SimEventQueueFixture, ScheduleAtTooShort) {
   bool tmp = false;
   DummyConsumer consumer(&queue_, [&tmp] { tmp = true; });
   consumer.EnqueueAt(queue_.ToTime(milliseconds(500)));
@@ -202,7 +206,7 @@ TEST_F(SimEventQueueFixture, ScheduleAtTooShort) {
   ASSERT_FALSE(tmp);
 }
 
-TEST_F(SimEventQueueFixture, ScheduleAtExact) {
+TEST_P(SimEventQueueFixture, ScheduleAtExact) {
   bool tmp = false;
   DummyConsumer consumer(&queue_, [&tmp] { tmp = true; });
   consumer.EnqueueAt(queue_.ToTime(milliseconds(500)));
@@ -212,7 +216,7 @@ TEST_F(SimEventQueueFixture, ScheduleAtExact) {
   ASSERT_FALSE(tmp);
 }
 
-TEST_F(SimEventQueueFixture, RunTwice) {
+TEST_P(SimEventQueueFixture, RunTwice) {
   bool tmp = false;
   DummyConsumer consumer(&queue_, [&tmp] { tmp = true; });
   queue_.RunAndStopIn(milliseconds(500));
@@ -223,7 +227,7 @@ TEST_F(SimEventQueueFixture, RunTwice) {
   ASSERT_TRUE(tmp);
 }
 
-TEST_F(SimEventQueueFixture, RawMillis) {
+TEST_P(SimEventQueueFixture, RawMillis) {
   uint64_t millis_at = 0;
   EventQueueTime time_at;
 
@@ -237,5 +241,214 @@ TEST_F(SimEventQueueFixture, RawMillis) {
   ASSERT_EQ(queue_.RawMillisToTime(500), time_at);
 }
 
+TEST_P(SimEventQueueFixture, SameTimeFIFO) {
+  std::vector<int> values;
+  std::vector<std::unique_ptr<DummyConsumer>> consumers;
+  for (int i = 0; i < 1000; ++i) {
+    consumers.emplace_back(make_unique<DummyConsumer>(
+        &queue_, [&values, i] { values.emplace_back(i); }));
+  }
+
+  for (int i = 0; i < 1000; ++i) {
+    consumers[i]->EnqueueAt(queue_.ToTime(milliseconds(i % 2 ? 10 : 20)));
+  }
+  queue_.RunAndStopIn(milliseconds(1000));
+
+  std::vector<int> model;
+  for (int i = 1; i < 1000; i += 2) {
+    model.emplace_back(i);
+  }
+  for (int i = 0; i < 1000; i += 2) {
+    model.emplace_back(i);
+  }
+  ASSERT_EQ(model, values);
+}
+
+TEST_P(SimEventQueueFixture, SameTimeEnqueuedAt) {
+  std::vector<int> values;
+  DummyConsumer c1(&queue_, [&values] { values.emplace_back(1); });
+  DummyConsumer c2(&queue_, [&values] { values.emplace_back(2); });
+  DummyConsumer c3(&queue_, [&values] { values.emplace_back(3); });
+
+  // c3's event is added last, but is ordered as if it was enqueued first.
+  queue_.RunAndStopIn(milliseconds(5));
+  c1.EnqueueAt(queue_.ToTime(milliseconds(10)));
+  c2.EnqueueAt(queue_.ToTime(milliseconds(10)));
+  c3.EnqueueAt(queue_.ToTime(milliseconds(10)), queue_.ToTime(milliseconds(1)));
+  queue_.RunAndStopIn(milliseconds(100));
+  ASSERT_EQ(std::vector<int>({3, 1, 2}), values);
+}
+
+TEST_P(SimEventQueueFixture, SameTimeReservedSequence) {
+  std::vector<int> values;
+  DummyConsumer c1(&queue_, [&values] { values.emplace_back(1); });
+  DummyConsumer c2(&queue_, [&values] { values.emplace_back(2); });
+
+  // c2's event is added last, but is ordered as if it was added first.
+  uint64_t sequence = queue_.ReserveSequence();
+  c1.EnqueueAt(queue_.ToTime(milliseconds(10)));
+  c2.EnqueueAt(queue_.ToTime(milliseconds(10)), queue_.CurrentTime(),
+               sequence);
+  queue_.RunAndStopIn(milliseconds(100));
+  ASSERT_EQ(std::vector<int>({2, 1}), values);
+}
+
+TEST_P(SimEventQueueFixture, EnqueueAfterStop) {
+  std::vector<int> values;
+  DummyConsumer c1(&queue_, [&values] { values.emplace_back(1); });
+  DummyConsumer c2(&queue_, [&values] { values.emplace_back(2); });
+
+  // The second run will stop before c1's event is consumed. c2's event is
+  // before c1's.
+  c1.EnqueueAt(queue_.ToTime(seconds(10)));
+  queue_.RunAndStopIn(milliseconds(1));
+  c2.EnqueueAt(queue_.ToTime(milliseconds(2)));
+  queue_.RunAndStopIn(seconds(100));
+  ASSERT_EQ(std::vector<int>({2, 1}), values);
+}
+
+TEST_P(SimEventQueueFixture, Evict) {
+  std::vector<int> values;
+  auto c1 = make_unique<DummyConsumer>(&queue_,
+                                       [&values] { values.emplace_back(1); });
+  DummyConsumer c2(&queue_, [&values] { values.emplace_back(2); });
+
+  for (size_t i = 0; i < 10; ++i) {
+    c1->EnqueueAt(queue_.ToTime(milliseconds(i * 100)));
+    c2.EnqueueAt(queue_.ToTime(milliseconds(i * 100)));
+  }
+
+  // Will evict c1's events.
+  c1.reset();
+  queue_.RunAndStopIn(seconds(100));
+  ASSERT_EQ(std::vector<int>(10, 2), values);
+}
+
+INSTANTIATE_TEST_CASE_P(
+    Schedulers, SimEventQueueFixture,
+    ::testing::Values(EventQueue::HEAP_SCHEDULER,
+                      EventQueue::TIMING_WHEEL_SCHEDULER));
+
+// Pops all events from a scheduler.
+static std::vector<std::pair<uint64_t, EventConsumer*>> PopAll(
+    EventScheduler* scheduler) {
+  std::vector<std::pair<uint64_t, EventConsumer*>> out;
+  while (!scheduler->empty()) {
+    const ScheduledEvent& event = scheduler->Top();
+    out.emplace_back(event.at.Raw(), event.consumer);
+    scheduler->Pop();
+  }
+
+  return out;
+}
+
+// The consumers are never dereferenced by the schedulers, so can use fake
+// pointers to identify events.
+static EventConsumer* FakeConsumer(size_t i) {
+  return reinterpret_cast<EventConsumer*>(i + 1);
+}
+
+TEST(TimingWheelSchedulerTest, Random) {
+  HeapEventScheduler heap;
+  TimingWheelEventScheduler wheel;
+  std::mt19937 rnd(1);
+
+  // Times will be spread over a wide range, with many duplicates.
+  std::vector<uint64_t> deltas = {0, 1, 255, 256, 1000, 1ul << 20,
+                                  1ul << 40, 1ul << 60};
+  std::uniform_int_distribution<size_t> delta_dist(0, deltas.size() - 1);
+  std::uniform_int_distribution<size_t> op_dist(0, 2);
+  uint64_t now = 0;
+  for (size_t i = 0; i < 100000; ++i) {
+    if (op_dist(rnd) == 0 && !heap.empty()) {
+      ASSERT_EQ(heap.size(), wheel.size());
+      const ScheduledEvent& heap_top = heap.Top();
+      const ScheduledEvent& wheel_top = wheel.Top();
+      ASSERT_EQ(heap_top.at, wheel_top.at);
+      ASSERT_EQ(heap_top.consumer, wheel_top.consumer);
+      now = heap_top.at.Raw();
+      heap.Pop();
+      wheel.Pop();
+      continue;
+    }
+
+    // Every once in a while an event will be in the past.
+    uint64_t at = now + deltas[delta_dist(rnd)];
+    if (i % 1000 == 0) {
+      at = now / 2;
+    }
+
+    // Some events are scheduled as if they were enqueued in the past.
+    uint64_t enqueued_at = now;
+    if (i % 10 == 0) {
+      enqueued_at = now / 3;
+    }
+
+    ScheduledEvent event(EventQueueTime(at), EventQueueTime(enqueued_at), i,
+                         FakeConsumer(i));
+    heap.Push(event);
+    wheel.Push(event);
+  }
+
+  auto from_heap = PopAll(&heap);
+  ASSERT_EQ(from_heap, PopAll(&wheel));
+  ASSERT_TRUE(std::is_sorted(
+      from_heap.begin(), from_heap.end(),
+      [](const std::pair<uint64_t, EventConsumer*>& lhs,
+         const std::pair<uint64_t, EventConsumer*>& rhs) {
+        return lhs.first < rhs.first;
+      }));
+}
+
+TEST(TimingWheelSchedulerTest, PushBeforeCursor) {
+  TimingWheelEventScheduler wheel;
+  wheel.Push({EventQueueTime(1000), EventQueueTime(0), 0, FakeConsumer(0)});
+  wheel.Push({EventQueueTime(1 << 20), EventQueueTime(0), 1, FakeConsumer(1)});
+
+  // Moves the wheel to the first event.
+  ASSERT_EQ(EventQueueTime(1000), wheel.Top().at);
+  wheel.Push({EventQueueTime(700), EventQueueTime(0), 2, FakeConsumer(2)});
+  wheel.Push({EventQueueTime(500), EventQueueTime(0), 3, FakeConsumer(3)});
+  ASSERT_EQ(4ul, wheel.size());
+
+  std::vector<std::pair<uint64_t, EventConsumer*>> model = {
+      {500, FakeConsumer(3)},
+      {700, FakeConsumer(2)},
+      {1000, FakeConsumer(0)},
+      {1 << 20, FakeConsumer(1)}};
+  ASSERT_EQ(model, PopAll(&wheel));
+}
+
+TEST(TimingWheelSchedulerTest, SameTimeOutOfOrder) {
+  TimingWheelEventScheduler wheel;
+  wheel.Push({EventQueueTime(100), EventQueueTime(50), 10, FakeConsumer(0)});
+  ASSERT_EQ(FakeConsumer(0), wheel.Top().consumer);
+
+  // Added to the first slot, but ordered before the event that is there.
+  wheel.Push({EventQueueTime(100), EventQueueTime(50), 5, FakeConsumer(1)});
+  wheel.Push({EventQueueTime(100), EventQueueTime(10), 20, FakeConsumer(2)});
+  std::vector<std::pair<uint64_t, EventConsumer*>> model = {
+      {100, FakeConsumer(2)}, {100, FakeConsumer(1)}, {100, FakeConsumer(0)}};
+  ASSERT_EQ(model, PopAll(&wheel));
+}
+
+TEST(TimingWheelSchedulerTest, EvictPartiallyConsumed) {
+  TimingWheelEventScheduler wheel;
+  for (size_t i = 0; i < 10; ++i) {
+    wheel.Push(
+        {EventQueueTime(100), EventQueueTime(0), i, FakeConsumer(i % 2)});
+  }
+
+  wheel.Pop();
+  wheel.EvictConsumer(FakeConsumer(1));
+  ASSERT_EQ(4ul, wheel.size());
+  std::vector<std::pair<uint64_t, EventConsumer*>> model(
+      4, {100, FakeConsumer(0)});
+  ASSERT_EQ(model, PopAll(&wheel));
+
+  wheel.Push({EventQueueTime(50), EventQueueTime(0), 10, FakeConsumer(0)});
+  ASSERT_EQ(EventQueueTime(50), wheel.Top().at);
+}
+
 }  // namespace
 }  // namespace ncode
@@ -0,0 +1,131 @@
+#include "fork.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <cstdio>
+#include <iostream>
+
+#include "logging.h"
+
+namespace ncode {
+
+// Writes all of 'data' to a file descriptor. Returns false on error.
+static bool WriteAll(int fd, const std::string& data) {
+  size_t written = 0;
+  while (written < data.size()) {
+    ssize_t ret = write(fd, data.data() + written, data.size() - written);
+    if (ret == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return false;
+    }
+    written += ret;
+  }
+
+  return true;
+}
+
+// A child that is still running.
+struct RunningChild {
+  size_t variant_index;
+  pid_t pid;
+
+  // Read end of the pipe the child writes its output to.
+  int fd;
+};
+
+// Starts a child that runs a variant and writes its output to a pipe. Does
+// not return in the child.
+static RunningChild StartChild(size_t variant_index,
+                               const std::function<std::string(size_t)>& f) {
+  int fds[2];
+  CHECK(pipe(fds) != -1) << "Unable to create pipe";
+
+  // Anything buffered would otherwise be written by the parent and by every
+  // child.
+  fflush(nullptr);
+  std::cout.flush();
+  std::cerr.flush();
+
+  pid_t pid = fork();
+  CHECK(pid != -1) << "Unable to fork";
+  if (pid == 0) {
+    close(fds[0]);
+    std::string output = f(variant_index);
+    bool written = WriteAll(fds[1], output);
+    close(fds[1]);
+    _exit(written ? 0 : 1);
+  }
+
+  close(fds[1]);
+  return {variant_index, pid, fds[0]};
+}
+
+std::vector<VariantResult> RunForkedVariants(
+    size_t variant_count, std::function<std::string(size_t)> variant,
+    size_t max_parallel) {
+  CHECK(max_parallel > 0) << "Zero max parallel";
+
+  std::vector<VariantResult> results(variant_count);
+  std::vector<RunningChild> running;
+  std::vector<pollfd> pollfds;
+  size_t next_variant = 0;
+  char buffer[4096];
+
+  while (next_variant < variant_count || !running.empty()) {
+    while (next_variant < variant_count && running.size() < max_parallel) {
+      running.emplace_back(StartChild(next_variant++, variant));
+    }
+
+    // Outputs are read while the children run, so that no child blocks on a
+    // full pipe.
+    pollfds.clear();
+    for (const RunningChild& child : running) {
+      pollfds.push_back({child.fd, POLLIN, 0});
+    }
+
+    int ret = poll(pollfds.data(), pollfds.size(), -1);
+    if (ret == -1) {
+      CHECK(errno == EINTR) << "Bad poll on child pipes";
+      continue;
+    }
+
+    for (size_t i = running.size(); i-- > 0;) {
+      if (pollfds[i].revents == 0) {
+        continue;
+      }
+
+      RunningChild& child = running[i];
+      ssize_t bytes_read = read(child.fd, buffer, sizeof(buffer));
+      if (bytes_read > 0) {
+        results[child.variant_index].output.append(buffer, bytes_read);
+        continue;
+      }
+
+      if (bytes_read == -1 && errno == EINTR) {
+        continue;
+      }
+
+      // The child has closed its end of the pipe.
+      close(child.fd);
+      int status;
+      while (waitpid(child.pid, &status, 0) == -1) {
+        CHECK(errno == EINTR) << "Unable to wait for child " << child.pid;
+      }
+
+      bool ok = WIFEXITED(status) && WEXITSTATUS(status) == 0;
+      if (!ok) {
+        LOG(ERROR) << "Variant " << child.variant_index << " failed";
+      }
+      results[child.variant_index].ok = ok;
+      running.erase(running.begin() + i);
+    }
+  }
+
+  return results;
+}
+
+}  // namespace ncode
@@ -0,0 +1,39 @@
+#ifndef NCODE_COMMON_FORK_H
+#define NCODE_COMMON_FORK_H
+
+#include <stddef.h>
+#include <functional>
+#include <string>
+#include <vector>
+
+namespace ncode {
+
+// The outcome of a variant that ran in a child process.
+struct VariantResult {
+  // False if the child crashed or exited with a non-zero status.
+  bool ok = false;
+
+  // What the variant returned.
+  std::string output;
+};
+
+// Calls 'variant' once for each index in [0, variant_count), each time in a
+// new child process forked from this one. A child starts with a
+// copy-on-write snapshot of the whole process, so a simulation that has been
+// run to a steady state before the call can be continued in a different way
+// by each variant, without repeating the warm-up and without serializing its
+// state. Up to 'max_parallel' children run at the same time. Blocks until all
+// children have exited and returns their results, in order of index.
+//
+// Only the calling thread exists in the children. No other threads should be
+// running or holding locks when this is called. This includes the collector
+// thread that a metric manager starts for thread-safe metrics. Children exit
+// as soon as the variant returns, without running destructors or atexit
+// handlers, so any output has to be flushed or returned by the variant.
+std::vector<VariantResult> RunForkedVariants(
+    size_t variant_count, std::function<std::string(size_t)> variant,
+    size_t max_parallel = 4);
+
+}  // namespace ncode
+
+#endif
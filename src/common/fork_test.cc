@@ -0,0 +1,75 @@
+#include "fork.h"
+
+#include <cstdlib>
+
+#include "common.h"
+#include "gtest/gtest.h"
+
+namespace ncode {
+namespace {
+
+TEST(ForkTest, ZeroMaxParallel) {
+  ASSERT_DEATH(RunForkedVariants(1, [](size_t i) { return std::to_string(i); },
+                                 0),
+               ".*");
+}
+
+TEST(ForkTest, NoVariants) {
+  ASSERT_TRUE(RunForkedVariants(0, [](size_t i) {
+                return std::to_string(i);
+              }).empty());
+}
+
+class ForkTestWithMaxParallel : public ::testing::TestWithParam<size_t> {};
+
+// Each variant starts from the state of the parent and changes to it are not
+// seen by the parent or by other variants.
+TEST_P(ForkTestWithMaxParallel, StartFromParentState) {
+  std::vector<int> state = {1, 2, 3};
+  std::vector<VariantResult> results =
+      RunForkedVariants(10, [&state](size_t i) {
+        state.push_back(i);
+        std::string output;
+        for (int value : state) {
+          output += std::to_string(value);
+        }
+        return output;
+      }, GetParam());
+
+  ASSERT_EQ(3ul, state.size());
+  ASSERT_EQ(10ul, results.size());
+  for (size_t i = 0; i < results.size(); ++i) {
+    ASSERT_TRUE(results[i].ok);
+    ASSERT_EQ("123" + std::to_string(i), results[i].output);
+  }
+}
+
+// Outputs that do not fit in a pipe's buffer.
+TEST_P(ForkTestWithMaxParallel, LargeOutput) {
+  std::vector<VariantResult> results = RunForkedVariants(
+      4, [](size_t i) { return std::string(1000000, 'a' + i); }, GetParam());
+  for (size_t i = 0; i < results.size(); ++i) {
+    ASSERT_TRUE(results[i].ok);
+    ASSERT_EQ(std::string(1000000, 'a' + i), results[i].output);
+  }
+}
+
+INSTANTIATE_TEST_CASE_P(MaxParallel, ForkTestWithMaxParallel,
+                        ::testing::Values(1, 2, 4, 10));
+
+TEST(ForkTest, FailedVariant) {
+  std::vector<VariantResult> results = RunForkedVariants(3, [](size_t i) {
+    if (i == 1) {
+      _Exit(1);
+    }
+    return std::string("ok");
+  });
+
+  ASSERT_TRUE(results[0].ok);
+  ASSERT_FALSE(results[1].ok);
+  ASSERT_TRUE(results[2].ok);
+  ASSERT_EQ("ok", results[2].output);
+}
+
+}  // namespace
+}  // namespace ncode
@@ -61,6 +61,14 @@ class FreeList {
 
   template <typename... Args>
   Pointer New(Args&&... args) {
+    Pointer return_ptr(NewRaw(std::forward<Args>(args)...), &ReleaseGlobal);
+    return std::move(return_ptr);
+  }
+
+  // Like New, but returns a raw pointer that should be passed to Release when
+  // the object is no longer needed. Avoids the overhead of Pointer's deleter.
+  template <typename... Args>
+  T* NewRaw(Args&&... args) {
     if (objects_.empty()) {
       size_t count = 0;
       if (raw_allocation_count_ % kRawAllocationThreshold == 0) {
@@ -84,9 +92,8 @@ class FreeList {
 
         T* const raw_ptr = &(mem[kBatchSize - 1]);
         new (raw_ptr) T(std::forward<Args>(args)...);
-        Pointer return_ptr(raw_ptr, &ReleaseGlobal);
         ++raw_allocation_count_;
-        return std::move(return_ptr);
+        return raw_ptr;
       }
     }
 
@@ -94,8 +101,7 @@ class FreeList {
     objects_.pop_back();
 
     new (raw_ptr) T(std::forward<Args>(args)...);
-    Pointer return_ptr(raw_ptr, &ReleaseGlobal);
-    return std::move(return_ptr);
+    return raw_ptr;
   }
 
   // Returns the number of objects that this free list holds.
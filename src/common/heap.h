@@ -0,0 +1,246 @@
+#ifndef NCODE_HEAP_H
+#define NCODE_HEAP_H
+
+#include <stddef.h>
+#include <algorithm>
+#include <cstdint>
+#include <limits>
+#include <utility>
+#include <vector>
+
+#include "common.h"
+#include "logging.h"
+
+namespace ncode {
+
+// A min-heap of items that are identified by dense integer ids. Each node in
+// the heap has D children. The position of each id in the heap is tracked,
+// which allows the key of an item to be decreased in place instead of pushing
+// a duplicate. Memory is retained across calls to Reset, so a heap can be
+// reused without allocating.
+template <typename Key, size_t D = 4>
+class IndexedDaryHeap {
+ public:
+  static_assert(D >= 2, "Heap should have at least 2 children per node");
+
+  IndexedDaryHeap() {}
+
+  // Empties the heap. After this call ids in [0, id_count) can be pushed.
+  void Reset(size_t id_count) {
+    for (const Entry& entry : heap_) {
+      positions_[entry.id] = kNotInHeap;
+    }
+
+    heap_.clear();
+    if (positions_.size() < id_count) {
+      positions_.resize(id_count, kNotInHeap);
+    }
+  }
+
+  bool empty() const { return heap_.empty(); }
+
+  size_t size() const { return heap_.size(); }
+
+  // Adds an item to the heap. If the item is already in the heap its key is
+  // set to the new key, if the new key is smaller than the current one.
+  void PushOrDecrease(uint32_t id, Key key) {
+    DCHECK(id < positions_.size());
+    uint32_t position = positions_[id];
+    if (position == kNotInHeap) {
+      position = heap_.size();
+      heap_.push_back({key, id});
+    } else if (key < heap_[position].key) {
+      heap_[position].key = key;
+    } else {
+      return;
+    }
+
+    SiftUp(position);
+  }
+
+  // Removes the item with the smallest key from the heap and returns its key
+  // and id.
+  std::pair<Key, uint32_t> PopMin() {
+    DCHECK(!heap_.empty());
+    Entry top = heap_.front();
+    positions_[top.id] = kNotInHeap;
+
+    Entry last = heap_.back();
+    heap_.pop_back();
+    if (!heap_.empty()) {
+      heap_.front() = last;
+      positions_[last.id] = 0;
+      SiftDown(0);
+    }
+
+    return {top.key, top.id};
+  }
+
+ private:
+  static constexpr uint32_t kNotInHeap = std::numeric_limits<uint32_t>::max();
+
+  struct Entry {
+    Key key;
+    uint32_t id;
+  };
+
+  void SiftUp(uint32_t position) {
+    Entry entry = heap_[position];
+    while (position > 0) {
+      uint32_t parent = (position - 1) / D;
+      if (!(entry.key < heap_[parent].key)) {
+        break;
+      }
+
+      heap_[position] = heap_[parent];
+      positions_[heap_[position].id] = position;
+      position = parent;
+    }
+
+    heap_[position] = entry;
+    positions_[entry.id] = position;
+  }
+
+  void SiftDown(uint32_t position) {
+    Entry entry = heap_[position];
+    size_t heap_size = heap_.size();
+    while (true) {
+      size_t first_child = position * D + 1;
+      if (first_child >= heap_size) {
+        break;
+      }
+
+      size_t last_child = std::min(first_child + D, heap_size);
+      size_t min_child = first_child;
+      for (size_t child = first_child + 1; child < last_child; ++child) {
+        if (heap_[child].key < heap_[min_child].key) {
+          min_child = child;
+        }
+      }
+
+      if (!(heap_[min_child].key < entry.key)) {
+        break;
+      }
+
+      heap_[position] = heap_[min_child];
+      positions_[heap_[position].id] = position;
+      position = min_child;
+    }
+
+    heap_[position] = entry;
+    positions_[entry.id] = position;
+  }
+
+  // The heap itself.
+  std::vector<Entry> heap_;
+
+  // For each id its position in the heap, or kNotInHeap.
+  std::vector<uint32_t> positions_;
+
+  DISALLOW_COPY_AND_ASSIGN(IndexedDaryHeap);
+};
+
+template <typename Key, size_t D>
+constexpr uint32_t IndexedDaryHeap<Key, D>::kNotInHeap;
+
+// A monotone priority queue for unsigned integer keys. The key of an item
+// pushed to the queue should not be smaller than the key last popped from it,
+// which is the case for Dijkstra's algorithm with non-negative weights. Items
+// are kept in buckets based on the highest bit in which their key differs from
+// the last popped key, each item moves between buckets at most 64 times. Stale
+// items are not removed, the same value can be pushed more than once. Memory
+// is retained across calls to Reset.
+template <typename Value>
+class RadixHeap {
+ public:
+  // There is one bucket for items whose key is the same as the last popped key
+  // and one for each bit of the key.
+  static constexpr size_t kBucketCount = 65;
+
+  RadixHeap() : size_(0), last_key_(0) {}
+
+  // Empties the heap.
+  void Reset() {
+    for (std::vector<Entry>& bucket : buckets_) {
+      bucket.clear();
+    }
+
+    size_ = 0;
+    last_key_ = 0;
+  }
+
+  bool empty() const { return size_ == 0; }
+
+  size_t size() const { return size_; }
+
+  // Adds an item to the heap.
+  void Push(uint64_t key, Value value) {
+    DCHECK(key >= last_key_) << "Key " << key << " smaller than last key "
+                             << last_key_;
+    buckets_[BucketIndex(key)].push_back({key, value});
+    ++size_;
+  }
+
+  // Removes the item with the smallest key from the heap and returns its key
+  // and value.
+  std::pair<uint64_t, Value> PopMin() {
+    DCHECK(size_ > 0);
+    if (buckets_[0].empty()) {
+      size_t i = 1;
+      while (buckets_[i].empty()) {
+        ++i;
+      }
+
+      // All items in the first non-empty bucket are redistributed relative to
+      // the smallest key in it. They all end up in lower buckets.
+      std::vector<Entry>& bucket = buckets_[i];
+      uint64_t min_key = bucket.front().key;
+      for (const Entry& entry : bucket) {
+        min_key = std::min(min_key, entry.key);
+      }
+
+      last_key_ = min_key;
+      for (const Entry& entry : bucket) {
+        buckets_[BucketIndex(entry.key)].push_back(entry);
+      }
+      bucket.clear();
+    }
+
+    Entry entry = buckets_[0].back();
+    buckets_[0].pop_back();
+    --size_;
+    return {entry.key, entry.value};
+  }
+
+ private:
+  struct Entry {
+    uint64_t key;
+    Value value;
+  };
+
+  size_t BucketIndex(uint64_t key) const {
+    uint64_t diff = key ^ last_key_;
+    if (diff == 0) {
+      return 0;
+    }
+
+    return 64 - __builtin_clzll(diff);
+  }
+
+  std::vector<Entry> buckets_[kBucketCount];
+
+  // Number of items in all buckets.
+  size_t size_;
+
+  // The key of the last popped item.
+  uint64_t last_key_;
+
+  DISALLOW_COPY_AND_ASSIGN(RadixHeap);
+};
+
+template <typename Value>
+constexpr size_t RadixHeap<Value>::kBucketCount;
+
+}  // namespace ncode
+
+#endif
@@ -0,0 +1,147 @@
+#include "heap.h"
+
+#include <queue>
+#include <random>
+#include "gtest/gtest.h"
+
+namespace ncode {
+namespace {
+
+TEST(IndexedDaryHeap, Empty) {
+  IndexedDaryHeap<uint64_t> heap;
+  heap.Reset(10);
+  ASSERT_TRUE(heap.empty());
+  ASSERT_EQ(0ul, heap.size());
+}
+
+TEST(IndexedDaryHeap, DecreaseKey) {
+  IndexedDaryHeap<uint64_t> heap;
+  heap.Reset(10);
+  heap.PushOrDecrease(1, 10);
+  heap.PushOrDecrease(2, 5);
+  heap.PushOrDecrease(3, 7);
+  heap.PushOrDecrease(1, 1);
+
+  // Larger key is ignored.
+  heap.PushOrDecrease(2, 100);
+  ASSERT_EQ(3ul, heap.size());
+
+  ASSERT_EQ(std::make_pair(1ul, 1u), heap.PopMin());
+  ASSERT_EQ(std::make_pair(5ul, 2u), heap.PopMin());
+  ASSERT_EQ(std::make_pair(7ul, 3u), heap.PopMin());
+  ASSERT_TRUE(heap.empty());
+}
+
+TEST(IndexedDaryHeap, Reset) {
+  IndexedDaryHeap<uint64_t> heap;
+  heap.Reset(10);
+  heap.PushOrDecrease(1, 10);
+  heap.PushOrDecrease(2, 5);
+
+  heap.Reset(20);
+  ASSERT_TRUE(heap.empty());
+  heap.PushOrDecrease(1, 20);
+  heap.PushOrDecrease(15, 3);
+  ASSERT_EQ(std::make_pair(3ul, 15u), heap.PopMin());
+  ASSERT_EQ(std::make_pair(20ul, 1u), heap.PopMin());
+}
+
+TEST(IndexedDaryHeap, Random) {
+  static constexpr size_t kIdCount = 1000;
+  std::mt19937 rnd(1);
+  std::uniform_int_distribution<uint64_t> key_dist(0, 10000);
+  std::uniform_int_distribution<uint32_t> id_dist(0, kIdCount - 1);
+
+  IndexedDaryHeap<uint64_t, 3> heap;
+  heap.Reset(kIdCount);
+  std::vector<uint64_t> model(kIdCount, std::numeric_limits<uint64_t>::max());
+  for (size_t i = 0; i < 10000; ++i) {
+    uint32_t id = id_dist(rnd);
+    uint64_t key = key_dist(rnd);
+    heap.PushOrDecrease(id, key);
+    model[id] = std::min(model[id], key);
+  }
+
+  uint64_t prev_key = 0;
+  while (!heap.empty()) {
+    std::pair<uint64_t, uint32_t> min = heap.PopMin();
+    ASSERT_LE(prev_key, min.first);
+    ASSERT_EQ(model[min.second], min.first);
+    model[min.second] = std::numeric_limits<uint64_t>::max();
+    prev_key = min.first;
+  }
+
+  for (uint64_t key : model) {
+    ASSERT_EQ(std::numeric_limits<uint64_t>::max(), key);
+  }
+}
+
+TEST(RadixHeap, Empty) {
+  RadixHeap<uint32_t> heap;
+  ASSERT_TRUE(heap.empty());
+  ASSERT_EQ(0ul, heap.size());
+}
+
+TEST(RadixHeap, Duplicates) {
+  RadixHeap<uint32_t> heap;
+  heap.Push(10, 1);
+  heap.Push(10, 2);
+  heap.Push(3, 3);
+  ASSERT_EQ(3ul, heap.size());
+
+  ASSERT_EQ(std::make_pair(3ul, 3u), heap.PopMin());
+  ASSERT_EQ(10ul, heap.PopMin().first);
+  ASSERT_EQ(10ul, heap.PopMin().first);
+  ASSERT_TRUE(heap.empty());
+}
+
+TEST(RadixHeap, Reset) {
+  RadixHeap<uint32_t> heap;
+  heap.Push(100, 1);
+  heap.Push(200, 2);
+  ASSERT_EQ(100ul, heap.PopMin().first);
+
+  // Keys smaller than the last popped one are fine after a reset.
+  heap.Reset();
+  ASSERT_TRUE(heap.empty());
+  heap.Push(5, 3);
+  ASSERT_EQ(std::make_pair(5ul, 3u), heap.PopMin());
+}
+
+// Pushes keys that are never smaller than the last popped one, as Dijkstra's
+// algorithm does, and compares to std::priority_queue.
+TEST(RadixHeap, Monotone) {
+  std::mt19937 rnd(1);
+  std::uniform_int_distribution<uint64_t> increment_dist(0, 1 << 20);
+  std::uniform_int_distribution<size_t> push_count_dist(0, 3);
+
+  using KeyAndValue = std::pair<uint64_t, uint32_t>;
+  std::priority_queue<KeyAndValue, std::vector<KeyAndValue>,
+                      std::greater<KeyAndValue>> model;
+  RadixHeap<uint32_t> heap;
+
+  uint64_t last_key = 0;
+  uint32_t value = 0;
+  for (size_t i = 0; i < 10000; ++i) {
+    size_t push_count = push_count_dist(rnd);
+    if (heap.empty()) {
+      push_count = std::max(push_count, 1ul);
+    }
+
+    for (size_t j = 0; j < push_count; ++j) {
+      uint64_t key = last_key + increment_dist(rnd);
+      heap.Push(key, value);
+      model.emplace(key, value);
+      ++value;
+    }
+
+    ASSERT_EQ(model.size(), heap.size());
+    std::pair<uint64_t, uint32_t> min = heap.PopMin();
+    ASSERT_EQ(model.top().first, min.first);
+    model.pop();
+    last_key = min.first;
+  }
+}
+
+}  // namespace
+}  // namespace ncode
@@ -94,6 +94,29 @@ class LRUCache {
     }
   }
 
+  // Evicts the least recently used entry. The cache should not be empty.
+  void EvictOldest() {
+    CHECK(!keys_.empty()) << "Empty cache";
+    const K& to_evict = keys_.back();
+    auto it = cache_map_.find(to_evict);
+    CHECK(it != cache_map_.end());
+
+    std::unique_ptr<V> to_evict_value = std::move(it->second.object);
+    ItemEvicted(to_evict, std::move(to_evict_value));
+
+    cache_map_.erase(it);
+    keys_.pop_back();
+  }
+
+  // The key of the least recently used entry. The cache should not be empty.
+  const K& OldestKey() const {
+    CHECK(!keys_.empty()) << "Empty cache";
+    return keys_.back();
+  }
+
+  // Number of entries in the cache.
+  size_t size() const { return cache_map_.size(); }
+
   // Called when an item is evicted from the cache.
   virtual void ItemEvicted(const K& key, std::unique_ptr<V> value) {
     Unused(key);
@@ -110,19 +133,6 @@ class LRUCache {
   };
   using CacheMap = std::unordered_map<K, ObjectAndListIterator, Hash, Pred>;
 
-  void EvictOldest() {
-    // Need to evict an entry.
-    const K& to_evict = keys_.back();
-    auto it = cache_map_.find(to_evict);
-    CHECK(it != cache_map_.end());
-
-    std::unique_ptr<V> to_evict_value = std::move(it->second.object);
-    ItemEvicted(to_evict, std::move(to_evict_value));
-
-    cache_map_.erase(it);
-    keys_.pop_back();
-  }
-
   const size_t max_cache_size_;
 
   LRUList keys_;
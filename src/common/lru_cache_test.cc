@@ -124,6 +124,21 @@ TEST_F(CacheTest, LeastRecentInsertNewOverflow) {
   ASSERT_EQ(model, cache_.evicted_items());
 }
 
+TEST_F(CacheTest, EvictOldest) {
+  cache_.Emplace(1, 1.0);
+  cache_.Emplace(2, 2.0);
+  cache_.Emplace(3, 3.0);
+  cache_.FindOrNull(1);
+  ASSERT_EQ(3ul, cache_.size());
+
+  cache_.EvictOldest();
+  cache_.EvictOldest();
+  ASSERT_EQ(1ul, cache_.size());
+
+  std::vector<std::pair<int, double>> model = {{2, 2.0}, {3, 3.0}};
+  ASSERT_EQ(model, cache_.evicted_items());
+}
+
 struct CompositeValue {
   CompositeValue(size_t a, double b) : a(a), b(b) {}
 
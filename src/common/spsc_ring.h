@@ -0,0 +1,77 @@
+#ifndef NCODE_SPSC_RING_H_
+#define NCODE_SPSC_RING_H_
+
+#include <stddef.h>
+#include <array>
+#include <atomic>
+#include <vector>
+
+#include "common.h"
+
+namespace ncode {
+
+// A fixed-size ring buffer with a single producer and a single consumer, which
+// can be on different threads. Neither side takes a lock.
+template <typename T, size_t NumValues>
+class SPSCRing {
+ public:
+  static constexpr size_t kMaxValues = NumValues;
+
+  SPSCRing() : head_(0), tail_(0) {
+    static_assert(IsPowerOfTwo(NumValues),
+                  "Number of values should be power of 2");
+  }
+
+  // Adds a value to the ring. Returns false if the ring is full. Should only
+  // be called by the producer.
+  bool TryPush(const T& value) {
+    size_t tail = tail_.load(std::memory_order_relaxed);
+    if (tail - head_.load(std::memory_order_acquire) == NumValues) {
+      return false;
+    }
+
+    values_[tail & kMask] = value;
+    tail_.store(tail + 1, std::memory_order_release);
+    return true;
+  }
+
+  // Moves all values out of the ring and appends them to 'out', oldest first.
+  // Should only be called by the consumer.
+  void PopAll(std::vector<T>* out) {
+    size_t head = head_.load(std::memory_order_relaxed);
+    size_t tail = tail_.load(std::memory_order_acquire);
+    for (size_t i = head; i != tail; ++i) {
+      out->emplace_back(std::move(values_[i & kMask]));
+    }
+    head_.store(tail, std::memory_order_release);
+  }
+
+  // Number of values in the ring. Only a snapshot if the other side is
+  // running.
+  size_t size() const {
+    return tail_.load(std::memory_order_acquire) -
+           head_.load(std::memory_order_acquire);
+  }
+
+ private:
+  static constexpr size_t kMask = NumValues - 1;
+  static constexpr size_t kCacheLineSize = 64;
+
+  // The next value to pop. Only changed by the consumer. The indices are
+  // padded so that the two sides do not write to the same cache line. The
+  // ring is usually heap-allocated, where alignas is not honored in C++11.
+  std::atomic<size_t> head_;
+  char head_padding_[kCacheLineSize - sizeof(std::atomic<size_t>)];
+
+  // The next free slot. Only changed by the producer.
+  std::atomic<size_t> tail_;
+  char tail_padding_[kCacheLineSize - sizeof(std::atomic<size_t>)];
+
+  std::array<T, NumValues> values_;
+
+  DISALLOW_COPY_AND_ASSIGN(SPSCRing);
+};
+
+}  // namespace ncode
+
+#endif
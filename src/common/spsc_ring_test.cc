@@ -0,0 +1,76 @@
+#include "spsc_ring.h"
+
+#include <thread>
+
+#include "gtest/gtest.h"
+
+namespace ncode {
+namespace {
+
+TEST(SPSCRing, Empty) {
+  SPSCRing<int, 4> ring;
+  std::vector<int> values;
+  ring.PopAll(&values);
+  ASSERT_TRUE(values.empty());
+  ASSERT_EQ(0ul, ring.size());
+}
+
+TEST(SPSCRing, Full) {
+  SPSCRing<int, 4> ring;
+  for (int i = 0; i < 4; ++i) {
+    ASSERT_TRUE(ring.TryPush(i));
+  }
+  ASSERT_FALSE(ring.TryPush(4));
+  ASSERT_EQ(4ul, ring.size());
+
+  std::vector<int> values = {-1};
+  ring.PopAll(&values);
+  ASSERT_EQ(std::vector<int>({-1, 0, 1, 2, 3}), values);
+  ASSERT_EQ(0ul, ring.size());
+
+  // Wraps around.
+  ASSERT_TRUE(ring.TryPush(5));
+  ASSERT_TRUE(ring.TryPush(6));
+  values.clear();
+  ring.PopAll(&values);
+  ASSERT_EQ(std::vector<int>({5, 6}), values);
+}
+
+TEST(SPSCRing, Strings) {
+  SPSCRing<std::string, 2> ring;
+  ASSERT_TRUE(ring.TryPush("a"));
+  ASSERT_TRUE(ring.TryPush("b"));
+
+  std::vector<std::string> values;
+  ring.PopAll(&values);
+  ASSERT_EQ(std::vector<std::string>({"a", "b"}), values);
+}
+
+// The consumer should see all values from a producer on another thread, in
+// order.
+TEST(SPSCRing, TwoThreads) {
+  static constexpr size_t kCount = 1000000;
+  SPSCRing<size_t, 64> ring;
+
+  std::thread producer([&ring] {
+    for (size_t i = 0; i < kCount; ++i) {
+      while (!ring.TryPush(i)) {
+        std::this_thread::yield();
+      }
+    }
+  });
+
+  std::vector<size_t> values;
+  while (values.size() != kCount) {
+    ring.PopAll(&values);
+    std::this_thread::yield();
+  }
+  producer.join();
+
+  for (size_t i = 0; i < kCount; ++i) {
+    ASSERT_EQ(i, values[i]);
+  }
+}
+
+}  // namespace
+}  // namespace ncode
@@ -0,0 +1,68 @@
+#ifndef NCODE_TIMING_WHEEL_H
+#define NCODE_TIMING_WHEEL_H
+
+#include <stddef.h>
+#include <cstdint>
+
+namespace ncode {
+
+// Helpers for hierarchical timing wheels with one level per byte of a 64-bit
+// time. A time is placed in the level of the most significant byte in which
+// it differs from the wheel's cursor, and in the slot given by the value of
+// that byte.
+static constexpr size_t kTimingWheelLevelCount = 8;
+static constexpr size_t kTimingWheelSlotCount = 256;
+
+// The level of a time, given the wheel's cursor. If the time is the same as
+// the cursor the level is 0.
+inline size_t TimingWheelLevel(uint64_t time, uint64_t cursor) {
+  uint64_t diff = time ^ cursor;
+  if (diff == 0) {
+    return 0;
+  }
+
+  return (63 - __builtin_clzll(diff)) / 8;
+}
+
+// The slot of a time in a given level.
+inline size_t TimingWheelSlot(uint64_t time, size_t level) {
+  return (time >> (level * 8)) & 0xFF;
+}
+
+// One bit per slot of a level, set for non-empty slots.
+class TimingWheelBitmap {
+ public:
+  void Set(size_t slot) { words_[slot / 64] |= 1ull << (slot % 64); }
+
+  void Clear(size_t slot) { words_[slot / 64] &= ~(1ull << (slot % 64)); }
+
+  // Returns the first set slot at or after 'from', or kTimingWheelSlotCount if
+  // there is none.
+  size_t FirstSet(size_t from) const {
+    size_t word = from / 64;
+    if (word >= kWordCount) {
+      return kTimingWheelSlotCount;
+    }
+
+    uint64_t bits = words_[word] & (~0ull << (from % 64));
+    while (true) {
+      if (bits != 0) {
+        return word * 64 + __builtin_ctzll(bits);
+      }
+
+      if (++word == kWordCount) {
+        return kTimingWheelSlotCount;
+      }
+      bits = words_[word];
+    }
+  }
+
+ private:
+  static constexpr size_t kWordCount = kTimingWheelSlotCount / 64;
+
+  uint64_t words_[kWordCount] = {};
+};
+
+}  // namespace ncode
+
+#endif
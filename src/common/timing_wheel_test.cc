@@ -0,0 +1,43 @@
+#include "timing_wheel.h"
+
+#include "gtest/gtest.h"
+
+namespace ncode {
+namespace {
+
+TEST(TimingWheel, Level) {
+  ASSERT_EQ(0ul, TimingWheelLevel(100, 100));
+  ASSERT_EQ(0ul, TimingWheelLevel(0xFF, 0));
+  ASSERT_EQ(1ul, TimingWheelLevel(0x100, 0));
+  ASSERT_EQ(2ul, TimingWheelLevel(0x1FF, 0x100FF));
+  ASSERT_EQ(7ul, TimingWheelLevel(1ull << 63, 0));
+}
+
+TEST(TimingWheel, Slot) {
+  ASSERT_EQ(0x34ul, TimingWheelSlot(0x1234, 0));
+  ASSERT_EQ(0x12ul, TimingWheelSlot(0x1234, 1));
+  ASSERT_EQ(0ul, TimingWheelSlot(0x1234, 2));
+  ASSERT_EQ(0x80ul, TimingWheelSlot(1ull << 63, 7));
+}
+
+TEST(TimingWheel, Bitmap) {
+  TimingWheelBitmap bitmap;
+  ASSERT_EQ(kTimingWheelSlotCount, bitmap.FirstSet(0));
+
+  bitmap.Set(5);
+  bitmap.Set(64);
+  bitmap.Set(255);
+  ASSERT_EQ(5ul, bitmap.FirstSet(0));
+  ASSERT_EQ(5ul, bitmap.FirstSet(5));
+  ASSERT_EQ(64ul, bitmap.FirstSet(6));
+  ASSERT_EQ(255ul, bitmap.FirstSet(65));
+  ASSERT_EQ(kTimingWheelSlotCount, bitmap.FirstSet(kTimingWheelSlotCount));
+
+  bitmap.Clear(64);
+  ASSERT_EQ(255ul, bitmap.FirstSet(6));
+  bitmap.Clear(255);
+  ASSERT_EQ(kTimingWheelSlotCount, bitmap.FirstSet(6));
+}
+
+}  // namespace
+}  // namespace ncode
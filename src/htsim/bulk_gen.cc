@@ -1,5 +1,6 @@
 #include "bulk_gen.h"
 
+#include <algorithm>
 #include <type_traits>
 
 #include "../common/logging.h"
@@ -7,20 +8,43 @@
 namespace ncode {
 namespace htsim {
 
+constexpr size_t BulkPacketGenerator::kBatchSize;
+constexpr size_t BulkPacketGenerator::kRunSize;
+
 BulkPacketGenerator::BulkPacketGenerator(
     const std::string& id,
     std::vector<std::unique_ptr<BulkPacketSource>> sources,
-    htsim::PacketHandler* out, EventQueue* event_queue)
+    htsim::PacketHandler* out, EventQueue* event_queue, size_t thread_count)
     : BulkPacketGeneratorBase(std::move(sources), out),
       EventConsumer(id, event_queue),
       current_batch_index_(0),
       stop_queue_when_done_(false) {
+  size_t shard_count = std::min(thread_count, sources_.size());
+  if (shard_count > 1) {
+    for (size_t i = 0; i < shard_count; ++i) {
+      shards_.emplace_back(make_unique<Shard>());
+    }
+
+    for (size_t i = 0; i < sources_.size(); ++i) {
+      shards_[i % shard_count]->sources.emplace_back(sources_[i].get(), i);
+    }
+  }
+
   Init();
 }
 
 BulkPacketGenerator::~BulkPacketGenerator() {
   ptr_queue_.Close();
+  free_batches_.Close();
+  for (const auto& shard : shards_) {
+    shard->runs.Close();
+    shard->free_runs.Close();
+  }
+
   batch_populator_.join();
+  for (const auto& shard : shards_) {
+    shard->thread.join();
+  }
 }
 
 void BulkPacketGenerator::GetNewBatchIfNeeded() {
@@ -32,6 +56,9 @@ void BulkPacketGenerator::GetNewBatchIfNeeded() {
 
     current_batch_.swap(*incoming_batch);
     current_batch_index_ = 0;
+
+    incoming_batch->clear();
+    free_batches_.ProduceOrBlock(std::move(incoming_batch));
   }
 }
 
@@ -57,7 +84,11 @@ void BulkPacketGenerator::HandleEvent() {
 
 void BulkPacketGenerator::PopulateBatches() {
   while (true) {
-    auto batch = make_unique<Batch>();
+    std::unique_ptr<Batch> batch = free_batches_.ConsumeOrBlock();
+    if (!batch) {
+      return;
+    }
+
     for (size_t i = 0; i < kBatchSize; ++i) {
       if (!Next(batch.get())) {
         break;
@@ -70,6 +101,97 @@ void BulkPacketGenerator::PopulateBatches() {
   }
 }
 
+void BulkPacketGenerator::MergeShards() {
+  // The run each shard's packets currently come from, and the position of
+  // the shard's next packet in it.
+  std::vector<std::unique_ptr<Run>> runs(shards_.size());
+  std::vector<size_t> run_positions(shards_.size(), 0);
+  VectorPriorityQueue<ShardHead, ShardHeadComparator> heads;
+
+  // Adds the next packet of a shard to 'heads', unless the shard is done.
+  auto advance = [this, &runs, &run_positions, &heads](size_t shard_index) {
+    Shard* shard = shards_[shard_index].get();
+    std::unique_ptr<Run>& run = runs[shard_index];
+    size_t& position = run_positions[shard_index];
+    if (run && position == run->packets.size()) {
+      run->packets.clear();
+      run->source_indices.clear();
+      shard->free_runs.ProduceOrBlock(std::move(run));
+    }
+
+    if (!run) {
+      run = shard->runs.ConsumeOrBlock();
+      position = 0;
+      if (!run) {
+        return;
+      }
+    }
+
+    heads.emplace(ShardHead{run->packets[position]->time_sent(),
+                            run->source_indices[position], shard_index});
+  };
+
+  for (size_t i = 0; i < shards_.size(); ++i) {
+    advance(i);
+  }
+
+  while (true) {
+    std::unique_ptr<Batch> batch = free_batches_.ConsumeOrBlock();
+    if (!batch) {
+      return;
+    }
+
+    while (batch->size() < kBatchSize && !heads.empty()) {
+      size_t shard_index = heads.PopTop().shard_index;
+      Run* run = runs[shard_index].get();
+      batch->emplace_back(std::move(run->packets[run_positions[shard_index]]));
+      ++run_positions[shard_index];
+      advance(shard_index);
+    }
+
+    if (!ptr_queue_.ProduceOrBlock(std::move(batch))) {
+      return;
+    }
+  }
+}
+
+void BulkPacketGenerator::PopulateRuns(Shard* shard) {
+  BulkPacketMerger merger;
+  for (const auto& source_and_index : shard->sources) {
+    merger.AddSource(source_and_index.first, source_and_index.second);
+  }
+
+  while (true) {
+    std::unique_ptr<Run> run = shard->free_runs.ConsumeOrBlock();
+    if (!run) {
+      return;
+    }
+
+    bool done = false;
+    while (run->packets.size() < kRunSize) {
+      uint32_t source_index;
+      PacketPtr pkt = merger.Next(&source_index);
+      if (!pkt) {
+        done = true;
+        break;
+      }
+
+      run->packets.emplace_back(std::move(pkt));
+      run->source_indices.emplace_back(source_index);
+    }
+
+    if (!run->packets.empty() && !shard->runs.ProduceOrBlock(std::move(run))) {
+      return;
+    }
+
+    if (done) {
+      // The merging thread will get the remaining runs, and then nothing.
+      shard->runs.Close();
+      return;
+    }
+  }
+}
+
 bool BulkPacketGenerator::Next(Batch* out) {
   PacketPtr next_pkt = NextPacket();
   if (!next_pkt) {
@@ -117,29 +239,63 @@ BulkPacketGeneratorBase::BulkPacketGeneratorBase(
 }
 
 PacketPtr BulkPacketGeneratorBase::NextPacket() {
+  uint32_t source_index;
+  return merger_.Next(&source_index);
+}
+
+void BulkPacketMerger::AddSource(BulkPacketSource* source,
+                                 uint32_t source_index) {
+  AddEventFromSource(source, source_index);
+}
+
+PacketPtr BulkPacketMerger::Next(uint32_t* source_index) {
   if (queue_.empty()) {
     return PacketPtr();
   }
 
   Event ev = queue_.PopTop();
   PacketPtr to_return = std::move(ev.pkt);
+  *source_index = ev.source_index;
 
-  BulkPacketSource* source = ev.source;
-  AddEventFromSource(source);
+  AddEventFromSource(ev.source, ev.source_index);
   return to_return;
 }
 
-void BulkPacketGeneratorBase::AddEventFromSource(BulkPacketSource* source) {
+void BulkPacketMerger::AddEventFromSource(BulkPacketSource* source,
+                                          uint32_t source_index) {
   PacketPtr next_pkt = source->NextPacket();
   if (next_pkt) {
-    queue_.emplace(std::move(next_pkt), source);
+    queue_.emplace(std::move(next_pkt), source, source_index);
   }
 }
 
 void BulkPacketGenerator::Init() {
-  AddInitialEvents();
+  // One batch is filled while the other one waits to be consumed.
+  for (size_t i = 0; i < 2; ++i) {
+    auto batch = make_unique<Batch>();
+    batch->reserve(kBatchSize);
+    free_batches_.ProduceOrBlock(std::move(batch));
+  }
+
+  if (shards_.empty()) {
+    AddInitialEvents();
+    batch_populator_ = std::thread([this] { PopulateBatches(); });
+  } else {
+    for (const auto& shard : shards_) {
+      for (size_t i = 0; i < 2; ++i) {
+        auto run = make_unique<Run>();
+        run->packets.reserve(kRunSize);
+        run->source_indices.reserve(kRunSize);
+        shard->free_runs.ProduceOrBlock(std::move(run));
+      }
+
+      shard->thread = std::thread(&BulkPacketGenerator::PopulateRuns,
+                                  shard.get());
+    }
+
+    batch_populator_ = std::thread([this] { MergeShards(); });
+  }
 
-  batch_populator_ = std::thread([this] { PopulateBatches(); });
   GetNewBatchIfNeeded();
   if (current_batch_.empty()) {
     return;
@@ -151,8 +307,8 @@ void BulkPacketGenerator::Init() {
 }
 
 void BulkPacketGeneratorBase::AddInitialEvents() {
-  for (const auto& source : sources_) {
-    AddEventFromSource(source.get());
+  for (size_t i = 0; i < sources_.size(); ++i) {
+    merger_.AddSource(sources_[i].get(), i);
   }
 }
 
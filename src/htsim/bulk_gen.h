@@ -11,6 +11,7 @@
 #include <memory>
 #include <random>
 #include <thread>
+#include <utility>
 #include <vector>
 
 #include "../common/common.h"
@@ -33,6 +34,47 @@ class BulkPacketSource {
   virtual PacketPtr NextPacket() = 0;
 };
 
+// Merges the packets of a number of sources in order of the time they are
+// sent. Packets sent at the same time are ordered by the index of their
+// source, so the order does not depend on how sources are split between
+// mergers.
+class BulkPacketMerger {
+ public:
+  // Adds a source and gets its first packet. Each source should have a
+  // different index.
+  void AddSource(BulkPacketSource* source, uint32_t source_index);
+
+  // Returns the next packet and sets 'source_index' to the index of its
+  // source. Returns an empty pointer when no source has more packets.
+  PacketPtr Next(uint32_t* source_index);
+
+ private:
+  struct Event {
+    Event(PacketPtr pkt, BulkPacketSource* source, uint32_t source_index)
+        : pkt(std::move(pkt)), source(source), source_index(source_index) {}
+
+    PacketPtr pkt;
+    BulkPacketSource* source;
+    uint32_t source_index;
+  };
+
+  struct Comparator {
+    bool operator()(const Event& lhs, const Event& rhs) {
+      if (lhs.pkt->time_sent() == rhs.pkt->time_sent()) {
+        return lhs.source_index > rhs.source_index;
+      }
+
+      return lhs.pkt->time_sent() > rhs.pkt->time_sent();
+    }
+  };
+
+  // Adds a new event to queue_ from a given source.
+  void AddEventFromSource(BulkPacketSource* source, uint32_t source_index);
+
+  // The queue that contains events.
+  VectorPriorityQueue<Event, Comparator> queue_;
+};
+
 // Common things for all BulkPacket generators.
 class BulkPacketGeneratorBase {
  public:
@@ -49,27 +91,10 @@ class BulkPacketGeneratorBase {
   }
 
  protected:
-  struct Event {
-    Event(PacketPtr pkt, BulkPacketSource* source)
-        : pkt(std::move(pkt)), source(source) {}
-
-    PacketPtr pkt;
-    BulkPacketSource* source;
-  };
-
-  struct Comparator {
-    bool operator()(const Event& lhs, const Event& rhs) {
-      return lhs.pkt->time_sent() > rhs.pkt->time_sent();
-    }
-  };
-
-  // Adds initial events for each source.
+  // Adds all sources to merger_.
   void AddInitialEvents();
 
-  // Adds a new event to queue_ from a given source.
-  void AddEventFromSource(BulkPacketSource* source);
-
-  // Fetches the next packet from the queue.
+  // Fetches the next packet from merger_.
   PacketPtr NextPacket();
 
   // Handler to output packets to.
@@ -78,23 +103,31 @@ class BulkPacketGeneratorBase {
   // Sources.
   std::vector<std::unique_ptr<BulkPacketSource>> sources_;
 
-  // The queue that contains events.
-  VectorPriorityQueue<Event, Comparator> queue_;
+  // Merges packets from all sources, if they are not split between threads.
+  BulkPacketMerger merger_;
 
   // All packets will be tagged with this tag.
   PacketTag default_tag_;
 };
 
+// Generates packets in background threads, while the current batch of packets
+// is being processed. With more than one thread the sources are split between
+// threads, each thread produces runs of packets from its sources in order and
+// another thread merges the runs. Packets are generated in the same order
+// regardless of the number of threads.
 class BulkPacketGenerator : public BulkPacketGeneratorBase,
                             public EventConsumer {
  public:
-  // A number of packets are cached in a background thread, while the current
-  // batch is being processed.
+  // Number of packets in a batch handed to the simulation thread.
   static constexpr size_t kBatchSize = 10000;
 
+  // Number of packets in a run produced by a thread from its sources.
+  static constexpr size_t kRunSize = 1000;
+
   BulkPacketGenerator(const std::string& id,
                       std::vector<std::unique_ptr<BulkPacketSource>> sources,
-                      htsim::PacketHandler* out, EventQueue* event_queue);
+                      htsim::PacketHandler* out, EventQueue* event_queue,
+                      size_t thread_count = 1);
 
   ~BulkPacketGenerator();
 
@@ -105,6 +138,40 @@ class BulkPacketGenerator : public BulkPacketGeneratorBase,
  private:
   using Batch = std::vector<PacketPtr>;
 
+  // Packets from the sources of a shard, in order.
+  struct Run {
+    Batch packets;
+
+    // The index of the source of each packet.
+    std::vector<uint32_t> source_indices;
+  };
+
+  // A subset of the sources, whose packets are generated in a separate
+  // thread. Runs are passed to the merging thread and recycled back.
+  struct Shard {
+    std::vector<std::pair<BulkPacketSource*, uint32_t>> sources;
+    PtrQueue<Run, 2> runs;
+    PtrQueue<Run, 2> free_runs;
+    std::thread thread;
+  };
+
+  // The next packet of a shard during merging.
+  struct ShardHead {
+    EventQueueTime at;
+    uint32_t source_index;
+    size_t shard_index;
+  };
+
+  struct ShardHeadComparator {
+    bool operator()(const ShardHead& lhs, const ShardHead& rhs) {
+      if (lhs.at == rhs.at) {
+        return lhs.source_index > rhs.source_index;
+      }
+
+      return lhs.at > rhs.at;
+    }
+  };
+
   void GetNewBatchIfNeeded();
 
   // Adds initial events for each source.
@@ -114,6 +181,12 @@ class BulkPacketGenerator : public BulkPacketGeneratorBase,
   // batch_populator_.
   void PopulateBatches();
 
+  // Like PopulateBatches, but merges the runs of all shards.
+  void MergeShards();
+
+  // Generates the runs of a shard. Called by the shard's thread.
+  static void PopulateRuns(Shard* shard);
+
   // Adds the next packet to a batch.
   bool Next(Batch* out);
 
@@ -121,10 +194,17 @@ class BulkPacketGenerator : public BulkPacketGeneratorBase,
   // consumes them.
   PtrQueue<Batch, 1> ptr_queue_;
 
+  // Consumed batches are passed back to be reused, so that their memory is
+  // not reallocated.
+  PtrQueue<Batch, 2> free_batches_;
+
   // The current batch.
   Batch current_batch_;
   size_t current_batch_index_;
 
+  // Empty if there is only one thread.
+  std::vector<std::unique_ptr<Shard>> shards_;
+
   // Populates batches.
   std::thread batch_populator_;
 
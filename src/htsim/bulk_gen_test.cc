@@ -57,6 +57,68 @@ class DummyHandler : public htsim::PacketHandler {
   size_t i_;
 };
 
+// Sends packets from a source port with a fixed gap between them.
+class GapSource : public BulkPacketSource {
+ public:
+  GapSource(EventQueue* event_queue, uint16_t src_port, milliseconds gap,
+            size_t max)
+      : i_(0),
+        max_(max),
+        gap_(gap),
+        tuple_(kSrc, kDst, kProtoUDP, AccessLayerPort(src_port), kDstPort),
+        event_queue_(event_queue) {}
+
+  PacketPtr NextPacket() override {
+    if (i_ == max_) {
+      return PacketPtr();
+    }
+
+    return make_unique<UDPPacket>(tuple_, kSize,
+                                  event_queue_->ToTime(gap_ * ++i_));
+  }
+
+ private:
+  size_t i_;
+  size_t max_;
+  milliseconds gap_;
+  net::FiveTuple tuple_;
+  EventQueue* event_queue_;
+};
+
+// Records the time and source port of all packets.
+class RecordingHandler : public htsim::PacketHandler {
+ public:
+  void HandlePacket(PacketPtr pkt) override {
+    records_.emplace_back(pkt->time_sent().Raw(),
+                          pkt->five_tuple().src_port().Raw());
+  }
+
+  const std::vector<std::pair<uint64_t, uint16_t>>& records() const {
+    return records_;
+  }
+
+ private:
+  std::vector<std::pair<uint64_t, uint16_t>> records_;
+};
+
+// Runs sources with different gaps, many of which send packets at the same
+// time, and returns the order in which packets are handled.
+static std::vector<std::pair<uint64_t, uint16_t>> RunGapSources(
+    size_t thread_count) {
+  SimTimeEventQueue event_queue;
+  RecordingHandler out;
+  std::vector<std::unique_ptr<BulkPacketSource>> sources;
+  for (uint16_t i = 0; i < 50; ++i) {
+    sources.emplace_back(make_unique<GapSource>(
+        &event_queue, i + 1, milliseconds(1 + i % 7), 2000 + 100 * i));
+  }
+
+  BulkPacketGenerator packet_generator(kSomeId, std::move(sources), &out,
+                                       &event_queue, thread_count);
+  event_queue.RunAndStopIn(hours(1));
+  return out.records();
+}
+
 class BulkGenFixture : public ::testing::Test {
  protected:
   SimTimeEventQueue event_queue_;
@@ -121,6 +183,39 @@ TEST_F(BulkGenFixture, SingleThreadShortSource) {
   ASSERT_EQ(10ul, out_.i());
 }
 
+TEST_F(BulkGenFixture, MultiThreadLongRunning) {
+  std::vector<std::unique_ptr<BulkPacketSource>> sources;
+  for (size_t i = 0; i < 4; ++i) {
+    sources.emplace_back(make_unique<DummySource>(&event_queue_));
+  }
+
+  BulkPacketGenerator packet_generator(kSomeId, std::move(sources), &out_,
+                                       &event_queue_, 3);
+  event_queue_.RunAndStopIn(hours(10));
+  ASSERT_EQ(4 * 360000ul, out_.i());
+}
+
+TEST_F(BulkGenFixture, MultiThreadInit) {
+  std::vector<std::unique_ptr<BulkPacketSource>> sources;
+  for (size_t i = 0; i < 4; ++i) {
+    sources.emplace_back(make_unique<DummySource>(&event_queue_));
+  }
+
+  BulkPacketGenerator packet_generator(kSomeId, std::move(sources), &out_,
+                                       &event_queue_, 4);
+  ASSERT_EQ(0ul, out_.i());
+}
+
+TEST(BulkGen, SameOrderForAnyThreadCount) {
+  std::vector<std::pair<uint64_t, uint16_t>> single_thread = RunGapSources(1);
+  ASSERT_EQ(222500ul, single_thread.size());
+  ASSERT_TRUE(std::is_sorted(single_thread.begin(), single_thread.end()));
+
+  for (size_t thread_count : {2, 3, 8}) {
+    ASSERT_EQ(single_thread, RunGapSources(thread_count));
+  }
+}
+
 }  // namespace
 }  // namespace htsim
 }  // namespace ncode
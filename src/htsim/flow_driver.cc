@@ -112,12 +112,14 @@ void FeedbackLoopFlowDriver::ScheduleNext() {
   EnqueueIn(next.wait_time);
 }
 
+constexpr size_t FlowPack::kMinLookahead;
+constexpr size_t FlowPack::kMaxLookahead;
+constexpr std::chrono::milliseconds FlowPack::kLookaheadWindow;
+
 void FlowPack::Init() {
   AddFirstEvents();
-  num_events_cached_ = CacheEvents();
-
-  if (num_events_cached_) {
-    EnqueueAt(pending_events_[0].add_data_event.at);
+  if (CacheEvents()) {
+    EnqueueAt(events_[0].add_data_event.at);
   }
 }
 
@@ -126,10 +128,8 @@ void FlowPack::AddDriver(std::unique_ptr<FlowDriver> driver,
   if (driver->type() == FlowDriver::INDEPENDENT) {
     std::unique_ptr<IndependentFlowDriver> independent_flow_driver(
         static_cast<IndependentFlowDriver*>(driver.release()));
-    ConnectionAndIndependentDriver connection_and_driver;
-    connection_and_driver.driver = std::move(independent_flow_driver);
-    connection_and_driver.connection = connection;
-    independent_drivers_.emplace_back(std::move(connection_and_driver));
+    independent_drivers_.emplace_back(connection,
+                                      std::move(independent_flow_driver));
   } else if (driver->type() == FlowDriver::DEPENDENT) {
     std::unique_ptr<ConnectionDependentFlowDriver> dependent_flow_driver(
         static_cast<ConnectionDependentFlowDriver*>(driver.release()));
@@ -139,7 +139,7 @@ void FlowPack::AddDriver(std::unique_ptr<FlowDriver> driver,
 }
 
 void FlowPack::HandleEvent() {
-  const Event& ev = pending_events_[next_event_index_++];
+  const Event& ev = events_[next_event_index_++];
   Connection* connection = ev.connection_and_driver->connection;
   if (ev.add_data_event.close) {
     connection->Close();
@@ -150,51 +150,113 @@ void FlowPack::HandleEvent() {
     }
   }
 
-  if (next_event_index_ == num_events_cached_) {
-    num_events_cached_ = CacheEvents();
-    next_event_index_ = 0;
-
-    if (num_events_cached_ == 0) {
+  if (next_event_index_ == events_.size()) {
+    if (CacheEvents() == 0) {
       return;
     }
   }
 
-  EnqueueAt(pending_events_[next_event_index_].add_data_event.at);
+  EnqueueAt(events_[next_event_index_].add_data_event.at);
 }
 
 void FlowPack::AddFirstEvents() {
-  Event ev;
   for (auto& connection_and_driver : independent_drivers_) {
-    ev.connection_and_driver = &connection_and_driver;
-    ev.add_data_event = connection_and_driver.driver->Next();
-    if (ev.add_data_event.at != EventQueueTime::MaxTime()) {
-      queue_.emplace(std::move(ev));
+    connection_and_driver.head = connection_and_driver.driver->Next();
+  }
+
+  BuildTree();
+}
+
+void FlowPack::BuildTree() {
+  size_t n = independent_drivers_.size();
+  CHECK(n <= std::numeric_limits<uint32_t>::max()) << "Too many drivers";
+  tree_.assign(std::max(n, static_cast<size_t>(1)), {0, 0});
+  if (n == 1) {
+    tree_[0] = {independent_drivers_[0].head.at.Raw(), 0};
+  }
+
+  if (n < 2) {
+    return;
+  }
+
+  // Winners of the matches at each node, only needed while building.
+  std::vector<TreeNode> winners(2 * n);
+  for (size_t i = 0; i < n; ++i) {
+    winners[n + i] = {independent_drivers_[i].head.at.Raw(),
+                      static_cast<uint32_t>(i)};
+  }
+
+  for (size_t node = n - 1; node > 0; --node) {
+    const TreeNode& lhs = winners[2 * node];
+    const TreeNode& rhs = winners[2 * node + 1];
+    if (Before(lhs, rhs)) {
+      winners[node] = lhs;
+      tree_[node] = rhs;
+    } else {
+      winners[node] = rhs;
+      tree_[node] = lhs;
     }
   }
+
+  tree_[0] = winners[1];
+}
+
+void FlowPack::Replay(uint32_t driver_index) {
+  size_t n = independent_drivers_.size();
+  TreeNode winner = {independent_drivers_[driver_index].head.at.Raw(),
+                     driver_index};
+  for (size_t node = (n + driver_index) / 2; node > 0; node /= 2) {
+    // No branches here either, see Before.
+    TreeNode other = tree_[node];
+    bool other_wins = Before(other, winner);
+    tree_[node] = other_wins ? winner : other;
+    winner = other_wins ? other : winner;
+  }
+
+  tree_[0] = winner;
 }
 
 size_t FlowPack::CacheEvents() {
-  size_t i;
+  events_.clear();
+  next_event_index_ = 0;
+  if (independent_drivers_.empty()) {
+    return 0;
+  }
 
   Event ev;
-  for (i = 0; i < kEventCacheSize; ++i) {
-    if (!queue_.size()) {
+  while (events_.size() < lookahead_) {
+    uint32_t winner = tree_[0].driver_index;
+    ConnectionAndIndependentDriver& connection_and_driver =
+        independent_drivers_[winner];
+    if (connection_and_driver.head.at == EventQueueTime::MaxTime()) {
+      // All drivers are out of events.
       break;
     }
 
-    pending_events_[i] = std::move(const_cast<Event&>(queue_.top()));
-    queue_.pop();
+    ev.add_data_event = connection_and_driver.head;
+    ev.connection_and_driver = &connection_and_driver;
+    events_.emplace_back(ev);
+
+    connection_and_driver.head = connection_and_driver.driver->Next();
+    Replay(winner);
+  }
 
-    Event& curr_event = pending_events_[i];
-    ev.connection_and_driver = curr_event.connection_and_driver;
-    ev.add_data_event = curr_event.connection_and_driver->driver->Next();
-    if (ev.add_data_event.at != EventQueueTime::MaxTime()) {
-      queue_.emplace(std::move(ev));
+  // Dense traffic gets larger batches, which are cheaper to merge, sparse
+  // traffic smaller ones, which take less memory.
+  if (events_.size() == lookahead_) {
+    EventQueueTime span =
+        events_.back().add_data_event.at - events_.front().add_data_event.at;
+    EventQueueTime window = event_queue()->ToTime(kLookaheadWindow);
+    size_t max_lookahead =
+        std::min(kMaxLookahead, kMinLookahead * independent_drivers_.size());
+    if (span < window) {
+      lookahead_ = std::min(max_lookahead, lookahead_ * 2);
+    } else if (span > window * 4) {
+      lookahead_ = std::max(kMinLookahead, lookahead_ / 2);
     }
   }
 
-  LOG(INFO) << "Cached " << i << " events";
-  return i;
+  return events_.size();
 }
 
 DefaultObjectSizeAndWaitTimeGenerator::DefaultObjectSizeAndWaitTimeGenerator(
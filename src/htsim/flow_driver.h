@@ -2,12 +2,10 @@
 #define NCODE_HTSIM_FLOW_DRIVER_H
 
 #include <stddef.h>
-#include <array>
 #include <chrono>
 #include <cstdint>
 #include <iostream>
 #include <memory>
-#include <queue>
 #include <random>
 #include <vector>
 
@@ -250,15 +248,24 @@ class FeedbackLoopFlowDriver : public ConnectionDependentFlowDriver,
   Connection* connection_;
 };
 
-// A flow pack is a collection of connections managed by their drivers.
+// A flow pack is a collection of connections managed by their drivers. Events
+// from independent drivers are merged in time order with a tournament (loser)
+// tree, and only a small batch of them is kept ahead of time, so memory
+// scales with the number of drivers.
 class FlowPack : public EventConsumer {
  public:
-  static constexpr size_t kEventCacheSize = 1000000;
+  // Bounds of the number of events merged ahead of time. The upper bound is
+  // also at most kMinLookahead per driver. Within these the batch size adapts
+  // so that a batch covers about kLookaheadWindow of time.
+  static constexpr size_t kMinLookahead = 16;
+  static constexpr size_t kMaxLookahead = 65536;
+  static constexpr std::chrono::milliseconds kLookaheadWindow =
+      std::chrono::milliseconds(10);
 
   FlowPack(const std::string& id, EventQueue* event_queue)
       : EventConsumer(id, event_queue),
-        next_event_index_(0),
-        num_events_cached_(0) {}
+        lookahead_(kMinLookahead),
+        next_event_index_(0) {}
 
   // Should be called after adding all drivers and connections.
   void Init();
@@ -267,16 +274,28 @@ class FlowPack : public EventConsumer {
   void AddDriver(std::unique_ptr<FlowDriver> driver, Connection* connection);
 
   // Looks for the next pending event. If there are no pending events will
-  // generate in bulk events.
+  // merge the next batch of events from all drivers.
   void HandleEvent() override;
 
-  // Goes through all flows and adds their first event to the queue.
+  // Goes through all flows and gets their first event.
   void AddFirstEvents();
 
+  // Number of events merged ahead of time in the next batch.
+  size_t lookahead() const { return lookahead_; }
+
  private:
   struct ConnectionAndIndependentDriver {
+    ConnectionAndIndependentDriver(
+        Connection* connection, std::unique_ptr<IndependentFlowDriver> driver)
+        : connection(connection),
+          driver(std::move(driver)),
+          head(kAddDataInfinity) {}
+
     Connection* connection;
     std::unique_ptr<IndependentFlowDriver> driver;
+
+    // The driver's next event, not yet merged.
+    AddDataEvent head;
   };
 
   struct Event {
@@ -288,23 +307,41 @@ class FlowPack : public EventConsumer {
     ConnectionAndIndependentDriver* connection_and_driver;
   };
 
-  struct Comparator {
-    bool operator()(const Event& lhs, const Event& rhs) {
-      return lhs.add_data_event.at > rhs.add_data_event.at;
-    }
+  // An entry in the tree, the time of a driver's head and the driver's index.
+  // The time is kept in the tree so that matches do not touch the drivers.
+  struct TreeNode {
+    uint64_t at;
+    uint32_t driver_index;
   };
 
-  size_t CacheEvents();
+  // True if 'lhs' should be merged before 'rhs'. Ties are broken by driver
+  // index, so the order is deterministic. Uses no branches, since drivers
+  // often have events at the same time and the outcome is hard to predict.
+  static bool Before(const TreeNode& lhs, const TreeNode& rhs) {
+    return (lhs.at < rhs.at) |
+           ((lhs.at == rhs.at) & (lhs.driver_index < rhs.driver_index));
+  }
 
-  // The queue that contains events.
-  std::priority_queue<Event, std::vector<Event>, Comparator> queue_;
+  // Builds the tree from the heads of all drivers.
+  void BuildTree();
 
-  // A cache of pending events.
-  std::array<Event, kEventCacheSize> pending_events_;
+  // Replays the matches from a driver's leaf to the root after its head
+  // changed.
+  void Replay(uint32_t driver_index);
 
-  size_t next_event_index_;
+  // Merges the next batch of events into 'events_'. Returns the number of
+  // events merged.
+  size_t CacheEvents();
 
-  size_t num_events_cached_;
+  // The loser tree. Drivers are leaves at positions [n, 2n) where n is the
+  // number of drivers. tree_[i] for 0 < i < n is the driver that lost the
+  // match at internal node i, tree_[0] is the overall winner.
+  std::vector<TreeNode> tree_;
+
+  // A batch of merged events and the next one to be handled.
+  std::vector<Event> events_;
+  size_t lookahead_;
+  size_t next_event_index_;
 
   // All drivers.
   std::vector<ConnectionAndIndependentDriver> independent_drivers_;
@@ -307,6 +307,84 @@ TEST(FlowPackTest, MultiDrivers) {
   event_queue.RunAndStopIn(seconds(100));
 }
 
+// Records the time of each AddData call.
+class RecordingConnection : public Connection {
+ public:
+  RecordingConnection(EventQueue* event_queue, std::vector<uint64_t>* times)
+      : Connection("Recording", kFiveTuple, nullptr, event_queue),
+        times_(times) {}
+
+  void ReceivePacket(PacketPtr pkt) override { Unused(pkt); }
+
+  void AddData(uint64_t data_bytes) override {
+    Unused(data_bytes);
+    times_->emplace_back(event_queue_->CurrentTime().Raw());
+  }
+
+  void Close() override {}
+
+ private:
+  std::vector<uint64_t>* times_;
+};
+
+TEST(FlowPackTest, ManyDrivers) {
+  SimTimeEventQueue event_queue;
+  std::vector<uint64_t> times;
+  std::vector<std::unique_ptr<RecordingConnection>> connections;
+
+  auto pack = make_unique<FlowPack>("FlowPack", &event_queue);
+  std::mt19937 rnd(1);
+  std::uniform_int_distribution<uint64_t> ms_dist(0, 999);
+  for (size_t i = 0; i < 100; ++i) {
+    std::vector<AddDataEvent> events;
+    for (size_t j = 0; j < 50; ++j) {
+      events.emplace_back(event_queue.ToTime(milliseconds(ms_dist(rnd))), 1);
+    }
+
+    auto driver = make_unique<ManualFlowDriver>();
+    driver->AddData(events);
+    connections.emplace_back(
+        make_unique<RecordingConnection>(&event_queue, &times));
+    pack->AddDriver(std::move(driver), connections.back().get());
+  }
+  pack->Init();
+
+  event_queue.RunAndStopIn(seconds(2));
+  ASSERT_EQ(5000ul, times.size());
+  ASSERT_TRUE(std::is_sorted(times.begin(), times.end()));
+
+  // 5 events per ms, batches should have grown.
+  ASSERT_LT(FlowPack::kMinLookahead, pack->lookahead());
+}
+
+TEST(FlowPackTest, SparseDrivers) {
+  SimTimeEventQueue event_queue;
+  std::vector<uint64_t> times;
+  RecordingConnection connection(&event_queue, &times);
+
+  std::vector<AddDataEvent> events;
+  for (size_t i = 0; i < 100; ++i) {
+    events.emplace_back(event_queue.ToTime(seconds(i)), 1);
+  }
+  auto driver = make_unique<ManualFlowDriver>();
+  driver->AddData(events);
+
+  auto pack = make_unique<FlowPack>("FlowPack", &event_queue);
+  pack->AddDriver(std::move(driver), &connection);
+  pack->Init();
+
+  event_queue.RunAndStopIn(seconds(200));
+  ASSERT_EQ(100ul, times.size());
+  ASSERT_EQ(FlowPack::kMinLookahead, pack->lookahead());
+}
+
+TEST(FlowPackTest, NoDrivers) {
+  SimTimeEventQueue event_queue;
+  auto pack = make_unique<FlowPack>("FlowPack", &event_queue);
+  pack->Init();
+  event_queue.RunAndStopIn(seconds(1));
+}
+
 }  // namespace
 }  // namespace htsim
 }  // namespace ncode
@@ -0,0 +1,160 @@
+#include "flow_table.h"
+
+#include <limits>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "../common/logging.h"
+
+namespace ncode {
+namespace htsim {
+
+// Multiplies two 64-bit values and folds the 128-bit result, as wyhash does.
+static uint64_t Mix(uint64_t a, uint64_t b) {
+  unsigned __int128 product = static_cast<unsigned __int128>(a) * b;
+  return static_cast<uint64_t>(product) ^
+         static_cast<uint64_t>(product >> 64);
+}
+
+constexpr size_t FlowTable::kGroupSize;
+constexpr uint8_t FlowTable::kEmptyTag;
+
+FlowTable::FlowTable()
+    : tags_(kGroupSize, kEmptyTag), slots_(kGroupSize, 0), group_mask_(0) {}
+
+uint64_t FlowTable::Hash(const net::FiveTuple& tuple) {
+  static constexpr uint64_t kSeeds[] = {0xa0761d6478bd642full,
+                                        0xe7037ed1a0b428dbull,
+                                        0x8ebc6af09c88c6e3ull};
+
+  uint64_t addresses = static_cast<uint64_t>(tuple.ip_src().Raw()) << 32 |
+                       tuple.ip_dst().Raw();
+  uint64_t ports_and_proto =
+      static_cast<uint64_t>(tuple.src_port().Raw()) << 32 |
+      static_cast<uint64_t>(tuple.dst_port().Raw()) << 16 |
+      tuple.ip_proto().Raw();
+  return Mix(Mix(addresses ^ kSeeds[0], ports_and_proto ^ kSeeds[1]),
+             kSeeds[2]);
+}
+
+#if defined(__SSE2__)
+uint32_t FlowTable::MatchTag(const uint8_t* tags, uint8_t tag) {
+  __m128i group = _mm_loadu_si128(reinterpret_cast<const __m128i*>(tags));
+  return _mm_movemask_epi8(_mm_cmpeq_epi8(group, _mm_set1_epi8(tag)));
+}
+
+uint32_t FlowTable::MatchEmpty(const uint8_t* tags) {
+  // Only empty slots have the top bit set.
+  __m128i group = _mm_loadu_si128(reinterpret_cast<const __m128i*>(tags));
+  return _mm_movemask_epi8(group);
+}
+#else
+uint32_t FlowTable::MatchTag(const uint8_t* tags, uint8_t tag) {
+  uint32_t mask = 0;
+  for (size_t i = 0; i < kGroupSize; ++i) {
+    mask |= static_cast<uint32_t>(tags[i] == tag) << i;
+  }
+  return mask;
+}
+
+uint32_t FlowTable::MatchEmpty(const uint8_t* tags) {
+  return MatchTag(tags, kEmptyTag);
+}
+#endif
+
+Connection* FlowTable::FindOrNull(const net::FiveTuple& tuple) const {
+  uint64_t hash = Hash(tuple);
+  uint8_t tag = hash >> 57;
+  size_t group = hash & group_mask_;
+
+  // Triangular probing visits every group if there is a power of 2 of them.
+  for (size_t step = 1;; ++step) {
+    const uint8_t* tags = &tags_[group * kGroupSize];
+    uint32_t matches = MatchTag(tags, tag);
+    while (matches != 0) {
+      size_t slot = group * kGroupSize + __builtin_ctz(matches);
+      const Entry& entry = entries_[slots_[slot]];
+      if (entry.first == tuple) {
+        return entry.second.get();
+      }
+      matches &= matches - 1;
+    }
+
+    // The table is never full, so there is always an empty slot somewhere.
+    if (MatchEmpty(tags) != 0) {
+      return nullptr;
+    }
+    group = (group + step) & group_mask_;
+  }
+}
+
+void FlowTable::InsertIndex(uint64_t hash, uint32_t index) {
+  size_t group = hash & group_mask_;
+  for (size_t step = 1;; ++step) {
+    uint8_t* tags = &tags_[group * kGroupSize];
+    uint32_t empty = MatchEmpty(tags);
+    if (empty != 0) {
+      size_t offset = __builtin_ctz(empty);
+      tags[offset] = hash >> 57;
+      slots_[group * kGroupSize + offset] = index;
+      return;
+    }
+    group = (group + step) & group_mask_;
+  }
+}
+
+void FlowTable::Grow() {
+  size_t group_count = (group_mask_ + 1) * 2;
+  group_mask_ = group_count - 1;
+  tags_.assign(group_count * kGroupSize, kEmptyTag);
+  slots_.assign(group_count * kGroupSize, 0);
+  for (size_t i = 0; i < entries_.size(); ++i) {
+    InsertIndex(Hash(entries_[i].first), i);
+  }
+}
+
+Connection* FlowTable::Insert(const net::FiveTuple& tuple,
+                              std::unique_ptr<Connection> connection) {
+  DCHECK(FindOrNull(tuple) == nullptr) << "Duplicate connection for "
+                                       << tuple;
+
+  // Keeps the load factor at most 7/8.
+  if ((entries_.size() + 1) * 8 > tags_.size() * 7) {
+    Grow();
+  }
+
+  Connection* raw_ptr = connection.get();
+  uint32_t index = entries_.size();
+  entries_.emplace_back(tuple, std::move(connection));
+  InsertIndex(Hash(tuple), index);
+  return raw_ptr;
+}
+
+net::FiveTuple FlowTable::PickSrcPortOrDie(
+    const net::FiveTuple& tuple_with_no_src_port) {
+  const net::FiveTuple& t = tuple_with_no_src_port;
+  net::FiveTuple key(t.ip_src(), t.ip_dst(), t.ip_proto(),
+                     net::AccessLayerPort(0), t.dst_port());
+
+  // Ports are never released, so all ports below the next one are taken.
+  // Some ports above it may be taken by connections that were not set up by
+  // this method, those are skipped.
+  uint32_t& next_port = next_src_port_.emplace(key, 1).first->second;
+  for (; next_port < std::numeric_limits<uint16_t>::max(); ++next_port) {
+    net::FiveTuple return_tuple(t.ip_src(), t.ip_dst(), t.ip_proto(),
+                                net::AccessLayerPort(next_port),
+                                t.dst_port());
+    if (FindOrNull(return_tuple) == nullptr) {
+      ++next_port;
+      return return_tuple;
+    }
+  }
+
+  CHECK(false) << "Out of src ports";
+  return net::FiveTuple::kDefaultTuple;
+}
+
+}  // namespace htsim
+}  // namespace ncode
@@ -0,0 +1,91 @@
+#ifndef NCODE_HTSIM_FLOW_TABLE_H
+#define NCODE_HTSIM_FLOW_TABLE_H
+
+#include <stddef.h>
+#include <cstdint>
+#include <memory>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "../common/common.h"
+#include "../net/net_common.h"
+#include "packet.h"
+
+namespace ncode {
+namespace htsim {
+
+// Maps 5-tuples to the connections of a device. This is an open-addressing
+// hash table: slots are grouped in 16s and each slot has a one-byte tag with
+// 7 bits of the tuple's hash. A lookup compares the tags of a whole group at
+// once (with SSE2 where available) and only compares tuples whose tags
+// match, so most lookups touch a single cache line of tags and one tuple.
+// Connections are never removed from a device, so there is no removal.
+class FlowTable {
+ public:
+  using Entry = std::pair<net::FiveTuple, std::unique_ptr<Connection>>;
+
+  FlowTable();
+
+  // Returns the connection for a tuple, or null if there is none.
+  Connection* FindOrNull(const net::FiveTuple& tuple) const;
+
+  // Adds a connection. There should be no connection for the tuple already.
+  Connection* Insert(const net::FiveTuple& tuple,
+                     std::unique_ptr<Connection> connection);
+
+  // Returns the tuple with its source port set to the lowest port that is not
+  // used by a connection with the same addresses, protocol and destination
+  // port, and has not been returned before. The caller is expected to add a
+  // connection with the tuple. Ports are handed out in order per destination,
+  // so this is O(1) amortized. Dies if all ports are taken.
+  net::FiveTuple PickSrcPortOrDie(const net::FiveTuple& tuple_with_no_src_port);
+
+  // All entries, in the order they were added.
+  const std::vector<Entry>& entries() const { return entries_; }
+
+  size_t size() const { return entries_.size(); }
+
+  // Hash of the 13 bytes of a tuple. Unlike FiveTuple::hash all bits of the
+  // result depend on all bits of the tuple.
+  static uint64_t Hash(const net::FiveTuple& tuple);
+
+ private:
+  static constexpr size_t kGroupSize = 16;
+
+  // Tag of an empty slot. Tags of full slots have their top bit clear.
+  static constexpr uint8_t kEmptyTag = 0x80;
+
+  // Returns a mask with a bit set for each slot in the group at 'tags' whose
+  // tag is 'tag'.
+  static uint32_t MatchTag(const uint8_t* tags, uint8_t tag);
+
+  // Returns a mask with a bit set for each empty slot in the group at 'tags'.
+  static uint32_t MatchEmpty(const uint8_t* tags);
+
+  // Puts the entry at 'index' in an empty slot.
+  void InsertIndex(uint64_t hash, uint32_t index);
+
+  // Doubles the number of groups and re-inserts all entries.
+  void Grow();
+
+  std::vector<Entry> entries_;
+
+  // The tag of each slot and the index in 'entries_' of its entry.
+  std::vector<uint8_t> tags_;
+  std::vector<uint32_t> slots_;
+
+  // Number of groups minus one. The number of groups is a power of 2.
+  size_t group_mask_;
+
+  // For each tuple with no source port the next source port to try.
+  std::unordered_map<net::FiveTuple, uint32_t, net::FiveTupleHasher>
+      next_src_port_;
+
+  DISALLOW_COPY_AND_ASSIGN(FlowTable);
+};
+
+}  // namespace htsim
+}  // namespace ncode
+
+#endif
@@ -0,0 +1,92 @@
+#include <stddef.h>
+#include <chrono>
+#include <iostream>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+#include "../common/common.h"
+#include "../common/event_queue.h"
+#include "../net/net_common.h"
+#include "flow_table.h"
+#include "udp.h"
+
+using namespace std::chrono;
+using namespace ncode;
+
+static constexpr size_t kConnectionCount = 100000;
+static constexpr size_t kLookupRounds = 20;
+
+// Connections from sequential ports on a few hosts, as a busy device would
+// terminate.
+static std::vector<net::FiveTuple> Tuples() {
+  std::vector<net::FiveTuple> tuples;
+  for (size_t i = 0; i < kConnectionCount; ++i) {
+    tuples.emplace_back(net::IPAddress(1 + i / 50000), net::IPAddress(100),
+                        net::kProtoTCP, net::AccessLayerPort(1 + i % 50000),
+                        net::AccessLayerPort(80));
+  }
+  return tuples;
+}
+
+template <typename F>
+static void Time(const std::string& what, F f) {
+  auto start = high_resolution_clock::now();
+  size_t found = f();
+  auto end = high_resolution_clock::now();
+  std::cout << what << " " << duration_cast<milliseconds>(end - start).count()
+            << "ms, " << found << " found\n";
+}
+
+int main(int argc, char** argv) {
+  Unused(argc);
+  Unused(argv);
+
+  SimTimeEventQueue event_queue;
+  std::vector<net::FiveTuple> tuples = Tuples();
+
+  std::unordered_map<net::FiveTuple, std::unique_ptr<htsim::Connection>,
+                     net::FiveTupleHasher> map;
+  htsim::FlowTable flow_table;
+  for (const net::FiveTuple& tuple : tuples) {
+    map.emplace(tuple, make_unique<htsim::UDPSource>("", tuple, nullptr,
+                                                     &event_queue));
+    flow_table.Insert(tuple, make_unique<htsim::UDPSource>(
+                                 "", tuple, nullptr, &event_queue));
+  }
+
+  Time("unordered_map", [&tuples, &map] {
+    size_t found = 0;
+    for (size_t round = 0; round < kLookupRounds; ++round) {
+      for (const net::FiveTuple& tuple : tuples) {
+        found += map.find(tuple) != map.end();
+        found += map.find(tuple.Reverse()) != map.end();
+      }
+    }
+    return found;
+  });
+
+  Time("FlowTable", [&tuples, &flow_table] {
+    size_t found = 0;
+    for (size_t round = 0; round < kLookupRounds; ++round) {
+      for (const net::FiveTuple& tuple : tuples) {
+        found += flow_table.FindOrNull(tuple) != nullptr;
+        found += flow_table.FindOrNull(tuple.Reverse()) != nullptr;
+      }
+    }
+    return found;
+  });
+
+  Time("PickSrcPortOrDie", [&event_queue] {
+    htsim::FlowTable table;
+    net::FiveTuple no_src_port(net::IPAddress(1), net::IPAddress(2),
+                               net::kProtoTCP, net::AccessLayerPort(0),
+                               net::AccessLayerPort(80));
+    for (size_t i = 0; i < 60000; ++i) {
+      net::FiveTuple tuple = table.PickSrcPortOrDie(no_src_port);
+      table.Insert(tuple, make_unique<htsim::UDPSource>("", tuple, nullptr,
+                                                         &event_queue));
+    }
+    return table.size();
+  });
+}
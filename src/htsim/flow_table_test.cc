@@ -0,0 +1,96 @@
+#include "flow_table.h"
+
+#include <set>
+
+#include "gtest/gtest.h"
+#include "udp.h"
+
+namespace ncode {
+namespace htsim {
+namespace {
+
+static net::FiveTuple Tuple(uint32_t src, uint32_t dst, uint16_t src_port,
+                            uint16_t dst_port) {
+  return net::FiveTuple(net::IPAddress(src), net::IPAddress(dst),
+                        net::kProtoUDP, net::AccessLayerPort(src_port),
+                        net::AccessLayerPort(dst_port));
+}
+
+class FlowTableTest : public ::testing::Test {
+ protected:
+  Connection* Add(const net::FiveTuple& tuple) {
+    auto connection =
+        make_unique<UDPSource>(tuple.ToString(), tuple, nullptr, &event_queue_);
+    return flow_table_.Insert(tuple, std::move(connection));
+  }
+
+  SimTimeEventQueue event_queue_;
+  FlowTable flow_table_;
+};
+
+TEST_F(FlowTableTest, Empty) {
+  ASSERT_EQ(0ul, flow_table_.size());
+  ASSERT_EQ(nullptr, flow_table_.FindOrNull(Tuple(1, 2, 3, 4)));
+}
+
+TEST_F(FlowTableTest, ManyConnections) {
+  std::vector<Connection*> connections;
+  for (uint32_t i = 0; i < 100000; ++i) {
+    connections.emplace_back(Add(Tuple(1 + i / 50000, 100, i % 50000, 80)));
+  }
+
+  ASSERT_EQ(100000ul, flow_table_.size());
+  for (uint32_t i = 0; i < 100000; ++i) {
+    net::FiveTuple tuple = Tuple(1 + i / 50000, 100, i % 50000, 80);
+    ASSERT_EQ(connections[i], flow_table_.FindOrNull(tuple));
+    ASSERT_EQ(tuple, flow_table_.entries()[i].first);
+    ASSERT_EQ(nullptr, flow_table_.FindOrNull(tuple.Reverse()));
+  }
+}
+
+// Tuples that differ in a single field should have very different hashes.
+TEST_F(FlowTableTest, Hash) {
+  std::set<uint64_t> low_bits;
+  std::set<uint64_t> high_bits;
+  for (uint16_t port = 0; port < 1024; ++port) {
+    uint64_t hash = FlowTable::Hash(Tuple(1, 2, port, 80));
+    low_bits.emplace(hash & 0xffff);
+    high_bits.emplace(hash >> 48);
+  }
+
+  // With 1024 random values out of 65536 there should be few collisions.
+  ASSERT_LT(1000ul, low_bits.size());
+  ASSERT_LT(1000ul, high_bits.size());
+}
+
+TEST_F(FlowTableTest, PickSrcPort) {
+  net::FiveTuple no_src_port = Tuple(1, 2, 0, 80);
+  net::FiveTuple tuple = flow_table_.PickSrcPortOrDie(no_src_port);
+  ASSERT_EQ(Tuple(1, 2, 1, 80), tuple);
+  Add(tuple);
+
+  // Port 2 is taken by a connection that was not set up by PickSrcPortOrDie.
+  Add(Tuple(1, 2, 2, 80));
+  tuple = flow_table_.PickSrcPortOrDie(no_src_port);
+  ASSERT_EQ(Tuple(1, 2, 3, 80), tuple);
+  Add(tuple);
+
+  // Other destinations have their own ports.
+  ASSERT_EQ(Tuple(1, 3, 1, 80),
+            flow_table_.PickSrcPortOrDie(Tuple(1, 3, 0, 80)));
+  ASSERT_EQ(Tuple(1, 2, 1, 81),
+            flow_table_.PickSrcPortOrDie(Tuple(1, 2, 0, 81)));
+}
+
+TEST_F(FlowTableTest, OutOfSrcPorts) {
+  net::FiveTuple no_src_port = Tuple(1, 2, 0, 80);
+  for (size_t i = 1; i < std::numeric_limits<uint16_t>::max(); ++i) {
+    Add(flow_table_.PickSrcPortOrDie(no_src_port));
+  }
+
+  ASSERT_DEATH(flow_table_.PickSrcPortOrDie(no_src_port), "Out of src ports");
+}
+
+}  // namespace
+}  // namespace htsim
+}  // namespace ncode
@@ -0,0 +1,592 @@
+#include "fluid.h"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+#include "../common/logging.h"
+#include "../common/strutil.h"
+#include "network.h"
+
+namespace ncode {
+namespace htsim {
+
+using namespace std::chrono;
+
+constexpr double FluidSimulation::kEpsilonBytes;
+
+static constexpr double kInfiniteRate = std::numeric_limits<double>::max();
+
+FluidConnection::FluidConnection(const std::string& id,
+                                 const net::FiveTuple& five_tuple,
+                                 uint32_t maxcwnd, FluidSimulation* simulation,
+                                 EventQueue* event_queue)
+    : Connection(id, five_tuple, nullptr, event_queue),
+      maxcwnd_(maxcwnd),
+      simulation_(simulation),
+      routable_(false),
+      max_rate_bps_(kInfiniteRate),
+      rate_bps_(0),
+      backlog_bytes_(0),
+      bytes_sent_(0),
+      last_update_(EventQueueTime::ZeroTime()),
+      active_(false),
+      pending_(false),
+      version_(0),
+      visit_mark_(0),
+      frozen_(false),
+      new_rate_bps_(0) {}
+
+void FluidConnection::AddData(uint64_t data_bytes) {
+  simulation_->ConnectionDataAdded(this, data_bytes);
+}
+
+void FluidConnection::Close() { simulation_->ConnectionClosed(this); }
+
+void FluidConnection::ReceivePacket(PacketPtr pkt) {
+  Unused(pkt);
+  LOG(FATAL) << "Fluid connections do not receive packets";
+}
+
+FluidDevice::FluidDevice(const std::string& id, net::IPAddress ip_address,
+                         FluidSimulation* simulation, bool interesting)
+    : id_(id),
+      ip_address_(ip_address),
+      simulation_(simulation),
+      matcher_(StrCat("matcher_", id), interesting),
+      next_src_port_(1) {}
+
+void FluidDevice::AddRule(std::unique_ptr<MatchRule> rule) {
+  matcher_.AddRule(std::move(rule));
+  simulation_->RulesChanged();
+}
+
+FluidConnection* FluidDevice::AddConnection(net::IPAddress dst_address,
+                                            net::AccessLayerPort dst_port,
+                                            uint32_t maxcwnd) {
+  CHECK(next_src_port_ != std::numeric_limits<uint16_t>::max())
+      << "Out of src ports at " << id_;
+  net::FiveTuple tuple(ip_address_, dst_address, net::kProtoTCP,
+                       net::AccessLayerPort(next_src_port_++), dst_port);
+  auto connection = make_unique<FluidConnection>(
+      StrCat("fluid_connection_", tuple.ToString()), tuple, maxcwnd,
+      simulation_, simulation_->event_queue());
+  FluidConnection* raw_ptr = connection.get();
+  connections_.emplace_back(std::move(connection));
+  simulation_->connections_.emplace_back(raw_ptr);
+  return raw_ptr;
+}
+
+FluidSimulation::FluidLink::FluidLink(const net::GraphLink& graph_link,
+                                      EventQueueTime now, double delay_sec)
+    : capacity_bps(graph_link.bandwidth().bps()),
+      delay_sec(delay_sec),
+      dst(graph_link.dst()),
+      dst_port(graph_link.dst_port()),
+      rate_bps(0),
+      bytes_seen(0),
+      last_update(now),
+      bits_seen_in_last_period(0),
+      remaining_bps(0),
+      unfrozen_count(0),
+      version(0),
+      visit_mark(0) {}
+
+FluidSimulation::FluidSimulation(const net::GraphStorage* graph,
+                                 EventQueue* event_queue, bool interesting)
+    : EventConsumer("fluid_simulation", event_queue),
+      graph_(graph),
+      interesting_(interesting),
+      time_units_per_second_(event_queue->ToTime(seconds(1)).Raw()),
+      rules_changed_(false),
+      scheduled_at_(EventQueueTime::MaxTime()),
+      visit_epoch_(0),
+      rate_computation_count_(0),
+      connections_recomputed_count_(0) {
+  links_.resize(graph->LinkCount());
+  EventQueueTime now = event_queue->CurrentTime();
+  for (net::GraphLinkIndex link_index : graph->AllLinks()) {
+    const net::GraphLink* graph_link = graph->GetLink(link_index);
+    double delay_sec = duration<double>(graph_link->delay()).count();
+    auto link = make_unique<FluidLink>(*graph_link, now, delay_sec);
+    if (interesting) {
+      const std::string& src = graph_link->src_node()->id();
+      const std::string& dst = graph_link->dst_node()->id();
+      AddQueueMetrics(src, dst, &link->queue_stats,
+                      &link->bits_seen_in_last_period);
+      AddPipeMetrics(src, dst, &link->pipe_stats);
+    }
+
+    links_[link_index] = std::move(link);
+    port_to_link_[{graph_link->src(), graph_link->src_port().Raw()}] =
+        link_index;
+  }
+}
+
+FluidDevice* FluidSimulation::AddDevice(const std::string& node_id,
+                                        net::IPAddress ip_address) {
+  net::GraphNodeIndex node = graph_->NodeFromStringOrDie(node_id);
+  CHECK(!ContainsKey(node_to_device_, node)) << "Duplicate device at "
+                                             << node_id;
+  CHECK(!ContainsKey(address_to_device_, ip_address))
+      << "Duplicate address at " << node_id;
+
+  auto device =
+      make_unique<FluidDevice>(node_id, ip_address, this, interesting_);
+  FluidDevice* raw_ptr = device.get();
+  devices_.emplace_back(std::move(device));
+  node_to_device_[node] = raw_ptr;
+  address_to_device_[ip_address] = raw_ptr;
+  return raw_ptr;
+}
+
+const QueueStats& FluidSimulation::GetQueueStats(
+    net::GraphLinkIndex link) const {
+  return links_[link]->queue_stats;
+}
+
+const PipeStats& FluidSimulation::GetPipeStats(net::GraphLinkIndex link) const {
+  return links_[link]->pipe_stats;
+}
+
+void FluidSimulation::UpdateStats() {
+  EventQueueTime now = event_queue()->CurrentTime();
+  for (FluidConnection* connection : connections_) {
+    if (connection->active_) {
+      Settle(connection, now);
+    }
+  }
+
+  for (const auto& link : links_) {
+    Settle(link.get(), now);
+  }
+}
+
+void FluidSimulation::ConnectionDataAdded(FluidConnection* connection,
+                                          uint64_t bytes) {
+  if (connection->active_) {
+    Settle(connection, event_queue()->CurrentTime());
+    connection->backlog_bytes_ += bytes;
+    PushCompletion(connection);
+    Schedule();
+    return;
+  }
+
+  connection->backlog_bytes_ += bytes;
+  if (!connection->pending_) {
+    connection->pending_ = true;
+    pending_.emplace_back(connection);
+    Schedule();
+  }
+}
+
+void FluidSimulation::ConnectionClosed(FluidConnection* connection) {
+  if (connection->active_) {
+    Settle(connection, event_queue()->CurrentTime());
+    Deactivate(connection);
+    Schedule();
+  }
+
+  connection->backlog_bytes_ = 0;
+}
+
+void FluidSimulation::FindPath(FluidConnection* connection) {
+  const net::FiveTuple& five_tuple = connection->five_tuple_;
+  connection->links_.clear();
+  connection->routable_ = false;
+  connection->max_rate_bps_ = kInfiniteRate;
+
+  FluidDevice* device = FindPtrOrNull(address_to_device_, five_tuple.ip_src());
+  CHECK(device != nullptr) << "No device for " << five_tuple.ToString();
+
+  uint64_t epoch = ++visit_epoch_;
+  double delay_sec = 0;
+  net::DevicePortNumber input_port = Device::kLoopbackPortNum;
+  PacketTag tag = kDefaultTag;
+  while (device->ip_address() != five_tuple.ip_dst()) {
+    const MatchRuleAction* action =
+        device->matcher()->LookupOrNull(five_tuple, input_port, tag);
+    if (action == nullptr) {
+      // The packet-level simulation would drop the data.
+      connection->links_.clear();
+      return;
+    }
+
+    if (action->tag() != kNullPacketTag) {
+      tag = action->tag();
+    }
+
+    std::pair<size_t, uint32_t> node_and_port = {
+        graph_->NodeFromStringOrDie(device->id()),
+        action->output_port().Raw()};
+    auto it = port_to_link_.find(node_and_port);
+    CHECK(it != port_to_link_.end()) << "Unable to find port "
+                                     << action->output_port().Raw() << " at "
+                                     << device->id();
+    FluidLink* link = links_[it->second].get();
+    CHECK(link->visit_mark != epoch) << "Forwarding loop for "
+                                     << five_tuple.ToString();
+    link->visit_mark = epoch;
+    connection->links_.emplace_back(it->second);
+    delay_sec += link->delay_sec;
+
+    device = FindPtrOrNull(node_to_device_, link->dst);
+    CHECK(device != nullptr) << "No device at "
+                             << graph_->GetNode(link->dst)->id();
+    input_port = link->dst_port;
+  }
+
+  connection->routable_ = true;
+  if (connection->maxcwnd_ != 0 && delay_sec > 0) {
+    connection->max_rate_bps_ = connection->maxcwnd_ * 8.0 / (2 * delay_sec);
+  }
+}
+
+void FluidSimulation::Attach(FluidConnection* connection) {
+  connection->link_positions_.resize(connection->links_.size());
+  for (size_t i = 0; i < connection->links_.size(); ++i) {
+    uint32_t link_index = connection->links_[i];
+    std::vector<FluidConnection*>& link_connections =
+        links_[link_index]->connections;
+    connection->link_positions_[i] = link_connections.size();
+    link_connections.emplace_back(connection);
+  }
+}
+
+void FluidSimulation::Detach(FluidConnection* connection) {
+  for (size_t i = 0; i < connection->links_.size(); ++i) {
+    uint32_t link_index = connection->links_[i];
+    std::vector<FluidConnection*>& link_connections =
+        links_[link_index]->connections;
+    size_t position = connection->link_positions_[i];
+
+    // The last connection on the link takes this connection's place.
+    FluidConnection* last = link_connections.back();
+    link_connections[position] = last;
+    for (size_t j = 0; j < last->links_.size(); ++j) {
+      if (last->links_[j] == link_index) {
+        last->link_positions_[j] = position;
+        break;
+      }
+    }
+
+    link_connections.pop_back();
+    changed_links_.emplace_back(link_index);
+  }
+}
+
+void FluidSimulation::Activate(FluidConnection* connection) {
+  connection->active_ = true;
+  connection->last_update_ = event_queue()->CurrentTime();
+  connection->rate_bps_ = 0;
+  ++connection->version_;
+  FindPath(connection);
+  if (!connection->routable_) {
+    // The connection stays active, but never sends anything.
+    return;
+  }
+
+  if (connection->links_.empty()) {
+    // Source and destination are the same, all data is sent immediately.
+    connection->bytes_sent_ += connection->backlog_bytes_;
+    connection->backlog_bytes_ = 0;
+    connection->stats_.bytes_tx = std::llround(connection->bytes_sent_);
+    ++connection->version_;
+    completions_.push({connection->last_update_, connection,
+                       connection->version_});
+    return;
+  }
+
+  Attach(connection);
+  changed_connections_.emplace_back(connection);
+}
+
+void FluidSimulation::Deactivate(FluidConnection* connection) {
+  Detach(connection);
+  connection->links_.clear();
+  connection->active_ = false;
+  connection->rate_bps_ = 0;
+  ++connection->version_;
+}
+
+void FluidSimulation::Settle(FluidConnection* connection, EventQueueTime now) {
+  double delta_sec =
+      (now - connection->last_update_).Raw() / time_units_per_second_;
+  double sent = std::min(connection->backlog_bytes_,
+                         connection->rate_bps_ * delta_sec / 8.0);
+  connection->backlog_bytes_ -= sent;
+  connection->bytes_sent_ += sent;
+  connection->stats_.bytes_tx = std::llround(connection->bytes_sent_);
+  connection->last_update_ = now;
+}
+
+void FluidSimulation::Settle(FluidLink* link, EventQueueTime now) {
+  double delta_sec = (now - link->last_update).Raw() / time_units_per_second_;
+  double bits = link->rate_bps * delta_sec;
+  link->bytes_seen += bits / 8.0;
+  link->bits_seen_in_last_period += std::llround(bits);
+  link->queue_stats.bytes_seen = std::llround(link->bytes_seen);
+  link->pipe_stats.bytes_tx = link->queue_stats.bytes_seen;
+  link->last_update = now;
+}
+
+void FluidSimulation::PushCompletion(FluidConnection* connection) {
+  ++connection->version_;
+  if (connection->rate_bps_ == 0) {
+    return;
+  }
+
+  double time_to_finish = connection->backlog_bytes_ * 8.0 /
+                          connection->rate_bps_ * time_units_per_second_;
+  EventQueueTime at =
+      connection->last_update_ +
+      EventQueueTime(static_cast<uint64_t>(std::ceil(time_to_finish)));
+  completions_.push({at, connection, connection->version_});
+}
+
+void FluidSimulation::Freeze(FluidConnection* connection, double rate_bps) {
+  connection->frozen_ = true;
+  connection->new_rate_bps_ = rate_bps;
+  for (uint32_t link_index : connection->links_) {
+    FluidLink* link = links_[link_index].get();
+    link->remaining_bps = std::max(0.0, link->remaining_bps - rate_bps);
+    --link->unfrozen_count;
+    ++link->version;
+    if (link->unfrozen_count > 0) {
+      shares_.push({link->remaining_bps / link->unfrozen_count, link_index,
+                    link->version});
+    }
+  }
+}
+
+void FluidSimulation::RecomputeRates() {
+  if (changed_connections_.empty() && changed_links_.empty()) {
+    return;
+  }
+
+  // Finds all links and connections that are affected by the change. These
+  // are the ones that are connected to a changed connection or link via
+  // links that are shared by connections.
+  uint64_t epoch = ++visit_epoch_;
+  std::vector<uint32_t> to_visit = std::move(changed_links_);
+  changed_links_.clear();
+  std::vector<FluidConnection*> component_connections;
+  auto visit_connection = [&](FluidConnection* connection) {
+    if (connection->visit_mark_ == epoch) {
+      return;
+    }
+
+    connection->visit_mark_ = epoch;
+    component_connections.emplace_back(connection);
+    to_visit.insert(to_visit.end(), connection->links_.begin(),
+                    connection->links_.end());
+  };
+
+  for (FluidConnection* connection : changed_connections_) {
+    if (connection->active_) {
+      visit_connection(connection);
+    }
+  }
+  changed_connections_.clear();
+
+  std::vector<uint32_t> component_links;
+  while (!to_visit.empty()) {
+    uint32_t link_index = to_visit.back();
+    to_visit.pop_back();
+    FluidLink* link = links_[link_index].get();
+    if (link->visit_mark == epoch) {
+      continue;
+    }
+
+    link->visit_mark = epoch;
+    component_links.emplace_back(link_index);
+    for (FluidConnection* connection : link->connections) {
+      visit_connection(connection);
+    }
+  }
+
+  ++rate_computation_count_;
+  connections_recomputed_count_ += component_connections.size();
+
+  // All data sent so far was sent at the old rates.
+  EventQueueTime now = event_queue()->CurrentTime();
+  for (FluidConnection* connection : component_connections) {
+    Settle(connection, now);
+    connection->frozen_ = false;
+  }
+
+  shares_ = {};
+  for (uint32_t link_index : component_links) {
+    FluidLink* link = links_[link_index].get();
+    Settle(link, now);
+    link->remaining_bps = link->capacity_bps;
+    link->unfrozen_count = link->connections.size();
+    ++link->version;
+    if (link->unfrozen_count > 0) {
+      shares_.push({link->remaining_bps / link->unfrozen_count, link_index,
+                    link->version});
+    }
+  }
+
+  std::vector<FluidConnection*> capped;
+  for (FluidConnection* connection : component_connections) {
+    if (connection->max_rate_bps_ != kInfiniteRate) {
+      capped.emplace_back(connection);
+    }
+  }
+  std::sort(capped.begin(), capped.end(),
+            [](const FluidConnection* lhs, const FluidConnection* rhs) {
+              return lhs->max_rate_bps_ < rhs->max_rate_bps_;
+            });
+
+  // Progressive filling. All connections that are not frozen have the same
+  // rate, which grows until either a link is saturated or a connection hits
+  // its maximum rate.
+  size_t next_capped = 0;
+  while (true) {
+    // Entries are stale if the link's share changed since they were added.
+    while (!shares_.empty()) {
+      const LinkShare& top = shares_.top();
+      const FluidLink* link = links_[top.link].get();
+      if (top.version == link->version && link->unfrozen_count > 0) {
+        break;
+      }
+      shares_.pop();
+    }
+
+    if (shares_.empty()) {
+      break;
+    }
+
+    while (next_capped < capped.size() && capped[next_capped]->frozen_) {
+      ++next_capped;
+    }
+
+    LinkShare top = shares_.top();
+    if (next_capped < capped.size() &&
+        capped[next_capped]->max_rate_bps_ <= top.share_bps) {
+      FluidConnection* connection = capped[next_capped];
+      Freeze(connection, connection->max_rate_bps_);
+      continue;
+    }
+
+    // The link is saturated, all connections on it get its share.
+    shares_.pop();
+    for (FluidConnection* connection : links_[top.link]->connections) {
+      if (!connection->frozen_) {
+        Freeze(connection, top.share_bps);
+      }
+    }
+  }
+
+  for (FluidConnection* connection : component_connections) {
+    DCHECK(connection->frozen_);
+    connection->rate_bps_ = connection->new_rate_bps_;
+    PushCompletion(connection);
+  }
+
+  for (uint32_t link_index : component_links) {
+    FluidLink* link = links_[link_index].get();
+    link->rate_bps = 0;
+    for (FluidConnection* connection : link->connections) {
+      link->rate_bps += connection->rate_bps_;
+    }
+
+    link->pipe_stats.bytes_in_flight =
+        std::llround(link->rate_bps * link->delay_sec / 8.0);
+  }
+}
+
+void FluidSimulation::Schedule() {
+  // Stale completions are dropped, so that they do not cause empty events.
+  while (!completions_.empty()) {
+    const Completion& top = completions_.top();
+    if (top.connection->version_ == top.version) {
+      break;
+    }
+    completions_.pop();
+  }
+
+  EventQueueTime now = event_queue()->CurrentTime();
+  EventQueueTime at = EventQueueTime::MaxTime();
+  if (!pending_.empty() || !changed_connections_.empty() ||
+      !changed_links_.empty() || rules_changed_) {
+    at = now;
+  } else if (!completions_.empty()) {
+    at = std::max(now, completions_.top().at);
+  }
+
+  if (at < scheduled_at_) {
+    scheduled_at_ = at;
+    EnqueueAt(at);
+  }
+}
+
+void FluidSimulation::HandleEvent() {
+  EventQueueTime now = event_queue()->CurrentTime();
+  if (now != scheduled_at_) {
+    // Superseded by an earlier event.
+    return;
+  }
+  scheduled_at_ = EventQueueTime::MaxTime();
+
+  std::vector<FluidConnection*> finished;
+  while (!completions_.empty() && completions_.top().at <= now) {
+    Completion completion = completions_.top();
+    completions_.pop();
+
+    FluidConnection* connection = completion.connection;
+    if (connection->version_ != completion.version) {
+      continue;
+    }
+
+    if (connection->active_) {
+      Settle(connection, now);
+      if (connection->backlog_bytes_ > kEpsilonBytes) {
+        // Rounding, will finish a bit later.
+        PushCompletion(connection);
+        continue;
+      }
+
+      Deactivate(connection);
+    }
+
+    connection->backlog_bytes_ = 0;
+    finished.emplace_back(connection);
+  }
+
+  if (rules_changed_) {
+    rules_changed_ = false;
+    for (FluidConnection* connection : connections_) {
+      if (connection->active_) {
+        Settle(connection, now);
+        Detach(connection);
+        connection->active_ = false;
+        Activate(connection);
+      }
+    }
+  }
+
+  for (FluidConnection* connection : pending_) {
+    connection->pending_ = false;
+    if (!connection->active_ && connection->backlog_bytes_ > 0) {
+      Activate(connection);
+    }
+  }
+  pending_.clear();
+
+  RecomputeRates();
+
+  for (FluidConnection* connection : finished) {
+    if (connection->on_send_buffer_drained_) {
+      auto callback = std::move(connection->on_send_buffer_drained_);
+      connection->on_send_buffer_drained_ = nullptr;
+      callback();
+    }
+  }
+
+  Schedule();
+}
+
+}  // namespace htsim
+}  // namespace ncode
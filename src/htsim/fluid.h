@@ -0,0 +1,338 @@
+// A flow-level (fluid) simulation. Instead of being split into packets the
+// data of each connection flows through the network like a fluid, at a rate
+// that is max-min fair among all connections that share links. The rate of a
+// connection can also be capped at its maximum window per RTT, which
+// approximates TCP. Rates only change when a connection starts or stops
+// sending, and only the rates of connections that share links with it
+// (directly or via other connections) need to be recomputed. This is done by
+// progressive filling (water-filling) over the affected links only. Between
+// these events there is nothing to simulate, so simulating hours of traffic
+// takes orders of magnitude fewer events than a packet-level simulation. The
+// price is that queueing, losses and the dynamics of TCP are not modeled.
+//
+// The simulation uses the same graph as the packet-level one, devices forward
+// according to the same kind of rules (see match.h) and connections implement
+// the Connection interface, so they can be driven by FlowDrivers and
+// FlowPacks. Each link reports the same metrics as a queue and a pipe do in
+// the packet-level simulation. Queues are always empty and there are no
+// packets, so queue sizes and all packet counts are 0.
+
+#ifndef NCODE_HTSIM_FLUID_H
+#define NCODE_HTSIM_FLUID_H
+
+#include <stddef.h>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <queue>
+#include <string>
+#include <vector>
+
+#include "../common/common.h"
+#include "../common/event_queue.h"
+#include "../net/net_common.h"
+#include "match.h"
+#include "packet.h"
+#include "queue.h"
+
+namespace ncode {
+namespace htsim {
+
+class FluidSimulation;
+
+// A connection in a fluid simulation. Data added to the connection is sent at
+// the rate the simulation allocates to it. When all data has been sent the
+// send buffer drained callback is called, as with TCP.
+class FluidConnection : public Connection {
+ public:
+  // If 'maxcwnd' is not 0 the connection will send at most 'maxcwnd' bytes
+  // per RTT. The RTT is assumed to be twice the delay of the connection's
+  // path.
+  FluidConnection(const std::string& id, const net::FiveTuple& five_tuple,
+                  uint32_t maxcwnd, FluidSimulation* simulation,
+                  EventQueue* event_queue);
+
+  void AddData(uint64_t data_bytes) override;
+
+  // Discards all data that has not been sent yet.
+  void Close() override;
+
+  // The current rate of the connection, 0 if it is idle.
+  double rate_bps() const { return rate_bps_; }
+
+  // Data that has been added but not yet sent, as of the last time the
+  // connection's rate changed or the simulation's stats were updated.
+  double backlog_bytes() const { return backlog_bytes_; }
+
+  // True if the connection has data to send.
+  bool active() const { return active_; }
+
+  // False if the connection's data cannot be delivered, because a device on
+  // the way has no rule for it.
+  bool routable() const { return routable_; }
+
+ protected:
+  void ReceivePacket(PacketPtr pkt) override;
+
+ private:
+  friend class FluidSimulation;
+
+  const uint32_t maxcwnd_;
+
+  FluidSimulation* simulation_;
+
+  // Links the connection's data goes over. Found from the rules of the
+  // devices when the connection becomes active or when rules change.
+  std::vector<uint32_t> links_;
+
+  // For each link in 'links_' the position of this connection in the link's
+  // list of connections.
+  std::vector<size_t> link_positions_;
+
+  bool routable_;
+
+  // The rate is never larger than this.
+  double max_rate_bps_;
+
+  double rate_bps_;
+  double backlog_bytes_;
+  double bytes_sent_;
+
+  // When the backlog was last brought up to date.
+  EventQueueTime last_update_;
+
+  bool active_;
+
+  // Set if the connection is waiting to become active.
+  bool pending_;
+
+  // Incremented every time the time the connection will finish changes.
+  uint64_t version_;
+
+  // Used when looking for connections affected by a change.
+  uint64_t visit_mark_;
+
+  // Set when the rate of the connection is fixed during water-filling.
+  bool frozen_;
+  double new_rate_bps_;
+
+  DISALLOW_COPY_AND_ASSIGN(FluidConnection);
+};
+
+// A device in a fluid simulation. Forwards data according to a set of rules,
+// the same way a Device does in the packet-level simulation.
+class FluidDevice {
+ public:
+  FluidDevice(const std::string& id, net::IPAddress ip_address,
+              FluidSimulation* simulation, bool interesting = true);
+
+  const std::string& id() const { return id_; }
+
+  net::IPAddress ip_address() const { return ip_address_; }
+
+  // Adds or updates a rule. A rule with no actions removes the rule with the
+  // same key.
+  void AddRule(std::unique_ptr<MatchRule> rule);
+
+  // Adds a new connection from this device to a destination.
+  FluidConnection* AddConnection(net::IPAddress dst_address,
+                                 net::AccessLayerPort dst_port,
+                                 uint32_t maxcwnd = 0);
+
+  Matcher* matcher() { return &matcher_; }
+
+ private:
+  const std::string id_;
+  const net::IPAddress ip_address_;
+
+  FluidSimulation* simulation_;
+
+  Matcher matcher_;
+
+  std::vector<std::unique_ptr<FluidConnection>> connections_;
+
+  // Source port of the next connection.
+  uint16_t next_src_port_;
+
+  DISALLOW_COPY_AND_ASSIGN(FluidDevice);
+};
+
+// Runs a fluid simulation over a graph. Each node of the graph that traffic
+// goes through should have a device.
+class FluidSimulation : public EventConsumer {
+ public:
+  FluidSimulation(const net::GraphStorage* graph, EventQueue* event_queue,
+                  bool interesting = true);
+
+  // Adds a device at a node of the graph.
+  FluidDevice* AddDevice(const std::string& node_id,
+                         net::IPAddress ip_address);
+
+  // Stats of a link. Only up to date after a call to UpdateStats.
+  const QueueStats& GetQueueStats(net::GraphLinkIndex link) const;
+  const PipeStats& GetPipeStats(net::GraphLinkIndex link) const;
+
+  // Brings the stats of all links and connections up to the current time.
+  // Stats are otherwise only updated when rates change, so this should be
+  // called before stats are read, or metrics are polled.
+  void UpdateStats();
+
+  // Number of times rates have been recomputed.
+  uint64_t rate_computation_count() const { return rate_computation_count_; }
+
+  // Total number of connection rates computed, over all recomputations.
+  uint64_t connections_recomputed_count() const {
+    return connections_recomputed_count_;
+  }
+
+  void HandleEvent() override;
+
+ private:
+  friend class FluidConnection;
+  friend class FluidDevice;
+
+  // Connections that finish in less than this many bytes are done.
+  static constexpr double kEpsilonBytes = 0.001;
+
+  struct FluidLink {
+    FluidLink(const net::GraphLink& graph_link, EventQueueTime now,
+              double delay_sec);
+
+    double capacity_bps;
+    double delay_sec;
+    net::GraphNodeIndex dst;
+    net::DevicePortNumber dst_port;
+
+    // Active connections that go over the link.
+    std::vector<FluidConnection*> connections;
+
+    // Sum of the rates of all connections.
+    double rate_bps;
+    double bytes_seen;
+    EventQueueTime last_update;
+
+    QueueStats queue_stats;
+    PipeStats pipe_stats;
+    size_t bits_seen_in_last_period;
+
+    // State used during water-filling.
+    double remaining_bps;
+    size_t unfrozen_count;
+    uint64_t version;
+    uint64_t visit_mark;
+  };
+
+  // A time at which a connection will have sent all its data.
+  struct Completion {
+    EventQueueTime at;
+    FluidConnection* connection;
+    uint64_t version;
+  };
+
+  struct CompletionComparator {
+    bool operator()(const Completion& lhs, const Completion& rhs) {
+      return lhs.at > rhs.at;
+    }
+  };
+
+  // A link and its fair share, used during water-filling.
+  struct LinkShare {
+    double share_bps;
+    uint32_t link;
+    uint64_t version;
+  };
+
+  struct LinkShareComparator {
+    bool operator()(const LinkShare& lhs, const LinkShare& rhs) {
+      return lhs.share_bps > rhs.share_bps;
+    }
+  };
+
+  // Called by connections.
+  void ConnectionDataAdded(FluidConnection* connection, uint64_t bytes);
+  void ConnectionClosed(FluidConnection* connection);
+
+  // Called by devices when their rules change.
+  void RulesChanged() {
+    rules_changed_ = true;
+    Schedule();
+  }
+
+  // Sets the connection's path from the devices' rules.
+  void FindPath(FluidConnection* connection);
+
+  // Adds / removes a connection to / from the links on its path.
+  void Attach(FluidConnection* connection);
+  void Detach(FluidConnection* connection);
+
+  void Activate(FluidConnection* connection);
+  void Deactivate(FluidConnection* connection);
+
+  // Brings the backlog of a connection or the stats of a link up to date.
+  void Settle(FluidConnection* connection, EventQueueTime now);
+  void Settle(FluidLink* link, EventQueueTime now);
+
+  // Adds the time the connection will finish at its current rate.
+  void PushCompletion(FluidConnection* connection);
+
+  // Recomputes the rates of all connections affected by changes since the
+  // last call.
+  void RecomputeRates();
+
+  // Fixes the rate of a connection during water-filling and updates the
+  // shares of the links it goes over.
+  void Freeze(FluidConnection* connection, double rate_bps);
+
+  // Makes sure there is an event for the next thing that needs to be done.
+  void Schedule();
+
+  const net::GraphStorage* graph_;
+  const bool interesting_;
+
+  // Event queue time units in a second.
+  const double time_units_per_second_;
+
+  std::vector<std::unique_ptr<FluidLink>> links_;
+
+  // Links by source node and port.
+  std::map<std::pair<size_t, uint32_t>, uint32_t> port_to_link_;
+
+  std::vector<std::unique_ptr<FluidDevice>> devices_;
+  std::map<size_t, FluidDevice*> node_to_device_;
+  std::map<net::IPAddress, FluidDevice*> address_to_device_;
+
+  // All connections of all devices.
+  std::vector<FluidConnection*> connections_;
+
+  // Connections that are waiting to become active.
+  std::vector<FluidConnection*> pending_;
+
+  // Connections and links whose rates need to be recomputed.
+  std::vector<FluidConnection*> changed_connections_;
+  std::vector<uint32_t> changed_links_;
+
+  bool rules_changed_;
+
+  std::priority_queue<Completion, std::vector<Completion>,
+                      CompletionComparator> completions_;
+
+  // Shares of links during water-filling.
+  std::priority_queue<LinkShare, std::vector<LinkShare>, LinkShareComparator>
+      shares_;
+
+  // Time of the earliest outstanding event, MaxTime if there is none.
+  EventQueueTime scheduled_at_;
+
+  // Incremented on every traversal of connections and links.
+  uint64_t visit_epoch_;
+
+  uint64_t rate_computation_count_;
+  uint64_t connections_recomputed_count_;
+
+  DISALLOW_COPY_AND_ASSIGN(FluidSimulation);
+};
+
+}  // namespace htsim
+}  // namespace ncode
+
+#endif
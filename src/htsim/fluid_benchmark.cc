@@ -0,0 +1,174 @@
+#include <stddef.h>
+#include <chrono>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "../common/common.h"
+#include "../common/event_queue.h"
+#include "../net/net_common.h"
+#include "fluid.h"
+#include "network.h"
+#include "tcp.h"
+
+using namespace std::chrono;
+using namespace ncode;
+
+static constexpr size_t kSourceCount = 16;
+static constexpr uint64_t kBytesPerSource = 10000000;
+static constexpr uint64_t kEdgeRateBps = 1000000000;
+static constexpr uint64_t kCoreRateBps = 100000000;
+static constexpr size_t kSimTimeSec = 20;
+
+static std::string SourceId(size_t i) { return "S" + std::to_string(i); }
+
+// Sources connected to a hub, which has a single bottleneck link to the
+// destination.
+static net::PBNet Star() {
+  net::PBNet net;
+  for (size_t i = 0; i < kSourceCount; ++i) {
+    net::AddBiEdgesToGraph({{SourceId(i), "H"}}, milliseconds(1),
+                           net::Bandwidth::FromBitsPerSecond(kEdgeRateBps),
+                           &net);
+  }
+  net::AddBiEdgesToGraph({{"H", "D"}}, milliseconds(10),
+                         net::Bandwidth::FromBitsPerSecond(kCoreRateBps), &net);
+  return net;
+}
+
+static std::unique_ptr<htsim::MatchRule> Route(net::IPAddress dst,
+                                               net::DevicePortNumber port) {
+  net::FiveTuple tuple(htsim::kWildIPAddress, dst, htsim::kWildIPProto,
+                       htsim::kWildAccessLayerPort,
+                       htsim::kWildAccessLayerPort);
+  htsim::MatchRuleKey key(htsim::kWildPacketTag, htsim::kWildDevicePortNumber,
+                          {tuple});
+  auto rule = make_unique<htsim::MatchRule>(key);
+  rule->AddAction(
+      make_unique<htsim::MatchRuleAction>(port, htsim::kWildPacketTag, 100));
+  return rule;
+}
+
+// Each node gets address index + 1, with the destination last.
+static net::IPAddress Address(const net::GraphStorage& graph,
+                              const std::string& node_id) {
+  return net::IPAddress(graph.NodeFromStringOrDie(node_id) + 1);
+}
+
+// Calls a function with (node, dst address, port) for every rule needed to
+// route between the sources and the destination.
+template <typename F>
+static void ForEachRoute(const net::GraphStorage& graph, F f) {
+  net::IPAddress dst = Address(graph, "D");
+  for (size_t i = 0; i < kSourceCount; ++i) {
+    std::string src = SourceId(i);
+    net::IPAddress src_address = Address(graph, src);
+    f(src, dst, graph.GetLink(graph.LinkOrDie(src, "H"))->src_port());
+    f(std::string("H"), src_address,
+      graph.GetLink(graph.LinkOrDie("H", src))->src_port());
+    f(std::string("D"), src_address,
+      graph.GetLink(graph.LinkOrDie("D", "H"))->src_port());
+  }
+  f(std::string("H"), dst,
+    graph.GetLink(graph.LinkOrDie("H", "D"))->src_port());
+}
+
+static void RunPacketLevel(const net::GraphStorage& graph) {
+  SimTimeEventQueue event_queue;
+  htsim::Network network(event_queue.RawMillisToTime(10), &event_queue);
+
+  std::map<std::string, std::unique_ptr<htsim::Device>> devices;
+  for (net::GraphNodeIndex node : graph.AllNodes()) {
+    const std::string& id = graph.GetNode(node)->id();
+    devices[id] = make_unique<htsim::Device>(id, Address(graph, id),
+                                             &event_queue, false);
+    network.AddDevice(devices[id].get());
+  }
+
+  std::vector<std::unique_ptr<htsim::Queue>> queues;
+  std::vector<std::unique_ptr<htsim::Pipe>> pipes;
+  for (net::GraphLinkIndex link_index : graph.AllLinks()) {
+    const net::GraphLink* link = graph.GetLink(link_index);
+    queues.emplace_back(
+        make_unique<htsim::FIFOQueue>(*link, 200000, &event_queue, false));
+    pipes.emplace_back(make_unique<htsim::Pipe>(*link, &event_queue, false));
+    network.AddLink(queues.back().get(), pipes.back().get());
+  }
+
+  ForEachRoute(graph, [&devices](const std::string& node, net::IPAddress dst,
+                                 net::DevicePortNumber port) {
+    htsim::Device* device = devices[node].get();
+    device->HandlePacket(make_unique<htsim::SSCPAddOrUpdate>(
+        htsim::kWildIPAddress, device->ip_address(), EventQueueTime(0),
+        Route(dst, port)));
+  });
+
+  net::IPAddress dst = Address(graph, "D");
+  for (size_t i = 0; i < kSourceCount; ++i) {
+    htsim::TCPSource* source = devices[SourceId(i)]->AddTCPGenerator(
+        dst, net::AccessLayerPort(100), 1500, 2000000);
+    source->AddData(kBytesPerSource);
+  }
+
+  auto start = high_resolution_clock::now();
+  event_queue.RunAndStopIn(seconds(kSimTimeSec));
+  auto end = high_resolution_clock::now();
+
+  htsim::DeviceStats stats = devices["D"]->GetStats();
+  uint64_t bytes_rx = 0;
+  for (const auto& tuple_and_stats : stats.connection_stats) {
+    bytes_rx += tuple_and_stats.second.bytes_rx;
+  }
+
+  std::cout << "Packet-level "
+            << duration_cast<microseconds>(end - start).count() << "us, "
+            << bytes_rx << " bytes delivered\n";
+}
+
+static void RunFluid(const net::GraphStorage& graph) {
+  SimTimeEventQueue event_queue;
+  htsim::FluidSimulation simulation(&graph, &event_queue, false);
+
+  std::map<std::string, htsim::FluidDevice*> devices;
+  for (net::GraphNodeIndex node : graph.AllNodes()) {
+    const std::string& id = graph.GetNode(node)->id();
+    devices[id] = simulation.AddDevice(id, Address(graph, id));
+  }
+
+  ForEachRoute(graph, [&devices](const std::string& node, net::IPAddress dst,
+                                 net::DevicePortNumber port) {
+    devices[node]->AddRule(Route(dst, port));
+  });
+
+  // Same window as the packet-level TCP sources.
+  net::IPAddress dst = Address(graph, "D");
+  std::vector<htsim::FluidConnection*> connections;
+  for (size_t i = 0; i < kSourceCount; ++i) {
+    connections.emplace_back(devices[SourceId(i)]->AddConnection(
+        dst, net::AccessLayerPort(100), 2000000));
+    connections.back()->AddData(kBytesPerSource);
+  }
+
+  auto start = high_resolution_clock::now();
+  event_queue.RunAndStopIn(seconds(kSimTimeSec));
+  auto end = high_resolution_clock::now();
+
+  uint64_t bytes_tx = 0;
+  for (const htsim::FluidConnection* connection : connections) {
+    bytes_tx += connection->GetStats().bytes_tx;
+  }
+
+  std::cout << "Fluid " << duration_cast<microseconds>(end - start).count()
+            << "us, " << bytes_tx << " bytes delivered, "
+            << simulation.rate_computation_count() << " rate computations\n";
+}
+
+int main(int argc, char** argv) {
+  Unused(argc);
+  Unused(argv);
+
+  net::GraphStorage graph(Star());
+  RunPacketLevel(graph);
+  RunFluid(graph);
+}
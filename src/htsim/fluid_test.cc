@@ -0,0 +1,285 @@
+#include "fluid.h"
+
+#include "gtest/gtest.h"
+#include "flow_driver.h"
+
+namespace ncode {
+namespace htsim {
+namespace {
+
+using namespace std::chrono;
+
+static constexpr uint64_t kRateBps = 10000000;
+static constexpr net::AccessLayerPort kPort = net::AccessLayerPort(100);
+
+// Adds a rule to a device that sends all traffic for an address out of a port.
+static void AddRoute(net::IPAddress dst, net::DevicePortNumber port,
+                     FluidDevice* device) {
+  net::FiveTuple tuple(kWildIPAddress, dst, kWildIPProto, kWildAccessLayerPort,
+                       kWildAccessLayerPort);
+  MatchRuleKey key(kWildPacketTag, kWildDevicePortNumber, {tuple});
+  auto action = make_unique<MatchRuleAction>(port, kWildPacketTag, 100);
+  auto rule = make_unique<MatchRule>(key);
+  rule->AddAction(std::move(action));
+  device->AddRule(std::move(rule));
+}
+
+class FluidTest : public ::testing::Test {
+ protected:
+  // Builds a simulation over a graph with a device at each node. Device
+  // addresses are assigned in order of the node ids.
+  void Init(const net::PBNet& graph_pb) {
+    graph_ = make_unique<net::GraphStorage>(graph_pb);
+    simulation_ = make_unique<FluidSimulation>(graph_.get(), &event_queue_);
+    uint32_t address = 0;
+    for (net::GraphNodeIndex node : graph_->AllNodes()) {
+      const std::string& id = graph_->GetNode(node)->id();
+      devices_[id] = simulation_->AddDevice(id, net::IPAddress(++address));
+    }
+  }
+
+  // Routes traffic from 'src' to 'dst' over a path given as a list of nodes.
+  void AddPath(const std::vector<std::string>& path) {
+    net::IPAddress dst_address = devices_[path.back()]->ip_address();
+    for (size_t i = 0; i < path.size() - 1; ++i) {
+      const net::GraphLink* link =
+          graph_->GetLink(graph_->LinkOrDie(path[i], path[i + 1]));
+      AddRoute(dst_address, link->src_port(), devices_[path[i]]);
+    }
+  }
+
+  FluidConnection* AddConnection(const std::string& src,
+                                 const std::string& dst,
+                                 uint32_t maxcwnd = 0) {
+    return devices_[src]->AddConnection(devices_[dst]->ip_address(), kPort,
+                                        maxcwnd);
+  }
+
+  const QueueStats& LinkQueueStats(const std::string& src,
+                                   const std::string& dst) {
+    return simulation_->GetQueueStats(graph_->LinkOrDie(src, dst));
+  }
+
+  double NowSec() {
+    nanoseconds now = event_queue_.TimeToNanos(event_queue_.CurrentTime());
+    return duration<double>(now).count();
+  }
+
+  SimTimeEventQueue event_queue_;
+  std::unique_ptr<net::GraphStorage> graph_;
+  std::unique_ptr<FluidSimulation> simulation_;
+  std::map<std::string, FluidDevice*> devices_;
+};
+
+static net::PBNet Dumbbell() {
+  net::PBNet net;
+  net::AddBiEdgesToGraph({{"A", "C"}, {"B", "C"}}, milliseconds(1),
+                         net::Bandwidth::FromBitsPerSecond(10 * kRateBps),
+                         &net);
+  net::AddBiEdgesToGraph({{"C", "D"}}, milliseconds(10),
+                         net::Bandwidth::FromBitsPerSecond(kRateBps), &net);
+  return net;
+}
+
+TEST_F(FluidTest, SharedBottleneck) {
+  Init(Dumbbell());
+  AddPath({"A", "C", "D"});
+  AddPath({"B", "C", "D"});
+
+  FluidConnection* connection_a = AddConnection("A", "D");
+  FluidConnection* connection_b = AddConnection("B", "D");
+  connection_a->AddData(std::numeric_limits<uint32_t>::max());
+  connection_b->AddData(std::numeric_limits<uint32_t>::max());
+  event_queue_.RunAndStopIn(milliseconds(100));
+
+  ASSERT_TRUE(connection_a->routable());
+  ASSERT_DOUBLE_EQ(kRateBps / 2.0, connection_a->rate_bps());
+  ASSERT_DOUBLE_EQ(kRateBps / 2.0, connection_b->rate_bps());
+}
+
+TEST_F(FluidTest, MaxMin) {
+  // Both connections over B->C are limited by it, the one that only goes over
+  // A->B gets the rest of A->B.
+  net::PBNet net;
+  net::AddBiEdgesToGraph({{"A", "B"}}, milliseconds(1),
+                         net::Bandwidth::FromBitsPerSecond(kRateBps), &net);
+  net::AddBiEdgesToGraph({{"B", "C"}}, milliseconds(1),
+                         net::Bandwidth::FromBitsPerSecond(4000000), &net);
+  Init(net);
+  AddPath({"A", "B", "C"});
+  AddPath({"A", "B"});
+  AddPath({"B", "C"});
+
+  FluidConnection* long_connection = AddConnection("A", "C");
+  FluidConnection* short_connection = AddConnection("A", "B");
+  FluidConnection* other_connection = AddConnection("B", "C");
+  long_connection->AddData(std::numeric_limits<uint32_t>::max());
+  short_connection->AddData(std::numeric_limits<uint32_t>::max());
+  other_connection->AddData(std::numeric_limits<uint32_t>::max());
+  event_queue_.RunAndStopIn(milliseconds(100));
+
+  ASSERT_DOUBLE_EQ(2000000, long_connection->rate_bps());
+  ASSERT_DOUBLE_EQ(2000000, other_connection->rate_bps());
+  ASSERT_DOUBLE_EQ(8000000, short_connection->rate_bps());
+}
+
+TEST_F(FluidTest, MaxCwnd) {
+  Init(Dumbbell());
+  AddPath({"A", "C", "D"});
+  AddPath({"B", "C", "D"});
+
+  // The path's delay is 11ms, so the RTT is 22ms.
+  FluidConnection* capped = AddConnection("A", "D", 11000);
+  FluidConnection* uncapped = AddConnection("B", "D");
+  capped->AddData(std::numeric_limits<uint32_t>::max());
+  uncapped->AddData(std::numeric_limits<uint32_t>::max());
+  event_queue_.RunAndStopIn(milliseconds(100));
+
+  ASSERT_NEAR(4000000, capped->rate_bps(), 1);
+  ASSERT_NEAR(6000000, uncapped->rate_bps(), 1);
+}
+
+TEST_F(FluidTest, Completion) {
+  Init(Dumbbell());
+  AddPath({"A", "C", "D"});
+
+  FluidConnection* connection = AddConnection("A", "D");
+  double drained_at = 0;
+  connection->OnSendBufferDrained([this, &drained_at] {
+    drained_at = NowSec();
+  });
+  connection->AddData(1000000);
+  event_queue_.RunAndStopIn(seconds(1));
+
+  ASSERT_NEAR(0.8, drained_at, 0.0001);
+  ASSERT_FALSE(connection->active());
+  ASSERT_EQ(0, connection->rate_bps());
+  ASSERT_EQ(1000000ul, connection->GetStats().bytes_tx);
+
+  simulation_->UpdateStats();
+  ASSERT_EQ(1000000ul, LinkQueueStats("A", "C").bytes_seen);
+  ASSERT_EQ(1000000ul, LinkQueueStats("C", "D").bytes_seen);
+  ASSERT_EQ(0ul, LinkQueueStats("D", "C").bytes_seen);
+  ASSERT_EQ(0ul, LinkQueueStats("C", "D").pkts_seen);
+}
+
+TEST_F(FluidTest, RatesChangeOnCompletion) {
+  Init(Dumbbell());
+  AddPath({"A", "C", "D"});
+  AddPath({"B", "C", "D"});
+
+  FluidConnection* connection_a = AddConnection("A", "D");
+  FluidConnection* connection_b = AddConnection("B", "D");
+  double a_drained_at = 0;
+  double b_drained_at = 0;
+  connection_a->OnSendBufferDrained([this, &a_drained_at] {
+    a_drained_at = NowSec();
+  });
+  connection_b->OnSendBufferDrained([this, &b_drained_at] {
+    b_drained_at = NowSec();
+  });
+
+  // A finishes at 1.6s, after which B has the link to itself.
+  connection_a->AddData(1000000);
+  connection_b->AddData(2000000);
+  event_queue_.RunAndStopIn(seconds(3));
+
+  ASSERT_NEAR(1.6, a_drained_at, 0.0001);
+  ASSERT_NEAR(2.4, b_drained_at, 0.0001);
+  ASSERT_EQ(2000000ul, connection_b->GetStats().bytes_tx);
+}
+
+TEST_F(FluidTest, IncrementalRecompute) {
+  net::PBNet net;
+  net::AddBiEdgesToGraph({{"A", "B"}, {"C", "D"}}, milliseconds(1),
+                         net::Bandwidth::FromBitsPerSecond(kRateBps), &net);
+  Init(net);
+  AddPath({"A", "B"});
+  AddPath({"C", "D"});
+
+  FluidConnection* connection_ab = AddConnection("A", "B");
+  connection_ab->AddData(std::numeric_limits<uint32_t>::max());
+  event_queue_.RunAndStopIn(milliseconds(100));
+  ASSERT_EQ(1ul, simulation_->rate_computation_count());
+  ASSERT_EQ(1ul, simulation_->connections_recomputed_count());
+
+  // The new connection does not share links with the old one, so only its
+  // rate is computed.
+  FluidConnection* connection_cd = AddConnection("C", "D");
+  connection_cd->AddData(std::numeric_limits<uint32_t>::max());
+  event_queue_.RunAndStopIn(milliseconds(100));
+  ASSERT_EQ(2ul, simulation_->rate_computation_count());
+  ASSERT_EQ(2ul, simulation_->connections_recomputed_count());
+  ASSERT_DOUBLE_EQ(kRateBps, connection_ab->rate_bps());
+  ASSERT_DOUBLE_EQ(kRateBps, connection_cd->rate_bps());
+
+  // This one shares a link with the first connection.
+  FluidConnection* other_ab = AddConnection("A", "B");
+  other_ab->AddData(std::numeric_limits<uint32_t>::max());
+  event_queue_.RunAndStopIn(milliseconds(100));
+  ASSERT_EQ(3ul, simulation_->rate_computation_count());
+  ASSERT_EQ(4ul, simulation_->connections_recomputed_count());
+  ASSERT_DOUBLE_EQ(kRateBps / 2.0, connection_ab->rate_bps());
+  ASSERT_DOUBLE_EQ(kRateBps, connection_cd->rate_bps());
+}
+
+TEST_F(FluidTest, Unroutable) {
+  Init(Dumbbell());
+  const net::GraphLink* link = graph_->GetLink(graph_->LinkOrDie("A", "C"));
+  AddRoute(devices_["D"]->ip_address(), link->src_port(), devices_["A"]);
+
+  FluidConnection* connection = AddConnection("A", "D");
+  connection->AddData(1000000);
+  event_queue_.RunAndStopIn(seconds(1));
+  ASSERT_FALSE(connection->routable());
+  ASSERT_TRUE(connection->active());
+  ASSERT_EQ(0, connection->rate_bps());
+
+  // Once there is a route the data is sent.
+  AddPath({"C", "D"});
+  event_queue_.RunAndStopIn(seconds(1));
+  ASSERT_TRUE(connection->routable());
+  ASSERT_FALSE(connection->active());
+  ASSERT_EQ(1000000ul, connection->GetStats().bytes_tx);
+}
+
+TEST_F(FluidTest, Close) {
+  Init(Dumbbell());
+  AddPath({"A", "C", "D"});
+
+  FluidConnection* connection = AddConnection("A", "D");
+  connection->AddData(10000000);
+  event_queue_.RunAndStopIn(milliseconds(800));
+  connection->Close();
+  event_queue_.RunAndStopIn(seconds(1));
+
+  ASSERT_FALSE(connection->active());
+  ASSERT_EQ(1000000ul, connection->GetStats().bytes_tx);
+  simulation_->UpdateStats();
+  ASSERT_EQ(1000000ul, LinkQueueStats("C", "D").bytes_seen);
+}
+
+TEST_F(FluidTest, FlowPack) {
+  Init(Dumbbell());
+  AddPath({"A", "C", "D"});
+
+  FluidConnection* connection = AddConnection("A", "D");
+  auto driver = make_unique<ManualFlowDriver>();
+  driver->AddData({{event_queue_.ToTime(seconds(1)), 1000000},
+                   {event_queue_.ToTime(seconds(3)), 1000000}});
+
+  auto pack = make_unique<FlowPack>("FlowPack", &event_queue_);
+  pack->AddDriver(std::move(driver), connection);
+  pack->Init();
+
+  event_queue_.RunAndStopIn(seconds(2));
+  ASSERT_EQ(1000000ul, connection->GetStats().bytes_tx);
+  ASSERT_FALSE(connection->active());
+
+  event_queue_.RunAndStopIn(seconds(2));
+  ASSERT_EQ(2000000ul, connection->GetStats().bytes_tx);
+}
+
+}  // namespace
+}  // namespace htsim
+}  // namespace ncode
@@ -204,11 +204,23 @@ static MatchRuleAction* GetActionOrNull(const Packet& packet, MatchRule* rule) {
   return action_chosen;
 }
 
-const MatchRuleAction* Matcher::MatchOrNull(const Packet& pkt,
-                                            net::DevicePortNumber input_port) {
+MatchRule* Matcher::FindRuleOrNull(const net::FiveTuple& five_tuple,
+                                   net::DevicePortNumber input_port,
+                                   PacketTag tag) {
   CHECK(input_port != kWildDevicePortNumber) << "Bad input port in MatchOrNull";
 
-  MatchRule* rule = root_.MatchOrNull(pkt.five_tuple(), input_port, pkt.tag());
+  MatchRule* rule;
+  if (!cache_.Lookup(five_tuple, input_port, tag, &rule)) {
+    rule = classifier_.MatchOrNull(five_tuple, input_port, tag);
+    cache_.Insert(five_tuple, input_port, tag, rule);
+  }
+
+  return rule;
+}
+
+const MatchRuleAction* Matcher::MatchOrNull(const Packet& pkt,
+                                            net::DevicePortNumber input_port) {
+  MatchRule* rule = FindRuleOrNull(pkt.five_tuple(), input_port, pkt.tag());
   if (rule == nullptr) {
     return nullptr;
   }
@@ -216,6 +228,17 @@ const MatchRuleAction* Matcher::MatchOrNull(const Packet& pkt,
   return GetActionOrNull(pkt, rule);
 }
 
+const MatchRuleAction* Matcher::LookupOrNull(const net::FiveTuple& five_tuple,
+                                             net::DevicePortNumber input_port,
+                                             PacketTag tag) {
+  MatchRule* rule = FindRuleOrNull(five_tuple, input_port, tag);
+  if (rule == nullptr) {
+    return nullptr;
+  }
+
+  return rule->ChooseOrNull(five_tuple);
+}
+
 void Matcher::AddRule(std::unique_ptr<MatchRule> rule) {
   const MatchRuleKey& key = rule->key();
   rule->set_parent_matcher(this);
@@ -226,16 +249,22 @@ void Matcher::AddRule(std::unique_ptr<MatchRule> rule) {
   bool delete_rule = rule->actions().empty();
   if (!delete_rule) {
     for (const net::FiveTuple& five_tuple : key.five_tuples()) {
-      root_.InsertOrUpdate(five_tuple, key.input_port(), key.tag(),
-                           rule_raw_ptr);
+      classifier_.InsertOrUpdate(five_tuple, key.input_port(), key.tag(),
+                                 rule_raw_ptr);
     }
   }
 
+  // The rule that is replaced can only be at the same points as the new one.
   MatchRule* to_clear = FindSmartPtrOrNull(all_rules_, key);
   if (to_clear != nullptr) {
-    root_.ClearRule(to_clear);
+    for (const net::FiveTuple& five_tuple : key.five_tuples()) {
+      classifier_.ClearIfSame(five_tuple, key.input_port(), key.tag(),
+                              to_clear);
+    }
   }
 
+  cache_.Clear();
+
   if (delete_rule) {
     all_rules_.erase(key);
   } else {
@@ -277,67 +306,151 @@ void MatchRuleAction::MergeStats(const ActionStats& stats) {
                                                 << " vs " << prev_pkts;
 }
 
-template <>
-std::pair<uint32_t, uint32_t> GetKeyAndWildcard<0>(
-    const net::FiveTuple& five_tuple, net::DevicePortNumber input_port,
-    PacketTag input_tag) {
-  Unused(five_tuple);
-  Unused(input_tag);
-  return {input_port.Raw(), kWildDevicePortNumber.Raw()};
+constexpr size_t TupleSpaceClassifier::kFieldCount;
+constexpr size_t MicroflowCache::kEntryCount;
+
+// Mixes a 64 bit value so that all bits of the input affect the high bits of
+// the output.
+static inline uint64_t Mix(uint64_t value) {
+  value ^= value >> 33;
+  value *= 0xff51afd7ed558ccdul;
+  value ^= value >> 33;
+  return value;
 }
 
-template <>
-std::pair<uint32_t, uint32_t> GetKeyAndWildcard<1>(
-    const net::FiveTuple& five_tuple, net::DevicePortNumber input_port,
-    PacketTag input_tag) {
-  Unused(five_tuple);
-  Unused(input_port);
-  return {input_tag.Raw(), kWildPacketTag.Raw()};
+size_t TupleSpaceClassifier::FieldValuesHasher::operator()(
+    const FieldValues& values) const {
+  uint64_t hash = 0;
+  for (uint32_t value : values) {
+    hash = Mix(hash ^ value);
+  }
+
+  return hash;
 }
 
-template <>
-std::pair<uint32_t, uint32_t> GetKeyAndWildcard<2>(
+TupleSpaceClassifier::FieldValues TupleSpaceClassifier::GetFieldValues(
     const net::FiveTuple& five_tuple, net::DevicePortNumber input_port,
     PacketTag input_tag) {
-  Unused(input_port);
-  Unused(input_tag);
-  return {five_tuple.ip_dst().Raw(), kWildIPAddress.Raw()};
+  return {{input_port.Raw(), input_tag.Raw(), five_tuple.ip_dst().Raw(),
+           five_tuple.ip_src().Raw(), five_tuple.ip_proto().Raw(),
+           five_tuple.src_port().Raw(), five_tuple.dst_port().Raw()}};
 }
 
-template <>
-std::pair<uint32_t, uint32_t> GetKeyAndWildcard<3>(
-    const net::FiveTuple& five_tuple, net::DevicePortNumber input_port,
-    PacketTag input_tag) {
-  Unused(input_port);
-  Unused(input_tag);
-  return {five_tuple.ip_src().Raw(), kWildIPAddress.Raw()};
+uint32_t TupleSpaceClassifier::GetMask(const FieldValues& values) {
+  static_assert(kWildDevicePortNumber.Raw() == 0 && kWildPacketTag.Raw() == 0 &&
+                    kWildIPAddress.Raw() == 0 && kWildIPProto.Raw() == 0 &&
+                    kWildAccessLayerPort.Raw() == 0,
+                "Wildcards should be 0");
+
+  uint32_t mask = 0;
+  for (uint32_t value : values) {
+    mask = (mask << 1) | (value != 0);
+  }
+
+  return mask;
 }
 
-template <>
-std::pair<uint32_t, uint32_t> GetKeyAndWildcard<4>(
-    const net::FiveTuple& five_tuple, net::DevicePortNumber input_port,
-    PacketTag input_tag) {
-  Unused(input_port);
-  Unused(input_tag);
-  return {five_tuple.ip_proto().Raw(), kWildIPProto.Raw()};
+void TupleSpaceClassifier::InsertOrUpdate(const net::FiveTuple& five_tuple,
+                                          net::DevicePortNumber input_port,
+                                          PacketTag input_tag,
+                                          MatchRule* rule) {
+  FieldValues values = GetFieldValues(five_tuple, input_port, input_tag);
+  uint32_t mask = GetMask(values);
+  auto it = std::lower_bound(
+      tables_.begin(), tables_.end(), mask,
+      [](const Table& table, uint32_t mask) { return table.mask > mask; });
+  if (it == tables_.end() || it->mask != mask) {
+    it = tables_.emplace(it, mask);
+  }
+
+  MatchRule*& current_rule = it->rules[values];
+  if (current_rule != nullptr) {
+    rule->MergeStats(*current_rule);
+  }
+
+  current_rule = rule;
 }
 
-template <>
-std::pair<uint32_t, uint32_t> GetKeyAndWildcard<5>(
-    const net::FiveTuple& five_tuple, net::DevicePortNumber input_port,
-    PacketTag input_tag) {
-  Unused(input_port);
-  Unused(input_tag);
-  return {five_tuple.src_port().Raw(), kWildAccessLayerPort.Raw()};
+void TupleSpaceClassifier::ClearIfSame(const net::FiveTuple& five_tuple,
+                                       net::DevicePortNumber input_port,
+                                       PacketTag input_tag, MatchRule* rule) {
+  FieldValues values = GetFieldValues(five_tuple, input_port, input_tag);
+  uint32_t mask = GetMask(values);
+  for (auto it = tables_.begin(); it != tables_.end(); ++it) {
+    if (it->mask != mask) {
+      continue;
+    }
+
+    auto rule_it = it->rules.find(values);
+    if (rule_it != it->rules.end() && rule_it->second == rule) {
+      it->rules.erase(rule_it);
+      if (it->rules.empty()) {
+        tables_.erase(it);
+      }
+    }
+
+    return;
+  }
 }
 
-template <>
-std::pair<uint32_t, uint32_t> GetKeyAndWildcard<6>(
-    const net::FiveTuple& five_tuple, net::DevicePortNumber input_port,
-    PacketTag input_tag) {
-  Unused(input_port);
-  Unused(input_tag);
-  return {five_tuple.dst_port().Raw(), kWildAccessLayerPort.Raw()};
+MatchRule* TupleSpaceClassifier::MatchOrNull(const net::FiveTuple& five_tuple,
+                                             net::DevicePortNumber input_port,
+                                             PacketTag input_tag) const {
+  FieldValues values = GetFieldValues(five_tuple, input_port, input_tag);
+  FieldValues masked;
+  for (const Table& table : tables_) {
+    for (size_t i = 0; i < kFieldCount; ++i) {
+      bool exact = (table.mask >> (kFieldCount - 1 - i)) & 1;
+      masked[i] = exact ? values[i] : 0;
+    }
+
+    auto it = table.rules.find(masked);
+    if (it != table.rules.end()) {
+      return it->second;
+    }
+  }
+
+  return nullptr;
+}
+
+size_t MicroflowCache::Index(const net::FiveTuple& five_tuple,
+                             net::DevicePortNumber input_port,
+                             PacketTag input_tag) {
+  uint64_t hash = five_tuple.hash();
+  hash ^= (static_cast<uint64_t>(input_port.Raw()) << 32) ^ input_tag.Raw();
+  return Mix(hash) % kEntryCount;
+}
+
+bool MicroflowCache::Lookup(const net::FiveTuple& five_tuple,
+                            net::DevicePortNumber input_port,
+                            PacketTag input_tag, MatchRule** rule) const {
+  if (entries_.empty()) {
+    return false;
+  }
+
+  const Entry& entry = entries_[Index(five_tuple, input_port, input_tag)];
+  if (entry.generation != generation_ || entry.input_port != input_port ||
+      entry.input_tag != input_tag || entry.five_tuple != five_tuple) {
+    return false;
+  }
+
+  *rule = entry.rule;
+  return true;
+}
+
+void MicroflowCache::Insert(const net::FiveTuple& five_tuple,
+                            net::DevicePortNumber input_port,
+                            PacketTag input_tag, MatchRule* rule) {
+  if (entries_.empty()) {
+    entries_.resize(kEntryCount);
+  }
+
+  Entry& entry = entries_[Index(five_tuple, input_port, input_tag)];
+  entry.generation = generation_;
+  entry.five_tuple = five_tuple;
+  entry.input_port = input_port;
+  entry.input_tag = input_tag;
+  entry.rule = rule;
 }
 
 SSCPStatsRequest::SSCPStatsRequest(net::IPAddress ip_src, net::IPAddress ip_dst,
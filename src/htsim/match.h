@@ -1,9 +1,9 @@
 #ifndef NCODE_HTSIM_MATCH_H
 #define NCODE_HTSIM_MATCH_H
 
+#include <array>
 #include <cstdint>
 #include <limits>
-#include <unordered_map>
 #include <map>
 #include <unordered_map>
 #include <sstream>
@@ -202,153 +202,114 @@ class MatchRule {
   DISALLOW_COPY_AND_ASSIGN(MatchRule);
 };
 
-template <size_t Index>
-std::pair<uint32_t, uint32_t> GetKeyAndWildcard(
-    const net::FiveTuple& five_tuple, net::DevicePortNumber input_port,
-    PacketTag input_tag) {
-  Unused(five_tuple);
-  Unused(input_port);
-  Unused(input_tag);
-
-  LOG(FATAL) << "Should never happen";
-  return {0, 0};
-}
-
-template <>
-std::pair<uint32_t, uint32_t> GetKeyAndWildcard<0>(
-    const net::FiveTuple& five_tuple, net::DevicePortNumber input_port,
-    PacketTag input_tag);
-
-template <>
-std::pair<uint32_t, uint32_t> GetKeyAndWildcard<1>(
-    const net::FiveTuple& five_tuple, net::DevicePortNumber input_port,
-    PacketTag input_tag);
-
-template <>
-std::pair<uint32_t, uint32_t> GetKeyAndWildcard<2>(
-    const net::FiveTuple& five_tuple, net::DevicePortNumber input_port,
-    PacketTag input_tag);
-
-template <>
-std::pair<uint32_t, uint32_t> GetKeyAndWildcard<3>(
-    const net::FiveTuple& five_tuple, net::DevicePortNumber input_port,
-    PacketTag input_tag);
-
-template <>
-std::pair<uint32_t, uint32_t> GetKeyAndWildcard<4>(
-    const net::FiveTuple& five_tuple, net::DevicePortNumber input_port,
-    PacketTag input_tag);
-
-template <>
-std::pair<uint32_t, uint32_t> GetKeyAndWildcard<5>(
-    const net::FiveTuple& five_tuple, net::DevicePortNumber input_port,
-    PacketTag input_tag);
-
-template <>
-std::pair<uint32_t, uint32_t> GetKeyAndWildcard<6>(
-    const net::FiveTuple& five_tuple, net::DevicePortNumber input_port,
-    PacketTag input_tag);
-
-template <size_t Index, size_t MaxIndex>
-class MatchNode {
+// Classifies packets using tuple space search. Each (tuple, input port, tag)
+// that a rule matches on is a point in a space of 7 fields -- input port, tag,
+// destination, source, protocol, source port and destination port. Each field
+// is either exact or a wildcard. Points that have the same set of wildcard
+// fields are stored in the same hash table, so a lookup is one hash probe per
+// distinct set of wildcards in use.
+//
+// If more than one point matches a packet the most specific one wins: a point
+// that is exact on a field beats all points that wildcard the field and
+// agree with it on all earlier fields. Tables are kept sorted in this order
+// and the first hit is returned.
+class TupleSpaceClassifier {
  public:
-  void ClearRule(MatchRule* rule) {
-    for (auto& key_and_child : children_) {
-      MatchNode<Index + 1, MaxIndex>& child = key_and_child.second;
-      child.ClearRule(rule);
-    }
-
-    if (wildcard_child_) {
-      wildcard_child_->ClearRule(rule);
-    }
-  }
+  static constexpr size_t kFieldCount = 7;
 
+  // Adds or replaces the rule for a point. If there was already a rule for the
+  // point its stats are merged into the new rule.
+  void InsertOrUpdate(const net::FiveTuple& five_tuple,
+                      net::DevicePortNumber input_port, PacketTag input_tag,
+                      MatchRule* rule);
+
+  // Removes the rule for a point, but only if it is 'rule'.
+  void ClearIfSame(const net::FiveTuple& five_tuple,
+                   net::DevicePortNumber input_port, PacketTag input_tag,
+                   MatchRule* rule);
+
+  // Returns the rule of the most specific point that matches, or null.
   MatchRule* MatchOrNull(const net::FiveTuple& five_tuple,
                          net::DevicePortNumber input_port,
-                         PacketTag input_tag) {
-    uint32_t key;
-    uint32_t wildcard;
-    std::tie(key, wildcard) =
-        GetKeyAndWildcard<Index>(five_tuple, input_port, input_tag);
-
-    MatchNode<Index + 1, MaxIndex>* child = FindOrNull(children_, key);
-    if (child != nullptr) {
-      MatchRule* exact_match =
-          child->MatchOrNull(five_tuple, input_port, input_tag);
-      if (exact_match != nullptr) {
-        return exact_match;
-      }
-    }
-
-    if (wildcard_child_) {
-      return wildcard_child_->MatchOrNull(five_tuple, input_port, input_tag);
-    }
-    return nullptr;
-  }
+                         PacketTag input_tag) const;
 
-  void InsertOrUpdate(const net::FiveTuple& five_tuple,
-                      net::DevicePortNumber input_port, PacketTag input_tag,
-                      MatchRule* rule) {
-    uint32_t key;
-    uint32_t wildcard;
-    std::tie(key, wildcard) =
-        GetKeyAndWildcard<Index>(five_tuple, input_port, input_tag);
-
-    MatchNode<Index + 1, MaxIndex>* child;
-    if (key == wildcard) {
-      if (!wildcard_child_) {
-        wildcard_child_ = make_unique<MatchNode<Index + 1, MaxIndex>>();
-      }
-      child = wildcard_child_.get();
-    } else {
-      child = &children_[key];
-    }
-    child->InsertOrUpdate(five_tuple, input_port, input_tag, rule);
-  }
+  // Number of hash tables that are searched on a miss.
+  size_t TableCount() const { return tables_.size(); }
 
  private:
-  std::unordered_map<uint32_t, MatchNode<Index + 1, MaxIndex>> children_;
-  std::unique_ptr<MatchNode<Index + 1, MaxIndex>> wildcard_child_;
+  // Values of all fields, in order of specificity.
+  using FieldValues = std::array<uint32_t, kFieldCount>;
+
+  struct FieldValuesHasher {
+    size_t operator()(const FieldValues& values) const;
+  };
+
+  // Points with the same set of wildcard fields. The mask has a bit set for
+  // each exact field. The first field is the most significant bit, so tables
+  // with larger masks are more specific.
+  struct Table {
+    explicit Table(uint32_t mask) : mask(mask) {}
+
+    uint32_t mask;
+    std::unordered_map<FieldValues, MatchRule*, FieldValuesHasher> rules;
+  };
+
+  static FieldValues GetFieldValues(const net::FiveTuple& five_tuple,
+                                    net::DevicePortNumber input_port,
+                                    PacketTag input_tag);
+
+  // Returns the mask of a point. Wildcard fields have value 0.
+  static uint32_t GetMask(const FieldValues& values);
+
+  // Tables ordered by decreasing mask. Empty tables are removed.
+  std::vector<Table> tables_;
 };
 
-// This is the leaf node.
-template <>
-class MatchNode<7, 7> {
+// A direct-mapped cache of classification results, keyed on the exact
+// 5-tuple, input port and tag of packets. Misses are cached too. All entries
+// are invalidated at once by bumping a generation number.
+class MicroflowCache {
  public:
-  MatchNode<7, 7>() : rule_(nullptr) {}
+  static constexpr size_t kEntryCount = 1024;
 
-  void InsertOrUpdate(const net::FiveTuple& five_tuple,
-                      net::DevicePortNumber input_port, PacketTag input_tag,
-                      MatchRule* rule) {
-    Unused(five_tuple);
-    Unused(input_port);
-    Unused(input_tag);
-    if (rule_) {
-      rule->MergeStats(*rule_);
-    }
-
-    rule_ = rule;
-    return;
-  }
+  MicroflowCache() : generation_(1) {}
 
-  MatchRule* MatchOrNull(const net::FiveTuple& five_tuple,
-                         net::DevicePortNumber input_port,
-                         PacketTag input_tag) {
-    Unused(five_tuple);
-    Unused(input_port);
-    Unused(input_tag);
-    return rule_;
-  }
+  // Looks up a packet. Returns true on a hit and sets 'rule'.
+  bool Lookup(const net::FiveTuple& five_tuple,
+              net::DevicePortNumber input_port, PacketTag input_tag,
+              MatchRule** rule) const;
 
-  void ClearRule(MatchRule* rule) {
-    if (rule_ == rule) {
-      rule_ = nullptr;
-    }
-  }
+  // Records the result of classifying a packet.
+  void Insert(const net::FiveTuple& five_tuple,
+              net::DevicePortNumber input_port, PacketTag input_tag,
+              MatchRule* rule);
+
+  // Invalidates all entries.
+  void Clear() { ++generation_; }
 
  private:
-  // Only used if this is a leaf.
-  MatchRule* rule_;
+  struct Entry {
+    Entry()
+        : generation(0),
+          input_port(kWildDevicePortNumber),
+          input_tag(kWildPacketTag),
+          rule(nullptr) {}
+
+    uint64_t generation;
+    net::FiveTuple five_tuple;
+    net::DevicePortNumber input_port;
+    PacketTag input_tag;
+    MatchRule* rule;
+  };
+
+  static size_t Index(const net::FiveTuple& five_tuple,
+                      net::DevicePortNumber input_port, PacketTag input_tag);
+
+  // Entries are only valid if their generation is the current one.
+  uint64_t generation_;
+
+  // Allocated on first insert, as many devices never see much traffic.
+  std::vector<Entry> entries_;
 };
 
 // A request that causes the router to return statistics for each rule.
@@ -403,6 +364,11 @@ class Matcher {
   const MatchRuleAction* MatchOrNull(const Packet& packet,
                                      net::DevicePortNumber input_port);
 
+  // Like MatchOrNull, but does not need a packet and does not update stats.
+  const MatchRuleAction* LookupOrNull(const net::FiveTuple& five_tuple,
+                                      net::DevicePortNumber input_port,
+                                      PacketTag tag);
+
   // Adds a new match rule to the current rule set.
   void AddRule(std::unique_ptr<MatchRule> rule);
 
@@ -415,14 +381,18 @@ class Matcher {
   void PopulateSSCPStats(SSCPStatsReply* stats_reply) const;
 
  private:
-  MatchRule* MatchOrNullFromList(const Packet& pkt,
-                                 net::DevicePortNumber input_port);
+  // Returns the rule that matches, consulting the cache first.
+  MatchRule* FindRuleOrNull(const net::FiveTuple& five_tuple,
+                            net::DevicePortNumber input_port, PacketTag tag);
 
   // Human-readable identifier.
   const std::string id_;
 
-  // Performs the actual matching. The root of the match tree.
-  MatchNode<0, 7> root_;
+  // Performs the actual matching.
+  TupleSpaceClassifier classifier_;
+
+  // Caches results from the classifier. Cleared when rules change.
+  MicroflowCache cache_;
 
   // Stores all rules that are owned by this object.
   std::map<MatchRuleKey, std::unique_ptr<MatchRule>> all_rules_;
@@ -0,0 +1,114 @@
+#include <stddef.h>
+#include <chrono>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <vector>
+
+#include "../common/common.h"
+#include "../common/logging.h"
+#include "../net/net_common.h"
+#include "match.h"
+#include "packet.h"
+
+using namespace std::chrono;
+using namespace ncode;
+
+static constexpr size_t kLookupCount = 10000000;
+static constexpr net::DevicePortNumber kInputPort = net::DevicePortNumber(1);
+
+// Adds a rule with a single action to a matcher.
+static void AddRule(const net::FiveTuple& tuple, net::DevicePortNumber in_port,
+                    htsim::PacketTag tag, htsim::Matcher* matcher) {
+  htsim::MatchRuleKey key(tag, in_port, {tuple});
+  auto rule = make_unique<htsim::MatchRule>(key);
+  rule->AddAction(make_unique<htsim::MatchRuleAction>(
+      net::DevicePortNumber(2), htsim::kWildPacketTag, 1));
+  matcher->AddRule(std::move(rule));
+}
+
+// Populates a matcher with a mix of per-destination, per-source-destination
+// and per-flow rules, like a device in a large simulation would have.
+static void PopulateMatcher(size_t rule_count, htsim::Matcher* matcher) {
+  for (size_t i = 0; i < rule_count; ++i) {
+    net::IPAddress src(i % 256 + 1);
+    net::IPAddress dst(i + 1);
+    net::AccessLayerPort src_port(i % 60000 + 1);
+    net::AccessLayerPort dst_port(80);
+    switch (i % 4) {
+      case 0:
+        AddRule({htsim::kWildIPAddress, dst, htsim::kWildIPProto,
+                 htsim::kWildAccessLayerPort, htsim::kWildAccessLayerPort},
+                htsim::kWildDevicePortNumber, htsim::kWildPacketTag, matcher);
+        break;
+      case 1:
+        AddRule({src, dst, htsim::kWildIPProto, htsim::kWildAccessLayerPort,
+                 htsim::kWildAccessLayerPort},
+                kInputPort, htsim::kWildPacketTag, matcher);
+        break;
+      case 2:
+        AddRule({src, dst, net::kProtoTCP, src_port, dst_port},
+                htsim::kWildDevicePortNumber, htsim::kWildPacketTag, matcher);
+        break;
+      default:
+        AddRule({htsim::kWildIPAddress, dst, htsim::kWildIPProto,
+                 htsim::kWildAccessLayerPort, htsim::kWildAccessLayerPort},
+                htsim::kWildDevicePortNumber, htsim::PacketTag(i + 1),
+                matcher);
+    }
+  }
+}
+
+// Matches packets from 'flow_count' different flows and returns the number of
+// lookups per second.
+static uint64_t LookupsPerSecond(size_t rule_count, size_t flow_count) {
+  htsim::Matcher matcher("benchmark", false);
+  PopulateMatcher(rule_count, &matcher);
+
+  std::mt19937 rnd(1);
+  std::uniform_int_distribution<size_t> rule_dist(0, rule_count - 1);
+  std::vector<htsim::PacketPtr> packets;
+  for (size_t i = 0; i < flow_count; ++i) {
+    // Tagged rules will not match untagged packets.
+    size_t rule_index = rule_dist(rnd);
+    if (rule_index % 4 == 3) {
+      --rule_index;
+    }
+
+    net::FiveTuple tuple(
+        net::IPAddress(rule_index % 256 + 1), net::IPAddress(rule_index + 1),
+        net::kProtoTCP, net::AccessLayerPort(rule_index % 60000 + 1),
+        net::AccessLayerPort(80));
+    packets.emplace_back(htsim::TCPPacket::New(tuple, 1500, EventQueueTime(0),
+                                               htsim::SeqNum(0)));
+  }
+
+  size_t matched = 0;
+  auto start = high_resolution_clock::now();
+  for (size_t i = 0; i < kLookupCount; ++i) {
+    const htsim::Packet& pkt = *packets[i % flow_count];
+    if (matcher.MatchOrNull(pkt, kInputPort) != nullptr) {
+      ++matched;
+    }
+  }
+  auto end = high_resolution_clock::now();
+  CHECK(matched == kLookupCount);
+
+  uint64_t duration_ms = duration_cast<milliseconds>(end - start).count();
+  duration_ms = std::max<uint64_t>(duration_ms, 1);
+  return kLookupCount * 1000 / duration_ms;
+}
+
+int main(int argc, char** argv) {
+  Unused(argc);
+  Unused(argv);
+
+  // Few flows will mostly hit the microflow cache, many flows will not.
+  for (size_t rule_count : {1000, 10000, 50000}) {
+    for (size_t flow_count : {16, 100000}) {
+      uint64_t lps = LookupsPerSecond(rule_count, flow_count);
+      std::cout << rule_count << " rules, " << flow_count << " flows "
+                << lps << " lookups/sec\n";
+    }
+  }
+}
@@ -1,3 +1,5 @@
+#include <random>
+
 #include "gtest/gtest.h"
 #include "packet.h"
 #include "match.h"
@@ -568,6 +570,131 @@ TEST_F(MatchFixture, ActionsSameOutPortSameTag) {
   ASSERT_DEATH(rule->AddAction(std::move(action_two)), ".*");
 }
 
+TEST_F(MatchFixture, CacheClearedOnUpdate) {
+  PacketPtr pkt_ptr =
+      GetPacket(kSrc, kDst, kSrcPort, kDstPort, kProto, kPacketInputTag);
+  ASSERT_EQ(nullptr, TryMatch(pkt_ptr, kDeviceInputPort));
+
+  AddRule(kSrc, kDst, kSrcPort, kDstPort, kProto, kDeviceInputPort,
+          kPacketInputTag, kDeviceOutputPort, kPacketOutputTag);
+  ASSERT_EQ(kDeviceOutputPort,
+            TryMatch(pkt_ptr, kDeviceInputPort)->output_port());
+  ASSERT_EQ(kDeviceOutputPort,
+            TryMatch(pkt_ptr, kDeviceInputPort)->output_port());
+
+  // A more specific rule should take over.
+  AddRule(kWildIPAddress, kDst, kSrcPort, kDstPort, kProto, kDeviceInputPort,
+          kPacketInputTag, kOtherDeviceOutputPort, kPacketOutputTag);
+  ASSERT_EQ(kDeviceOutputPort,
+            TryMatch(pkt_ptr, kDeviceInputPort)->output_port());
+  AddDiscardRule(kSrc, kDst, kSrcPort, kDstPort, kProto, kDeviceInputPort,
+                 kPacketInputTag);
+  ASSERT_EQ(kOtherDeviceOutputPort,
+            TryMatch(pkt_ptr, kDeviceInputPort)->output_port());
+}
+
+// A point in the classifier that is checked by brute force.
+struct ReferencePoint {
+  std::array<uint32_t, TupleSpaceClassifier::kFieldCount> values;
+  MatchRule* rule;
+
+  uint32_t Mask() const {
+    uint32_t mask = 0;
+    for (uint32_t value : values) {
+      mask = (mask << 1) | (value != 0);
+    }
+    return mask;
+  }
+
+  bool Matches(const std::array<uint32_t, TupleSpaceClassifier::kFieldCount>&
+                   pkt_values) const {
+    for (size_t i = 0; i < values.size(); ++i) {
+      if (values[i] != 0 && values[i] != pkt_values[i]) {
+        return false;
+      }
+    }
+    return true;
+  }
+};
+
+// The 5-tuple part of a point's values.
+static net::FiveTuple TupleFromValues(
+    const std::array<uint32_t, TupleSpaceClassifier::kFieldCount>& values) {
+  return net::FiveTuple(IPAddress(values[3]), IPAddress(values[2]),
+                        IPProto(values[4]), AccessLayerPort(values[5]),
+                        AccessLayerPort(values[6]));
+}
+
+TEST(TupleSpaceClassifier, Random) {
+  std::mt19937 rnd(1);
+  std::uniform_int_distribution<uint32_t> value_dist(0, 2);
+  TupleSpaceClassifier classifier;
+  std::vector<std::unique_ptr<MatchRule>> rules;
+  std::vector<ReferencePoint> reference;
+
+  auto random_values = [&rnd, &value_dist] {
+    std::array<uint32_t, TupleSpaceClassifier::kFieldCount> values;
+    for (uint32_t& value : values) {
+      value = value_dist(rnd);
+    }
+    return values;
+  };
+
+  for (size_t i = 0; i < 2000; ++i) {
+    std::array<uint32_t, TupleSpaceClassifier::kFieldCount> values =
+        random_values();
+    net::FiveTuple tuple = TupleFromValues(values);
+    DevicePortNumber input_port(values[0]);
+    PacketTag tag(values[1]);
+
+    rules.emplace_back(make_unique<MatchRule>(
+        MatchRuleKey(tag, input_port, {tuple})));
+    MatchRule* rule = rules.back().get();
+    if (i % 5 == 0) {
+      classifier.ClearIfSame(tuple, input_port, tag, rules[i / 2].get());
+      reference.erase(
+          std::remove_if(reference.begin(), reference.end(),
+                         [&values, &rules, i](const ReferencePoint& point) {
+                           return point.values == values &&
+                                  point.rule == rules[i / 2].get();
+                         }),
+          reference.end());
+    } else {
+      classifier.InsertOrUpdate(tuple, input_port, tag, rule);
+      reference.erase(std::remove_if(reference.begin(), reference.end(),
+                                     [&values](const ReferencePoint& point) {
+                                       return point.values == values;
+                                     }),
+                      reference.end());
+      reference.push_back({values, rule});
+    }
+
+    // Packets never carry wildcard values, except for the tag.
+    std::array<uint32_t, TupleSpaceClassifier::kFieldCount> pkt_values =
+        random_values();
+    for (size_t field = 0; field < pkt_values.size(); ++field) {
+      if (field != 1) {
+        pkt_values[field] = std::max(1u, pkt_values[field]);
+      }
+    }
+
+    const ReferencePoint* best = nullptr;
+    for (const ReferencePoint& point : reference) {
+      if (point.Matches(pkt_values) &&
+          (best == nullptr || point.Mask() > best->Mask())) {
+        best = &point;
+      }
+    }
+
+    net::FiveTuple pkt_tuple = TupleFromValues(pkt_values);
+    MatchRule* matched = classifier.MatchOrNull(
+        pkt_tuple, DevicePortNumber(pkt_values[0]), PacketTag(pkt_values[1]));
+    ASSERT_EQ(best == nullptr ? nullptr : best->rule, matched);
+  }
+
+  ASSERT_GE(128ul, classifier.TableCount());
+}
+
 }  // namespace
 }  // namespace test
 }  // namespace ht2sim
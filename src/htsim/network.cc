@@ -2,7 +2,6 @@
 
 #include <gflags/gflags.h>
 #include <chrono>
-#include <limits>
 #include <utility>
 
 #include "../common/event_queue.h"
@@ -76,9 +75,9 @@ void Device::HandlePacket(PacketPtr pkt) {
 
   const net::FiveTuple& incoming_tuple = pkt->five_tuple();
   net::FiveTuple outgoing_tuple = incoming_tuple.Reverse();
-  auto it = connections_.find(outgoing_tuple);
-  if (it != connections_.end()) {
-    it->second->HandlePacket(std::move(pkt));
+  Connection* connection = connections_.FindOrNull(outgoing_tuple);
+  if (connection != nullptr) {
+    connection->HandlePacket(std::move(pkt));
     return;
   }
 
@@ -102,24 +101,8 @@ void Device::HandlePacket(PacketPtr pkt) {
                << incoming_tuple.ip_proto().Raw();
   }
 
-  Connection* raw_ptr = new_connection.get();
-  connections_.emplace(outgoing_tuple, std::move(new_connection));
-  raw_ptr->HandlePacket(std::move(pkt));
-}
-
-net::FiveTuple Device::PickSrcPortOrDie(
-    const net::FiveTuple& tuple_with_no_src_port) {
-  const net::FiveTuple& t = tuple_with_no_src_port;
-  for (uint16_t i = 1; i < std::numeric_limits<uint16_t>::max(); ++i) {
-    net::FiveTuple return_tuple(t.ip_src(), t.ip_dst(), t.ip_proto(),
-                                net::AccessLayerPort(i), t.dst_port());
-    if (connections_.find(return_tuple) == connections_.end()) {
-      return return_tuple;
-    }
-  }
-
-  CHECK(false) << "Out of src ports";
-  return net::FiveTuple::kDefaultTuple;
+  connections_.Insert(outgoing_tuple, std::move(new_connection))
+      ->HandlePacket(std::move(pkt));
 }
 
 net::FiveTuple Device::PrepareTuple(net::IPAddress dst_address,
@@ -127,8 +110,7 @@ net::FiveTuple Device::PrepareTuple(net::IPAddress dst_address,
   net::FiveTuple tuple(ip_address_, dst_address,
                        tcp ? net::kProtoTCP : net::kProtoUDP,
                        kWildAccessLayerPort, dst_port);
-  tuple = PickSrcPortOrDie(tuple);
-  return tuple;
+  return connections_.PickSrcPortOrDie(tuple);
 }
 
 TCPSource* Device::AddTCPGenerator(net::IPAddress dst_address,
@@ -142,10 +124,10 @@ TCPSource* Device::AddTCPGenerator(net::IPAddress dst_address,
       gen_id, tuple, mss, maxcwnd, loopback_port, event_queue_, important);
 
   CHECK(network_ != nullptr) << "Device not part of a network";
-  network_->RegisterTCPSourceWithRetxTimer(new_connection.get());
+  network_->RegisterTCPSourceWithRetxTimer(new_connection.get(), event_queue_);
 
   TCPSource* raw_ptr = new_connection.get();
-  connections_.emplace(tuple, std::move(new_connection));
+  connections_.Insert(tuple, std::move(new_connection));
 
   LOG(INFO) << Substitute("Added TCP generator at $0 with 5-tuple $1", id_,
                           tuple.ToString());
@@ -161,7 +143,7 @@ UDPSource* Device::AddUDPGenerator(net::IPAddress dst_address,
   auto new_connection =
       make_unique<UDPSource>(gen_id, tuple, loopback_port, event_queue_);
   UDPSource* raw_ptr = new_connection.get();
-  connections_.emplace(tuple, std::move(new_connection));
+  connections_.Insert(tuple, std::move(new_connection));
   return raw_ptr;
 }
 
@@ -311,7 +293,7 @@ void Device::HandlePacketFromPort(Port* input_port, PacketPtr pkt) {
 }
 
 void Device::RecordBytesReceivedByTCPSinks() {
-  for (const auto& five_tuple_and_connection : connections_) {
+  for (const auto& five_tuple_and_connection : connections_.entries()) {
     Connection* connection = five_tuple_and_connection.second.get();
     TCPSink* tcp_sink = dynamic_cast<TCPSink*>(connection);
     if (tcp_sink == nullptr) {
@@ -336,11 +318,9 @@ void Device::AddExternalInternalObserver(PacketObserver* observer) {
   external_internal_observer_ = observer;
 }
 
-Network::Network(EventQueueTime tcp_retx_scan_period, EventQueue* event_queue)
-    : SimComponent("network", event_queue) {
-  tcp_retx_timer_ = make_unique<TCPRtxTimer>("tcp_retx_timer",
-                                             tcp_retx_scan_period, event_queue);
-}
+Network::Network(EventQueueTime tcp_retx_timer_tick, EventQueue* event_queue)
+    : SimComponent("network", event_queue),
+      tcp_retx_timer_tick_(tcp_retx_timer_tick) {}
 
 void Network::AddDevice(Device* device) {
   id_to_device_.emplace(device->id(), device);
@@ -373,8 +353,20 @@ void Network::AddLink(Queue* queue, Pipe* pipe, bool internal) {
                           link->dst_port().Raw());
 }
 
-void Network::RegisterTCPSourceWithRetxTimer(TCPSource* src) {
-  tcp_retx_timer_->RegisterTCPSource(src);
+void Network::RegisterTCPSourceWithRetxTimer(TCPSource* src,
+                                             EventQueue* event_queue) {
+  TCPRtxTimer* timer;
+  {
+    std::lock_guard<std::mutex> lock(tcp_retx_timers_mu_);
+    std::unique_ptr<TCPRtxTimer>& timer_ptr = tcp_retx_timers_[event_queue];
+    if (!timer_ptr) {
+      timer_ptr = make_unique<TCPRtxTimer>(
+          "tcp_retx_timer", tcp_retx_timer_tick_, event_queue);
+    }
+    timer = timer_ptr.get();
+  }
+
+  timer->RegisterTCPSource(src);
 }
 
 void Network::RecordBytesReceivedByTCPSinks() {
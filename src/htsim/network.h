@@ -5,12 +5,13 @@
 #include <cstdint>
 #include <map>
 #include <memory>
+#include <mutex>
 #include <string>
-#include <unordered_map>
 
 #include "../common/common.h"
 #include "../common/map_util.h"
 #include "../net/net_common.h"
+#include "flow_table.h"
 #include "htsim.h"
 #include "match.h"
 #include "packet.h"
@@ -100,7 +101,7 @@ class Device : public SimComponent, public PacketHandler {
   // Returns the status of this device.
   DeviceStats GetStats() const {
     DeviceStats return_stats = stats_;
-    for (const auto& tuple_and_connection : connections_) {
+    for (const auto& tuple_and_connection : connections_.entries()) {
       const net::FiveTuple& tuple = tuple_and_connection.first;
       const Connection* connection = tuple_and_connection.second.get();
       return_stats.connection_stats[tuple] = connection->GetStats();
@@ -164,9 +165,6 @@ class Device : public SimComponent, public PacketHandler {
   net::FiveTuple PrepareTuple(net::IPAddress dst_address,
                               net::AccessLayerPort dst_port, bool tcp);
 
-  // Picks a source port or throws an exception.
-  net::FiveTuple PickSrcPortOrDie(const net::FiveTuple& tuple_with_no_src_port);
-
   // This device's address.
   net::IPAddress ip_address_;
 
@@ -181,8 +179,7 @@ class Device : public SimComponent, public PacketHandler {
 
   // Map from 5-tuples of incoming packets to connections that can accept the
   // packets.
-  std::unordered_map<net::FiveTuple, std::unique_ptr<Connection>,
-                     net::FiveTupleHasher> connections_;
+  FlowTable connections_;
 
   // The parent network instance.
   Network* network_;
@@ -216,7 +213,7 @@ class Device : public SimComponent, public PacketHandler {
 
 class Network : public SimComponent {
  public:
-  Network(EventQueueTime tcp_retx_scan_period, EventQueue* event_queue);
+  Network(EventQueueTime tcp_retx_timer_tick, EventQueue* event_queue);
 
   // Adds a device.
   void AddDevice(Device* device);
@@ -225,8 +222,10 @@ class Network : public SimComponent {
   // pipe. The source / dst of the pipe should already be present.
   void AddLink(Queue* queue, Pipe* pipe, bool internal = false);
 
-  // Adds a TCP source to the common retx timer.
-  void RegisterTCPSourceWithRetxTimer(TCPSource* src);
+  // Adds a TCP source to the common retx timer of the event queue the source
+  // runs on. If the network's devices are split among multiple event queues
+  // (see partition.h) each event queue gets its own timer.
+  void RegisterTCPSourceWithRetxTimer(TCPSource* src, EventQueue* event_queue);
 
   // Records all bytes received by all sinks in all devices. Should be called at
   // the end of the simulation.
@@ -243,8 +242,16 @@ class Network : public SimComponent {
   std::map<std::string, Queue*> queue_id_to_queue_;
   std::map<std::string, Pipe*> pipe_id_to_pipe_;
 
-  // All TCP connections in the network will share the same retx timer.
-  std::unique_ptr<TCPRtxTimer> tcp_retx_timer_;
+  // Resolution of the retx timers.
+  const EventQueueTime tcp_retx_timer_tick_;
+
+  // All TCP connections that run on the same event queue share the same retx
+  // timer. Timers are created on demand, when a TCP source is registered.
+  std::map<EventQueue*, std::unique_ptr<TCPRtxTimer>> tcp_retx_timers_;
+
+  // Protects tcp_retx_timers_, sources can be registered from different
+  // threads.
+  std::mutex tcp_retx_timers_mu_;
 
   DISALLOW_COPY_AND_ASSIGN(Network);
 };
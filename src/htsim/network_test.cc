@@ -1,3 +1,4 @@
+#include "../common/fork.h"
 #include "gtest/gtest.h"
 #include "network.h"
 #include "udp.h"
@@ -374,10 +375,58 @@ TEST_F(TwoDeviceTCPTest, SmallTransfer) {
   double num_pkts = 1000000.0 / 1500.0;
   double pkts_and_acks = 2 * num_pkts;
 
-  ASSERT_NEAR(bytes_total, a_stats.bytes_seen, bytes_total * 0.2);
+  // The queue is small, so slow start will overshoot and there will be
+  // retransmissions. With SACK all data should make it through before the end
+  // of the simulation.
+  ASSERT_EQ(1ul, b_stats.connection_stats.size());
+  ASSERT_EQ(bytes_total, b_stats.connection_stats.begin()->second.bytes_rx);
+  ASSERT_LE(bytes_total, a_stats.bytes_seen);
+  ASSERT_NEAR(bytes_total, a_stats.bytes_seen, bytes_total * 0.3);
   ASSERT_NEAR(pkts_and_acks, a_stats.packets_seen, pkts_and_acks * 0.2);
 }
 
+// A warmed-up transfer is continued in two forked variants: one with no
+// changes and one where the route from A to B is removed. The first should
+// end up exactly where continuing the simulation in this process does.
+TEST_F(TwoDeviceTCPTest, ForkedVariants) {
+  AddDevices();
+  AddLink(2 * (kRateBps / 8.0) * kDelaySec);
+  AddRoute();
+  AddTCPGenerator(10000000);
+  event_queue_.RunAndStopIn(seconds(2));
+
+  EventQueueTime end = event_queue_.ToTime(seconds(4));
+  auto bytes_rx = [this] {
+    DeviceStats b_stats = device_b_.GetStats();
+    return std::to_string(b_stats.connection_stats.begin()->second.bytes_rx);
+  };
+
+  std::vector<VariantResult> results =
+      RunForkedVariants(2, [this, end, &bytes_rx](size_t i) {
+        if (i == 1) {
+          MatchRuleKey key(kWildPacketTag, kWildDevicePortNumber,
+                           {net::FiveTuple(kWildIPAddress, net::IPAddress(2),
+                                           kWildIPProto, kWildAccessLayerPort,
+                                           kWildAccessLayerPort)});
+          device_a_.HandlePacket(make_unique<SSCPAddOrUpdate>(
+              kWildIPAddress, net::IPAddress(1), event_queue_.CurrentTime(),
+              make_unique<MatchRule>(key)));
+        }
+
+        event_queue_.RunUntil(end);
+        return bytes_rx();
+      });
+
+  std::string warm_up_bytes_rx = bytes_rx();
+  event_queue_.RunUntil(end);
+
+  ASSERT_TRUE(results[0].ok);
+  ASSERT_TRUE(results[1].ok);
+  ASSERT_EQ(bytes_rx(), results[0].output);
+  ASSERT_LT(std::stoull(warm_up_bytes_rx), std::stoull(results[0].output));
+  ASSERT_GT(std::stoull(results[0].output), std::stoull(results[1].output));
+}
+
 }  // namespace
 }  // namespace htsim
 }  // namespace ncode
@@ -1,5 +1,8 @@
 #include "packet.h"
 
+#include <algorithm>
+
+#include "../common/free_list.h"
 #include "../common/logging.h"
 #include "../common/substitute.h"
 #include "match.h"
@@ -10,13 +13,37 @@ namespace htsim {
 Packet::Packet(const net::FiveTuple& five_tuple, uint16_t size_bytes,
                EventQueueTime time_sent)
     : five_tuple_(five_tuple),
+      time_sent_(time_sent),
+      tag_(kDefaultTag),
       size_bytes_(size_bytes),
       ip_id_(0),
-      tag_(kDefaultTag),
+      payload_bytes_(size_bytes),
       ttl_(kDefaultTTL),
-      time_sent_(time_sent),
       preferential_drop_(false),
-      payload_bytes_(size_bytes) {}
+      allocation_(HEAP) {}
+
+void PacketDeleter::operator()(Packet* pkt) const {
+  switch (pkt->allocation_) {
+    case Packet::TCP_FREE_LIST:
+      GetFreeList<TCPPacket>().Release(static_cast<TCPPacket*>(pkt));
+      break;
+    case Packet::TCP_SACK_FREE_LIST:
+      GetFreeList<TCPSackPacket>().Release(static_cast<TCPSackPacket*>(pkt));
+      break;
+    case Packet::UDP_FREE_LIST:
+      GetFreeList<UDPPacket>().Release(static_cast<UDPPacket*>(pkt));
+      break;
+    default:
+      delete pkt;
+  }
+}
+
+void PacketHandler::HandlePacketBatch(PacketBatch* packets) {
+  for (size_t i = 0; i < packets->size(); ++i) {
+    HandlePacket(std::move(packets->packet(i)));
+  }
+  packets->clear();
+}
 
 bool Packet::DecrementTTL() {
   if (ttl_ == 0) {
@@ -29,14 +56,24 @@ bool Packet::DecrementTTL() {
 TCPPacket::TCPPacket(net::FiveTuple five_tuple, uint16_t size_bytes,
                      EventQueueTime time_sent, SeqNum sequence)
     : Packet(five_tuple, size_bytes, time_sent),
-      sequence_(sequence),
-      flags_(0) {
+      sack_block_count_(0),
+      flags_(0),
+      sequence_(sequence) {
   CHECK(size_bytes > 0) << "0-size TCP packet";
 }
 
+TypedPacketPtr<TCPPacket> TCPPacket::New(net::FiveTuple five_tuple,
+                                         uint16_t size_bytes,
+                                         EventQueueTime time_sent,
+                                         SeqNum sequence) {
+  TCPPacket* pkt = GetFreeList<TCPPacket>().NewRaw(five_tuple, size_bytes,
+                                                   time_sent, sequence);
+  pkt->allocation_ = TCP_FREE_LIST;
+  return TypedPacketPtr<TCPPacket>(pkt);
+}
+
 PacketPtr TCPPacket::Duplicate() const {
-  auto new_pkt =
-      make_unique<TCPPacket>(five_tuple_, size_bytes_, time_sent_, sequence_);
+  auto new_pkt = New(five_tuple_, size_bytes_, time_sent_, sequence_);
   new_pkt->ip_id_ = ip_id_;
   new_pkt->tag_ = tag_;
   new_pkt->ttl_ = ttl_;
@@ -51,14 +88,68 @@ std::string TCPPacket::ToString() const {
                     sequence_.Raw());
 }
 
+constexpr size_t TCPSackPacket::kMaxSackBlocks;
+constexpr uint16_t TCPSackPacket::kSackBlockBytes;
+
+TCPSackPacket::TCPSackPacket(net::FiveTuple five_tuple, uint16_t size_bytes,
+                             EventQueueTime time_sent, SeqNum sequence,
+                             const std::vector<SackBlock>& sack_blocks)
+    : TCPPacket(five_tuple, size_bytes, time_sent, sequence) {
+  sack_block_count_ = std::min(sack_blocks.size(), kMaxSackBlocks);
+  std::copy(sack_blocks.begin(), sack_blocks.begin() + sack_block_count_,
+            sack_blocks_);
+}
+
+TypedPacketPtr<TCPSackPacket> TCPSackPacket::New(
+    net::FiveTuple five_tuple, uint16_t size_bytes, EventQueueTime time_sent,
+    SeqNum sequence, const std::vector<SackBlock>& sack_blocks) {
+  TCPSackPacket* pkt = GetFreeList<TCPSackPacket>().NewRaw(
+      five_tuple, size_bytes, time_sent, sequence, sack_blocks);
+  pkt->allocation_ = TCP_SACK_FREE_LIST;
+  return TypedPacketPtr<TCPSackPacket>(pkt);
+}
+
+PacketPtr TCPSackPacket::Duplicate() const {
+  std::vector<SackBlock> sack_blocks(sack_blocks_,
+                                     sack_blocks_ + sack_block_count_);
+  auto new_pkt = New(five_tuple_, size_bytes_, time_sent_, sequence(),
+                     sack_blocks);
+  new_pkt->ip_id_ = ip_id_;
+  new_pkt->tag_ = tag_;
+  new_pkt->ttl_ = ttl_;
+  new_pkt->preferential_drop_ = preferential_drop_;
+  new_pkt->payload_bytes_ = payload_bytes_;
+  new_pkt->set_flags(flags());
+  return new_pkt;
+}
+
+std::string TCPSackPacket::ToString() const {
+  std::string out = TCPPacket::ToString();
+  for (size_t i = 0; i < sack_block_count_; ++i) {
+    SubstituteAndAppend(&out, " SACK [$0, $1)", sack_blocks_[i].start,
+                        sack_blocks_[i].end);
+  }
+
+  return out;
+}
+
 UDPPacket::UDPPacket(net::FiveTuple five_tuple, uint16_t size_bytes,
                      EventQueueTime time_sent)
     : Packet(five_tuple, size_bytes, time_sent) {
   CHECK(size_bytes > 0) << "0-size UDP packet";
 }
 
+TypedPacketPtr<UDPPacket> UDPPacket::New(net::FiveTuple five_tuple,
+                                         uint16_t size_bytes,
+                                         EventQueueTime time_sent) {
+  UDPPacket* pkt =
+      GetFreeList<UDPPacket>().NewRaw(five_tuple, size_bytes, time_sent);
+  pkt->allocation_ = UDP_FREE_LIST;
+  return TypedPacketPtr<UDPPacket>(pkt);
+}
+
 PacketPtr UDPPacket::Duplicate() const {
-  auto new_pkt = make_unique<UDPPacket>(five_tuple_, size_bytes_, time_sent_);
+  auto new_pkt = New(five_tuple_, size_bytes_, time_sent_);
   new_pkt->ip_id_ = ip_id_;
   new_pkt->tag_ = tag_;
   new_pkt->ttl_ = ttl_;
@@ -5,6 +5,7 @@
 #include <functional>
 #include <memory>
 #include <string>
+#include <vector>
 
 #include "../common/common.h"
 #include "../common/event_queue.h"
@@ -33,10 +34,30 @@ static constexpr uint8_t kDefaultTTL = 100;
 
 class Packet;
 
+// Releases packets. Packets allocated with TCPPacket::New or UDPPacket::New
+// are returned to a free list, all others are deleted. Can be constructed from
+// std::default_delete so that packets allocated with make_unique can also be
+// used as PacketPtr.
+struct PacketDeleter {
+  PacketDeleter() {}
+
+  template <typename T>
+  PacketDeleter(const std::default_delete<T>& default_delete) {
+    Unused(default_delete);
+  }
+
+  void operator()(Packet* pkt) const;
+};
+
 // All packets have this pointer type.
-using PacketPtr = std::unique_ptr<Packet>;
+using PacketPtr = std::unique_ptr<Packet, PacketDeleter>;
+
+// A pointer to a packet of a given type. Converts to PacketPtr.
+template <typename T>
+using TypedPacketPtr = std::unique_ptr<T, PacketDeleter>;
 
-// A generic packet in the simulation.
+// A generic packet in the simulation. Fields are laid out so that a TCP packet
+// fits in a single cache line.
 class Packet {
  public:
   virtual ~Packet() {}
@@ -96,17 +117,28 @@ class Packet {
   virtual std::string ToString() const = 0;
 
  protected:
+  // Where the memory of the packet comes from.
+  enum Allocation : uint8_t {
+    HEAP = 0,
+    TCP_FREE_LIST = 1,
+    TCP_SACK_FREE_LIST = 2,
+    UDP_FREE_LIST = 3
+  };
+
   Packet(const net::FiveTuple& five_tuple, uint16_t size_bytes,
          EventQueueTime time_sent);
 
   net::FiveTuple five_tuple_;
+  EventQueueTime time_sent_;
+  PacketTag tag_;
   uint16_t size_bytes_;
   uint16_t ip_id_;
-  PacketTag tag_;
+  uint16_t payload_bytes_;
   uint8_t ttl_;
-  EventQueueTime time_sent_;
   bool preferential_drop_;
-  uint16_t payload_bytes_;
+  Allocation allocation_;
+
+  friend struct PacketDeleter;
 };
 
 // A TCP packet. The same packet object is used for regular TCP packets as for
@@ -116,6 +148,13 @@ class TCPPacket : public Packet {
   TCPPacket(net::FiveTuple five_tuple, uint16_t size_bytes,
             EventQueueTime time_sent, SeqNum sequence);
 
+  // Allocates a packet from a thread-local free list. Much cheaper than
+  // make_unique when many packets are created and destroyed.
+  static TypedPacketPtr<TCPPacket> New(net::FiveTuple five_tuple,
+                                       uint16_t size_bytes,
+                                       EventQueueTime time_sent,
+                                       SeqNum sequence);
+
   // The sequence number.
   SeqNum sequence() const { return sequence_; }
 
@@ -126,12 +165,56 @@ class TCPPacket : public Packet {
   void set_flags(uint8_t flags) { flags_ = flags; }
   uint8_t flags() const { return flags_; }
 
- private:
-  SeqNum sequence_;
+  // Number of SACK blocks the packet carries. If non-zero the packet is a
+  // TCPSackPacket.
+  uint8_t sack_block_count() const { return sack_block_count_; }
+
+ protected:
+  uint8_t sack_block_count_;
 
+ private:
   // If this packet comes from a real-world trace this field will be set to the
   // flags of the TCP packet. If not it will be 0.
   uint8_t flags_;
+
+  SeqNum sequence_;
+};
+
+// A range [start, end) of sequence numbers that a TCP sink has received.
+struct SackBlock {
+  uint64_t start;
+  uint64_t end;
+};
+
+// A TCP ACK that also carries selective ACK blocks, like the TCP SACK option.
+class TCPSackPacket : public TCPPacket {
+ public:
+  // Maximum number of blocks in a single ACK.
+  static constexpr size_t kMaxSackBlocks = 3;
+
+  // Each block takes up this many bytes in the header.
+  static constexpr uint16_t kSackBlockBytes = 8;
+
+  // At most kMaxSackBlocks will be used from 'sack_blocks'.
+  TCPSackPacket(net::FiveTuple five_tuple, uint16_t size_bytes,
+                EventQueueTime time_sent, SeqNum sequence,
+                const std::vector<SackBlock>& sack_blocks);
+
+  static TypedPacketPtr<TCPSackPacket> New(
+      net::FiveTuple five_tuple, uint16_t size_bytes, EventQueueTime time_sent,
+      SeqNum sequence, const std::vector<SackBlock>& sack_blocks);
+
+  const SackBlock& sack_block(size_t i) const {
+    DCHECK(i < sack_block_count_);
+    return sack_blocks_[i];
+  }
+
+  PacketPtr Duplicate() const override;
+
+  std::string ToString() const override;
+
+ private:
+  SackBlock sack_blocks_[kMaxSackBlocks];
 };
 
 // A UDP packet.
@@ -140,17 +223,64 @@ class UDPPacket : public Packet {
   UDPPacket(net::FiveTuple five_tuple, uint16_t size_bytes,
             EventQueueTime time_sent);
 
+  // Allocates a packet from a thread-local free list.
+  static TypedPacketPtr<UDPPacket> New(net::FiveTuple five_tuple,
+                                       uint16_t size_bytes,
+                                       EventQueueTime time_sent);
+
   PacketPtr Duplicate() const override;
 
   std::string ToString() const override;
 };
 
+// A train of packets that are handled together, in order. The train is handed
+// on at once, but each packet keeps the time at which it would have been
+// handed on if it was not part of the train. That is never earlier than the
+// time of the first packet.
+class PacketBatch {
+ public:
+  PacketBatch() {}
+
+  // Adds a packet to the end of the train.
+  void Add(PacketPtr pkt, EventQueueTime at) {
+    packets_.emplace_back(std::move(pkt));
+    times_.emplace_back(at);
+  }
+
+  // The i-th packet of the train, can be moved out.
+  PacketPtr& packet(size_t i) { return packets_[i]; }
+
+  // When the i-th packet would have been handed on on its own.
+  EventQueueTime at(size_t i) const { return times_[i]; }
+
+  size_t size() const { return packets_.size(); }
+
+  bool empty() const { return packets_.empty(); }
+
+  void clear() {
+    packets_.clear();
+    times_.clear();
+  }
+
+ private:
+  std::vector<PacketPtr> packets_;
+  std::vector<EventQueueTime> times_;
+
+  DISALLOW_COPY_AND_ASSIGN(PacketBatch);
+};
+
 // An interface for any class that can handle packets.
 class PacketHandler {
  public:
   virtual ~PacketHandler() {}
   virtual void HandlePacket(PacketPtr pkt) = 0;
 
+  // Handles a number of packets at once, taking ownership of all of them.
+  // The batch is left empty. By default calls HandlePacket for each packet,
+  // ignoring the times at which they would have arrived on their own.
+  // Handlers that can do better should override it.
+  virtual void HandlePacketBatch(PacketBatch* packets);
+
  protected:
   PacketHandler() {}
 
@@ -226,6 +356,9 @@ class Connection : public PacketHandler, public SimComponent {
   // A callback to be called when the TX buffer has been drained.
   std::function<void()> on_send_buffer_drained_;
 
+  // Stats about the connection.
+  ConnectionStats stats_;
+
  private:
   // Returns the bps transmitted since the last call to PollBpsTx.
   uint64_t PollBpsTx(uint64_t now_ms);
@@ -236,9 +369,6 @@ class Connection : public PacketHandler, public SimComponent {
   // Packets generated by this connection are sent here, non-owning pointer
   PacketHandler* out_;
 
-  // Stats about the connection.
-  ConnectionStats stats_;
-
   // Used by PollBps to compute per-second averages from stats_.
   uint64_t prev_bytes_tx_;
   uint64_t prev_bytes_rx_;
@@ -45,6 +45,37 @@ TEST_F(PacketTest, TTLExpired) {
   ASSERT_FALSE(udp_packet_.DecrementTTL());
 }
 
+TEST_F(PacketTest, FreeList) {
+  TypedPacketPtr<TCPPacket> tcp_pkt =
+      TCPPacket::New(kTestTuple, kSize, kTime, kSeqNum);
+  tcp_pkt->set_flags(1);
+  tcp_pkt->set_tag(PacketTag(10));
+  ASSERT_EQ(kSeqNum, tcp_pkt->sequence());
+
+  PacketPtr duplicate = tcp_pkt->Duplicate();
+  const TCPPacket* tcp_duplicate =
+      static_cast<const TCPPacket*>(duplicate.get());
+  ASSERT_EQ(kTestTuple, tcp_duplicate->five_tuple());
+  ASSERT_EQ(kSeqNum, tcp_duplicate->sequence());
+  ASSERT_EQ(1, tcp_duplicate->flags());
+  ASSERT_EQ(PacketTag(10), tcp_duplicate->tag());
+
+  // Memory should be reused.
+  const Packet* raw_ptr = duplicate.get();
+  duplicate.reset();
+  PacketPtr udp_pkt = UDPPacket::New(kTestTuple, kSize, kTime);
+  PacketPtr another_tcp_pkt = TCPPacket::New(kTestTuple, kSize, kTime, kSeqNum);
+  ASSERT_EQ(raw_ptr, another_tcp_pkt.get());
+}
+
+TEST_F(PacketTest, HeapAllocated) {
+  PacketPtr pkt = make_unique<UDPPacket>(kTestTuple, kSize, kTime);
+  ASSERT_EQ(kSize, pkt->size_bytes());
+  pkt.reset();
+}
+
+TEST_F(PacketTest, Size) { ASSERT_GE(64ul, sizeof(TCPPacket)); }
+
 class MockHandler : public PacketHandler {
  public:
   std::vector<PacketPtr> packets() { return std::move(packets_); }
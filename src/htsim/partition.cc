@@ -0,0 +1,261 @@
+#include "partition.h"
+
+#include <algorithm>
+#include <numeric>
+#include <tuple>
+#include <utility>
+
+#include "../common/logging.h"
+
+namespace ncode {
+namespace htsim {
+
+CrossPartitionPipe::CrossPartitionPipe(const net::GraphLink& graph_link,
+                                       size_t src_partition,
+                                       EventQueue* src_event_queue,
+                                       EventQueue* dst_event_queue,
+                                       bool interesting)
+    : Pipe(graph_link, dst_event_queue, interesting),
+      src_partition_(src_partition),
+      src_event_queue_(src_event_queue),
+      last_exit_at_(EventQueueTime::ZeroTime()),
+      exit_sequence_(0) {}
+
+void CrossPartitionPipe::HandleEvent() {
+  exit_sequence_ = event_queue()->ReserveSequence();
+  Pipe::HandleEvent();
+}
+
+void CrossPartitionPipe::HandlePacket(PacketPtr pkt) {
+  outbox_.emplace_back(src_event_queue_->CurrentTime(),
+                       src_event_queue_->ReserveSequence(), std::move(pkt));
+}
+
+void CrossPartitionPipe::HandlePacketBatch(PacketBatch* packets) {
+  for (size_t i = 0; i < packets->size(); ++i) {
+    outbox_.emplace_back(packets->at(i), src_event_queue_->ReserveSequence(),
+                         std::move(packets->packet(i)));
+  }
+  packets->clear();
+}
+
+void CrossPartitionPipe::TakeOutbox(std::vector<Delivery>* out) {
+  for (OutboxEntry& entry : outbox_) {
+    // If the pipe was not empty when the packet entered it, a regular pipe
+    // would have scheduled the packet's exit when the previous packet exited.
+    EventQueueTime exit_at = entry.entered_at + delay();
+    bool after_exit = entry.entered_at < last_exit_at_;
+    EventQueueTime enqueued_at = after_exit ? last_exit_at_ : entry.entered_at;
+    out->emplace_back(exit_at, enqueued_at, after_exit, src_partition_,
+                      entry.sequence, this, std::move(entry.pkt));
+    last_exit_at_ = exit_at;
+  }
+  outbox_.clear();
+}
+
+void CrossPartitionPipe::Deliver(Delivery* delivery) {
+  // The sequence number only matters if the pipe is empty. If it is and the
+  // packet followed another one, that one has already exited.
+  uint64_t sequence = delivery->after_exit ? exit_sequence_
+                                           : event_queue()->ReserveSequence();
+  AddInFlight(delivery->exit_at, delivery->enqueued_at, sequence,
+              std::move(delivery->pkt));
+}
+
+PartitionedSimulation::PartitionedSimulation(
+    size_t partition_count, size_t thread_count,
+    EventQueue::SchedulerType scheduler_type)
+    : lookahead_(EventQueueTime::MaxTime()), window_count_(0) {
+  CHECK(partition_count > 0) << "No partitions";
+  for (size_t i = 0; i < partition_count; ++i) {
+    event_queues_.emplace_back(make_unique<SimTimeEventQueue>(scheduler_type));
+    partitions_.emplace_back(i);
+  }
+
+  if (thread_count == 0) {
+    thread_count = partition_count;
+  }
+
+  thread_count = std::min(thread_count, partition_count);
+  if (thread_count > 1) {
+    processor_ = make_unique<ThreadBatchProcessor<size_t>>(thread_count);
+  }
+}
+
+std::unique_ptr<Pipe> PartitionedSimulation::NewPipe(
+    const net::GraphLink& graph_link, size_t src_partition,
+    size_t dst_partition, bool interesting) {
+  EventQueue* src_event_queue = event_queue(src_partition);
+  EventQueue* dst_event_queue = event_queue(dst_partition);
+  if (src_partition == dst_partition) {
+    return make_unique<Pipe>(graph_link, src_event_queue, interesting);
+  }
+
+  auto pipe = make_unique<CrossPartitionPipe>(
+      graph_link, src_partition, src_event_queue, dst_event_queue, interesting);
+  CHECK(!pipe->delay().isZero())
+      << "Link between partitions should have non-zero delay";
+  lookahead_ = std::min(lookahead_, pipe->delay());
+  cross_partition_pipes_.emplace_back(pipe.get());
+  return pipe;
+}
+
+void PartitionedSimulation::DeliverOutboxes() {
+  std::vector<CrossPartitionPipe::Delivery> deliveries;
+  for (CrossPartitionPipe* pipe : cross_partition_pipes_) {
+    pipe->TakeOutbox(&deliveries);
+  }
+
+  // The order in which packets from different pipes are delivered does not
+  // depend on the order in which pipes were created. Packets of the same pipe
+  // stay in order, as they enter the pipe in order.
+  std::stable_sort(deliveries.begin(), deliveries.end(),
+                   [](const CrossPartitionPipe::Delivery& lhs,
+                      const CrossPartitionPipe::Delivery& rhs) {
+                     return std::tie(lhs.exit_at, lhs.enqueued_at,
+                                     lhs.src_partition, lhs.src_sequence) <
+                            std::tie(rhs.exit_at, rhs.enqueued_at,
+                                     rhs.src_partition, rhs.src_sequence);
+                   });
+  for (CrossPartitionPipe::Delivery& delivery : deliveries) {
+    delivery.pipe->Deliver(&delivery);
+  }
+}
+
+void PartitionedSimulation::RunUntil(EventQueueTime stop_time) {
+  while (true) {
+    DeliverOutboxes();
+
+    EventQueueTime next_event_time = EventQueueTime::MaxTime();
+    for (const auto& event_queue : event_queues_) {
+      next_event_time = std::min(next_event_time, event_queue->NextEventTime());
+    }
+
+    if (next_event_time >= stop_time) {
+      break;
+    }
+
+    // No packet that is sent over a cross-partition pipe during the window
+    // can exit the pipe before the end of the window.
+    EventQueueTime window_end = stop_time;
+    if (stop_time - next_event_time > lookahead_) {
+      window_end = next_event_time + lookahead_;
+    }
+
+    ++window_count_;
+    if (!processor_) {
+      for (const auto& event_queue : event_queues_) {
+        event_queue->RunUntil(window_end);
+      }
+      continue;
+    }
+
+    processor_->RunInParallel(
+        partitions_, [this, window_end](const size_t& partition, size_t i,
+                                        size_t thread_index) {
+          Unused(i);
+          Unused(thread_index);
+          event_queues_[partition]->RunUntil(window_end);
+        });
+  }
+
+  // Brings the time of all partitions to the stop time.
+  for (const auto& event_queue : event_queues_) {
+    event_queue->RunUntil(stop_time);
+  }
+
+  // Packets sent at the very end are handed over now, so that they are not
+  // left in the outboxes if the simulation is not resumed.
+  DeliverOutboxes();
+}
+
+net::GraphNodeMap<size_t> PartitionNodes(const net::GraphStorage& graph,
+                                         size_t partition_count) {
+  CHECK(partition_count > 0) << "No partitions";
+  size_t node_count = graph.NodeCount();
+  size_t max_group_size = (node_count + partition_count - 1) / partition_count;
+
+  // Nodes are grouped with a union-find structure, joining the endpoints of
+  // links in order of increasing delay, as long as groups do not get too big.
+  std::vector<size_t> parents(node_count);
+  std::vector<size_t> sizes(node_count, 1);
+  std::iota(parents.begin(), parents.end(), 0);
+  auto find_root = [&parents](size_t node) {
+    while (parents[node] != node) {
+      parents[node] = parents[parents[node]];
+      node = parents[node];
+    }
+    return node;
+  };
+
+  std::vector<net::GraphLinkIndex> links;
+  for (net::GraphLinkIndex link_index : graph.AllLinks()) {
+    links.emplace_back(link_index);
+  }
+  std::stable_sort(links.begin(), links.end(),
+                   [&graph](net::GraphLinkIndex lhs, net::GraphLinkIndex rhs) {
+                     return graph.GetLink(lhs)->delay() <
+                            graph.GetLink(rhs)->delay();
+                   });
+
+  for (net::GraphLinkIndex link_index : links) {
+    const net::GraphLink* link = graph.GetLink(link_index);
+    size_t src_root = find_root(link->src());
+    size_t dst_root = find_root(link->dst());
+    if (src_root == dst_root ||
+        sizes[src_root] + sizes[dst_root] > max_group_size) {
+      continue;
+    }
+
+    if (sizes[src_root] < sizes[dst_root]) {
+      std::swap(src_root, dst_root);
+    }
+    parents[dst_root] = src_root;
+    sizes[src_root] += sizes[dst_root];
+  }
+
+  // Groups are assigned to partitions largest first, each one to the
+  // partition with the fewest nodes.
+  std::vector<size_t> roots;
+  for (size_t node = 0; node < node_count; ++node) {
+    if (find_root(node) == node) {
+      roots.emplace_back(node);
+    }
+  }
+  std::stable_sort(roots.begin(), roots.end(),
+                   [&sizes](size_t lhs, size_t rhs) {
+                     return sizes[lhs] > sizes[rhs];
+                   });
+
+  std::vector<size_t> partition_sizes(partition_count, 0);
+  std::vector<size_t> root_to_partition(node_count, 0);
+  for (size_t root : roots) {
+    auto it = std::min_element(partition_sizes.begin(), partition_sizes.end());
+    root_to_partition[root] = std::distance(partition_sizes.begin(), it);
+    *it += sizes[root];
+  }
+
+  net::GraphNodeMap<size_t> out;
+  for (net::GraphNodeIndex node_index : graph.AllNodes()) {
+    out[node_index] = root_to_partition[find_root(node_index)];
+  }
+
+  return out;
+}
+
+net::Delay PartitionLookahead(const net::GraphStorage& graph,
+                              const net::GraphNodeMap<size_t>& partitions) {
+  net::Delay lookahead = net::Delay::max();
+  for (net::GraphLinkIndex link_index : graph.AllLinks()) {
+    const net::GraphLink* link = graph.GetLink(link_index);
+    if (partitions.GetValueOrDie(link->src()) !=
+        partitions.GetValueOrDie(link->dst())) {
+      lookahead = std::min(lookahead, link->delay());
+    }
+  }
+
+  return lookahead;
+}
+
+}  // namespace htsim
+}  // namespace ncode
@@ -0,0 +1,219 @@
+// Parallel simulation of a network split into partitions. Each partition runs
+// on its own event queue, possibly in its own thread. Partitions only interact
+// via pipes that connect devices in different partitions. Since a packet that
+// enters such a pipe at time t only exits it at t + delay the partitions can
+// safely run independently of each other for a window of time as long as the
+// smallest delay of a cross-partition pipe (the lookahead). At the end of each
+// window all partitions synchronize and packets that were sent over
+// cross-partition pipes are handed over to the destination partitions. The
+// order of events does not depend on the number of threads, so the results of
+// a simulation are deterministic and the same as when all partitions are run
+// in a single thread. Packets handed over between partitions are ordered by
+// exit time, then by the time their exit events would have been enqueued,
+// then by source partition and the order in which they entered their pipes.
+// Their exit events are ordered among other events in the destination
+// partition as if the pipe's ends were on the same event queue. The results
+// are the same as when running all components on a single event queue, as
+// long as a packet that enters an empty cross-partition pipe does not exit at
+// the same time as another event in the destination partition that was
+// enqueued at the time the packet entered the pipe. The order of those two
+// events depends on the order of events in the source and destination
+// partitions, which only a single event queue has.
+//
+// All components of the simulation that interact with each other other than
+// via cross-partition pipes should be in the same partition. Metrics that
+// record values during the simulation should not be shared between
+// partitions. Callback-based metrics are fine, as long as they are polled when
+// the simulation is not running.
+
+#ifndef NCODE_HTSIM_PARTITION_H
+#define NCODE_HTSIM_PARTITION_H
+
+#include <stddef.h>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "../common/common.h"
+#include "../common/event_queue.h"
+#include "../common/thread_runner.h"
+#include "../net/net_common.h"
+#include "packet.h"
+#include "queue.h"
+
+namespace ncode {
+namespace htsim {
+
+// A pipe whose source is in one partition and destination in another.
+// Packets enter the pipe on the source's event queue, but are only added to
+// the pipe (on the destination's event queue) when the partitions
+// synchronize.
+class CrossPartitionPipe : public Pipe {
+ public:
+  // A packet that entered the pipe since the last synchronization.
+  struct Delivery {
+    Delivery(EventQueueTime exit_at, EventQueueTime enqueued_at,
+             bool after_exit, size_t src_partition, uint64_t src_sequence,
+             CrossPartitionPipe* pipe, PacketPtr pkt)
+        : exit_at(exit_at),
+          enqueued_at(enqueued_at),
+          after_exit(after_exit),
+          src_partition(src_partition),
+          src_sequence(src_sequence),
+          pipe(pipe),
+          pkt(std::move(pkt)) {}
+
+    // When the packet exits the pipe.
+    EventQueueTime exit_at;
+
+    // When the exit event would have been enqueued if both ends of the pipe
+    // were on the same event queue.
+    EventQueueTime enqueued_at;
+
+    // True if the pipe was not empty when the packet entered it. The exit
+    // event would then have been enqueued when the previous packet exited.
+    bool after_exit;
+
+    // Where and when in the source partition the packet entered the pipe.
+    size_t src_partition;
+    uint64_t src_sequence;
+
+    CrossPartitionPipe* pipe;
+    PacketPtr pkt;
+  };
+
+  CrossPartitionPipe(const net::GraphLink& graph_link, size_t src_partition,
+                     EventQueue* src_event_queue, EventQueue* dst_event_queue,
+                     bool interesting = true);
+
+  // Called from the destination partition.
+  void HandleEvent() override;
+
+  // Called from the source partition.
+  void HandlePacket(PacketPtr pkt) override;
+
+  // Called from the source partition. The packets are delivered one by one,
+  // not as a train, each entering the pipe when it would have on its own.
+  void HandlePacketBatch(PacketBatch* packets) override;
+
+  // Moves packets that entered the pipe since the last synchronization to
+  // 'out', in the order they entered. Should only be called when neither
+  // partition is running.
+  void TakeOutbox(std::vector<Delivery>* out);
+
+  // Adds a packet taken from the outbox to the pipe. The exit event is ordered
+  // in the destination partition the same way it would have been if both
+  // ends were on the same event queue. Packets should be delivered in the
+  // order they were taken from the outbox.
+  void Deliver(Delivery* delivery);
+
+ private:
+  // The partition the source is in.
+  size_t src_partition_;
+
+  // The event queue of the source partition.
+  EventQueue* src_event_queue_;
+
+  // A packet that entered the pipe since the last synchronization.
+  struct OutboxEntry {
+    OutboxEntry(EventQueueTime entered_at, uint64_t sequence, PacketPtr pkt)
+        : entered_at(entered_at), sequence(sequence), pkt(std::move(pkt)) {}
+
+    EventQueueTime entered_at;
+    uint64_t sequence;
+    PacketPtr pkt;
+  };
+
+  std::vector<OutboxEntry> outbox_;
+
+  // The time the last packet taken from the outbox exits the pipe.
+  EventQueueTime last_exit_at_;
+
+  // Reserved when the last exit event was handled. If both ends were on the
+  // same event queue the event for the next packet would have been enqueued
+  // then.
+  uint64_t exit_sequence_;
+
+  DISALLOW_COPY_AND_ASSIGN(CrossPartitionPipe);
+};
+
+// Runs a simulation split into a number of partitions.
+class PartitionedSimulation {
+ public:
+  // If 'thread_count' is 0 there will be one thread per partition.
+  PartitionedSimulation(
+      size_t partition_count, size_t thread_count = 0,
+      EventQueue::SchedulerType scheduler_type = EventQueue::HEAP_SCHEDULER);
+
+  // The event queue for a partition. All components in the partition should
+  // use this event queue.
+  SimTimeEventQueue* event_queue(size_t partition) {
+    CHECK(partition < event_queues_.size());
+    return event_queues_[partition].get();
+  }
+
+  size_t partition_count() const { return event_queues_.size(); }
+
+  // Returns a new pipe for a link from a device in one partition to a device
+  // in another. If the partitions are the same the pipe is a regular pipe.
+  // The returned pipe should outlive the simulation.
+  std::unique_ptr<Pipe> NewPipe(const net::GraphLink& graph_link,
+                                size_t src_partition, size_t dst_partition,
+                                bool interesting = true);
+
+  // The length of the synchronization window. This is the smallest delay of
+  // all cross-partition pipes or MaxTime if there are none.
+  EventQueueTime lookahead() const { return lookahead_; }
+
+  // Number of synchronization windows executed so far.
+  uint64_t window_count() const { return window_count_; }
+
+  // Runs the simulation until the given time.
+  void RunUntil(EventQueueTime stop_time);
+
+  // Runs the simulation for the given amount of time from the current time.
+  template <typename T>
+  void RunAndStopIn(T duration) {
+    SimTimeEventQueue* first_queue = event_queues_.front().get();
+    RunUntil(first_queue->CurrentTime() + first_queue->ToTime(duration));
+  }
+
+ private:
+  // Hands over packets to the destination partitions.
+  void DeliverOutboxes();
+
+  // One event queue per partition.
+  std::vector<std::unique_ptr<SimTimeEventQueue>> event_queues_;
+
+  // Partition indices, passed to the thread pool.
+  std::vector<size_t> partitions_;
+
+  // All pipes between partitions. Not owned.
+  std::vector<CrossPartitionPipe*> cross_partition_pipes_;
+
+  EventQueueTime lookahead_;
+
+  uint64_t window_count_;
+
+  // Runs partitions in parallel. Null if there is only one thread.
+  std::unique_ptr<ThreadBatchProcessor<size_t>> processor_;
+
+  DISALLOW_COPY_AND_ASSIGN(PartitionedSimulation);
+};
+
+// Assigns the nodes of a graph to partitions. Nodes connected by links with
+// small delay are placed in the same partition, so that the lookahead of the
+// partitioned simulation is large. Partitions are kept roughly the same size.
+// Returns the partition of each node.
+net::GraphNodeMap<size_t> PartitionNodes(const net::GraphStorage& graph,
+                                         size_t partition_count);
+
+// The smallest delay of a link between nodes in different partitions.
+net::Delay PartitionLookahead(const net::GraphStorage& graph,
+                              const net::GraphNodeMap<size_t>& partitions);
+
+}  // namespace htsim
+}  // namespace ncode
+
+#endif
@@ -0,0 +1,201 @@
+#include "partition.h"
+
+#include "gtest/gtest.h"
+#include "network.h"
+#include "tcp.h"
+#include "udp.h"
+
+namespace ncode {
+namespace htsim {
+namespace {
+
+using namespace std::chrono;
+
+static constexpr uint64_t kRateBps = 10000000;
+static constexpr double kDelaySec = 0.010;
+static constexpr size_t kSimEndTimeMs = 5000;
+
+static net::PBNet TwoClusters() {
+  net::PBNet net;
+  net::AddBiEdgesToGraph({{"A", "B"}, {"C", "D"}}, milliseconds(1),
+                         net::Bandwidth::FromBitsPerSecond(kRateBps), &net);
+  net::AddBiEdgesToGraph({{"B", "C"}}, milliseconds(20),
+                         net::Bandwidth::FromBitsPerSecond(kRateBps), &net);
+  return net;
+}
+
+TEST(PartitionNodes, TwoClusters) {
+  net::GraphStorage graph(TwoClusters());
+  net::GraphNodeMap<size_t> partitions = PartitionNodes(graph, 2);
+
+  size_t a = partitions[graph.NodeFromStringOrDie("A")];
+  size_t b = partitions[graph.NodeFromStringOrDie("B")];
+  size_t c = partitions[graph.NodeFromStringOrDie("C")];
+  size_t d = partitions[graph.NodeFromStringOrDie("D")];
+  ASSERT_EQ(a, b);
+  ASSERT_EQ(c, d);
+  ASSERT_NE(a, c);
+  ASSERT_EQ(milliseconds(20), PartitionLookahead(graph, partitions));
+}
+
+TEST(PartitionNodes, SinglePartition) {
+  net::GraphStorage graph(TwoClusters());
+  net::GraphNodeMap<size_t> partitions = PartitionNodes(graph, 1);
+  for (net::GraphNodeIndex node : graph.AllNodes()) {
+    ASSERT_EQ(0ul, partitions[node]);
+  }
+
+  ASSERT_EQ(net::Delay::max(), PartitionLookahead(graph, partitions));
+}
+
+// Stats collected at the end of a simulation.
+struct TwoDeviceResult {
+  uint64_t a_packets_seen;
+  uint64_t a_bytes_seen;
+  uint64_t b_packets_seen;
+  uint64_t b_bytes_seen;
+  uint64_t queue_pkts_dropped;
+  uint64_t pipe_pkts_tx;
+  uint64_t reverse_pipe_pkts_tx;
+  uint64_t tcp_bytes_rx;
+
+  bool operator==(const TwoDeviceResult& other) const {
+    return std::tie(a_packets_seen, a_bytes_seen, b_packets_seen, b_bytes_seen,
+                    queue_pkts_dropped, pipe_pkts_tx, reverse_pipe_pkts_tx,
+                    tcp_bytes_rx) ==
+           std::tie(other.a_packets_seen, other.a_bytes_seen,
+                    other.b_packets_seen, other.b_bytes_seen,
+                    other.queue_pkts_dropped, other.pipe_pkts_tx,
+                    other.reverse_pipe_pkts_tx, other.tcp_bytes_rx);
+  }
+};
+
+// Adds a rule to a device that sends all traffic for an address out of a port.
+static void AddRoute(net::IPAddress dst, net::DevicePortNumber port,
+                     Device* device) {
+  net::FiveTuple tuple(kWildIPAddress, dst, kWildIPProto, kWildAccessLayerPort,
+                      kWildAccessLayerPort);
+  MatchRuleKey key(kWildPacketTag, kWildDevicePortNumber, {tuple});
+  auto action = make_unique<MatchRuleAction>(port, kWildPacketTag, 100);
+  auto rule = make_unique<MatchRule>(key);
+  rule->AddAction(std::move(action));
+
+  auto message = make_unique<SSCPAddOrUpdate>(
+      kWildIPAddress, device->ip_address(), EventQueueTime(0), std::move(rule));
+  device->HandlePacket(std::move(message));
+}
+
+// Runs a TCP transfer from A to B, which may be in different partitions. The
+// queue at A is small, so some packets will be dropped.
+static TwoDeviceResult RunTwoDevices(
+    size_t partition_count, size_t thread_count,
+    EventQueue::SchedulerType scheduler_type = EventQueue::HEAP_SCHEDULER) {
+  net::PBNet graph_pb;
+  net::AddBiEdgesToGraph({{"A", "B"}}, duration_cast<net::Delay>(
+                                           duration<double>(kDelaySec)),
+                         net::Bandwidth::FromBitsPerSecond(kRateBps),
+                         &graph_pb);
+  net::GraphStorage graph(graph_pb);
+  const net::GraphLink* link = graph.GetLink(graph.LinkOrDie("A", "B"));
+  const net::GraphLink* reverse_link =
+      graph.GetLink(graph.LinkOrDie("B", "A"));
+
+  PartitionedSimulation sim(partition_count, thread_count, scheduler_type);
+  size_t partition_a = 0;
+  size_t partition_b = partition_count - 1;
+  EventQueue* queue_a = sim.event_queue(partition_a);
+  EventQueue* queue_b = sim.event_queue(partition_b);
+
+  Network network(queue_a->RawMillisToTime(10), queue_a);
+  Device device_a("A", net::IPAddress(1), queue_a);
+  Device device_b("B", net::IPAddress(2), queue_b);
+  network.AddDevice(&device_a);
+  network.AddDevice(&device_b);
+
+  std::unique_ptr<Pipe> pipe = sim.NewPipe(*link, partition_a, partition_b);
+  FIFOQueue queue(*link, 20000, queue_a);
+  network.AddLink(&queue, pipe.get());
+
+  std::unique_ptr<Pipe> reverse_pipe =
+      sim.NewPipe(*reverse_link, partition_b, partition_a);
+  FIFOQueue reverse_queue(*reverse_link, 20000, queue_b);
+  network.AddLink(&reverse_queue, reverse_pipe.get());
+
+  AddRoute(device_b.ip_address(), link->src_port(), &device_a);
+  AddRoute(device_a.ip_address(), reverse_link->src_port(), &device_b);
+
+  TCPSource* tcp_source = device_a.AddTCPGenerator(
+      device_b.ip_address(), net::AccessLayerPort(100), 1500, 2000000);
+  tcp_source->AddData(10000000);
+
+  sim.RunAndStopIn(milliseconds(kSimEndTimeMs));
+  for (size_t i = 0; i < partition_count; ++i) {
+    EXPECT_EQ(milliseconds(kSimEndTimeMs),
+              sim.event_queue(i)->TimeToNanos(
+                  sim.event_queue(i)->CurrentTime()));
+  }
+
+  DeviceStats a_stats = device_a.GetStats();
+  DeviceStats b_stats = device_b.GetStats();
+  TwoDeviceResult result;
+  result.a_packets_seen = a_stats.packets_seen;
+  result.a_bytes_seen = a_stats.bytes_seen;
+  result.b_packets_seen = b_stats.packets_seen;
+  result.b_bytes_seen = b_stats.bytes_seen;
+  result.queue_pkts_dropped = queue.GetStats().pkts_dropped;
+  result.pipe_pkts_tx = pipe->GetStats().pkts_tx;
+  result.reverse_pipe_pkts_tx = reverse_pipe->GetStats().pkts_tx;
+  result.tcp_bytes_rx = 0;
+  for (const auto& tuple_and_stats : b_stats.connection_stats) {
+    result.tcp_bytes_rx += tuple_and_stats.second.bytes_rx;
+  }
+
+  return result;
+}
+
+TEST(PartitionedSimulation, SinglePartition) {
+  PartitionedSimulation sim(1);
+  ASSERT_EQ(1ul, sim.partition_count());
+  ASSERT_EQ(EventQueueTime::MaxTime(), sim.lookahead());
+
+  sim.RunAndStopIn(milliseconds(100));
+  ASSERT_EQ(milliseconds(100),
+            sim.event_queue(0)->TimeToNanos(sim.event_queue(0)->CurrentTime()));
+}
+
+TEST(PartitionedSimulation, SameForAnyThreadCount) {
+  TwoDeviceResult single_thread = RunTwoDevices(2, 1);
+  ASSERT_LT(0ul, single_thread.queue_pkts_dropped);
+  ASSERT_LT(0ul, single_thread.tcp_bytes_rx);
+
+  TwoDeviceResult two_threads = RunTwoDevices(2, 2);
+  ASSERT_TRUE(single_thread == two_threads);
+}
+
+TEST(PartitionedSimulation, SameAsSingleQueue) {
+  TwoDeviceResult single_queue = RunTwoDevices(1, 1);
+  TwoDeviceResult partitioned = RunTwoDevices(2, 2);
+  ASSERT_TRUE(single_queue == partitioned);
+
+  TwoDeviceResult timing_wheel =
+      RunTwoDevices(2, 2, EventQueue::TIMING_WHEEL_SCHEDULER);
+  ASSERT_TRUE(single_queue == timing_wheel);
+}
+
+TEST(PartitionedSimulation, Windows) {
+  net::PBNet graph_pb = TwoClusters();
+  net::GraphStorage graph(graph_pb);
+  const net::GraphLink* link = graph.GetLink(graph.LinkOrDie("B", "C"));
+
+  PartitionedSimulation sim(2);
+  std::unique_ptr<Pipe> pipe = sim.NewPipe(*link, 0, 1);
+  ASSERT_EQ(sim.event_queue(0)->ToTime(milliseconds(20)), sim.lookahead());
+
+  // No events, the simulation should finish in one go.
+  sim.RunAndStopIn(milliseconds(1000));
+  ASSERT_EQ(0ul, sim.window_count());
+}
+
+}  // namespace
+}  // namespace htsim
+}  // namespace ncode
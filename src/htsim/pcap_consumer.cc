@@ -13,14 +13,22 @@ namespace htsim {
 
 PcapPacketGen::PcapPacketGen(
     std::unique_ptr<pcap::OfflineSourceProvider> source_provider,
-    EventQueue* event_queue)
-    : offline_pcap_(std::move(source_provider), this),
+    EventQueue* event_queue, bool use_mmap, size_t decode_threads)
+    : batch_index_(0),
       max_interpacket_gap_(pcap::Timestamp::max()),
       time_shift_(pcap::Timestamp::zero()),
       prev_timestamp_(pcap::Timestamp::zero()),
       event_queue_(event_queue),
       break_(false),
-      overwrite_ttl_(false) {}
+      overwrite_ttl_(false) {
+  if (use_mmap) {
+    mmap_pcap_ = make_unique<pcap::MmapOfflinePcap>(std::move(source_provider),
+                                                    decode_threads);
+  } else {
+    offline_pcap_ =
+        make_unique<pcap::OfflinePcap>(std::move(source_provider), this);
+  }
+}
 
 void PcapPacketGen::HandleTCP(pcap::Timestamp timestamp,
                               const pcap::IPHeader& ip_header,
@@ -47,7 +55,7 @@ void PcapPacketGen::HandleTCP(pcap::Timestamp timestamp,
   }
 
   SeqNum seq_num(ntohl(tcp_header.th_seq));
-  auto packet = make_unique<TCPPacket>(five_tuple, size, time, seq_num);
+  auto packet = TCPPacket::New(five_tuple, size, time, seq_num);
   packet->set_id(ntohs(ip_header.ip_id));
   packet->set_flags(tcp_header.th_flags);
   packet->set_payload(payload_len);
@@ -76,7 +84,7 @@ void PcapPacketGen::HandleUDP(pcap::Timestamp timestamp,
     return;
   }
 
-  auto packet = make_unique<UDPPacket>(five_tuple, size, time);
+  auto packet = UDPPacket::New(five_tuple, size, time);
   packet->set_id(ntohs(ip_header.ip_id));
   packet->set_payload(payload_len);
   packet->set_ttl(overwrite_ttl_ ? kDefaultTTL : ip_header.ip_ttl);
@@ -87,9 +95,25 @@ void PcapPacketGen::set_max_inter_packet_gap(pcap::Timestamp gap) {
   max_interpacket_gap_ = gap;
 }
 
+bool PcapPacketGen::NextTracePacket() {
+  if (offline_pcap_) {
+    return offline_pcap_->NextPacket();
+  }
+
+  if (batch_index_ == batch_.size()) {
+    if (!mmap_pcap_->NextBatch(&batch_)) {
+      return false;
+    }
+    batch_index_ = 0;
+  }
+
+  pcap::DispatchPacket(batch_[batch_index_++], this);
+  return true;
+}
+
 PacketPtr PcapPacketGen::NextPacket() {
   while (!pending_packet_) {
-    if (!offline_pcap_.NextPacket() || break_) {
+    if (!NextTracePacket() || break_) {
       return PacketPtr();
     }
   }
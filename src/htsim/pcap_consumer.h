@@ -8,6 +8,7 @@
 
 #include "../net/net_common.h"
 #include "../net/pcap.h"
+#include "../net/pcap_mmap.h"
 #include "bulk_gen.h"
 #include "match.h"
 #include "packet.h"
@@ -20,8 +21,12 @@ namespace htsim {
 class PcapPacketGen : public BulkPacketSource, public pcap::PacketHandler {
  public:
   virtual ~PcapPacketGen() {}
+
+  // If 'use_mmap' is true the trace will be read by MmapOfflinePcap instead
+  // of libpcap, with batches decoded by 'decode_threads' threads.
   PcapPacketGen(std::unique_ptr<pcap::OfflineSourceProvider> source_provider,
-                EventQueue* event_queue);
+                EventQueue* event_queue, bool use_mmap = false,
+                size_t decode_threads = 1);
 
   void HandleTCP(pcap::Timestamp timestamp, const pcap::IPHeader& ip_header,
                  const pcap::TCPHeader& tcp_header,
@@ -48,8 +53,16 @@ class PcapPacketGen : public BulkPacketSource, public pcap::PacketHandler {
   // not monotonic will return false.
   bool GetEventQueueTime(pcap::Timestamp timestamp, EventQueueTime* time);
 
-  // Reads from the .pcap file.
-  pcap::OfflinePcap offline_pcap_;
+  // Processes the next packet from the trace. Returns true on success.
+  bool NextTracePacket();
+
+  // Reads from the .pcap file. Only one of the two is set.
+  std::unique_ptr<pcap::OfflinePcap> offline_pcap_;
+  std::unique_ptr<pcap::MmapOfflinePcap> mmap_pcap_;
+
+  // The current batch from 'mmap_pcap_' and the next packet in it.
+  std::vector<pcap::DecodedPacket> batch_;
+  size_t batch_index_;
 
   // The currently pending packet.
   PacketPtr pending_packet_;
@@ -44,6 +44,27 @@ class ConsumerTest : public ::testing::Test {
         "pcap_test_data/output_dump");
   }
 
+  // Reads the trace and checks that all packets were seen.
+  void Consume(bool use_mmap, size_t decode_threads) {
+    auto pcap_source = make_unique<PcapPacketGen>(
+        std::move(source_), &event_queue_, use_mmap, decode_threads);
+    std::vector<std::unique_ptr<BulkPacketSource>> sources;
+    sources.emplace_back(std::move(pcap_source));
+
+    BulkPacketGenerator bulk_generator("PcapPacketGen", std::move(sources),
+                                       &pipe_, &event_queue_);
+
+    // An hour should be more than the timestamp of the last packet in the
+    // file.
+    event_queue_.RunAndStopIn(std::chrono::hours(1));
+
+    // Delta between last and first packet in the trace.
+    std::chrono::microseconds last_pkt(37264);
+    ASSERT_EQ(last_pkt, dummy_handler_.last_packet_rx_at());
+    ASSERT_EQ(9933ul, pipe_.GetStats().pkts_tx);
+    ASSERT_EQ(dummy_handler_.packet_count(), pipe_.GetStats().pkts_tx);
+  }
+
   ncode::SimTimeEventQueue event_queue_;
   DummyPacketHandler dummy_handler_;
   Pipe pipe_;
@@ -52,24 +73,11 @@ class ConsumerTest : public ::testing::Test {
   std::vector<std::unique_ptr<BulkPacketSource>> sources_;
 };
 
-TEST_F(ConsumerTest, MultiConsume) {
-  auto pcap_source =
-      make_unique<PcapPacketGen>(std::move(source_), &event_queue_);
-  std::vector<std::unique_ptr<BulkPacketSource>> sources;
-  sources.emplace_back(std::move(pcap_source));
-
-  BulkPacketGenerator bulk_generator("PcapPacketGen", std::move(sources),
-                                     &pipe_, &event_queue_);
+TEST_F(ConsumerTest, MultiConsume) { Consume(false, 1); }
 
-  // An hour should be more than the timestamp of the last packet in the file.
-  event_queue_.RunAndStopIn(std::chrono::hours(1));
+TEST_F(ConsumerTest, MmapConsume) { Consume(true, 1); }
 
-  // Delta between last and first packet in the trace.
-  std::chrono::microseconds last_pkt(37264);
-  ASSERT_EQ(last_pkt, dummy_handler_.last_packet_rx_at());
-  ASSERT_EQ(9933ul, pipe_.GetStats().pkts_tx);
-  ASSERT_EQ(dummy_handler_.packet_count(), pipe_.GetStats().pkts_tx);
-}
+TEST_F(ConsumerTest, MmapConsumeManyThreads) { Consume(true, 4); }
 
 }  // namespace
 }  // namespace htsim
@@ -106,39 +106,106 @@ Pipe::Pipe(const std::string& src, const std::string& dst, EventQueueTime delay,
   }
 }
 
-void Pipe::AddMetrics(const std::string& src, const std::string& dst) {
-  kPipeBytesTxMetric->GetHandle([this] { return stats_.bytes_tx; }, src, dst);
-  kPipeBytesInFlightMetric->GetHandle([this] { return stats_.bytes_in_flight; },
-                                      src, dst);
-  kPipePktsTxMetric->GetHandle([this] { return stats_.pkts_tx; }, src, dst);
-  kPipePktsInFlightMetric->GetHandle([this] { return stats_.pkts_in_flight; },
+void AddPipeMetrics(const std::string& src, const std::string& dst,
+                    const PipeStats* stats) {
+  kPipeBytesTxMetric->GetHandle([stats] { return stats->bytes_tx; }, src, dst);
+  kPipeBytesInFlightMetric->GetHandle(
+      [stats] { return stats->bytes_in_flight; }, src, dst);
+  kPipePktsTxMetric->GetHandle([stats] { return stats->pkts_tx; }, src, dst);
+  kPipePktsInFlightMetric->GetHandle([stats] { return stats->pkts_in_flight; },
                                      src, dst);
 }
 
-void Pipe::HandleEvent() {
-  PacketPtr pkt = std::move(queue_.front().second);
-  queue_.pop_front();
+void AddQueueMetrics(const std::string& src, const std::string& dst,
+                     const QueueStats* stats,
+                     size_t* bits_seen_in_last_period) {
+  kQueueSizeBytesMetric->GetHandle([stats] { return stats->queue_size_bytes; },
+                                   src, dst);
+  kQueueSizePktsMetric->GetHandle([stats] { return stats->queue_size_pkts; },
+                                  src, dst);
+  kQueuePktsDroppedMetric->GetHandle([stats] { return stats->pkts_dropped; },
+                                     src, dst);
+  kQueueBytesSeenMetric->GetHandle([stats] { return stats->bytes_seen; }, src,
+                                   dst);
+  kQueueBPSMetric->GetHandle([bits_seen_in_last_period] {
+    size_t tmp = *bits_seen_in_last_period;
+    *bits_seen_in_last_period = 0;
+    return tmp;
+  }, src, dst);
+}
 
-  stats_.bytes_in_flight -= pkt->size_bytes();
-  stats_.pkts_in_flight -= 1;
-  stats_.bytes_tx += pkt->size_bytes();
-  stats_.pkts_tx += 1;
+void Pipe::AddMetrics(const std::string& src, const std::string& dst) {
+  AddPipeMetrics(src, dst, &stats_);
+}
+
+void Pipe::HandleEvent() {
+  bool last_in_train = false;
+  while (!last_in_train) {
+    InFlight& in_flight = queue_.front();
+    last_in_train = in_flight.last_in_train;
+
+    uint32_t size_bytes = in_flight.pkt->size_bytes();
+    stats_.bytes_in_flight -= size_bytes;
+    stats_.pkts_in_flight -= 1;
+    stats_.bytes_tx += size_bytes;
+    stats_.pkts_tx += 1;
+
+    train_.Add(std::move(in_flight.pkt), in_flight.at);
+    queue_.pop_front();
+  }
 
   if (!queue_.empty()) {
-    EventQueueTime next_event_time = queue_.front().first;
+    EventQueueTime next_event_time = queue_.front().at;
     EnqueueAt(next_event_time);
   }
 
-  other_end_->HandlePacket(std::move(pkt));
+  if (train_.size() == 1) {
+    PacketPtr pkt = std::move(train_.packet(0));
+    train_.clear();
+    other_end_->HandlePacket(std::move(pkt));
+    return;
+  }
+
+  other_end_->HandlePacketBatch(&train_);
+  train_.clear();
 }
 
 void Pipe::HandlePacket(PacketPtr pkt) {
+  EventQueueTime now = event_queue()->CurrentTime();
+  AddInFlight(now + delay_, now, event_queue()->ReserveSequence(),
+              std::move(pkt));
+}
+
+void Pipe::HandlePacketBatch(PacketBatch* packets) {
+  if (packets->empty()) {
+    return;
+  }
+
+  // The train exits when its first packet does, but each packet keeps the
+  // time it would have exited on its own.
+  EventQueueTime now = event_queue()->CurrentTime();
   if (queue_.empty()) {
-    EnqueueIn(delay_);
+    EnqueueAt(packets->at(0) + delay_, now);
+  }
+
+  for (size_t i = 0; i < packets->size(); ++i) {
+    PacketPtr& pkt = packets->packet(i);
+    stats_.bytes_in_flight += pkt->size_bytes();
+    stats_.pkts_in_flight += 1;
+    queue_.emplace_back(packets->at(i) + delay_, std::move(pkt),
+                        i == packets->size() - 1);
+  }
+  packets->clear();
+}
+
+void Pipe::AddInFlight(EventQueueTime at, EventQueueTime enqueued_at,
+                       uint64_t sequence, PacketPtr pkt) {
+  if (queue_.empty()) {
+    EnqueueAt(at, enqueued_at, sequence);
   }
 
   uint32_t size_bytes = pkt->size_bytes();
-  queue_.emplace_back(event_queue()->CurrentTime() + delay_, std::move(pkt));
+  queue_.emplace_back(at, std::move(pkt), true);
   stats_.bytes_in_flight += size_bytes;
   stats_.pkts_in_flight += 1;
 }
@@ -159,19 +226,7 @@ Queue::Queue(const net::GraphLink& edge, EventQueue* event_queue,
             interesting) {}
 
 void Queue::AddMetrics(const std::string& src, const std::string& dst) {
-  kQueueSizeBytesMetric->GetHandle([this] { return stats_.queue_size_bytes; },
-                                   src, dst);
-  kQueueSizePktsMetric->GetHandle([this] { return stats_.queue_size_pkts; },
-                                  src, dst);
-  kQueuePktsDroppedMetric->GetHandle([this] { return stats_.pkts_dropped; },
-                                     src, dst);
-  kQueueBytesSeenMetric->GetHandle([this] { return stats_.bytes_seen; }, src,
-                                   dst);
-  kQueueBPSMetric->GetHandle([this] {
-    size_t tmp = bits_seen_in_last_period_;
-    bits_seen_in_last_period_ = 0;
-    return tmp;
-  }, src, dst);
+  AddQueueMetrics(src, dst, &stats_, &bits_seen_in_last_period_);
 }
 
 void Queue::ApplyValue(double value) {
@@ -183,7 +238,18 @@ void Queue::ApplyValue(double value) {
   }
 }
 
+void FIFOQueue::ReleaseDrained(EventQueueTime now) {
+  while (!draining_.empty() && draining_.front().first <= now) {
+    stats_.queue_size_bytes -= draining_.front().second;
+    stats_.queue_size_pkts -= 1;
+    draining_.pop_front();
+  }
+}
+
 void FIFOQueue::HandlePacket(PacketPtr pkt) {
+  EventQueueTime now = event_queue()->CurrentTime();
+  ReleaseDrained(now);
+
   size_t size_bytes = pkt->size_bytes();
   if (ShouldDrop(size_bytes)) {
     stats_.bytes_dropped += size_bytes;
@@ -208,21 +274,72 @@ void FIFOQueue::HandlePacket(PacketPtr pkt) {
   bits_seen_in_last_period_ += size_bytes * 8;
 
   if (queue_was_empty) {
-    EnqueueIn(PacketDrainTime(*queue_.front()));
+    // Packets that left early as part of a batch still occupy the link.
+    EventQueueTime start_at = std::max(now, busy_until_);
+    drain_at_ = start_at + PacketDrainTime(*queue_.front());
+    EnqueueAt(drain_at_);
   }
 }
 
 void FIFOQueue::HandleEvent() {
+  EventQueueTime now = event_queue()->CurrentTime();
+  ReleaseDrained(now);
+
+  // Events that only release packets that finished draining.
+  if (queue_.empty() || now < drain_at_) {
+    return;
+  }
+
   PacketPtr pkt = std::move(queue_.front());
   queue_.pop_front();
 
   stats_.queue_size_bytes -= pkt->size_bytes();
   stats_.queue_size_pkts -= 1;
+  busy_until_ = now;
+
+  if (batch_epsilon_.isZero()) {
+    if (!queue_.empty()) {
+      drain_at_ = now + PacketDrainTime(*queue_.front());
+      EnqueueAt(drain_at_);
+    }
+    other_end_->HandlePacket(std::move(pkt));
+    return;
+  }
+
+  batch_.Add(std::move(pkt), now);
+  EventQueueTime batch_until = now + batch_epsilon_;
+  while (!queue_.empty()) {
+    EventQueueTime drained_at = busy_until_ + PacketDrainTime(*queue_.front());
+    if (drained_at > batch_until) {
+      break;
+    }
+
+    // The packet stays in the queue's stats until it would have been
+    // drained without batching.
+    busy_until_ = drained_at;
+    draining_.emplace_back(drained_at, queue_.front()->size_bytes());
+    batch_.Add(std::move(queue_.front()), drained_at);
+    queue_.pop_front();
+  }
 
   if (!queue_.empty()) {
-    EnqueueIn(PacketDrainTime(*queue_.front()));
+    drain_at_ = busy_until_ + PacketDrainTime(*queue_.front());
+    EnqueueAt(drain_at_);
+  } else if (!draining_.empty()) {
+    // No drain event will release the packets in the batch, need an event of
+    // its own.
+    EnqueueAt(busy_until_);
+  }
+
+  if (batch_.size() == 1) {
+    pkt = std::move(batch_.packet(0));
+    batch_.clear();
+    other_end_->HandlePacket(std::move(pkt));
+    return;
   }
-  other_end_->HandlePacket(std::move(pkt));
+
+  other_end_->HandlePacketBatch(&batch_);
+  batch_.clear();
 }
 
 void FIFOQueue::SetRate(net::Bandwidth new_rate) {
@@ -238,10 +355,14 @@ FIFOQueue::FIFOQueue(const std::string& src, const std::string& dst,
                      EventQueue* event_queue, bool interesting)
     : Queue(src, dst, event_queue, interesting),
       max_size_bytes_(max_size_bytes),
-      rate_(net::Bandwidth::FromBitsPerSecond(0)) {
+      rate_(net::Bandwidth::FromBitsPerSecond(0)),
+      batch_epsilon_(EventQueueTime::ZeroTime()),
+      busy_until_(EventQueueTime::ZeroTime()),
+      drain_at_(EventQueueTime::ZeroTime()) {
   SetRate(rate);
   if (interesting) {
     kQueueSizeMsMetric->GetHandle([this] {
+      ReleaseDrained(this->event_queue()->CurrentTime());
       EventQueueTime time_in_queue(stats_.queue_size_bytes * 8 *
                                    time_per_bit_.Raw());
       return this->event_queue()->TimeToRawMillis(time_in_queue);
@@ -25,6 +25,11 @@ struct PipeStats {
   uint64_t bytes_in_flight = 0;
 };
 
+// Registers the standard pipe metrics, which are polled from 'stats'. Used by
+// pipes and by other models of links that want to report the same metrics.
+void AddPipeMetrics(const std::string& src, const std::string& dst,
+                    const PipeStats* stats);
+
 // A pipe adds some constant delay to all incoming packets
 class Pipe : public EventConsumer, public PacketHandler {
  public:
@@ -41,6 +46,10 @@ class Pipe : public EventConsumer, public PacketHandler {
 
   void HandlePacket(PacketPtr pkt) override;
 
+  // All packets in the batch travel through the pipe as a single train. They
+  // exit at the same time and are handed to the other end as a batch.
+  void HandlePacketBatch(PacketBatch* packets) override;
+
   const PipeStats& GetStats() const { return stats_; }
 
   const net::GraphLink* graph_link() const {
@@ -48,10 +57,33 @@ class Pipe : public EventConsumer, public PacketHandler {
     return graph_link_;
   }
 
+  // The amount of time packets spend in the pipe.
+  EventQueueTime delay() const { return delay_; }
+
+ protected:
+  // Adds a packet that will exit the pipe at a given time. Packets should be
+  // added in the order they exit the pipe. If the pipe is empty the exit event
+  // is ordered as if it was enqueued at 'enqueued_at' with a given sequence
+  // number (see EventQueue::ReserveSequence).
+  void AddInFlight(EventQueueTime at, EventQueueTime enqueued_at,
+                   uint64_t sequence, PacketPtr pkt);
+
  private:
   void AddMetrics(const std::string& src, const std::string& dst);
 
-  typedef std::pair<EventQueueTime, PacketPtr> ServiceTimeAndPacket;
+  // A packet in flight.
+  struct InFlight {
+    InFlight(EventQueueTime at, PacketPtr pkt, bool last_in_train)
+        : at(at), pkt(std::move(pkt)), last_in_train(last_in_train) {}
+
+    // When the packet exits the pipe. Packets in a train exit with the first
+    // one, for them this is when they would have exited on their own.
+    EventQueueTime at;
+    PacketPtr pkt;
+
+    // False if the next packet is part of the same train as this one.
+    bool last_in_train;
+  };
 
   // The amount of delay to add.
   const EventQueueTime delay_;
@@ -60,7 +92,10 @@ class Pipe : public EventConsumer, public PacketHandler {
   PacketHandler* other_end_;
 
   // The packets in flight.
-  std::deque<ServiceTimeAndPacket> queue_;
+  std::deque<InFlight> queue_;
+
+  // The train that is currently exiting the pipe.
+  PacketBatch train_;
 
   // The link this pipe is associated with.
   const net::GraphLink* graph_link_;
@@ -80,6 +115,12 @@ struct QueueStats {
   uint64_t bytes_dropped = 0;
 };
 
+// Registers the standard queue metrics, which are polled from 'stats'.
+// 'bits_seen_in_last_period' is reset every time the queue's rate metric is
+// polled.
+void AddQueueMetrics(const std::string& src, const std::string& dst,
+                     const QueueStats* stats, size_t* bits_seen_in_last_period);
+
 // A common interface for all queues.
 class Queue : public EventConsumer,
               public PacketHandler,
@@ -143,11 +184,28 @@ class FIFOQueue : public Queue {
 
   net::Bandwidth GetRate() const override { return rate_; }
 
+  // If 'epsilon' is not zero, every time a packet is drained the packets
+  // behind it that will finish draining within 'epsilon' are drained with it,
+  // and all of them are handed to the other end as a batch, at the time the
+  // first one is drained. This saves an event per packet when the queue is
+  // busy, at the cost of packets leaving the queue up to 'epsilon' early. The
+  // link is still busy for exactly as long as it takes to drain each packet,
+  // and packets that left early are counted in the queue's size until they
+  // would have been drained, so drop decisions are the same as without
+  // batching. The size is only updated when the queue handles a packet or an
+  // event, so stats read in between may include packets of the last batch
+  // for up to 'epsilon' longer. Zero by default.
+  void set_batch_epsilon(EventQueueTime epsilon) { batch_epsilon_ = epsilon; }
+
  protected:
   inline EventQueueTime PacketDrainTime(const Packet& pkt) {
     return EventQueueTime(time_per_bit_.Raw() * pkt.size_bytes() * 8);
   }
 
+  // Removes from the stats packets that left as part of a batch and would
+  // have finished draining by 'now'.
+  void ReleaseDrained(EventQueueTime now);
+
   // Queue capacity.
   const uint64_t max_size_bytes_;
 
@@ -163,6 +221,23 @@ class FIFOQueue : public Queue {
   // Keeps track of the amounts of time packets are waiting.
   SummaryStats time_waiting_;
 
+  // See set_batch_epsilon.
+  EventQueueTime batch_epsilon_;
+
+  // The time the last drained packet finishes draining. Only later than the
+  // current time if the packet left the queue early, as part of a batch.
+  EventQueueTime busy_until_;
+
+  // When the packet at the head of the queue finishes draining.
+  EventQueueTime drain_at_;
+
+  // Packets that left as part of a batch but are still draining: when each
+  // one finishes draining and its size.
+  std::deque<std::pair<EventQueueTime, uint32_t>> draining_;
+
+  // The packets that are drained together.
+  PacketBatch batch_;
+
   DISALLOW_COPY_AND_ASSIGN(FIFOQueue);
 };
 
@@ -0,0 +1,122 @@
+#include <stddef.h>
+#include <chrono>
+#include <iostream>
+#include <memory>
+#include <vector>
+
+#include "../common/common.h"
+#include "../common/event_queue.h"
+#include "../net/net_common.h"
+#include "packet.h"
+#include "queue.h"
+
+using namespace std::chrono;
+using namespace ncode;
+
+static constexpr size_t kHopCount = 4;
+static constexpr uint16_t kPacketSize = 1500;
+static constexpr uint64_t kRateBps = 10000000000;
+
+// Sends bursts of packets into a handler at a fixed rate.
+class PacketSource : public EventConsumer {
+ public:
+  PacketSource(bool pooled, size_t burst, EventQueueTime gap,
+               htsim::PacketHandler* out, EventQueue* event_queue)
+      : EventConsumer("Source", event_queue),
+        pooled_(pooled),
+        burst_(burst),
+        gap_(gap),
+        out_(out),
+        five_tuple_(net::IPAddress(1), net::IPAddress(2), net::kProtoUDP,
+                    net::AccessLayerPort(1), net::AccessLayerPort(2)),
+        packets_sent_(0) {
+    EnqueueIn(gap_);
+  }
+
+  void HandleEvent() override {
+    EventQueueTime now = event_queue()->CurrentTime();
+    for (size_t i = 0; i < burst_; ++i) {
+      htsim::PacketPtr pkt;
+      if (pooled_) {
+        pkt = htsim::UDPPacket::New(five_tuple_, kPacketSize, now);
+      } else {
+        pkt = make_unique<htsim::UDPPacket>(five_tuple_, kPacketSize, now);
+      }
+
+      ++packets_sent_;
+      out_->HandlePacket(std::move(pkt));
+    }
+    EnqueueIn(gap_);
+  }
+
+  uint64_t packets_sent() const { return packets_sent_; }
+
+ private:
+  bool pooled_;
+  size_t burst_;
+  EventQueueTime gap_;
+  htsim::PacketHandler* out_;
+  net::FiveTuple five_tuple_;
+  uint64_t packets_sent_;
+};
+
+// Runs packets through a chain of FIFOQueues and Pipes for one second of
+// simulated time and returns the number of packet hops per second of real
+// time. Packets are sent in bursts of 'burst' and queues drain packets that
+// are within 'batch_epsilon' of each other as a batch.
+static uint64_t PacketsPerSecond(bool pooled, size_t burst,
+                                 nanoseconds batch_epsilon) {
+  SimTimeEventQueue event_queue;
+  net::Bandwidth rate = net::Bandwidth::FromBitsPerSecond(kRateBps);
+  htsim::DummyPacketHandler sink;
+
+  std::vector<std::unique_ptr<htsim::FIFOQueue>> queues;
+  std::vector<std::unique_ptr<htsim::Pipe>> pipes;
+  htsim::PacketHandler* next = &sink;
+  for (size_t i = 0; i < kHopCount; ++i) {
+    std::string src = "N" + std::to_string(i);
+    std::string dst = "N" + std::to_string(i + 1);
+    pipes.emplace_back(make_unique<htsim::Pipe>(
+        src, dst, event_queue.ToTime(milliseconds(1)), &event_queue, false));
+    pipes.back()->Connect(next);
+    queues.emplace_back(make_unique<htsim::FIFOQueue>(
+        src, dst, rate, 1000000, &event_queue, false));
+    queues.back()->Connect(pipes.back().get());
+    queues.back()->set_batch_epsilon(event_queue.ToTime(batch_epsilon));
+    next = queues.back().get();
+  }
+
+  // Packets are sent slightly slower than the rate of the queues.
+  EventQueueTime gap = event_queue.ToTime(nanoseconds(1250)) * burst;
+  PacketSource source(pooled, burst, gap, next, &event_queue);
+
+  auto start = high_resolution_clock::now();
+  event_queue.RunAndStopIn(seconds(1));
+  auto end = high_resolution_clock::now();
+  uint64_t duration_ms = duration_cast<milliseconds>(end - start).count();
+  duration_ms = std::max<uint64_t>(duration_ms, 1);
+  return source.packets_sent() * kHopCount * 1000 / duration_ms;
+}
+
+int main(int argc, char** argv) {
+  Unused(argc);
+  Unused(argv);
+
+  std::cout << "TCP packet size " << sizeof(htsim::TCPPacket) << " bytes\n";
+  std::cout << "UDP packet size " << sizeof(htsim::UDPPacket) << " bytes\n";
+
+  // The pooled run goes second, so that it does not benefit from memory that
+  // the heap run has already touched.
+  nanoseconds no_batching(0);
+  uint64_t heap_pps = PacketsPerSecond(false, 1, no_batching);
+  uint64_t pooled_pps = PacketsPerSecond(true, 1, no_batching);
+  std::cout << "Heap " << heap_pps << " packets/sec\n";
+  std::cout << "Free list " << pooled_pps << " packets/sec\n";
+
+  // Bursts of 32 packets, each of which takes 1.2us to drain.
+  nanoseconds epsilon = microseconds(10);
+  uint64_t burst_pps = PacketsPerSecond(true, 32, no_batching);
+  uint64_t batched_pps = PacketsPerSecond(true, 32, epsilon);
+  std::cout << "Bursts " << burst_pps << " packets/sec\n";
+  std::cout << "Bursts, batched " << batched_pps << " packets/sec\n";
+}
@@ -0,0 +1,313 @@
+#include "queue.h"
+
+#include "gtest/gtest.h"
+
+namespace ncode {
+namespace htsim {
+namespace {
+
+using namespace std::chrono;
+
+// Each packet takes 12ms to drain at this rate.
+static constexpr uint64_t kRateBps = 1000000;
+static constexpr uint16_t kPacketSize = 1500;
+
+static PacketPtr NewPacket(uint32_t id) {
+  net::FiveTuple five_tuple(net::IPAddress(1), net::IPAddress(2),
+                            net::kProtoUDP, net::AccessLayerPort(id),
+                            net::AccessLayerPort(2));
+  return make_unique<UDPPacket>(five_tuple, kPacketSize,
+                                EventQueueTime::ZeroTime());
+}
+
+// Records when packets arrive and how many arrive at once.
+class Recorder : public PacketHandler {
+ public:
+  struct Arrival {
+    uint64_t at_ms;
+    size_t packet_count;
+    bool as_batch;
+
+    // When each packet would have arrived on its own.
+    std::vector<uint64_t> packet_at_ms;
+  };
+
+  explicit Recorder(EventQueue* event_queue) : event_queue_(event_queue) {}
+
+  void HandlePacket(PacketPtr pkt) override {
+    Record(*pkt);
+    arrivals_.push_back({Now(), 1, false, {Now()}});
+  }
+
+  void HandlePacketBatch(PacketBatch* packets) override {
+    std::vector<uint64_t> packet_at_ms;
+    for (size_t i = 0; i < packets->size(); ++i) {
+      Record(*packets->packet(i));
+      packet_at_ms.emplace_back(event_queue_->TimeToRawMillis(packets->at(i)));
+    }
+    arrivals_.push_back({Now(), packets->size(), true, packet_at_ms});
+    packets->clear();
+  }
+
+  const std::vector<Arrival>& arrivals() const { return arrivals_; }
+
+  const std::vector<uint16_t>& src_ports() const { return src_ports_; }
+
+ private:
+  uint64_t Now() const {
+    return event_queue_->TimeToRawMillis(event_queue_->CurrentTime());
+  }
+
+  void Record(const Packet& pkt) {
+    src_ports_.push_back(pkt.five_tuple().src_port().Raw());
+  }
+
+  EventQueue* event_queue_;
+  std::vector<Arrival> arrivals_;
+  std::vector<uint16_t> src_ports_;
+};
+
+// Sends a packet to a handler at a given time.
+class SendAt : public EventConsumer {
+ public:
+  SendAt(EventQueueTime at, uint32_t id, PacketHandler* out,
+         EventQueue* event_queue)
+      : EventConsumer("SendAt", event_queue), id_(id), out_(out) {
+    EnqueueAt(at);
+  }
+
+  void HandleEvent() override { out_->HandlePacket(NewPacket(id_)); }
+
+ private:
+  uint32_t id_;
+  PacketHandler* out_;
+};
+
+class FIFOQueueTest : public ::testing::Test {
+ protected:
+  FIFOQueueTest()
+      : recorder_(&event_queue_),
+        queue_("A", "B", net::Bandwidth::FromBitsPerSecond(kRateBps), 1000000,
+               &event_queue_, false) {
+    queue_.Connect(&recorder_);
+  }
+
+  void AddPackets(size_t count) {
+    for (size_t i = 0; i < count; ++i) {
+      queue_.HandlePacket(NewPacket(i + 1));
+    }
+  }
+
+  SimTimeEventQueue event_queue_;
+  Recorder recorder_;
+  FIFOQueue queue_;
+};
+
+TEST_F(FIFOQueueTest, NoBatching) {
+  AddPackets(10);
+  event_queue_.RunAndStopIn(seconds(1));
+
+  ASSERT_EQ(10ul, recorder_.arrivals().size());
+  for (size_t i = 0; i < 10; ++i) {
+    ASSERT_EQ(12 * (i + 1), recorder_.arrivals()[i].at_ms);
+    ASSERT_FALSE(recorder_.arrivals()[i].as_batch);
+  }
+}
+
+TEST_F(FIFOQueueTest, Batching) {
+  queue_.set_batch_epsilon(event_queue_.ToTime(milliseconds(36)));
+  AddPackets(10);
+  event_queue_.RunAndStopIn(seconds(1));
+
+  // Packets that finish draining at 24, 36 and 48ms leave with the one that
+  // finishes at 12ms.
+  const std::vector<Recorder::Arrival>& arrivals = recorder_.arrivals();
+  ASSERT_EQ(3ul, arrivals.size());
+  ASSERT_EQ(12ul, arrivals[0].at_ms);
+  ASSERT_EQ(4ul, arrivals[0].packet_count);
+  std::vector<uint64_t> model_at_ms = {12, 24, 36, 48};
+  ASSERT_EQ(model_at_ms, arrivals[0].packet_at_ms);
+  ASSERT_EQ(60ul, arrivals[1].at_ms);
+  ASSERT_EQ(4ul, arrivals[1].packet_count);
+  ASSERT_EQ(108ul, arrivals[2].at_ms);
+  ASSERT_EQ(2ul, arrivals[2].packet_count);
+  ASSERT_TRUE(arrivals[2].as_batch);
+
+  std::vector<uint16_t> model = {1, 2, 3, 4, 5, 6, 7, 8, 9, 10};
+  ASSERT_EQ(model, recorder_.src_ports());
+  ASSERT_EQ(0ul, queue_.GetStats().queue_size_pkts);
+  ASSERT_EQ(0ul, queue_.GetStats().queue_size_bytes);
+  ASSERT_EQ(10ul, queue_.GetStats().pkts_seen);
+}
+
+TEST_F(FIFOQueueTest, BatchingSinglePacket) {
+  queue_.set_batch_epsilon(event_queue_.ToTime(milliseconds(5)));
+  AddPackets(3);
+  event_queue_.RunAndStopIn(seconds(1));
+
+  ASSERT_EQ(3ul, recorder_.arrivals().size());
+  for (size_t i = 0; i < 3; ++i) {
+    ASSERT_EQ(12 * (i + 1), recorder_.arrivals()[i].at_ms);
+    ASSERT_FALSE(recorder_.arrivals()[i].as_batch);
+  }
+}
+
+// A packet that arrives after a batch has left, but before the link would
+// have finished draining it, waits for the link.
+TEST_F(FIFOQueueTest, BatchingLinkBusy) {
+  queue_.set_batch_epsilon(event_queue_.ToTime(milliseconds(36)));
+  AddPackets(2);
+  SendAt send_at(event_queue_.ToTime(milliseconds(15)), 3, &queue_,
+                 &event_queue_);
+  event_queue_.RunAndStopIn(seconds(1));
+
+  const std::vector<Recorder::Arrival>& arrivals = recorder_.arrivals();
+  ASSERT_EQ(2ul, arrivals.size());
+  ASSERT_EQ(12ul, arrivals[0].at_ms);
+  ASSERT_EQ(2ul, arrivals[0].packet_count);
+  ASSERT_EQ(36ul, arrivals[1].at_ms);
+  ASSERT_EQ(1ul, arrivals[1].packet_count);
+}
+
+// Sends packets to a queue periodically and records the size of the queue
+// after each one.
+class PeriodicSender : public EventConsumer {
+ public:
+  PeriodicSender(EventQueueTime start, EventQueueTime period, size_t count,
+                 FIFOQueue* queue, EventQueue* event_queue)
+      : EventConsumer("PeriodicSender", event_queue),
+        period_(period),
+        count_(count),
+        queue_(queue) {
+    EnqueueAt(start);
+  }
+
+  void HandleEvent() override {
+    queue_->HandlePacket(NewPacket(queue_sizes_.size() + 1));
+    queue_sizes_.emplace_back(queue_->GetStats().queue_size_bytes);
+    if (queue_sizes_.size() < count_) {
+      EnqueueIn(period_);
+    }
+  }
+
+  const std::vector<uint64_t>& queue_sizes() const { return queue_sizes_; }
+
+ private:
+  EventQueueTime period_;
+  size_t count_;
+  FIFOQueue* queue_;
+  std::vector<uint64_t> queue_sizes_;
+};
+
+struct FullQueueResult {
+  QueueStats stats;
+  std::vector<uint64_t> queue_sizes;
+  std::vector<uint16_t> src_ports;
+};
+
+// Sends packets faster than a queue that fits 4 packets can drain them.
+static FullQueueResult RunFullQueue(uint64_t batch_epsilon_ms) {
+  SimTimeEventQueue event_queue;
+  Recorder recorder(&event_queue);
+  FIFOQueue queue("A", "B", net::Bandwidth::FromBitsPerSecond(kRateBps),
+                  4 * kPacketSize, &event_queue, false);
+  queue.Connect(&recorder);
+  queue.set_batch_epsilon(event_queue.ToTime(milliseconds(batch_epsilon_ms)));
+
+  // Packets do not arrive at the same time as others finish draining.
+  PeriodicSender sender(event_queue.ToTime(microseconds(500)),
+                        event_queue.ToTime(microseconds(5300)), 100, &queue,
+                        &event_queue);
+  event_queue.RunAndStopIn(seconds(10));
+  return {queue.GetStats(), sender.queue_sizes(), recorder.src_ports()};
+}
+
+// Packets that leave as part of a batch count towards the size of the queue
+// until they would have been drained, so the same packets are dropped.
+TEST(FIFOQueueFullTest, BatchingSameDrops) {
+  FullQueueResult no_batching = RunFullQueue(0);
+  FullQueueResult batching = RunFullQueue(36);
+
+  ASSERT_LT(0ul, no_batching.stats.pkts_dropped);
+  ASSERT_EQ(no_batching.stats.pkts_dropped, batching.stats.pkts_dropped);
+  ASSERT_EQ(no_batching.stats.bytes_dropped, batching.stats.bytes_dropped);
+  ASSERT_EQ(no_batching.stats.pkts_seen, batching.stats.pkts_seen);
+  ASSERT_EQ(no_batching.queue_sizes, batching.queue_sizes);
+  ASSERT_EQ(no_batching.src_ports, batching.src_ports);
+  ASSERT_EQ(0ul, batching.stats.queue_size_bytes);
+  ASSERT_EQ(0ul, batching.stats.queue_size_pkts);
+}
+
+class PipeTest : public ::testing::Test {
+ protected:
+  PipeTest()
+      : recorder_(&event_queue_),
+        pipe_("A", "B", event_queue_.ToTime(milliseconds(10)), &event_queue_,
+              false) {
+    pipe_.Connect(&recorder_);
+  }
+
+  SimTimeEventQueue event_queue_;
+  Recorder recorder_;
+  Pipe pipe_;
+};
+
+TEST_F(PipeTest, Train) {
+  PacketBatch batch;
+  for (size_t i = 0; i < 3; ++i) {
+    batch.Add(NewPacket(i + 1), EventQueueTime::ZeroTime());
+  }
+  pipe_.HandlePacketBatch(&batch);
+  ASSERT_TRUE(batch.empty());
+  ASSERT_EQ(3ul, pipe_.GetStats().pkts_in_flight);
+
+  pipe_.HandlePacket(NewPacket(4));
+  batch.Add(NewPacket(5), EventQueueTime::ZeroTime());
+  pipe_.HandlePacketBatch(&batch);
+  event_queue_.RunAndStopIn(seconds(1));
+
+  const std::vector<Recorder::Arrival>& arrivals = recorder_.arrivals();
+  ASSERT_EQ(3ul, arrivals.size());
+  ASSERT_EQ(10ul, arrivals[0].at_ms);
+  ASSERT_EQ(3ul, arrivals[0].packet_count);
+  ASSERT_TRUE(arrivals[0].as_batch);
+  ASSERT_FALSE(arrivals[1].as_batch);
+  ASSERT_FALSE(arrivals[2].as_batch);
+
+  std::vector<uint16_t> model = {1, 2, 3, 4, 5};
+  ASSERT_EQ(model, recorder_.src_ports());
+  ASSERT_EQ(5ul, pipe_.GetStats().pkts_tx);
+  ASSERT_EQ(5ul * kPacketSize, pipe_.GetStats().bytes_tx);
+  ASSERT_EQ(0ul, pipe_.GetStats().pkts_in_flight);
+}
+
+// Batches from a queue travel through a pipe as trains.
+TEST(QueueAndPipeTest, Trains) {
+  SimTimeEventQueue event_queue;
+  Recorder recorder(&event_queue);
+  Pipe pipe("A", "B", event_queue.ToTime(milliseconds(10)), &event_queue,
+            false);
+  FIFOQueue queue("A", "B", net::Bandwidth::FromBitsPerSecond(kRateBps),
+                  1000000, &event_queue, false);
+  queue.Connect(&pipe);
+  pipe.Connect(&recorder);
+  queue.set_batch_epsilon(event_queue.ToTime(milliseconds(36)));
+  for (size_t i = 0; i < 10; ++i) {
+    queue.HandlePacket(NewPacket(i + 1));
+  }
+  event_queue.RunAndStopIn(seconds(1));
+
+  const std::vector<Recorder::Arrival>& arrivals = recorder.arrivals();
+  ASSERT_EQ(3ul, arrivals.size());
+  ASSERT_EQ(22ul, arrivals[0].at_ms);
+  ASSERT_EQ(4ul, arrivals[0].packet_count);
+  std::vector<uint64_t> model_at_ms = {22, 34, 46, 58};
+  ASSERT_EQ(model_at_ms, arrivals[0].packet_at_ms);
+  ASSERT_EQ(70ul, arrivals[1].at_ms);
+  ASSERT_EQ(118ul, arrivals[2].at_ms);
+  ASSERT_EQ(10ul, pipe.GetStats().pkts_tx);
+}
+
+}  // namespace
+}  // namespace htsim
+}  // namespace ncode
@@ -84,6 +84,81 @@ static auto* kTCPSinkBytesRx =
 // Size of an ACK packet.
 static constexpr size_t kAckSize = 40;
 
+// Size of the kind and length fields of the SACK option.
+static constexpr size_t kSackOptionHeaderSize = 2;
+
+std::vector<SackBlock>::const_iterator TCPScoreboard::FirstEndingAfter(
+    uint64_t seq) const {
+  return std::upper_bound(
+      ranges_.begin(), ranges_.end(), seq,
+      [](uint64_t value, const SackBlock& range) { return value < range.end; });
+}
+
+void TCPScoreboard::Add(uint64_t start, uint64_t end) {
+  if (start >= end) {
+    return;
+  }
+
+  // The first range that overlaps or is adjacent to the new one.
+  auto first = std::lower_bound(
+      ranges_.begin(), ranges_.end(), start,
+      [](const SackBlock& range, uint64_t value) { return range.end < value; });
+  auto last = first;
+  while (last != ranges_.end() && last->start <= end) {
+    start = std::min(start, last->start);
+    end = std::max(end, last->end);
+    ++last;
+  }
+
+  if (first == last) {
+    ranges_.insert(first, {start, end});
+    return;
+  }
+
+  *first = {start, end};
+  ranges_.erase(first + 1, last);
+}
+
+uint64_t TCPScoreboard::Advance(uint64_t seq) {
+  auto it = ranges_.erase(ranges_.cbegin(), FirstEndingAfter(seq));
+  if (it != ranges_.end() && it->start <= seq) {
+    seq = it->end;
+    ranges_.erase(it);
+  }
+
+  return seq;
+}
+
+uint64_t TCPScoreboard::NextMissing(uint64_t seq) const {
+  auto it = FirstEndingAfter(seq);
+  if (it != ranges_.end() && it->start <= seq) {
+    return it->end;
+  }
+
+  return seq;
+}
+
+uint64_t TCPScoreboard::NextPresent(uint64_t seq) const {
+  auto it = FirstEndingAfter(seq);
+  if (it == ranges_.end()) {
+    return std::numeric_limits<uint64_t>::max();
+  }
+
+  return std::max(seq, it->start);
+}
+
+bool TCPScoreboard::Contains(uint64_t seq) const {
+  auto it = FirstEndingAfter(seq);
+  return it != ranges_.end() && it->start <= seq;
+}
+
+const SackBlock& TCPScoreboard::RangeContaining(uint64_t seq) const {
+  auto it = FirstEndingAfter(seq);
+  CHECK(it != ranges_.end() && it->start <= seq) << "No range contains "
+                                                  << seq;
+  return *it;
+}
+
 TCPSource::TCPSource(const std::string& id, const net::FiveTuple& five_tuple,
                      uint16_t mss, uint32_t maxcwnd, PacketHandler* out,
                      EventQueue* event_queue, bool important)
@@ -91,7 +166,9 @@ TCPSource::TCPSource(const std::string& id, const net::FiveTuple& five_tuple,
       mss_(mss),
       maxcwnd_(maxcwnd),
       fast_retx_metric_(nullptr),
-      retx_timeout_metric_(nullptr) {
+      retx_timeout_metric_(nullptr),
+      rtx_timer_(nullptr),
+      rtx_timer_index_(0) {
   AddMetrics(important);
   Close();
 }
@@ -112,6 +189,8 @@ void TCPSource::Close() {
   sawtooth_ = 0;
   recoverq_ = 0;
   in_fast_recovery_ = false;
+  sacked_.Clear();
+  retx_next_ = 0;
   send_buffer_ = 0;
   rto_ = event_queue_->ToTime(seconds(1)).Raw();
 }
@@ -158,9 +237,13 @@ void TCPSource::ReceivePacket(PacketPtr pkt) {
   // The packet must be a TCP ack. We only know how to handle ACKs (all flows
   // are unidirectional).
   const TCPPacket* ack_packet = static_cast<const TCPPacket*>(pkt.get());
+  HandleAck(*ack_packet);
+  UpdateRtxTimer();
+}
 
-  uint64_t seqno = ack_packet->sequence().Raw();
-  EventQueueTime time_ack_sent = ack_packet->time_sent();
+void TCPSource::HandleAck(const TCPPacket& ack_packet) {
+  uint64_t seqno = ack_packet.sequence().Raw();
+  EventQueueTime time_ack_sent = ack_packet.time_sent();
   if (time_ack_sent < first_sent_time_) {
     // Ignore the ACK.
     return;
@@ -171,6 +254,9 @@ void TCPSource::ReceivePacket(PacketPtr pkt) {
     seqno = last_acked_;
   }
 
+  ProcessSackBlocks(ack_packet);
+  sacked_.Advance(seqno + 1);
+
   // Compute RTT
   int64_t m = (event_queue_->CurrentTime() - time_ack_sent).Raw();
   if (m != 0) {
@@ -247,8 +333,14 @@ void TCPSource::ReceivePacket(PacketPtr pkt) {
 
     cwnd_ += mss_;
 
-    RetransmitPacket();
-    fast_retx_metric_->AddValue(last_acked_ + 1);
+    // The next unacked packet may have already been retransmitted because of
+    // SACK information.
+    if (last_acked_ + 1 >= retx_next_) {
+      RetransmitPacket(last_acked_ + 1);
+      fast_retx_metric_->AddValue(last_acked_ + 1);
+    } else {
+      RetransmitNextHole();
+    }
 
     SendPackets();
     return;
@@ -256,6 +348,12 @@ void TCPSource::ReceivePacket(PacketPtr pkt) {
 
   // It's a dup ack
   if (in_fast_recovery_) {
+    // Each dup ack means a packet has left the network. If the sink has
+    // reported more holes they are retransmitted first.
+    if (RetransmitNextHole()) {
+      return;
+    }
+
     // Still in fast recovery; hopefully the prodigal ACK is on it's way.
     cwnd_ += mss_;
     if (cwnd_ > maxcwnd_) {
@@ -293,7 +391,8 @@ void TCPSource::ReceivePacket(PacketPtr pkt) {
 
   //  std::cout << "fast retx " << (last_acked_ + 1) << "\n";
 
-  RetransmitPacket();
+  retx_next_ = last_acked_ + 1;
+  RetransmitPacket(last_acked_ + 1);
   fast_retx_metric_->AddValue(last_acked_ + 1);
 
   cwnd_ = ssthresh_ + 3 * mss_;
@@ -359,6 +458,8 @@ void TCPSource::RtxTimerHook(EventQueueTime now) {
   }
 
   if (now.Raw() <= last_sent_time_.Raw() + rto_) {
+    // The RTO has changed since the timer was armed.
+    UpdateRtxTimer();
     return;
   }
 
@@ -390,19 +491,87 @@ void TCPSource::RtxTimerHook(EventQueueTime now) {
   highest_seqno_sent_ = last_acked_ + mss_;
   dupacks_ = 0;
 
-  RetransmitPacket();
+  // The sink may have discarded out of order data, will not rely on it.
+  sacked_.Clear();
+  retx_next_ = 0;
+
+  RetransmitPacket(last_acked_ + 1);
   retx_timeout_metric_->AddValue(last_acked_ + 1);
+  UpdateRtxTimer();
+}
+
+void TCPSource::set_rtx_timer(TCPRtxTimer* rtx_timer, uint32_t index) {
+  rtx_timer_ = rtx_timer;
+  rtx_timer_index_ = index;
+  UpdateRtxTimer();
 }
 
-void TCPSource::RetransmitPacket() {
+void TCPSource::UpdateRtxTimer() {
+  if (rtx_timer_ == nullptr) {
+    return;
+  }
+
+  if (highest_seqno_sent_ == 0) {
+    rtx_timer_->Disarm(rtx_timer_index_);
+    return;
+  }
+
+  if (last_acked_ >= highest_seqno_sent_real_) {
+    // Nothing to retransmit, but the hook still has to be called if someone
+    // is waiting for the send buffer to drain.
+    if (on_send_buffer_drained_) {
+      rtx_timer_->Arm(rtx_timer_index_, event_queue_->CurrentTime());
+    } else {
+      rtx_timer_->Disarm(rtx_timer_index_);
+    }
+
+    return;
+  }
+
+  // RtxTimerHook only retransmits if strictly more than the RTO has passed.
+  rtx_timer_->Arm(rtx_timer_index_,
+                  EventQueueTime(last_sent_time_.Raw() + rto_ + 1));
+}
+
+void TCPSource::RetransmitPacket(uint64_t seqno) {
+  uint64_t size = mss_;
+  uint64_t next_sacked = sacked_.NextPresent(seqno);
+  if (next_sacked > seqno) {
+    size = std::min(size, next_sacked - seqno);
+  }
+
   EventQueueTime now = event_queue_->CurrentTime();
-  auto pkt_ptr =
-      make_unique<TCPPacket>(five_tuple_, mss_, now, SeqNum(last_acked_ + 1));
+  auto pkt_ptr = TCPPacket::New(five_tuple_, size, now, SeqNum(seqno));
+  retx_next_ = std::max(retx_next_, seqno + size);
 
   last_sent_time_ = now;
   SendPacket(std::move(pkt_ptr));
 }
 
+bool TCPSource::RetransmitNextHole() {
+  uint64_t hole = sacked_.NextMissing(std::max(retx_next_, last_acked_ + 1));
+  if (hole >= sacked_.HighestEnd()) {
+    return false;
+  }
+
+  RetransmitPacket(hole);
+  fast_retx_metric_->AddValue(hole);
+  return true;
+}
+
+void TCPSource::ProcessSackBlocks(const TCPPacket& ack_packet) {
+  if (ack_packet.sack_block_count() == 0) {
+    return;
+  }
+
+  const TCPSackPacket& sack_packet =
+      static_cast<const TCPSackPacket&>(ack_packet);
+  for (size_t i = 0; i < sack_packet.sack_block_count(); ++i) {
+    const SackBlock& block = sack_packet.sack_block(i);
+    sacked_.Add(block.start, block.end);
+  }
+}
+
 void TCPSource::SendPackets() {
   if (last_acked_ >= highest_seqno_sent_real_ && send_buffer_ == 0 &&
       on_send_buffer_drained_) {
@@ -423,8 +592,8 @@ void TCPSource::SendPackets() {
     }
 
     size_t to_tx = std::min(static_cast<uint64_t>(mss_), send_buffer_);
-    auto pkt_ptr = make_unique<TCPPacket>(five_tuple_, to_tx, now,
-                                          SeqNum(highest_seqno_sent_ + 1));
+    auto pkt_ptr = TCPPacket::New(five_tuple_, to_tx, now,
+                                  SeqNum(highest_seqno_sent_ + 1));
 
     send_buffer_ -= to_tx;
     highest_seqno_sent_ += to_tx;  // XX beware wrapping
@@ -454,32 +623,210 @@ void TCPSource::AddData(uint64_t bytes) {
   }
 
   SendPackets();
+  UpdateRtxTimer();
 }
 
-TCPRtxTimer::TCPRtxTimer(const std::string& id, EventQueueTime scan_period,
+constexpr size_t TCPRtxTimer::kLevelCount;
+constexpr size_t TCPRtxTimer::kSlotCount;
+constexpr uint32_t TCPRtxTimer::kNoTimer;
+constexpr uint64_t TCPRtxTimer::kNoTick;
+
+TCPRtxTimer::TCPRtxTimer(const std::string& id, EventQueueTime tick,
                          EventQueue* event_queue)
     : SimComponent(id, event_queue),
       EventConsumer(id, event_queue),
-      scan_period_(scan_period) {}
+      tick_(tick),
+      scheduled_at_(EventQueueTime::MaxTime()),
+      armed_count_(0),
+      fired_count_(0) {
+  CHECK(tick_ > EventQueueTime::ZeroTime()) << "Zero tick";
+  current_tick_ = event_queue_->CurrentTime().Raw() / tick_.Raw();
+}
 
-void TCPRtxTimer::HandleEvent() {
+void TCPRtxTimer::RegisterTCPSource(TCPSource* tcp_source) {
+  if (FLAGS_disable_tcp_retx_timer) {
+    return;
+  }
+
+  CHECK(timers_.size() < kNoTimer) << "Too many TCP sources";
+  uint32_t index = timers_.size();
+  timers_.emplace_back(tcp_source);
+  tcp_source->set_rtx_timer(this, index);
+}
+
+void TCPRtxTimer::Arm(uint32_t index, EventQueueTime at) {
+  DCHECK(index < timers_.size());
+  Timer& timer = timers_[index];
+  if (armed_count_ == 0) {
+    // Nothing in the wheel, can skip ahead.
+    uint64_t now_tick = event_queue_->CurrentTime().Raw() / tick_.Raw();
+    current_tick_ = std::max(current_tick_, now_tick);
+  }
+
+  uint64_t tick = (at.Raw() + tick_.Raw() - 1) / tick_.Raw();
+  tick = std::max(tick, current_tick_ + 1);
+  if (timer.tick == tick) {
+    return;
+  }
+
+  if (timer.armed()) {
+    Unlink(index);
+  } else {
+    ++armed_count_;
+  }
+
+  timer.tick = tick;
+  Link(index);
+
+  EventQueueTime fire_at = std::max(EventQueueTime(tick * tick_.Raw()),
+                                    event_queue_->CurrentTime());
+  if (fire_at < scheduled_at_) {
+    scheduled_at_ = fire_at;
+    EnqueueAt(fire_at);
+  }
+}
+
+void TCPRtxTimer::Disarm(uint32_t index) {
+  DCHECK(index < timers_.size());
+  Timer& timer = timers_[index];
+  if (!timer.armed()) {
+    return;
+  }
+
+  Unlink(index);
+  timer.tick = kNoTick;
+  --armed_count_;
+}
+
+void TCPRtxTimer::Link(uint32_t index) {
+  Timer& timer = timers_[index];
+  size_t level_index = TimingWheelLevel(timer.tick, current_tick_);
+  size_t slot_index = TimingWheelSlot(timer.tick, level_index);
+  timer.level = level_index;
+  timer.slot = slot_index;
+
+  Level& level = levels_[level_index];
+  uint32_t& head = level.heads[slot_index];
+  timer.prev = kNoTimer;
+  timer.next = head;
+  if (head != kNoTimer) {
+    timers_[head].prev = index;
+  } else {
+    level.occupied.Set(slot_index);
+  }
+  head = index;
+}
+
+void TCPRtxTimer::Unlink(uint32_t index) {
+  Timer& timer = timers_[index];
+  Level& level = levels_[timer.level];
+  if (timer.prev != kNoTimer) {
+    timers_[timer.prev].next = timer.next;
+  } else {
+    level.heads[timer.slot] = timer.next;
+    if (timer.next == kNoTimer) {
+      level.occupied.Clear(timer.slot);
+    }
+  }
+
+  if (timer.next != kNoTimer) {
+    timers_[timer.next].prev = timer.prev;
+  }
+}
+
+uint64_t TCPRtxTimer::NextTick() const {
+  if (armed_count_ == 0) {
+    return kNoTick;
+  }
+
+  // Timers in a level are all in slots after the current tick's byte at that
+  // level, and all timers in a level are before those in higher levels.
+  for (size_t level_index = 0; level_index < kLevelCount; ++level_index) {
+    const Level& level = levels_[level_index];
+    size_t slot = level.occupied.FirstSet(0);
+    if (slot == kSlotCount) {
+      continue;
+    }
+
+    size_t shift = 8 * level_index;
+    uint64_t high_mask = shift + 8 == 64 ? 0 : ~0ull << (shift + 8);
+    return (current_tick_ & high_mask) | (static_cast<uint64_t>(slot) << shift);
+  }
+
+  LOG(FATAL) << "Armed timers not in wheel";
+  return kNoTick;
+}
+
+void TCPRtxTimer::ProcessTick(uint64_t tick) {
+  DCHECK(tick > current_tick_);
+  current_tick_ = tick;
+
+  // Timers in the slot for this tick in higher levels move down.
+  for (size_t level_index = kLevelCount - 1; level_index > 0; --level_index) {
+    size_t shift = 8 * level_index;
+    if ((tick & ((1ull << shift) - 1)) != 0) {
+      continue;
+    }
+
+    Level& level = levels_[level_index];
+    size_t slot_index = TimingWheelSlot(tick, level_index);
+    uint32_t index = level.heads[slot_index];
+    level.heads[slot_index] = kNoTimer;
+    level.occupied.Clear(slot_index);
+    while (index != kNoTimer) {
+      uint32_t next = timers_[index].next;
+      Link(index);
+      index = next;
+    }
+  }
+
+  // All timers left in the lowest level's slot fire now. The hook may re-arm
+  // the timer, but always for a later tick.
   EventQueueTime now = event_queue_->CurrentTime();
-  for (const auto& tcp_ptr : tcp_sources_) {
-    tcp_ptr->RtxTimerHook(now);
+  Level& level = levels_[0];
+  size_t slot_index = TimingWheelSlot(tick, 0);
+  while (level.heads[slot_index] != kNoTimer) {
+    uint32_t index = level.heads[slot_index];
+    DCHECK(timers_[index].tick == tick);
+    Disarm(index);
+    ++fired_count_;
+    timers_[index].tcp_source->RtxTimerHook(now);
   }
+}
 
-  EnqueueIn(scan_period_);
+void TCPRtxTimer::Schedule() {
+  uint64_t next_tick = NextTick();
+  if (next_tick == kNoTick) {
+    return;
+  }
+
+  EventQueueTime fire_at = std::max(EventQueueTime(next_tick * tick_.Raw()),
+                                    event_queue_->CurrentTime());
+  if (fire_at < scheduled_at_) {
+    scheduled_at_ = fire_at;
+    EnqueueAt(fire_at);
+  }
 }
 
-void TCPRtxTimer::RegisterTCPSource(TCPSource* tcp_source) {
-  if (FLAGS_disable_tcp_retx_timer) {
+void TCPRtxTimer::HandleEvent() {
+  EventQueueTime now = event_queue_->CurrentTime();
+  if (now != scheduled_at_) {
+    // Superseded by an event for an earlier tick.
     return;
   }
 
-  tcp_sources_.emplace_back(tcp_source);
-  if (tcp_sources_.size() == 1) {
-    EnqueueIn(scan_period_);
+  uint64_t now_tick = now.Raw() / tick_.Raw();
+  while (true) {
+    uint64_t next_tick = NextTick();
+    if (next_tick == kNoTick || next_tick > now_tick) {
+      break;
+    }
+
+    ProcessTick(next_tick);
   }
+
+  scheduled_at_ = EventQueueTime::MaxTime();
+  Schedule();
 }
 
 void TCPSink::AddMetrics() {
@@ -491,7 +838,7 @@ void TCPSink::AddMetrics() {
 void TCPSink::Reset() {
   cumulative_ack_ = 0;
   last_seen_incoming_tag_ = PacketTag::Max();
-  received_.clear();
+  received_.Clear();
 }
 
 void TCPSink::ReceivePacket(PacketPtr pkt) {
@@ -513,36 +860,48 @@ void TCPSink::ReceivePacket(PacketPtr pkt) {
   }
 
   if (seqno == cumulative_ack_ + 1) {  // it's the next expected seq no
-    cumulative_ack_ = seqno + size_bytes - 1;
-    // are there any additional received packets we can now ack?
-    while (!received_.empty() && (received_.front() == cumulative_ack_ + 1)) {
-      received_.pop_front();
-      cumulative_ack_ += size_bytes;
-    }
-  } else if (seqno < cumulative_ack_ + 1) {
-  }       // must have been a bad retransmit
-  else {  // it's not the next expected sequence number
-    if (received_.empty()) {
-      received_.push_front(seqno);
-    } else if (seqno > received_.back()) {  // likely case
-      received_.push_back(seqno);
-    } else {  // uncommon case - it fills a hole
-      for (auto it = received_.begin(); it != received_.end(); ++it) {
-        if (seqno == (*it)) break;  // it's a bad retransmit
-        if (seqno < (*it)) {
-          received_.insert(it, seqno);
-          break;
-        }
-      }
-    }
+    // Any data received out of order that is now contiguous is acked too.
+    cumulative_ack_ = received_.Advance(seqno + size_bytes) - 1;
+  } else if (seqno > cumulative_ack_ + 1) {
+    // It's not the next expected sequence number.
+    received_.Add(seqno, seqno + size_bytes);
   }
+  // Otherwise it must have been a bad retransmit.
 
-  SendAck(pkt->time_sent());
+  SendAck(pkt->time_sent(), seqno);
 }
 
-void TCPSink::SendAck(EventQueueTime time_sent) {
-  auto pkt_ptr = make_unique<TCPPacket>(five_tuple_, kAckSize, time_sent,
-                                        SeqNum(cumulative_ack_));
+void TCPSink::SendAck(EventQueueTime time_sent, uint64_t last_seqno) {
+  if (received_.empty()) {
+    auto pkt_ptr = TCPPacket::New(five_tuple_, kAckSize, time_sent,
+                                  SeqNum(cumulative_ack_));
+    SendPacket(std::move(pkt_ptr));
+    return;
+  }
+
+  // As in RFC 2018 the first block is the one with the most recent data, the
+  // rest are the ones closest to the cumulative ACK.
+  sack_blocks_.clear();
+  if (received_.Contains(last_seqno)) {
+    sack_blocks_.emplace_back(received_.RangeContaining(last_seqno));
+  }
+
+  for (const SackBlock& range : received_.ranges()) {
+    if (sack_blocks_.size() == TCPSackPacket::kMaxSackBlocks) {
+      break;
+    }
+
+    if (!sack_blocks_.empty() && range.start == sack_blocks_.front().start) {
+      continue;
+    }
+
+    sack_blocks_.emplace_back(range);
+  }
+
+  size_t size = kAckSize + kSackOptionHeaderSize +
+                TCPSackPacket::kSackBlockBytes * sack_blocks_.size();
+  auto pkt_ptr = TCPSackPacket::New(five_tuple_, size, time_sent,
+                                    SeqNum(cumulative_ack_), sack_blocks_);
   SendPacket(std::move(pkt_ptr));
 }
 
@@ -1,21 +1,73 @@
 #ifndef NCODE_HTSIM_TCP_H
 #define NCODE_HTSIM_TCP_H
 
+#include <algorithm>
 #include <cstdint>
 #include <iostream>
-#include <list>
+#include <limits>
 #include <memory>
 #include <stdexcept>
 #include <vector>
 
 #include "../common/common.h"
 #include "../common/logging.h"
+#include "../common/timing_wheel.h"
 #include "../metrics/metrics.h"
 #include "packet.h"
 
 namespace ncode {
 namespace htsim {
 
+class TCPRtxTimer;
+
+// A set of sequence number ranges, kept sorted. Overlapping and adjacent
+// ranges are merged. Used by the sink to keep track of data received out of
+// order and by the source to keep track of data that has been selectively
+// acked. There is usually only a handful of ranges, one per hole in the
+// sequence space, so insertions are a binary search and a short move.
+class TCPScoreboard {
+ public:
+  // Adds the range [start, end).
+  void Add(uint64_t start, uint64_t end);
+
+  // Removes all sequence numbers below 'seq'. If a range starts at or before
+  // 'seq' it is removed and its end returned, otherwise returns 'seq'. Can be
+  // used to advance the cumulative ACK.
+  uint64_t Advance(uint64_t seq);
+
+  // Returns the first sequence number at or after 'seq' that is not in the
+  // set.
+  uint64_t NextMissing(uint64_t seq) const;
+
+  // Returns the first sequence number at or after 'seq' that is in the set,
+  // or uint64_t max if there is none.
+  uint64_t NextPresent(uint64_t seq) const;
+
+  // Returns the range that contains 'seq'. Should only be called if there is
+  // such a range.
+  const SackBlock& RangeContaining(uint64_t seq) const;
+
+  // Whether 'seq' is in any of the ranges.
+  bool Contains(uint64_t seq) const;
+
+  // Returns the end of the last range, or 0 if empty.
+  uint64_t HighestEnd() const {
+    return ranges_.empty() ? 0 : ranges_.back().end;
+  }
+
+  const std::vector<SackBlock>& ranges() const { return ranges_; }
+
+  bool empty() const { return ranges_.empty(); }
+
+  void Clear() { ranges_.clear(); }
+
+ private:
+  // Returns the first range that ends after 'seq'.
+  std::vector<SackBlock>::const_iterator FirstEndingAfter(uint64_t seq) const;
+
+  std::vector<SackBlock> ranges_;
+};
+
 class TCPSource : public Connection {
  public:
   // How many packets to initially open the congestion window to.
@@ -33,12 +85,33 @@ class TCPSource : public Connection {
 
   void RtxTimerHook(EventQueueTime now);
 
+  // Called when the source is registered with a retx timer. 'index' is the
+  // source's timer in the wheel.
+  void set_rtx_timer(TCPRtxTimer* rtx_timer, uint32_t index);
+
  private:
   void UpdateCompletionTime();
 
+  // Processes an incoming ACK.
+  void HandleAck(const TCPPacket& ack_packet);
+
+  // Arms the retx timer to fire when the RTO of the last packet sent expires,
+  // or disarms it if there is no unacked data.
+  void UpdateRtxTimer();
+
   void InflateWindow();
 
-  void RetransmitPacket();
+  // Retransmits up to an MSS worth of data starting at 'seqno', but not
+  // beyond the next selectively acked range.
+  void RetransmitPacket(uint64_t seqno);
+
+  // Retransmits the first hole at or after 'retx_next_' that is below the
+  // highest selectively acked sequence number. Returns false if there is no
+  // such hole.
+  bool RetransmitNextHole();
+
+  // Updates 'sacked_' from an ACK.
+  void ProcessSackBlocks(const TCPPacket& ack_packet);
 
   void SendPackets();
 
@@ -63,6 +136,12 @@ class TCPSource : public Connection {
 
   bool in_fast_recovery_;
 
+  // Ranges above 'last_acked_' that the sink has selectively acked.
+  TCPScoreboard sacked_;
+
+  // Holes below this have already been retransmitted in the current recovery.
+  uint64_t retx_next_;
+
   // How many bytes there are to be sent.
   uint64_t send_buffer_;
 
@@ -81,6 +160,11 @@ class TCPSource : public Connection {
   // Time the first packet in the flow is sent.
   EventQueueTime first_sent_time_;
 
+  // The timer wheel that keeps the retx timeout, null if the source is not
+  // registered with one.
+  TCPRtxTimer* rtx_timer_;
+  uint32_t rtx_timer_index_;
+
   DISALLOW_COPY_AND_ASSIGN(TCPSource);
 };
 
@@ -107,7 +191,9 @@ class TCPSink : public Connection {
 
   void ReceivePacket(PacketPtr pkt) override;
 
-  void SendAck(EventQueueTime time_sent);
+  // Sends an ACK. If some data has been received out of order the ACK will
+  // have SACK blocks, the first one containing 'last_seqno'.
+  void SendAck(EventQueueTime time_sent, uint64_t last_seqno);
 
   // Records the number of bytes received so far from the current connection to
   // a metric. This is an alternative to recording cumulative_ack_ periodically,
@@ -121,7 +207,12 @@ class TCPSink : public Connection {
   void Reset();
 
   uint64_t cumulative_ack_;
-  std::list<uint64_t> received_;
+
+  // Data received above the cumulative ACK.
+  TCPScoreboard received_;
+
+  // Scratch space for the blocks of outgoing ACKs.
+  std::vector<SackBlock> sack_blocks_;
 
   // Each incoming packet can be tagged. This variable stores the tag of the
   // last received packet and can be used to update the metric that counts the
@@ -134,24 +225,111 @@ class TCPSink : public Connection {
   DISALLOW_COPY_AND_ASSIGN(TCPSink);
 };
 
-// All TCP flows share the same rtx timer, this reduces the overall number of
-// events in the queue, but may cause synchronization in pathological
-// situations. Usually there should be very few TCP retx timeouts.
+// All TCP sources that run on the same event queue share the same rtx timer.
+// It is a hashed hierarchical timer wheel with one timer per source. Time is
+// divided into ticks of fixed length. There are 8 levels of 256 slots, one
+// level per byte of the tick. A timer is kept in a list in the level of the
+// most significant byte in which its tick differs from the current tick, and
+// in the slot given by the value of that byte. Arming, re-arming and
+// disarming a timer are O(1), so sources can re-arm their timer on every
+// packet sent and ACK received. The wheel is a single event consumer that is
+// only scheduled for the tick of the earliest timer, or for the tick at which
+// timers in a higher level need to be cascaded to a lower one. Only sources
+// whose timer expires are called.
 class TCPRtxTimer : public SimComponent, public EventConsumer {
  public:
-  TCPRtxTimer(const std::string& id, EventQueueTime scan_period,
+  static constexpr size_t kLevelCount = kTimingWheelLevelCount;
+  static constexpr size_t kSlotCount = kTimingWheelSlotCount;
+
+  // Timers fire at multiples of 'tick'.
+  TCPRtxTimer(const std::string& id, EventQueueTime tick,
               EventQueue* event_queue);
 
   void RegisterTCPSource(TCPSource* tcp_source);
 
+  // Arms a timer to call its source's RtxTimerHook at the first tick that is
+  // not before 'at'. If the timer is already armed it is re-armed.
+  void Arm(uint32_t index, EventQueueTime at);
+
+  // Disarms a timer. Does nothing if the timer is not armed.
+  void Disarm(uint32_t index);
+
   void HandleEvent() override;
 
+  // Number of armed timers.
+  size_t armed_count() const { return armed_count_; }
+
+  // Number of times a timer has fired.
+  uint64_t fired_count() const { return fired_count_; }
+
  private:
-  // How often to check if the rtx timer expired.
-  const EventQueueTime scan_period_;
+  static constexpr uint32_t kNoTimer = std::numeric_limits<uint32_t>::max();
+  static constexpr uint64_t kNoTick = std::numeric_limits<uint64_t>::max();
+
+  struct Timer {
+    explicit Timer(TCPSource* tcp_source)
+        : tcp_source(tcp_source),
+          tick(kNoTick),
+          prev(kNoTimer),
+          next(kNoTimer),
+          level(0),
+          slot(0) {}
+
+    bool armed() const { return tick != kNoTick; }
+
+    TCPSource* tcp_source;
+
+    // The tick the timer fires at, kNoTick if the timer is not armed.
+    uint64_t tick;
+
+    // Neighbours in the slot's list.
+    uint32_t prev;
+    uint32_t next;
+
+    uint8_t level;
+    uint8_t slot;
+  };
+
+  struct Level {
+    Level() { std::fill(heads, heads + kSlotCount, kNoTimer); }
+
+    // The first timer in each slot.
+    uint32_t heads[kSlotCount];
+
+    TimingWheelBitmap occupied;
+  };
+
+  // Adds an armed timer to the slot for its tick.
+  void Link(uint32_t index);
+
+  // Removes a timer from its slot.
+  void Unlink(uint32_t index);
+
+  // The earliest tick at which there is something to do, or kNoTick if no
+  // timers are armed.
+  uint64_t NextTick() const;
+
+  // Advances the wheel to 'tick', cascades timers down and fires all timers
+  // for the tick.
+  void ProcessTick(uint64_t tick);
+
+  // Makes sure there is an event for NextTick().
+  void Schedule();
+
+  // Length of a tick.
+  const EventQueueTime tick_;
+
+  // All timers with ticks up to and including this one have fired.
+  uint64_t current_tick_;
+
+  // Time of the earliest outstanding event, MaxTime if there is none.
+  EventQueueTime scheduled_at_;
+
+  size_t armed_count_;
+  uint64_t fired_count_;
 
-  // Sources to check for rtx.
-  std::vector<TCPSource*> tcp_sources_;
+  std::vector<Timer> timers_;
+  Level levels_[kLevelCount];
 
   DISALLOW_COPY_AND_ASSIGN(TCPRtxTimer);
 };
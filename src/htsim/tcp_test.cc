@@ -0,0 +1,255 @@
+#include "tcp.h"
+
+#include <limits>
+#include <random>
+#include <set>
+
+#include "../common/event_queue.h"
+#include "gtest/gtest.h"
+
+namespace ncode {
+namespace htsim {
+namespace {
+
+using namespace std::chrono;
+
+static constexpr uint64_t kNone = std::numeric_limits<uint64_t>::max();
+
+TEST(TCPScoreboard, Empty) {
+  TCPScoreboard scoreboard;
+  ASSERT_TRUE(scoreboard.empty());
+  ASSERT_EQ(0ul, scoreboard.HighestEnd());
+  ASSERT_FALSE(scoreboard.Contains(0));
+  ASSERT_EQ(10ul, scoreboard.NextMissing(10));
+  ASSERT_EQ(kNone, scoreboard.NextPresent(10));
+  ASSERT_EQ(10ul, scoreboard.Advance(10));
+}
+
+TEST(TCPScoreboard, AddMerges) {
+  TCPScoreboard scoreboard;
+  scoreboard.Add(10, 20);
+  scoreboard.Add(30, 40);
+  ASSERT_EQ(2ul, scoreboard.ranges().size());
+
+  // Adjacent to the first range.
+  scoreboard.Add(20, 25);
+  ASSERT_EQ(2ul, scoreboard.ranges().size());
+  ASSERT_EQ(10ul, scoreboard.ranges()[0].start);
+  ASSERT_EQ(25ul, scoreboard.ranges()[0].end);
+
+  // Bridges both ranges.
+  scoreboard.Add(22, 35);
+  ASSERT_EQ(1ul, scoreboard.ranges().size());
+  ASSERT_EQ(10ul, scoreboard.ranges()[0].start);
+  ASSERT_EQ(40ul, scoreboard.ranges()[0].end);
+
+  // Already there.
+  scoreboard.Add(12, 18);
+  ASSERT_EQ(1ul, scoreboard.ranges().size());
+
+  // Empty range.
+  scoreboard.Add(50, 50);
+  ASSERT_EQ(1ul, scoreboard.ranges().size());
+  ASSERT_EQ(40ul, scoreboard.HighestEnd());
+}
+
+TEST(TCPScoreboard, Queries) {
+  TCPScoreboard scoreboard;
+  scoreboard.Add(10, 20);
+  scoreboard.Add(30, 40);
+
+  ASSERT_FALSE(scoreboard.Contains(9));
+  ASSERT_TRUE(scoreboard.Contains(10));
+  ASSERT_TRUE(scoreboard.Contains(19));
+  ASSERT_FALSE(scoreboard.Contains(20));
+
+  ASSERT_EQ(5ul, scoreboard.NextMissing(5));
+  ASSERT_EQ(20ul, scoreboard.NextMissing(15));
+  ASSERT_EQ(40ul, scoreboard.NextMissing(30));
+  ASSERT_EQ(10ul, scoreboard.NextPresent(5));
+  ASSERT_EQ(15ul, scoreboard.NextPresent(15));
+  ASSERT_EQ(30ul, scoreboard.NextPresent(20));
+  ASSERT_EQ(kNone, scoreboard.NextPresent(40));
+
+  const SackBlock& range = scoreboard.RangeContaining(35);
+  ASSERT_EQ(30ul, range.start);
+  ASSERT_EQ(40ul, range.end);
+}
+
+TEST(TCPScoreboard, Advance) {
+  TCPScoreboard scoreboard;
+  scoreboard.Add(10, 20);
+  scoreboard.Add(30, 40);
+
+  // Does not reach the first range.
+  ASSERT_EQ(5ul, scoreboard.Advance(5));
+  ASSERT_EQ(2ul, scoreboard.ranges().size());
+
+  // Fills the gap before the first range.
+  ASSERT_EQ(20ul, scoreboard.Advance(10));
+  ASSERT_EQ(1ul, scoreboard.ranges().size());
+
+  // Past the start of the second range.
+  ASSERT_EQ(40ul, scoreboard.Advance(35));
+  ASSERT_TRUE(scoreboard.empty());
+}
+
+// Compares the scoreboard to a set of individual sequence numbers.
+TEST(TCPScoreboard, Random) {
+  std::mt19937 rnd(1);
+  std::uniform_int_distribution<uint64_t> seq_dist(0, 200);
+  std::uniform_int_distribution<uint64_t> len_dist(1, 10);
+
+  TCPScoreboard scoreboard;
+  std::set<uint64_t> model;
+  for (size_t i = 0; i < 1000; ++i) {
+    uint64_t start = seq_dist(rnd);
+    uint64_t end = start + len_dist(rnd);
+    scoreboard.Add(start, end);
+    for (uint64_t seq = start; seq < end; ++seq) {
+      model.insert(seq);
+    }
+
+    for (uint64_t seq = 0; seq < 220; ++seq) {
+      ASSERT_EQ(model.count(seq) != 0, scoreboard.Contains(seq));
+    }
+
+    for (size_t j = 1; j < scoreboard.ranges().size(); ++j) {
+      ASSERT_LT(scoreboard.ranges()[j - 1].end, scoreboard.ranges()[j].start);
+    }
+
+    if (i % 100 == 99) {
+      scoreboard.Clear();
+      model.clear();
+    }
+  }
+}
+
+TEST(TCPSackPacket, Blocks) {
+  net::FiveTuple tuple(net::IPAddress(1), net::IPAddress(2), net::kProtoTCP,
+                       net::AccessLayerPort(10), net::AccessLayerPort(20));
+  std::vector<SackBlock> blocks = {{10, 20}, {30, 40}, {50, 60}, {70, 80}};
+  auto pkt = TCPSackPacket::New(tuple, 100, EventQueueTime(0), SeqNum(5),
+                                blocks);
+  ASSERT_EQ(TCPSackPacket::kMaxSackBlocks, pkt->sack_block_count());
+  ASSERT_EQ(30ul, pkt->sack_block(1).start);
+  ASSERT_EQ(60ul, pkt->sack_block(2).end);
+
+  PacketPtr duplicate = pkt->Duplicate();
+  const TCPPacket* tcp_duplicate =
+      static_cast<const TCPPacket*>(duplicate.get());
+  ASSERT_EQ(TCPSackPacket::kMaxSackBlocks, tcp_duplicate->sack_block_count());
+  const TCPSackPacket* sack_duplicate =
+      static_cast<const TCPSackPacket*>(tcp_duplicate);
+  ASSERT_EQ(50ul, sack_duplicate->sack_block(2).start);
+}
+
+// Records the times packets are sent at. Nothing is ever ACKed.
+class RecordingHandler : public PacketHandler {
+ public:
+  explicit RecordingHandler(EventQueue* event_queue)
+      : event_queue_(event_queue) {}
+
+  void HandlePacket(PacketPtr pkt) override {
+    Unused(pkt);
+    times_ms_.emplace_back(
+        event_queue_->TimeToRawMillis(event_queue_->CurrentTime()));
+  }
+
+  const std::vector<uint64_t>& times_ms() const { return times_ms_; }
+
+ private:
+  EventQueue* event_queue_;
+  std::vector<uint64_t> times_ms_;
+};
+
+static net::FiveTuple TupleForPort(uint16_t port) {
+  return net::FiveTuple(net::IPAddress(1), net::IPAddress(2), net::kProtoTCP,
+                        net::AccessLayerPort(port), net::AccessLayerPort(80));
+}
+
+// Ticks of 1us, 1ms and 100ms. With short ticks timers are cascaded through
+// more levels.
+static const std::vector<nanoseconds> kTicks = {
+    microseconds(1), milliseconds(1), milliseconds(100)};
+
+TEST(TCPRtxTimer, IdleSources) {
+  for (nanoseconds tick : kTicks) {
+    SimTimeEventQueue event_queue;
+    RecordingHandler handler(&event_queue);
+    TCPRtxTimer timer("timer", event_queue.ToTime(tick), &event_queue);
+
+    std::vector<std::unique_ptr<TCPSource>> sources;
+    for (uint16_t i = 0; i < 1000; ++i) {
+      sources.emplace_back(make_unique<TCPSource>(
+          "src", TupleForPort(i), 1500, 100000, &handler, &event_queue));
+      timer.RegisterTCPSource(sources.back().get());
+    }
+
+    event_queue.RunAndStopIn(seconds(10));
+    ASSERT_EQ(0ul, timer.armed_count());
+    ASSERT_EQ(0ul, timer.fired_count());
+    ASSERT_EQ(0ul, timer.outstanding_event_count());
+    ASSERT_TRUE(handler.times_ms().empty());
+  }
+}
+
+TEST(TCPRtxTimer, Timeout) {
+  for (nanoseconds tick : kTicks) {
+    SimTimeEventQueue event_queue;
+    RecordingHandler handler(&event_queue);
+    TCPRtxTimer timer("timer", event_queue.ToTime(tick), &event_queue);
+
+    TCPSource idle_source("idle", TupleForPort(1), 1500, 100000, &handler,
+                          &event_queue);
+    TCPSource source("src", TupleForPort(2), 1500, 100000, &handler,
+                     &event_queue);
+    timer.RegisterTCPSource(&idle_source);
+    timer.RegisterTCPSource(&source);
+
+    // The initial RTO is 1 second and does not back off. Each timeout can be
+    // up to a tick late.
+    source.AddData(1500);
+    ASSERT_EQ(1ul, timer.armed_count());
+    event_queue.RunAndStopIn(milliseconds(3500));
+
+    uint64_t tick_ms = std::max(1l, duration_cast<milliseconds>(tick).count());
+    const std::vector<uint64_t>& times_ms = handler.times_ms();
+    ASSERT_EQ(4ul, times_ms.size());
+    for (size_t i = 0; i < times_ms.size(); ++i) {
+      ASSERT_LE(i * 1000, times_ms[i]);
+      ASSERT_GE(i * (1000 + tick_ms), times_ms[i]);
+    }
+
+    ASSERT_EQ(3ul, timer.fired_count());
+    ASSERT_EQ(1ul, timer.armed_count());
+  }
+}
+
+TEST(TCPRtxTimer, Rearm) {
+  for (nanoseconds tick : kTicks) {
+    SimTimeEventQueue event_queue;
+    RecordingHandler handler(&event_queue);
+    TCPRtxTimer timer("timer", event_queue.ToTime(tick), &event_queue);
+
+    TCPSource source("src", TupleForPort(1), 1500, 100000, &handler,
+                     &event_queue);
+    timer.RegisterTCPSource(&source);
+    source.AddData(1500);
+
+    // Sending more data pushes the timeout back.
+    event_queue.RunAndStopIn(milliseconds(500));
+    source.AddData(1500);
+    event_queue.RunAndStopIn(milliseconds(700));
+    ASSERT_EQ(0ul, timer.fired_count());
+    ASSERT_EQ(2ul, handler.times_ms().size());
+
+    event_queue.RunAndStopIn(milliseconds(500));
+    ASSERT_EQ(1ul, timer.fired_count());
+    ASSERT_EQ(3ul, handler.times_ms().size());
+  }
+}
+
+}  // namespace
+}  // namespace htsim
+}  // namespace ncode
@@ -1,9 +1,17 @@
 #include "metrics.h"
 
+#include <errno.h>
 #include <google/protobuf/repeated_field.h>
+#include <string.h>
+#include <sys/file.h>
+#include <algorithm>
 #include <cstdint>
+#include <functional>
 #include <limits>
+#include <map>
 #include <memory>
+#include <mutex>
+#include <queue>
 #include <string>
 #include <type_traits>
 #include <vector>
@@ -130,85 +138,843 @@ void SaveEntryToProtobuf<BytesBlob>(const Entry<BytesBlob>& entry,
   *out->mutable_bytes_value() = entry.value;
 }
 
-OutputStream::OutputStream(const std::string& file) {
+// Splits entries into a column of timestamps and a column of values.
+template <typename T, typename ValueType>
+static void EntriesToColumns(const std::vector<Entry<T>>& entries,
+                             std::vector<uint64_t>* timestamps,
+                             std::vector<ValueType>* values) {
+  timestamps->reserve(entries.size());
+  values->reserve(entries.size());
+  for (const Entry<T>& entry : entries) {
+    timestamps->emplace_back(entry.timestamp);
+    values->emplace_back(entry.value);
+  }
+}
+
+template <typename T>
+static void SaveIntegerEntriesToChunk(const std::vector<Entry<T>>& entries,
+                                      PBManifestEntry::Type type,
+                                      uint32_t manifest_index,
+                                      std::string* out) {
+  std::vector<uint64_t> timestamps;
+  std::vector<uint64_t> values;
+  EntriesToColumns(entries, &timestamps, &values);
+  EncodeIntegerChunk(type, manifest_index, timestamps, values, out);
+}
+
+template <>
+bool SaveEntriesToChunk<uint64_t>(const std::vector<Entry<uint64_t>>& entries,
+                                  uint32_t manifest_index, std::string* out) {
+  SaveIntegerEntriesToChunk(entries, PBManifestEntry::UINT64, manifest_index,
+                            out);
+  return true;
+}
+
+template <>
+bool SaveEntriesToChunk<uint32_t>(const std::vector<Entry<uint32_t>>& entries,
+                                  uint32_t manifest_index, std::string* out) {
+  SaveIntegerEntriesToChunk(entries, PBManifestEntry::UINT32, manifest_index,
+                            out);
+  return true;
+}
+
+template <>
+bool SaveEntriesToChunk<bool>(const std::vector<Entry<bool>>& entries,
+                              uint32_t manifest_index, std::string* out) {
+  SaveIntegerEntriesToChunk(entries, PBManifestEntry::BOOL, manifest_index,
+                            out);
+  return true;
+}
+
+template <>
+bool SaveEntriesToChunk<double>(const std::vector<Entry<double>>& entries,
+                                uint32_t manifest_index, std::string* out) {
+  std::vector<uint64_t> timestamps;
+  std::vector<double> values;
+  EntriesToColumns(entries, &timestamps, &values);
+  EncodeDoubleChunk(manifest_index, timestamps, values, out);
+  return true;
+}
+
+constexpr char OutputStream::kBlockFormatMagic[];
+constexpr size_t OutputStream::kBlockFormatMagicSize;
+constexpr size_t OutputStream::kBlockHeaderSize;
+constexpr uint32_t OutputStream::kIndexMarker;
+constexpr char OutputStream::kIndexMagic[];
+constexpr size_t OutputStream::kIndexMagicSize;
+constexpr size_t OutputStream::kIndexFooterSize;
+constexpr size_t OutputStream::kEntriesPerBlock;
+constexpr size_t OutputStream::kMaxQueuedBlocks;
+constexpr int OutputStream::kCompressionLevel;
+
+using google::protobuf::io::ArrayInputStream;
+using google::protobuf::io::CodedInputStream;
+using google::protobuf::io::CodedOutputStream;
+using google::protobuf::io::GzipInputStream;
+using google::protobuf::io::GzipOutputStream;
+using google::protobuf::io::StringOutputStream;
+using google::protobuf::io::ZeroCopyInputStream;
+
+// Writes all of 'size' bytes to a file descriptor.
+static void WriteAllOrDie(int fd, const char* data, size_t size) {
+  size_t written = 0;
+  while (written < size) {
+    ssize_t ret = write(fd, data + written, size - written);
+    if (ret == -1) {
+      CHECK(errno == EINTR) << "Unable to write metrics: " << strerror(errno);
+      continue;
+    }
+    written += ret;
+  }
+}
+
+// Reads all of 'size' bytes at 'offset'. Returns false if there are not
+// enough bytes in the file.
+static bool PReadAll(int fd, char* data, size_t size, uint64_t offset) {
+  size_t total = 0;
+  while (total < size) {
+    ssize_t ret = pread(fd, data + total, size - total, offset + total);
+    if (ret == -1 && errno == EINTR) {
+      continue;
+    }
+
+    if (ret <= 0) {
+      return false;
+    }
+    total += ret;
+  }
+
+  return true;
+}
+
+// Decompresses a block. Returns false if the block is corrupt.
+static bool DecompressBlock(const std::string& compressed,
+                            uint32_t uncompressed_size, std::string* out) {
+  out->clear();
+  ArrayInputStream array_input(compressed.data(), compressed.size());
+  GzipInputStream gzip_input(&array_input, GzipInputStream::ZLIB);
+  out->reserve(uncompressed_size);
+  const void* data;
+  int size;
+  while (gzip_input.Next(&data, &size)) {
+    out->append(static_cast<const char*>(data), size);
+  }
+
+  return out->size() == uncompressed_size;
+}
+
+// Where the values of each metric are in a single block, by manifest index.
+// The offsets of the extents are not set.
+using BlockExtents = std::map<uint32_t, PBMetricsIndex::Extent>;
+
+static void AddToExtents(uint32_t manifest_index, uint64_t count,
+                         uint64_t min_timestamp, uint64_t max_timestamp,
+                         BlockExtents* extents) {
+  auto it = extents->find(manifest_index);
+  if (it == extents->end()) {
+    PBMetricsIndex::Extent& extent = (*extents)[manifest_index];
+    extent.set_count(count);
+    extent.set_min_timestamp(min_timestamp);
+    extent.set_max_timestamp(max_timestamp);
+    return;
+  }
+
+  PBMetricsIndex::Extent& extent = it->second;
+  extent.set_count(extent.count() + count);
+  extent.set_min_timestamp(std::min(extent.min_timestamp(), min_timestamp));
+  extent.set_max_timestamp(std::max(extent.max_timestamp(), max_timestamp));
+}
+
+// Adds the values of a chunk to the extents of its block. Returns false if
+// the chunk is corrupt.
+static bool AddChunkToExtents(const std::string& chunk,
+                              BlockExtents* extents) {
+  PBManifestEntry::Type type;
+  uint32_t value_count;
+  uint32_t manifest_index;
+  uint64_t min_timestamp;
+  uint64_t max_timestamp;
+  if (!ParseChunkFooter(chunk, &type, &value_count, &manifest_index) ||
+      !ChunkTimestampRange(chunk, &min_timestamp, &max_timestamp)) {
+    return false;
+  }
+
+  AddToExtents(manifest_index, value_count, min_timestamp, max_timestamp,
+               extents);
+  return true;
+}
+
+// Adds all records of an uncompressed block to its extents, and appends its
+// manifest entries to 'manifest_entries'. Returns false if the block is
+// corrupt.
+static bool AddBlockToExtents(const std::string& block, BlockExtents* extents,
+                              std::vector<PBManifestEntry>* manifest_entries) {
+  ArrayInputStream array_input(block.data(), block.size());
+  CodedInputStream coded_input(&array_input);
+  std::string chunk;
+  PBMetricEntry entry;
+  while (static_cast<size_t>(coded_input.CurrentPosition()) < block.size()) {
+    uint32_t manifest_index;
+    uint32_t size;
+    if (!coded_input.ReadVarint32(&manifest_index) ||
+        !coded_input.ReadVarint32(&size)) {
+      return false;
+    }
+
+    if (manifest_index == kChunkRecordIndex) {
+      if (!coded_input.ReadString(&chunk, size) ||
+          !AddChunkToExtents(chunk, extents)) {
+        return false;
+      }
+      continue;
+    }
+
+    CodedInputStream::Limit limit = coded_input.PushLimit(size);
+    entry.Clear();
+    if (!entry.MergeFromCodedStream(&coded_input) ||
+        !coded_input.ConsumedEntireMessage()) {
+      return false;
+    }
+    coded_input.PopLimit(limit);
+    AddToExtents(manifest_index, 1, entry.timestamp(), entry.timestamp(),
+                 extents);
+    if (manifest_index == MetricBase::kManifestEntryMetaIndex) {
+      manifest_entries->emplace_back(entry.manifest_entry());
+    }
+  }
+
+  return true;
+}
+
+// Builds the index of a file, one block at a time.
+class IndexBuilder {
+ public:
+  IndexBuilder() {}
+
+  // Adds the extents and the manifest entries of the block at 'offset'.
+  // Blocks should be added in order.
+  void AddBlock(uint64_t offset, const BlockExtents& block_extents,
+                const std::vector<PBManifestEntry>& manifest_entries) {
+    for (const PBManifestEntry& manifest_entry : manifest_entries) {
+      *index_.add_manifest_entries() = manifest_entry;
+    }
+
+    for (const auto& manifest_index_and_extent : block_extents) {
+      uint32_t manifest_index = manifest_index_and_extent.first;
+      PBMetricsIndex::MetricExtents*& metric_extents = metrics_[manifest_index];
+      if (metric_extents == nullptr) {
+        metric_extents = index_.add_metrics();
+        metric_extents->set_manifest_index(manifest_index);
+      }
+
+      PBMetricsIndex::Extent* extent = metric_extents->add_extents();
+      *extent = manifest_index_and_extent.second;
+      extent->set_offset(offset);
+    }
+  }
+
+  // Returns what should follow the last block, if it ends at 'offset'.
+  std::string Trailer(uint64_t offset) const {
+    std::string serialized_index;
+    index_.SerializeToString(&serialized_index);
+
+    std::string trailer;
+    {
+      StringOutputStream string_output(&trailer);
+      CodedOutputStream coded_output(&string_output);
+      coded_output.WriteLittleEndian32(OutputStream::kIndexMarker);
+      coded_output.WriteLittleEndian32(serialized_index.size());
+      coded_output.WriteRaw(serialized_index.data(), serialized_index.size());
+      coded_output.WriteLittleEndian64(offset);
+      coded_output.WriteRaw(OutputStream::kIndexMagic,
+                            OutputStream::kIndexMagicSize);
+    }
+    return trailer;
+  }
+
+ private:
+  PBMetricsIndex index_;
+
+  // The extents of each manifest index in index_.
+  std::map<uint32_t, PBMetricsIndex::MetricExtents*> metrics_;
+
+  DISALLOW_COPY_AND_ASSIGN(IndexBuilder);
+};
+
+// Reads the index at the end of a file in block format.
+static bool ReadIndexFromFile(int fd, PBMetricsIndex* index) {
+  struct stat file_stat;
+  if (fstat(fd, &file_stat) != 0) {
+    return false;
+  }
+
+  uint64_t file_size = file_stat.st_size;
+  if (file_size < OutputStream::kBlockFormatMagicSize +
+                      OutputStream::kIndexFooterSize + 8) {
+    return false;
+  }
+
+  char footer[OutputStream::kIndexFooterSize];
+  if (!PReadAll(fd, footer, sizeof(footer),
+                file_size - OutputStream::kIndexFooterSize) ||
+      memcmp(footer + 8, OutputStream::kIndexMagic,
+             OutputStream::kIndexMagicSize) != 0) {
+    return false;
+  }
+
+  uint64_t offset;
+  CodedInputStream::ReadLittleEndian64FromArray(
+      reinterpret_cast<const uint8_t*>(footer), &offset);
+
+  char header[8];
+  if (offset > file_size || !PReadAll(fd, header, sizeof(header), offset)) {
+    return false;
+  }
+
+  uint32_t marker;
+  uint32_t index_size;
+  const uint8_t* header_ptr = reinterpret_cast<const uint8_t*>(header);
+  header_ptr =
+      CodedInputStream::ReadLittleEndian32FromArray(header_ptr, &marker);
+  CodedInputStream::ReadLittleEndian32FromArray(header_ptr, &index_size);
+  if (marker != OutputStream::kIndexMarker ||
+      offset + sizeof(header) + index_size + OutputStream::kIndexFooterSize !=
+          file_size) {
+    return false;
+  }
+
+  std::string serialized_index(index_size, 0);
+  if (!PReadAll(fd, &serialized_index[0], index_size,
+                offset + sizeof(header))) {
+    return false;
+  }
+
+  return index->ParseFromString(serialized_index);
+}
+
+OutputStream::OutputStream(const std::string& file, size_t writer_threads)
+    : writer_threads_count_(writer_threads),
+      current_block_(make_unique<Block>()),
+      next_sequence_(0),
+      file_offset_(kBlockFormatMagicSize),
+      index_builder_(make_unique<IndexBuilder>()) {
   fd_ = open(file.c_str(), O_WRONLY | O_TRUNC | O_CREAT,  // open mode
              S_IREAD | S_IWRITE | S_IRGRP | S_IROTH | S_ISUID);
   CHECK(fd_ > 0) << "Bad output file " << file;
 
-  file_output_ = make_unique<google::protobuf::io::FileOutputStream>(fd_);
+  // The lock is held until the trailer is written, AddIndexToFile uses it to
+  // tell files that are still being written from ones cut short.
+  CHECK(flock(fd_, LOCK_EX | LOCK_NB) == 0)
+      << "Output file " << file << " is already being written to";
+
+  current_block_->sequence = 0;
+  WriteAllOrDie(fd_, kBlockFormatMagic, kBlockFormatMagicSize);
 }
 
 OutputStream::~OutputStream() {
-  // close streams
-  file_output_->Close();
-  file_output_.reset();
+  queue_.Close();
+  for (std::thread& writer_thread : writer_threads_) {
+    writer_thread.join();
+  }
+
+  // The last block is not full.
+  if (!current_block_->records.empty()) {
+    WriteBlock(*current_block_);
+  }
+
+  std::string trailer = index_builder_->Trailer(file_offset_);
+  WriteAllOrDie(fd_, trailer.data(), trailer.size());
   close(fd_);
 }
 
-void OutputStream::WriteBulk(const std::vector<PBMetricEntry>& entries,
+void OutputStream::WriteBulk(std::vector<PBMetricEntry>* entries,
                              uint32_t manifest_index) {
   std::lock_guard<std::mutex> lock(mu_);
-  for (const auto& entry : entries) {
-    WriteDelimitedTo(entry, manifest_index);
+  for (PBMetricEntry& entry : *entries) {
+    Record* record = NextRecord();
+    record->manifest_index = manifest_index;
+    record->entry.Swap(&entry);
+    RecordAdded();
   }
+  entries->clear();
 }
 
 void OutputStream::WriteSingle(const PBMetricEntry& entry,
                                uint32_t manifest_index) {
+  PBMetricEntry entry_copy = entry;
   std::lock_guard<std::mutex> lock(mu_);
-  WriteDelimitedTo(entry, manifest_index);
-}
-
-// Writes a protobuf to the stream.
-bool OutputStream::WriteDelimitedTo(const PBMetricEntry& entry,
-                                    uint32_t manifest_index) {
-  // Write the size and the manifest index. The index comes first.
-  ::google::protobuf::io::CodedOutputStream coded_output(file_output_.get());
-  coded_output.WriteVarint32(manifest_index);
-  const int size = entry.ByteSize();
-  coded_output.WriteVarint32(size);
-
-  uint8_t* buffer = coded_output.GetDirectBufferForNBytesAndAdvance(size);
-  if (buffer != nullptr) {
-    // Optimization:  The message fits in one buffer, so use the faster
-    // direct-to-array serialization path.
-    entry.SerializeWithCachedSizesToArray(buffer);
-  } else {
-    // Slightly-slower path when the message is multiple buffers.
-    entry.SerializeWithCachedSizes(&coded_output);
-    if (coded_output.HadError()) {
-      return false;
+  Record* record = NextRecord();
+  record->manifest_index = manifest_index;
+  record->entry.Swap(&entry_copy);
+  RecordAdded();
+}
+
+void OutputStream::WriteChunk(std::string* chunk) {
+  CHECK(!chunk->empty());
+  std::lock_guard<std::mutex> lock(mu_);
+  Record* record = NextRecord();
+  record->manifest_index = kChunkRecordIndex;
+  record->chunk.swap(*chunk);
+  RecordAdded();
+}
+
+OutputStream::Record* OutputStream::NextRecord() {
+  std::vector<Record>& records = current_block_->records;
+  if (records.empty()) {
+    records.reserve(kEntriesPerBlock);
+  }
+
+  records.emplace_back();
+  return &records.back();
+}
+
+void OutputStream::RecordAdded() {
+  if (current_block_->records.size() < kEntriesPerBlock) {
+    return;
+  }
+
+  std::unique_ptr<Block> full_block = std::move(current_block_);
+  current_block_ = make_unique<Block>();
+  current_block_->sequence = full_block->sequence + 1;
+  if (writer_threads_count_ == 0) {
+    WriteBlock(*full_block);
+    return;
+  }
+
+  if (writer_threads_.empty()) {
+    for (size_t i = 0; i < writer_threads_count_; ++i) {
+      writer_threads_.emplace_back([this] { RunWriter(); });
     }
   }
 
-  return true;
+  // Blocks if the writers are behind.
+  queue_.ProduceOrBlock(std::move(full_block));
+}
+
+void OutputStream::RunWriter() {
+  while (true) {
+    std::unique_ptr<Block> block = queue_.ConsumeOrBlock();
+    if (!block) {
+      return;
+    }
+
+    WriteBlock(*block);
+  }
+}
+
+void OutputStream::WriteBlock(const Block& block) {
+  std::string serialized;
+  BlockExtents block_extents;
+  std::vector<PBManifestEntry> manifest_entries;
+  {
+    StringOutputStream string_output(&serialized);
+    CodedOutputStream coded_output(&string_output);
+    for (const Record& record : block.records) {
+      coded_output.WriteVarint32(record.manifest_index);
+      if (!record.chunk.empty()) {
+        coded_output.WriteVarint32(record.chunk.size());
+        coded_output.WriteRaw(record.chunk.data(), record.chunk.size());
+        CHECK(AddChunkToExtents(record.chunk, &block_extents));
+        continue;
+      }
+
+      coded_output.WriteVarint32(record.entry.ByteSize());
+      record.entry.SerializeWithCachedSizes(&coded_output);
+      uint64_t timestamp = record.entry.timestamp();
+      AddToExtents(record.manifest_index, 1, timestamp, timestamp,
+                   &block_extents);
+      if (record.manifest_index == MetricBase::kManifestEntryMetaIndex) {
+        manifest_entries.emplace_back(record.entry.manifest_entry());
+      }
+    }
+  }
+
+  // Room for the header is left at the start of the compressed block.
+  std::string compressed(kBlockHeaderSize, 0);
+  {
+    StringOutputStream string_output(&compressed);
+    GzipOutputStream::Options options;
+    options.format = GzipOutputStream::ZLIB;
+    options.compression_level = kCompressionLevel;
+    GzipOutputStream gzip_output(&string_output, options);
+    void* data;
+    int size;
+    size_t offset = 0;
+    while (offset < serialized.size() && gzip_output.Next(&data, &size)) {
+      size_t to_copy = std::min<size_t>(size, serialized.size() - offset);
+      memcpy(data, serialized.data() + offset, to_copy);
+      offset += to_copy;
+      if (to_copy < static_cast<size_t>(size)) {
+        gzip_output.BackUp(size - to_copy);
+      }
+    }
+    CHECK(gzip_output.Close()) << "Unable to compress metrics block";
+  }
+
+  uint8_t* header = reinterpret_cast<uint8_t*>(&compressed[0]);
+  header = CodedOutputStream::WriteLittleEndian32ToArray(
+      compressed.size() - kBlockHeaderSize, header);
+  header = CodedOutputStream::WriteLittleEndian32ToArray(serialized.size(),
+                                                         header);
+  CodedOutputStream::WriteLittleEndian32ToArray(block.records.size(), header);
+
+  std::unique_lock<std::mutex> lock(write_mu_);
+  write_condition_.wait(
+      lock, [this, &block] { return next_sequence_ == block.sequence; });
+  WriteAllOrDie(fd_, compressed.data(), compressed.size());
+  index_builder_->AddBlock(file_offset_, block_extents, manifest_entries);
+  file_offset_ += compressed.size();
+  ++next_sequence_;
+  write_condition_.notify_all();
 }
 
-InputStream::InputStream(const std::string& file) {
+// Presents the decompressed blocks of a file as a single stream. If
+// 'single_block' is true only the first block is read.
+class BlockInputStream : public ZeroCopyInputStream {
+ public:
+  BlockInputStream(ZeroCopyInputStream* file_input, bool single_block)
+      : file_input_(file_input),
+        single_block_(single_block),
+        blocks_read_(0),
+        done_(false),
+        position_(0),
+        byte_count_(0) {}
+
+  bool Next(const void** data, int* size) override {
+    while (position_ == block_.size()) {
+      if (!ReadBlock()) {
+        return false;
+      }
+    }
+
+    *data = block_.data() + position_;
+    *size = block_.size() - position_;
+    position_ = block_.size();
+    byte_count_ += *size;
+    return true;
+  }
+
+  void BackUp(int count) override {
+    position_ -= count;
+    byte_count_ -= count;
+  }
+
+  bool Skip(int count) override {
+    while (static_cast<size_t>(count) > block_.size() - position_) {
+      count -= block_.size() - position_;
+      byte_count_ += block_.size() - position_;
+      position_ = block_.size();
+      if (!ReadBlock()) {
+        return false;
+      }
+    }
+
+    position_ += count;
+    byte_count_ += count;
+    return true;
+  }
+
+  int64_t ByteCount() const override { return byte_count_; }
+
+ private:
+  // Reads in and decompresses the next block. Returns false at the end of the
+  // blocks or if the block is corrupt. Once it returns false it will keep
+  // returning false, as whatever follows the last block (e.g., the index) is
+  // not a block.
+  bool ReadBlock() {
+    block_.clear();
+    position_ = 0;
+    if (done_ || (single_block_ && blocks_read_ == 1)) {
+      done_ = true;
+      return false;
+    }
+
+    CodedInputStream coded_input(file_input_);
+    uint32_t compressed_size;
+    uint32_t uncompressed_size;
+    uint32_t entry_count;
+    if (!coded_input.ReadLittleEndian32(&compressed_size) ||
+        compressed_size == OutputStream::kIndexMarker) {
+      done_ = true;
+      return false;
+    }
+
+    if (!coded_input.ReadLittleEndian32(&uncompressed_size) ||
+        !coded_input.ReadLittleEndian32(&entry_count) ||
+        !coded_input.ReadString(&compressed_, compressed_size)) {
+      LOG(ERROR) << "Truncated metrics block";
+      done_ = true;
+      return false;
+    }
+
+    if (!DecompressBlock(compressed_, uncompressed_size, &block_)) {
+      LOG(ERROR) << "Corrupt metrics block";
+      block_.clear();
+      done_ = true;
+      return false;
+    }
+
+    ++blocks_read_;
+    return true;
+  }
+
+  ZeroCopyInputStream* file_input_;
+
+  const bool single_block_;
+  size_t blocks_read_;
+
+  // Set once there are no more blocks to read.
+  bool done_;
+
+  // The compressed and the decompressed current block.
+  std::string compressed_;
+  std::string block_;
+
+  // How much of block_ has been returned.
+  size_t position_;
+
+  int64_t byte_count_;
+};
+
+InputStream::InputStream(const std::string& file)
+    : chunk_manifest_index_(0),
+      chunk_size_(0),
+      chunk_position_(0),
+      chunk_decoded_(false) {
   fd_ = open(file.c_str(), O_RDONLY);
   CHECK(fd_ > 0) << "Bad input file " << file << ": " << strerror(errno);
+
+  // Files in block format start with a magic string. Files in the old format
+  // start with a delimited record, whose first bytes may match some of the
+  // magic's (manifest index 78 is the single varint byte 'N'), so the format
+  // is only detected when all bytes of the magic match.
+  char magic[OutputStream::kBlockFormatMagicSize];
+  ssize_t magic_size = read(fd_, magic, sizeof(magic));
+  bool block_format =
+      magic_size == sizeof(magic) &&
+      memcmp(magic, OutputStream::kBlockFormatMagic, sizeof(magic)) == 0;
+  if (!block_format) {
+    CHECK(lseek(fd_, 0, SEEK_SET) == 0) << "Unable to seek in " << file;
+  }
+
   file_input_ = make_unique<google::protobuf::io::FileInputStream>(fd_);
+  input_ = file_input_.get();
+  if (block_format) {
+    block_input_ = make_unique<BlockInputStream>(file_input_.get(), false);
+    input_ = block_input_.get();
+  }
 }
 
 InputStream::~InputStream() {
   // close streams
+  block_input_.reset();
   file_input_->Close();
   file_input_.reset();
   close(fd_);
 }
 
 bool InputStream::ReadDelimitedHeaderFrom(uint32_t* manifest_index) {
-  google::protobuf::io::CodedInputStream input(file_input_.get());
+  if (InChunk()) {
+    *manifest_index = chunk_manifest_index_;
+    return true;
+  }
+
+  google::protobuf::io::CodedInputStream input(input_);
 
   // Read the manifest.
   if (!input.ReadVarint32(manifest_index)) {
     return false;
   }
+
+  // Files in the old format have no chunks.
+  if (!block_input_ || *manifest_index != kChunkRecordIndex) {
+    return true;
+  }
+
+  uint32_t size;
+  if (!input.ReadVarint32(&size) || !input.ReadString(&chunk_, size)) {
+    return false;
+  }
+
+  PBManifestEntry::Type type;
+  uint32_t value_count;
+  if (!ParseChunkFooter(chunk_, &type, &value_count, &chunk_manifest_index_)) {
+    LOG(ERROR) << "Corrupt metrics chunk";
+    return false;
+  }
+
+  chunk_size_ = value_count;
+  chunk_position_ = 0;
+  chunk_decoded_ = false;
+  *manifest_index = chunk_manifest_index_;
+  return true;
+}
+
+bool InputStream::ReadIndex(PBMetricsIndex* index) {
+  if (!block_input_) {
+    return false;
+  }
+
+  return ReadIndexFromFile(fd_, index);
+}
+
+void InputStream::SeekToBlock(uint64_t offset) {
+  CHECK(block_input_) << "Only files in block format have blocks";
+  block_input_.reset();
+  file_input_.reset();
+  CHECK(lseek(fd_, offset, SEEK_SET) == static_cast<off_t>(offset))
+      << "Unable to seek to block at " << offset;
+
+  file_input_ = make_unique<google::protobuf::io::FileInputStream>(fd_);
+  block_input_ = make_unique<BlockInputStream>(file_input_.get(), true);
+  input_ = block_input_.get();
+  SkipChunk();
+}
+
+// Copies all blocks of a file in block format to 'out_file', up to the first
+// truncated or corrupt one, followed by their index.
+static void CopyBlocksWithIndex(int fd, const std::string& file,
+                                const std::string& out_file) {
+  int out_fd = open(out_file.c_str(), O_WRONLY | O_TRUNC | O_CREAT,
+                    S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+  CHECK(out_fd > 0) << "Bad output file " << out_file << ": "
+                    << strerror(errno);
+  WriteAllOrDie(out_fd, OutputStream::kBlockFormatMagic,
+                OutputStream::kBlockFormatMagicSize);
+
+  IndexBuilder index_builder;
+  uint64_t offset = OutputStream::kBlockFormatMagicSize;
+  std::string compressed;
+  std::string block;
+  while (true) {
+    char header[OutputStream::kBlockHeaderSize];
+    if (!PReadAll(fd, header, sizeof(header), offset)) {
+      break;
+    }
+
+    uint32_t compressed_size;
+    uint32_t uncompressed_size;
+    const uint8_t* ptr = reinterpret_cast<const uint8_t*>(header);
+    ptr = CodedInputStream::ReadLittleEndian32FromArray(ptr, &compressed_size);
+    CodedInputStream::ReadLittleEndian32FromArray(ptr, &uncompressed_size);
+    if (compressed_size == OutputStream::kIndexMarker) {
+      break;
+    }
+
+    BlockExtents block_extents;
+    std::vector<PBManifestEntry> manifest_entries;
+    compressed.resize(compressed_size);
+    if (!PReadAll(fd, &compressed[0], compressed_size,
+                  offset + sizeof(header)) ||
+        !DecompressBlock(compressed, uncompressed_size, &block) ||
+        !AddBlockToExtents(block, &block_extents, &manifest_entries)) {
+      LOG(ERROR) << "Corrupt metrics block at " << offset
+                 << ", will drop the rest of " << file;
+      break;
+    }
+
+    // Blocks are copied as they are, so they have the same offsets in the
+    // new file.
+    WriteAllOrDie(out_fd, header, sizeof(header));
+    WriteAllOrDie(out_fd, compressed.data(), compressed.size());
+    index_builder.AddBlock(offset, block_extents, manifest_entries);
+    offset += sizeof(header) + compressed_size;
+  }
+
+  std::string trailer = index_builder.Trailer(offset);
+  WriteAllOrDie(out_fd, trailer.data(), trailer.size());
+  close(out_fd);
+}
+
+// Writes all records of a file in the old format to a new file in block
+// format. Returns false if not a single record could be read, in which case
+// the file is probably not a metrics file at all.
+static bool ConvertToBlockFormat(const std::string& file,
+                                 const std::string& out_file) {
+  InputStream input_stream(file);
+  OutputStream output_stream(out_file, 0);
+  uint32_t manifest_index;
+  PBMetricEntry entry;
+  size_t record_count = 0;
+  while (input_stream.ReadDelimitedHeaderFrom(&manifest_index)) {
+    // The index of chunk records is not used by metrics, but would be taken
+    // for one in block format.
+    entry.Clear();
+    if (manifest_index == kChunkRecordIndex ||
+        !input_stream.ReadDelimitedFrom(&entry)) {
+      LOG(ERROR) << "Corrupt metrics record " << record_count
+                 << ", will drop the rest of " << file;
+      break;
+    }
+
+    output_stream.WriteSingle(entry, manifest_index);
+    ++record_count;
+  }
+
+  return record_count > 0;
+}
+
+bool AddIndexToFile(const std::string& file) {
+  int fd = open(file.c_str(), O_RDONLY);
+  CHECK(fd > 0) << "Bad file " << file << ": " << strerror(errno);
+
+  // OutputStream holds the lock until the file is complete.
+  if (flock(fd, LOCK_EX | LOCK_NB) != 0) {
+    LOG(ERROR) << "Metrics file " << file << " is still being written to";
+    close(fd);
+    return false;
+  }
+
+  char magic[OutputStream::kBlockFormatMagicSize];
+  bool block_format =
+      PReadAll(fd, magic, sizeof(magic), 0) &&
+      memcmp(magic, OutputStream::kBlockFormatMagic, sizeof(magic)) == 0;
+
+  // The original file is only replaced once the new one is complete.
+  std::string tmp_file = StrCat(file, ".index_tmp");
+  if (block_format) {
+    CopyBlocksWithIndex(fd, file, tmp_file);
+  } else if (!ConvertToBlockFormat(file, tmp_file)) {
+    LOG(ERROR) << "No metrics records in " << file << ", will not index it";
+    std::remove(tmp_file.c_str());
+    close(fd);
+    return false;
+  }
+
+  int tmp_fd = open(tmp_file.c_str(), O_RDONLY);
+  CHECK(tmp_fd > 0 && fsync(tmp_fd) == 0) << "Unable to sync " << tmp_file;
+  close(tmp_fd);
+  CHECK(rename(tmp_file.c_str(), file.c_str()) == 0)
+      << "Unable to replace " << file << ": " << strerror(errno);
+  close(fd);
+  return true;
+}
+
+bool InputStream::ReadChunk(DecodedChunk* chunk) {
+  CHECK(InChunk());
+  size_t position = chunk_position_;
+  chunk_position_ = chunk_size_;
+  if (chunk_decoded_) {
+    std::swap(*chunk, decoded_chunk_);
+    chunk_decoded_ = false;
+  } else if (!DecodeChunk(chunk_, chunk)) {
+    LOG(ERROR) << "Corrupt metrics chunk";
+    return false;
+  }
+
+  if (position > 0) {
+    chunk->RemovePrefix(position);
+  }
   return true;
 }
 
 bool InputStream::SkipMessage() {
-  google::protobuf::io::CodedInputStream input(file_input_.get());
+  if (InChunk()) {
+    ++chunk_position_;
+    return true;
+  }
+
+  google::protobuf::io::CodedInputStream input(input_);
 
   // Read the size.
   uint32_t size;
@@ -220,8 +986,22 @@ bool InputStream::SkipMessage() {
 }
 
 bool InputStream::ReadDelimitedFrom(PBMetricEntry* message) {
+  if (InChunk()) {
+    if (!chunk_decoded_) {
+      if (!DecodeChunk(chunk_, &decoded_chunk_)) {
+        LOG(ERROR) << "Corrupt metrics chunk";
+        SkipChunk();
+        return false;
+      }
+      chunk_decoded_ = true;
+    }
+
+    decoded_chunk_.ToProtobuf(chunk_position_++, message);
+    return true;
+  }
+
   // We create a new coded stream for each message.
-  google::protobuf::io::CodedInputStream input(file_input_.get());
+  google::protobuf::io::CodedInputStream input(input_);
 
   // Read the size.
   uint32_t size;
@@ -268,9 +1048,60 @@ void PopulateManifestEntryField(PBMetricField* field,
   field->set_string_value(value);
 }
 
+constexpr uint64_t MetricManager::kCollectorPeriodMs;
+
+// Hands out thread indices, smallest first.
+class ThreadIndexPool {
+ public:
+  ThreadIndexPool() : next_index_(0) {}
+
+  size_t Get() {
+    std::lock_guard<std::mutex> lock(mu_);
+    if (free_indices_.empty()) {
+      return next_index_++;
+    }
+
+    size_t index = free_indices_.top();
+    free_indices_.pop();
+    return index;
+  }
+
+  void Release(size_t index) {
+    std::lock_guard<std::mutex> lock(mu_);
+    free_indices_.emplace(index);
+  }
+
+ private:
+  std::mutex mu_;
+  std::priority_queue<size_t, std::vector<size_t>, std::greater<size_t>>
+      free_indices_;
+  size_t next_index_;
+};
+
+// Threads can exit after static objects are destroyed, so the pool is never
+// deleted.
+static ThreadIndexPool* GetThreadIndexPool() {
+  static ThreadIndexPool* pool = new ThreadIndexPool();
+  return pool;
+}
+
+// The index of a thread, returned to the pool when the thread exits.
+struct ThreadIndex {
+  ThreadIndex() : index(GetThreadIndexPool()->Get()) {}
+  ~ThreadIndex() { GetThreadIndexPool()->Release(index); }
+
+  size_t index;
+};
+
+size_t MetricThreadIndex() {
+  static thread_local ThreadIndex thread_index;
+  return thread_index.index;
+}
+
 MetricManager::MetricManager()
     : current_index_(std::numeric_limits<size_t>::max()),
-      timestamp_provider_(make_unique<DefaultTimestampProvider>()) {}
+      timestamp_provider_(make_unique<DefaultTimestampProvider>()),
+      collector_stop_(false) {}
 
 size_t MetricManager::NextIndex() { return ++current_index_; }
 
@@ -335,6 +1166,8 @@ OutputStream* MetricBase::OutputStreamOrNull() {
   return nullptr;
 }
 
+void MetricBase::WakeCollector() { parent_manager_->WakeCollector(); }
+
 size_t MetricBase::NextIndex() {
   if (local_output_stream_) {
     return ++local_current_index_;
@@ -364,7 +1197,40 @@ void MetricManager::PollAllMetrics() {
   }
 }
 
-MetricManager::~MetricManager() { PersistAllMetrics(); }
+void MetricManager::DrainAllMetrics() {
+  std::lock_guard<std::mutex> lock(mu_);
+  for (const auto& metric_ptr : all_metrics_) {
+    metric_ptr->DrainAllHandles();
+  }
+}
+
+void MetricManager::RunCollector() {
+  std::unique_lock<std::mutex> lock(collector_mu_);
+  while (!collector_stop_) {
+    collector_cv_.wait_for(lock, std::chrono::milliseconds(kCollectorPeriodMs));
+    lock.unlock();
+    DrainAllMetrics();
+    lock.lock();
+  }
+}
+
+void MetricManager::StopCollector() {
+  if (!collector_.joinable()) {
+    return;
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(collector_mu_);
+    collector_stop_ = true;
+  }
+  collector_cv_.notify_all();
+  collector_.join();
+}
+
+MetricManager::~MetricManager() {
+  StopCollector();
+  PersistAllMetrics();
+}
 
 MetricManager* DefaultMetricManager() {
   static MetricManager default_manager;
@@ -1,8 +1,11 @@
 #ifndef NCODE_METRICS_METRIC_H
 #define NCODE_METRICS_METRIC_H
 
+#include <algorithm>
 #include <array>
+#include <atomic>
 #include <chrono>
+#include <condition_variable>
 #include <queue>
 #include <map>
 #include <thread>
@@ -20,43 +23,140 @@
 #include "../common/circular_array.h"
 #include "../common/event_queue.h"
 #include "../common/logging.h"
+#include "../common/ptr_queue.h"
+#include "../common/spsc_ring.h"
 #include "../common/strutil.h"
 #include "metrics.pb.h"
+#include "metrics_chunk.h"
 
 namespace ncode {
 namespace metrics {
 
-// A file descriptor along with an output stream. All are populated upon
-// construction.
+class IndexBuilder;
+
+// Writes entries to a file. Entries are grouped in blocks, which are
+// serialized, compressed and written by background threads, so callers only
+// pay for queueing entries. The file starts with kBlockFormatMagic. Each
+// block has a header of three little-endian 32-bit integers: the compressed
+// size, the uncompressed size and the number of records in the block. The
+// header is followed by the zlib-compressed block. Uncompressed, a block has
+// the same format as files that were written before blocks were introduced:
+// for each record a varint manifest index, a varint size and the serialized
+// entry. A record can also be a chunk of values of a single metric (see
+// metrics_chunk.h), in which case its manifest index is kChunkRecordIndex.
+// Blocks are independent of each other, so readers can skip a block without
+// decompressing it.
+//
+// The last block is followed by an index (a PBMetricsIndex) of where the
+// values of each metric are. In place of a block header the index has
+// kIndexMarker and its size, both as little-endian 32-bit integers. The file
+// ends with the offset of kIndexMarker as a little-endian 64-bit integer and
+// kIndexMagic, so that readers can find the index from the end of the file.
+// Files that do not end with kIndexMagic, because they were cut short or were
+// written before indices were introduced, can still be read sequentially.
 class OutputStream {
  public:
-  OutputStream(const std::string& file);
+  static constexpr char kBlockFormatMagic[] = "NCMBLK01";
+  static constexpr size_t kBlockFormatMagicSize = 8;
+  static constexpr size_t kBlockHeaderSize = 12;
 
+  static constexpr uint32_t kIndexMarker = 0xFFFFFFFF;
+  static constexpr char kIndexMagic[] = "NCMIDX01";
+  static constexpr size_t kIndexMagicSize = 8;
+  static constexpr size_t kIndexFooterSize = 16;
+
+  // Number of records in each block, other than the last one.
+  static constexpr size_t kEntriesPerBlock = 16384;
+
+  // Number of full blocks that can wait for the writers before callers
+  // block.
+  static constexpr size_t kMaxQueuedBlocks = 8;
+
+  // The zlib compression level of blocks. Higher levels compress metrics only
+  // slightly better, but are several times slower.
+  static constexpr int kCompressionLevel = 1;
+
+  // Blocks are processed by up to 'writer_threads' threads, which are only
+  // started once the first block is full. If 'writer_threads' is 0 blocks are
+  // written by the caller that fills them.
+  OutputStream(const std::string& file, size_t writer_threads = 2);
+
+  // Writes out all entries.
   ~OutputStream();
 
-  // Writes a series of entries to the stream.
-  void WriteBulk(const std::vector<PBMetricEntry>& entries,
-                 uint32_t manifest_index);
+  // Writes a series of entries to the stream. Takes the entries, leaving
+  // 'entries' empty.
+  void WriteBulk(std::vector<PBMetricEntry>* entries, uint32_t manifest_index);
 
   // Writes a single entry to the stream.
   void WriteSingle(const PBMetricEntry& entry, uint32_t manifest_index);
 
+  // Writes an encoded chunk to the stream. Takes the chunk, leaving 'chunk'
+  // empty.
+  void WriteChunk(std::string* chunk);
+
  private:
-  // Writes a protobuf to the stream.
-  bool WriteDelimitedTo(const PBMetricEntry& entry, uint32_t manifest_index);
+  // Either an entry or a chunk.
+  struct Record {
+    uint32_t manifest_index;
+    PBMetricEntry entry;
+    std::string chunk;
+  };
+
+  // Entries that go in the same block.
+  struct Block {
+    // Blocks are written in order of sequence.
+    uint64_t sequence;
+    std::vector<Record> records;
+  };
+
+  // Adds an empty record to the current block and returns it. Should be
+  // called with mu_ held, followed by RecordAdded once the record is
+  // populated.
+  Record* NextRecord();
+
+  // Queues the current block if it is full. Should be called with mu_ held.
+  void RecordAdded();
+
+  // Serializes, compresses and writes out a block, after all blocks that come
+  // before it.
+  void WriteBlock(const Block& block);
+
+  // Writes blocks from the queue until it is closed.
+  void RunWriter();
 
   // A file descriptor. Closed on destruction.
   int fd_;
 
-  // File output stream. Owned by this object.
-  std::unique_ptr<google::protobuf::io::FileOutputStream> file_output_;
+  // Number of threads to start when the first block is full.
+  const size_t writer_threads_count_;
 
-  // The output stream is thread safe.
+  // The block that entries are currently added to.
+  std::unique_ptr<Block> current_block_;
+
+  // Full blocks that wait for a writer.
+  PtrQueue<Block, kMaxQueuedBlocks> queue_;
+
+  std::vector<std::thread> writer_threads_;
+
+  // Protects current_block_ and writer_threads_, and orders blocks in the
+  // queue.
   std::mutex mu_;
 
+  // The sequence of the next block to write to the file, where in the file
+  // it will go and the index of the blocks written so far, protected by
+  // write_mu_.
+  uint64_t next_sequence_;
+  uint64_t file_offset_;
+  std::unique_ptr<IndexBuilder> index_builder_;
+  std::mutex write_mu_;
+  std::condition_variable write_condition_;
+
   DISALLOW_COPY_AND_ASSIGN(OutputStream);
 };
 
+// Reads entries from files written by OutputStream. Files that were written
+// before blocks were introduced can also be read.
 class InputStream {
  public:
   InputStream(const std::string& file);
@@ -75,6 +175,27 @@ class InputStream {
   // ReadDelimitedHeaderFrom.
   bool ReadDelimitedFrom(PBMetricEntry* message);
 
+  // The calls above return the values of a chunk one at a time, as if they
+  // were separate entries. Readers that can handle many values at once can
+  // instead check if the entry whose header was just read is in a chunk, and
+  // if it is read or skip it, and the rest of the chunk, in one call.
+  bool InChunk() const { return chunk_position_ < chunk_size_; }
+
+  // Decodes the rest of the current chunk. Should only be called if InChunk
+  // returns true.
+  bool ReadChunk(DecodedChunk* chunk);
+
+  // Skips over the rest of the current chunk, without decoding it.
+  void SkipChunk() { chunk_position_ = chunk_size_; }
+
+  // Reads the index at the end of the file. Returns false if the file has no
+  // index.
+  bool ReadIndex(PBMetricsIndex* index);
+
+  // Moves to the block at 'offset', which should come from the index. After
+  // this call only the entries of that block are returned.
+  void SeekToBlock(uint64_t offset);
+
  private:
   // File descriptor. Closed on destruction.
   int fd_;
@@ -82,9 +203,36 @@ class InputStream {
   // File input stream. Owned by this object.
   std::unique_ptr<google::protobuf::io::FileInputStream> file_input_;
 
+  // Decompresses blocks from file_input_. Null if the file is not in block
+  // format.
+  std::unique_ptr<google::protobuf::io::ZeroCopyInputStream> block_input_;
+
+  // The stream that entries are read from, either file_input_ or
+  // block_input_.
+  google::protobuf::io::ZeroCopyInputStream* input_;
+
+  // The most recently read chunk, its manifest index, how many values it
+  // has and how many of them have been returned. Chunks are only decoded if
+  // their values are read.
+  std::string chunk_;
+  uint32_t chunk_manifest_index_;
+  size_t chunk_size_;
+  size_t chunk_position_;
+  bool chunk_decoded_;
+  DecodedChunk decoded_chunk_;
+
   DISALLOW_COPY_AND_ASSIGN(InputStream);
 };
 
+// Rewrites a file so that it is in block format and has an index. Files in
+// block format keep all blocks up to the first truncated or corrupt one, and
+// have their index rebuilt. Files in the old format are converted, up to the
+// first corrupt record. The new file is written next to the original and
+// renamed over it once complete, so the original is never modified in place.
+// Returns false and leaves the file as it is if an OutputStream is still
+// writing to it, or if it is not in block format and has no records.
+bool AddIndexToFile(const std::string& file);
+
 // Converts common::Distribution to PBDistribution. When serializing the type of
 // the original distribution is coerced to double.
 template <typename T>
@@ -134,7 +282,7 @@ template <typename T>
 void ParseEntryFromProtobuf(const PBMetricEntry& entry, Entry<T>* out) {
   Unused(entry);
   Unused(out);
-  assert(false);
+  LOG(FATAL) << "Unsupported metric type";
 }
 
 template <>
@@ -168,7 +316,7 @@ template <typename T>
 void SaveEntryToProtobuf(const Entry<T>& entry, PBMetricEntry* out) {
   Unused(entry);
   Unused(out);
-  assert(false);
+  LOG(FATAL) << "Unsupported metric type";
 }
 
 template <>
@@ -202,6 +350,72 @@ void SaveEntryToProtobuf(const Entry<Distribution<T>>& entry,
   *out->mutable_distribution_value() = DistributionToProtobuf(entry_value);
 }
 
+// Encodes a series of entries as a chunk. Returns false if entries of this
+// type are not stored in chunks, in which case they are stored as separate
+// protobufs.
+template <typename T>
+bool SaveEntriesToChunk(const std::vector<Entry<T>>& entries,
+                        uint32_t manifest_index, std::string* out) {
+  Unused(entries);
+  Unused(manifest_index);
+  Unused(out);
+  return false;
+}
+
+template <>
+bool SaveEntriesToChunk<uint64_t>(const std::vector<Entry<uint64_t>>& entries,
+                                  uint32_t manifest_index, std::string* out);
+
+template <>
+bool SaveEntriesToChunk<uint32_t>(const std::vector<Entry<uint32_t>>& entries,
+                                  uint32_t manifest_index, std::string* out);
+
+template <>
+bool SaveEntriesToChunk<bool>(const std::vector<Entry<bool>>& entries,
+                              uint32_t manifest_index, std::string* out);
+
+template <>
+bool SaveEntriesToChunk<double>(const std::vector<Entry<double>>& entries,
+                                uint32_t manifest_index, std::string* out);
+
+// Extracts the i-th value of a decoded chunk. Called for each value of the
+// chunk, so the specializations are inline.
+template <typename T>
+void ParseEntryFromChunk(const DecodedChunk& chunk, size_t i, Entry<T>* out) {
+  Unused(chunk);
+  Unused(i);
+  Unused(out);
+  LOG(FATAL) << "Unsupported metric type";
+}
+
+template <>
+inline void ParseEntryFromChunk<uint64_t>(const DecodedChunk& chunk, size_t i,
+                                          Entry<uint64_t>* out) {
+  out->timestamp = chunk.timestamps[i];
+  out->value = chunk.integer_values[i];
+}
+
+template <>
+inline void ParseEntryFromChunk<uint32_t>(const DecodedChunk& chunk, size_t i,
+                                          Entry<uint32_t>* out) {
+  out->timestamp = chunk.timestamps[i];
+  out->value = static_cast<uint32_t>(chunk.integer_values[i]);
+}
+
+template <>
+inline void ParseEntryFromChunk<bool>(const DecodedChunk& chunk, size_t i,
+                                      Entry<bool>* out) {
+  out->timestamp = chunk.timestamps[i];
+  out->value = chunk.integer_values[i] != 0;
+}
+
+template <>
+inline void ParseEntryFromChunk<double>(const DecodedChunk& chunk, size_t i,
+                                        Entry<double>* out) {
+  out->timestamp = chunk.timestamps[i];
+  out->value = chunk.double_values[i];
+}
+
 // A generic interface for a class that knows how to provide timestamps.
 class TimestampProviderInterface {
  public:
@@ -307,11 +521,134 @@ struct SomethingWithMutex<true> {
   mutable std::mutex mu_;
 };
 
+// Returns a small number that is unique among running threads. The numbers
+// of threads that have exited are reused.
+size_t MetricThreadIndex();
+
+// Mixin for handles that let each thread buffer entries in a ring of its own.
+// Handles that are not thread safe do not buffer.
+template <typename EntryType, bool>
+struct SomethingWithThreadBuffers {
+  inline size_t TryBuffer(const Entry<EntryType>& entry) {
+    Unused(entry);
+    return 0;
+  }
+
+  inline void DrainBuffers(std::vector<Entry<EntryType>>* out) const {
+    Unused(out);
+  }
+};
+template <typename EntryType>
+struct SomethingWithThreadBuffers<EntryType, true> {
+  // Threads that get an index above this do not buffer.
+  static constexpr size_t kMaxThreads = 64;
+  static constexpr size_t kEntriesInBuffer = 1024;
+  using Buffer = SPSCRing<Entry<EntryType>, kEntriesInBuffer>;
+
+  // Buffers are allocated on first use, so that handles that are only used
+  // by one thread, or not at all, stay small.
+  struct Buffers {
+    Buffers() {
+      for (std::atomic<Buffer*>& buffer : per_thread) {
+        buffer.store(nullptr, std::memory_order_relaxed);
+      }
+    }
+
+    ~Buffers() {
+      for (std::atomic<Buffer*>& buffer : per_thread) {
+        delete buffer.load(std::memory_order_relaxed);
+      }
+    }
+
+    std::array<std::atomic<Buffer*>, kMaxThreads> per_thread;
+  };
+
+  SomethingWithThreadBuffers() : buffers_(nullptr) {}
+
+  ~SomethingWithThreadBuffers() {
+    delete buffers_.load(std::memory_order_relaxed);
+  }
+
+  // Adds an entry to the calling thread's buffer without taking a lock.
+  // Returns the number of entries in the buffer, or 0 if the buffer is full
+  // or the thread cannot have one.
+  inline size_t TryBuffer(const Entry<EntryType>& entry) {
+    size_t thread_index = MetricThreadIndex();
+    if (thread_index >= kMaxThreads) {
+      return 0;
+    }
+
+    Buffers* buffers = buffers_.load(std::memory_order_acquire);
+    if (buffers == nullptr) {
+      Buffers* new_buffers = new Buffers();
+      if (buffers_.compare_exchange_strong(buffers, new_buffers,
+                                           std::memory_order_acq_rel)) {
+        buffers = new_buffers;
+      } else {
+        delete new_buffers;
+      }
+    }
+
+    // Only this thread ever sets its own buffer.
+    std::atomic<Buffer*>& slot = buffers->per_thread[thread_index];
+    Buffer* buffer = slot.load(std::memory_order_relaxed);
+    if (buffer == nullptr) {
+      buffer = new Buffer();
+      slot.store(buffer, std::memory_order_release);
+    }
+
+    if (!buffer->TryPush(entry)) {
+      return 0;
+    }
+
+    return buffer->size();
+  }
+
+  // Moves all buffered entries to 'out'. The entries from different threads
+  // are merged by timestamp. Calls should not overlap.
+  void DrainBuffers(std::vector<Entry<EntryType>>* out) const {
+    Buffers* buffers = buffers_.load(std::memory_order_acquire);
+    if (buffers == nullptr) {
+      return;
+    }
+
+    size_t start = out->size();
+    for (std::atomic<Buffer*>& slot : buffers->per_thread) {
+      Buffer* buffer = slot.load(std::memory_order_acquire);
+      if (buffer == nullptr) {
+        continue;
+      }
+
+      size_t merged_until = out->size();
+      buffer->PopAll(out);
+      std::inplace_merge(out->begin() + start, out->begin() + merged_until,
+                         out->end(), [](const Entry<EntryType>& lhs,
+                                        const Entry<EntryType>& rhs) {
+                           return lhs.timestamp < rhs.timestamp;
+                         });
+    }
+  }
+
+  std::atomic<Buffers*> buffers_;
+};
+
+// A handle that values can be added to. If the handle is thread safe, values
+// are first buffered by the thread that adds them, without taking locks. They
+// are moved into the handle's history and persisted when the history is
+// read, when a thread's buffer fills up, or regularly by the metric manager's
+// collector thread. Values that different threads add are ordered by
+// timestamp within each batch that is moved.
 template <typename EntryType, bool ThreadSafe>
 class MetricHandle : public MetricHandleBase,
-                     private SomethingWithMutex<ThreadSafe> {
+                     private SomethingWithMutex<ThreadSafe>,
+                     private SomethingWithThreadBuffers<EntryType, ThreadSafe> {
  public:
   static constexpr size_t kEntriesInMem = 32;
+
+  // When a thread has buffered this many values the collector is woken up.
+  static constexpr size_t kBufferedBeforeCollect =
+      SomethingWithThreadBuffers<EntryType, true>::kEntriesInBuffer / 2;
+
   using MetricCallback = std::function<EntryType()>;
 
   MetricHandle(MetricBase* parent_metric, MetricCallback callback);
@@ -320,6 +657,7 @@ class MetricHandle : public MetricHandleBase,
 
   size_t NumEntriesInMem() const override {
     std::unique_lock<std::mutex> lock = GetLock();
+    DrainPrivate();
     return storage_.size();
   }
 
@@ -332,8 +670,15 @@ class MetricHandle : public MetricHandleBase,
 
   void Persist() override;
 
+  // Moves all values that threads have buffered to the history.
+  void Drain() {
+    std::unique_lock<std::mutex> lock = GetLock();
+    DrainPrivate();
+  }
+
   bool MostRecentEntryInMem(Entry<EntryType>* entry) const {
     std::unique_lock<std::mutex> lock = GetLock();
+    DrainPrivate();
     if (storage_.empty()) {
       return false;
     }
@@ -344,15 +689,25 @@ class MetricHandle : public MetricHandleBase,
 
  private:
   using SomethingWithMutex<ThreadSafe>::GetLock;
+  using SomethingWithThreadBuffers<EntryType, ThreadSafe>::TryBuffer;
+  using SomethingWithThreadBuffers<EntryType, ThreadSafe>::DrainBuffers;
 
-  std::vector<Entry<EntryType>> PersistPrivate();
+  std::vector<Entry<EntryType>> PersistPrivate() const;
 
-  void ValuesToDisk(const std::vector<Entry<EntryType>>& values);
+  void ValuesToDisk(const std::vector<Entry<EntryType>>& values) const;
 
   Entry<EntryType> PollAndAdd(uint64_t time_now);
 
   Entry<EntryType> AddValuePrivate(EntryType value, uint64_t time_now);
 
+  // Adds an entry to the history. Should be called with the lock held.
+  void AddToStorage(const Entry<EntryType>& entry) const;
+
+  // Moves buffered values to the history. Should be called with the lock
+  // held. Buffered values are logically already part of the history, so this
+  // can be called from const methods.
+  void DrainPrivate() const;
+
   // A callback to the app to provide values.
   const MetricCallback app_callback_;
 
@@ -361,10 +716,13 @@ class MetricHandle : public MetricHandleBase,
   // logged this is decremented and when it reaches 0 it the log is flushed. The
   // counter is reset to the max number of messages that can be stored in the
   // in-mem circular buffer (NumValues).
-  size_t log_tokens_;
+  mutable size_t log_tokens_;
 
   // Elements stored.
-  CircularArray<Entry<EntryType>, kEntriesInMem> storage_;
+  mutable CircularArray<Entry<EntryType>, kEntriesInMem> storage_;
+
+  // Values that were just moved out of the threads' buffers.
+  mutable std::vector<Entry<EntryType>> drained_;
 
   DISALLOW_COPY_AND_ASSIGN(MetricHandle);
 };
@@ -435,6 +793,10 @@ class MetricBase {
   // Causes all handles to be persisted.
   virtual void PersistAllHandles() = 0;
 
+  // Causes values that threads have buffered in handles to be moved to the
+  // handles' histories.
+  virtual void DrainAllHandles() = 0;
+
   // Causes all handles that have callbacks registered to get their value.
   virtual void PollAllHandles() = 0;
 
@@ -456,6 +818,9 @@ class MetricBase {
   // stream when it cannot be set will result in a crash.
   bool stream_locked() const { return stream_locked_; }
 
+  // Asks the parent manager's collector to drain all metrics now.
+  void WakeCollector();
+
  protected:
   MetricBase(MetricManager* metric_manager, PBManifestEntry base_entry)
       : parent_manager_(metric_manager),
@@ -502,6 +867,20 @@ class Metric : public MetricBase, private SomethingWithMutex<ThreadSafe> {
     }
   }
 
+  void DrainAllHandles() override {
+    // Handles that are not thread safe do not buffer. They should also not be
+    // touched by threads other than the one that uses them.
+    if (!ThreadSafe) {
+      return;
+    }
+
+    std::unique_lock<std::mutex> lock = GetLock();
+    for (auto& handle_fields_and_handle : fields_to_handle_) {
+      HandleType& handle = handle_fields_and_handle.second;
+      handle.Drain();
+    }
+  }
+
   void PollAllHandles() override {
     std::unique_lock<std::mutex> lock = GetLock();
     for (auto& handle_fields_and_handle : fields_to_handle_) {
@@ -563,6 +942,15 @@ class MetricManager {
 
   void PollAllMetrics();
 
+  // Moves the values that threads have buffered in thread-safe handles to the
+  // handles' histories. Called regularly by a background thread once there
+  // are thread-safe metrics.
+  void DrainAllMetrics();
+
+  // Makes the collector thread drain all metrics without waiting for the end
+  // of its period.
+  void WakeCollector() { collector_cv_.notify_one(); }
+
   size_t NextIndex();
 
   // Sets the output. Should only be called once. If the second argument is
@@ -598,6 +986,10 @@ class MetricManager {
     }
 
     all_metrics_.push_back(std::move(metric));
+    if (ThreadSafe && !collector_.joinable()) {
+      collector_ = std::thread([this] { RunCollector(); });
+    }
+
     return raw_metric_ptr;
   }
 
@@ -653,6 +1045,15 @@ class MetricManager {
     return;
   }
 
+  // How often the collector thread drains the metrics.
+  static constexpr uint64_t kCollectorPeriodMs = 100;
+
+  // Drains all metrics every kCollectorPeriodMs until stopped.
+  void RunCollector();
+
+  // Stops the collector thread, if it is running.
+  void StopCollector();
+
   // The current index that will be incremented and returned by NextIndex. Only
   // used if there is a single output file. If there are per-metric files each
   // metric will have its own index space.
@@ -673,6 +1074,15 @@ class MetricManager {
 
   // Protects current_index_ and all_metrics_;
   std::mutex mu_;
+
+  // Drains thread-safe metrics. Only started when the first thread-safe
+  // metric is created.
+  std::thread collector_;
+
+  // Protects collector_stop_.
+  std::mutex collector_mu_;
+  std::condition_variable collector_cv_;
+  bool collector_stop_;
 };
 
 // Returns the default metric manager singleton.
@@ -715,6 +1125,7 @@ template <typename EntryType, bool ThreadSafe>
 typename MetricHandleBase::Span
 MetricHandle<EntryType, ThreadSafe>::EntriesInMemSpan() const {
   std::unique_lock<std::mutex> lock = GetLock();
+  DrainPrivate();
   if (storage_.empty()) {
     return std::make_pair(std::numeric_limits<uint64_t>::min(),
                           std::numeric_limits<uint64_t>::min());
@@ -727,13 +1138,15 @@ MetricHandle<EntryType, ThreadSafe>::EntriesInMemSpan() const {
 
 template <typename EntryType, bool ThreadSafe>
 void MetricHandle<EntryType, ThreadSafe>::Persist() {
+  std::unique_lock<std::mutex> lock = GetLock();
+  DrainPrivate();
   std::vector<Entry<EntryType>> values = PersistPrivate();
   ValuesToDisk(values);
 }
 
 template <typename EntryType, bool ThreadSafe>
 std::vector<Entry<EntryType>>
-MetricHandle<EntryType, ThreadSafe>::PersistPrivate() {
+MetricHandle<EntryType, ThreadSafe>::PersistPrivate() const {
   std::vector<Entry<EntryType>> values = storage_.GetValues();
 
   // How many values we have to skip from the start of the log.
@@ -745,9 +1158,15 @@ MetricHandle<EntryType, ThreadSafe>::PersistPrivate() {
 
 template <typename EntryType, bool ThreadSafe>
 void MetricHandle<EntryType, ThreadSafe>::ValuesToDisk(
-    const std::vector<Entry<EntryType>>& values) {
+    const std::vector<Entry<EntryType>>& values) const {
   OutputStream* output_stream = parent_metric_->OutputStreamOrNull();
-  if (!output_stream) {
+  if (!output_stream || values.empty()) {
+    return;
+  }
+
+  std::string chunk;
+  if (SaveEntriesToChunk(values, metric_index_, &chunk)) {
+    output_stream->WriteChunk(&chunk);
     return;
   }
 
@@ -756,7 +1175,7 @@ void MetricHandle<EntryType, ThreadSafe>::ValuesToDisk(
     const Entry<EntryType>& value = values[i];
     SaveEntryToProtobuf(value, &entries_to_stream[i]);
   }
-  output_stream->WriteBulk(entries_to_stream, metric_index_);
+  output_stream->WriteBulk(&entries_to_stream, metric_index_);
 }
 
 template <typename EntryType, bool ThreadSafe>
@@ -771,15 +1190,43 @@ template <typename EntryType, bool ThreadSafe>
 Entry<EntryType> MetricHandle<EntryType, ThreadSafe>::AddValuePrivate(
     EntryType value, uint64_t time_now) {
   Entry<EntryType> entry = {value, time_now};
+  size_t buffered = TryBuffer(entry);
+  if (buffered == kBufferedBeforeCollect) {
+    // Better to have the collector move the values, and persist them, before
+    // the buffer fills up and this thread has to do it.
+    parent_metric_->WakeCollector();
+  }
+
+  if (buffered > 0) {
+    return entry;
+  }
+
+  // The thread's buffer is full, or the thread has none. What is already
+  // buffered goes first.
   std::unique_lock<std::mutex> lock = GetLock();
+  DrainPrivate();
+  AddToStorage(entry);
+  return entry;
+}
+
+template <typename EntryType, bool ThreadSafe>
+void MetricHandle<EntryType, ThreadSafe>::AddToStorage(
+    const Entry<EntryType>& entry) const {
   storage_.AddValue(entry);
 
   --log_tokens_;
   if (log_tokens_ == 0) {
-    Persist();
+    ValuesToDisk(PersistPrivate());
   }
+}
 
-  return entry;
+template <typename EntryType, bool ThreadSafe>
+void MetricHandle<EntryType, ThreadSafe>::DrainPrivate() const {
+  DrainBuffers(&drained_);
+  for (const Entry<EntryType>& entry : drained_) {
+    AddToStorage(entry);
+  }
+  drained_.clear();
 }
 
 template <typename EntryType, bool ThreadSafe, typename... FieldTypes>
@@ -0,0 +1,143 @@
+#include <stddef.h>
+#include <chrono>
+#include <cstdio>
+#include <iostream>
+#include <memory>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "../common/common.h"
+#include "../common/file.h"
+#include "metrics.h"
+#include "metrics_parser.h"
+
+using namespace std::chrono;
+using namespace ncode;
+
+static constexpr size_t kValuesPerThread = 1000000;
+static constexpr char kOutput[] = "metrics_benchmark.out";
+
+// Has a number of threads add values to the same thread-safe handle and
+// returns the number of nanoseconds each value took, as seen by the threads.
+// If 'to_file' is false values are not persisted.
+static double NanosPerValue(size_t thread_count, bool to_file) {
+  auto metric_manager = make_unique<metrics::MetricManager>();
+  if (to_file) {
+    metric_manager->SetOutput(kOutput, false);
+  }
+  auto* metric =
+      metric_manager->GetThreadSafeMetric<uint64_t>("metric", "A metric");
+  auto* handle = metric->GetHandle();
+
+  auto start = high_resolution_clock::now();
+  std::vector<std::thread> threads;
+  for (size_t i = 0; i < thread_count; ++i) {
+    threads.emplace_back([handle] {
+      for (size_t value = 0; value < kValuesPerThread; ++value) {
+        handle->AddValue(value);
+      }
+    });
+  }
+
+  for (std::thread& thread : threads) {
+    thread.join();
+  }
+  auto end = high_resolution_clock::now();
+
+  // Everything that is still buffered is written out when the manager goes.
+  metric_manager.reset();
+  std::remove(kOutput);
+
+  uint64_t duration_ns = duration_cast<nanoseconds>(end - start).count();
+  return static_cast<double>(duration_ns) / (thread_count * kValuesPerThread);
+}
+
+// Writes out values of a single uint64 metric, either as entries or in
+// chunks, the same way MetricHandle persists them.
+static void WriteValues(size_t value_count, bool chunks) {
+  metrics::OutputStream output_stream(kOutput);
+  metrics::PBMetricEntry manifest_entry;
+  manifest_entry.mutable_manifest_entry()->set_type(
+      metrics::PBManifestEntry::UINT64);
+  manifest_entry.mutable_manifest_entry()->set_id("metric");
+  output_stream.WriteSingle(manifest_entry,
+                            metrics::MetricBase::kManifestEntryMetaIndex);
+
+  // Values are spaced by ~1us and are a slowly growing counter.
+  std::vector<metrics::Entry<uint64_t>> values;
+  uint64_t timestamp = 1000000000;
+  for (size_t i = 0; i < value_count; ++i) {
+    timestamp += 1000 + i % 7;
+    values.push_back({i / 3, timestamp});
+    if (values.size() < 32 && i != value_count - 1) {
+      continue;
+    }
+
+    if (chunks) {
+      std::string chunk;
+      metrics::SaveEntriesToChunk(values, 0, &chunk);
+      output_stream.WriteChunk(&chunk);
+    } else {
+      std::vector<metrics::PBMetricEntry> entries(values.size());
+      for (size_t j = 0; j < values.size(); ++j) {
+        metrics::SaveEntryToProtobuf(values[j], &entries[j]);
+      }
+      output_stream.WriteBulk(&entries, 0);
+    }
+    values.clear();
+  }
+}
+
+// Writes out a file and returns the number of nanoseconds it takes to parse
+// each value. The size of the file is returned in 'file_size'.
+static double NanosPerParsedValue(bool chunks, int* file_size) {
+  static constexpr size_t kValueCount = 10000000;
+  WriteValues(kValueCount, chunks);
+  *file_size = File::FileSizeOrDie(kOutput);
+
+  uint64_t sum = 0;
+  using Processor =
+      metrics::parser::IdCallbackProcessor<uint64_t,
+                                           metrics::PBManifestEntry::UINT64>;
+  auto processor = make_unique<Processor>(
+      std::set<uint32_t>({0}),
+      [&sum](const metrics::Entry<uint64_t>& entry,
+             const metrics::PBManifestEntry& manifest_entry,
+             uint32_t manifest_index) {
+        Unused(manifest_entry);
+        Unused(manifest_index);
+        sum += entry.value;
+      });
+
+  auto start = high_resolution_clock::now();
+  metrics::parser::MetricsParser parser(kOutput);
+  parser.AddProcessor(std::move(processor));
+  parser.Parse();
+  auto end = high_resolution_clock::now();
+  std::remove(kOutput);
+
+  CHECK(sum > 0);
+  uint64_t duration_ns = duration_cast<nanoseconds>(end - start).count();
+  return static_cast<double>(duration_ns) / kValueCount;
+}
+
+int main(int argc, char** argv) {
+  Unused(argc);
+  Unused(argv);
+
+  for (bool chunks : {false, true}) {
+    int file_size;
+    double parse_ns = NanosPerParsedValue(chunks, &file_size);
+    std::cout << (chunks ? "chunks: " : "entries: ") << file_size
+              << " bytes, " << parse_ns << "ns per value parsed\n";
+  }
+
+  for (size_t thread_count : {1, 2, 4, 8, 16, 32}) {
+    std::cout << thread_count << " threads "
+              << NanosPerValue(thread_count, false) << "ns per value, "
+              << NanosPerValue(thread_count, true)
+              << "ns per value persisted\n";
+  }
+}
@@ -0,0 +1,427 @@
+#include "metrics_chunk.h"
+
+#include <string.h>
+#include <algorithm>
+
+#include "../common/logging.h"
+
+namespace ncode {
+namespace metrics {
+
+static uint64_t ZigZagEncode(uint64_t value) {
+  int64_t sign = static_cast<int64_t>(value) >> 63;
+  return (value << 1) ^ static_cast<uint64_t>(sign);
+}
+
+static uint64_t ZigZagDecode(uint64_t value) {
+  return (value >> 1) ^ (~(value & 1) + 1);
+}
+
+static void AppendVarint(uint64_t value, std::string* out) {
+  while (value >= 0x80) {
+    out->push_back(static_cast<char>(value | 0x80));
+    value >>= 7;
+  }
+  out->push_back(static_cast<char>(value));
+}
+
+static void AppendFixed32(uint32_t value, std::string* out) {
+  for (size_t i = 0; i < 4; ++i) {
+    out->push_back(static_cast<char>(value >> (8 * i)));
+  }
+}
+
+static uint32_t ReadFixed32(const uint8_t* data) {
+  return static_cast<uint32_t>(data[0]) |
+         (static_cast<uint32_t>(data[1]) << 8) |
+         (static_cast<uint32_t>(data[2]) << 16) |
+         (static_cast<uint32_t>(data[3]) << 24);
+}
+
+// Reads a varint at 'data', advancing it. Returns false if the varint does
+// not end before 'end'.
+static inline bool ReadVarint(const uint8_t** data, const uint8_t* end,
+                              uint64_t* value) {
+  const uint8_t* ptr = *data;
+  uint64_t result = 0;
+  for (size_t shift = 0; shift < 64 && ptr != end; shift += 7) {
+    uint8_t byte = *ptr++;
+    result |= static_cast<uint64_t>(byte & 0x7F) << shift;
+    if (byte < 0x80) {
+      *data = ptr;
+      *value = result;
+      return true;
+    }
+  }
+
+  return false;
+}
+
+// Appends bits to a string, most significant bit first.
+class BitWriter {
+ public:
+  explicit BitWriter(std::string* out) : out_(out), used_bits_(0) {}
+
+  // Writes out the lowest 'bit_count' bits of 'value'.
+  void Write(uint64_t value, size_t bit_count) {
+    while (bit_count > 0) {
+      if (used_bits_ == 0) {
+        out_->push_back(0);
+      }
+
+      size_t free_bits = 8 - used_bits_;
+      size_t to_write = std::min(free_bits, bit_count);
+      uint8_t bits = (value >> (bit_count - to_write)) & ((1 << to_write) - 1);
+      out_->back() |= static_cast<char>(bits << (free_bits - to_write));
+      used_bits_ = (used_bits_ + to_write) % 8;
+      bit_count -= to_write;
+    }
+  }
+
+ private:
+  std::string* out_;
+
+  // Bits used in the last byte of out_. If 0 the next bit starts a new byte.
+  size_t used_bits_;
+};
+
+// Reads bits written by BitWriter.
+class BitReader {
+ public:
+  BitReader(const uint8_t* data, const uint8_t* end)
+      : data_(data), end_(end), used_bits_(0) {}
+
+  bool Read(size_t bit_count, uint64_t* value) {
+    uint64_t result = 0;
+    while (bit_count > 0) {
+      if (data_ == end_) {
+        return false;
+      }
+
+      size_t available_bits = 8 - used_bits_;
+      size_t to_read = std::min(available_bits, bit_count);
+      uint64_t bits =
+          (*data_ >> (available_bits - to_read)) & ((1 << to_read) - 1);
+      result = (result << to_read) | bits;
+      used_bits_ += to_read;
+      if (used_bits_ == 8) {
+        ++data_;
+        used_bits_ = 0;
+      }
+      bit_count -= to_read;
+    }
+
+    *value = result;
+    return true;
+  }
+
+  // True if all bits were read, apart from the padding of the last byte,
+  // which BitWriter leaves as zeros.
+  bool AtEnd() const {
+    if (used_bits_ == 0) {
+      return data_ == end_;
+    }
+
+    uint8_t padding_mask = (1 << (8 - used_bits_)) - 1;
+    return data_ + 1 == end_ && (*data_ & padding_mask) == 0;
+  }
+
+ private:
+  const uint8_t* data_;
+  const uint8_t* end_;
+
+  // Bits of *data_ that are already read.
+  size_t used_bits_;
+};
+
+static void EncodeTimestamps(const std::vector<uint64_t>& timestamps,
+                             std::string* out) {
+  CHECK(!timestamps.empty()) << "Empty chunk";
+  AppendVarint(timestamps[0], out);
+
+  uint64_t prev_delta = 0;
+  for (size_t i = 1; i < timestamps.size(); ++i) {
+    uint64_t delta = timestamps[i] - timestamps[i - 1];
+    AppendVarint(ZigZagEncode(delta - prev_delta), out);
+    prev_delta = delta;
+  }
+}
+
+static void AppendFooter(PBManifestEntry::Type type, uint32_t value_count,
+                         uint32_t manifest_index, std::string* out) {
+  out->push_back(static_cast<char>(type));
+  AppendFixed32(value_count, out);
+  AppendFixed32(manifest_index, out);
+}
+
+void EncodeIntegerChunk(PBManifestEntry::Type type, uint32_t manifest_index,
+                        const std::vector<uint64_t>& timestamps,
+                        const std::vector<uint64_t>& values, std::string* out) {
+  CHECK(type == PBManifestEntry::UINT32 || type == PBManifestEntry::UINT64 ||
+        type == PBManifestEntry::BOOL);
+  CHECK(timestamps.size() == values.size());
+  EncodeTimestamps(timestamps, out);
+
+  uint64_t prev_value = 0;
+  for (uint64_t value : values) {
+    AppendVarint(ZigZagEncode(value - prev_value), out);
+    prev_value = value;
+  }
+
+  AppendFooter(type, values.size(), manifest_index, out);
+}
+
+void EncodeDoubleChunk(uint32_t manifest_index,
+                       const std::vector<uint64_t>& timestamps,
+                       const std::vector<double>& values, std::string* out) {
+  CHECK(timestamps.size() == values.size());
+  EncodeTimestamps(timestamps, out);
+
+  BitWriter bit_writer(out);
+  uint64_t prev_bits = 0;
+
+  // The meaningful bits of the last XOR that was not zero. Initially no bits
+  // can be reused.
+  size_t prev_leading = 64;
+  size_t prev_trailing = 0;
+  for (size_t i = 0; i < values.size(); ++i) {
+    uint64_t bits;
+    memcpy(&bits, &values[i], sizeof(bits));
+    if (i == 0) {
+      bit_writer.Write(bits, 64);
+      prev_bits = bits;
+      continue;
+    }
+
+    uint64_t xor_bits = bits ^ prev_bits;
+    prev_bits = bits;
+    if (xor_bits == 0) {
+      bit_writer.Write(0, 1);
+      continue;
+    }
+
+    // The number of leading zeros is stored in 5 bits.
+    size_t leading = std::min(__builtin_clzll(xor_bits), 31);
+    size_t trailing = __builtin_ctzll(xor_bits);
+    if (leading >= prev_leading && trailing >= prev_trailing) {
+      // The meaningful bits fit in the previous window.
+      bit_writer.Write(0x2, 2);
+      bit_writer.Write(xor_bits >> prev_trailing,
+                       64 - prev_leading - prev_trailing);
+      continue;
+    }
+
+    // The length of the meaningful bits (1 to 64) is stored as length - 1 in
+    // 6 bits.
+    size_t meaningful = 64 - leading - trailing;
+    bit_writer.Write(0x3, 2);
+    bit_writer.Write(leading, 5);
+    bit_writer.Write(meaningful - 1, 6);
+    bit_writer.Write(xor_bits >> trailing, meaningful);
+    prev_leading = leading;
+    prev_trailing = trailing;
+  }
+
+  AppendFooter(PBManifestEntry::DOUBLE, values.size(), manifest_index, out);
+}
+
+bool ParseChunkFooter(const std::string& chunk, PBManifestEntry::Type* type,
+                      uint32_t* value_count, uint32_t* manifest_index) {
+  if (chunk.size() < kChunkFooterSize) {
+    return false;
+  }
+
+  const uint8_t* footer = reinterpret_cast<const uint8_t*>(chunk.data()) +
+                          chunk.size() - kChunkFooterSize;
+  uint8_t type_value = footer[0];
+  if (type_value != PBManifestEntry::UINT32 &&
+      type_value != PBManifestEntry::UINT64 &&
+      type_value != PBManifestEntry::BOOL &&
+      type_value != PBManifestEntry::DOUBLE) {
+    return false;
+  }
+
+  *type = static_cast<PBManifestEntry::Type>(type_value);
+  *value_count = ReadFixed32(footer + 1);
+  *manifest_index = ReadFixed32(footer + 5);
+  return *value_count > 0;
+}
+
+static bool DecodeTimestamps(const uint8_t** data, const uint8_t* end,
+                             size_t count, std::vector<uint64_t>* out) {
+  out->resize(count);
+  uint64_t* timestamps = out->data();
+  uint64_t timestamp;
+  if (!ReadVarint(data, end, &timestamp)) {
+    return false;
+  }
+  timestamps[0] = timestamp;
+
+  uint64_t delta = 0;
+  for (size_t i = 1; i < count; ++i) {
+    uint64_t delta_of_delta;
+    if (!ReadVarint(data, end, &delta_of_delta)) {
+      return false;
+    }
+
+    delta += ZigZagDecode(delta_of_delta);
+    timestamp += delta;
+    timestamps[i] = timestamp;
+  }
+
+  return true;
+}
+
+static bool DecodeIntegers(const uint8_t* data, const uint8_t* end,
+                           size_t count, std::vector<uint64_t>* out) {
+  out->resize(count);
+  uint64_t* values = out->data();
+  uint64_t value = 0;
+  for (size_t i = 0; i < count; ++i) {
+    uint64_t delta;
+    if (!ReadVarint(&data, end, &delta)) {
+      return false;
+    }
+
+    value += ZigZagDecode(delta);
+    values[i] = value;
+  }
+
+  return data == end;
+}
+
+static bool DecodeDoubles(const uint8_t* data, const uint8_t* end,
+                          size_t count, std::vector<double>* out) {
+  out->resize(count);
+  double* values = out->data();
+  BitReader bit_reader(data, end);
+  uint64_t bits;
+  if (!bit_reader.Read(64, &bits)) {
+    return false;
+  }
+  memcpy(&values[0], &bits, sizeof(bits));
+
+  size_t leading = 0;
+  size_t trailing = 0;
+  for (size_t i = 1; i < count; ++i) {
+    uint64_t control;
+    if (!bit_reader.Read(1, &control)) {
+      return false;
+    }
+
+    if (control != 0) {
+      if (!bit_reader.Read(1, &control)) {
+        return false;
+      }
+
+      if (control != 0) {
+        uint64_t new_leading;
+        uint64_t meaningful;
+        if (!bit_reader.Read(5, &new_leading) ||
+            !bit_reader.Read(6, &meaningful)) {
+          return false;
+        }
+
+        if (new_leading + meaningful + 1 > 64) {
+          return false;
+        }
+
+        leading = new_leading;
+        trailing = 64 - leading - (meaningful + 1);
+      }
+
+      uint64_t xor_bits;
+      if (!bit_reader.Read(64 - leading - trailing, &xor_bits)) {
+        return false;
+      }
+      bits ^= xor_bits << trailing;
+    }
+
+    memcpy(&values[i], &bits, sizeof(bits));
+  }
+
+  return bit_reader.AtEnd();
+}
+
+bool DecodeChunk(const std::string& chunk, DecodedChunk* out) {
+  uint32_t value_count;
+  if (!ParseChunkFooter(chunk, &out->type, &value_count,
+                        &out->manifest_index)) {
+    return false;
+  }
+
+  // Each value takes at least a byte for its timestamp.
+  if (value_count > chunk.size()) {
+    return false;
+  }
+
+  const uint8_t* data = reinterpret_cast<const uint8_t*>(chunk.data());
+  const uint8_t* end = data + chunk.size() - kChunkFooterSize;
+  if (!DecodeTimestamps(&data, end, value_count, &out->timestamps)) {
+    return false;
+  }
+
+  if (out->type == PBManifestEntry::DOUBLE) {
+    out->integer_values.clear();
+    return DecodeDoubles(data, end, value_count, &out->double_values);
+  }
+
+  out->double_values.clear();
+  return DecodeIntegers(data, end, value_count, &out->integer_values);
+}
+
+bool ChunkTimestampRange(const std::string& chunk, uint64_t* min_timestamp,
+                         uint64_t* max_timestamp) {
+  PBManifestEntry::Type type;
+  uint32_t value_count;
+  uint32_t manifest_index;
+  if (!ParseChunkFooter(chunk, &type, &value_count, &manifest_index) ||
+      value_count > chunk.size()) {
+    return false;
+  }
+
+  std::vector<uint64_t> timestamps;
+  const uint8_t* data = reinterpret_cast<const uint8_t*>(chunk.data());
+  const uint8_t* end = data + chunk.size() - kChunkFooterSize;
+  if (!DecodeTimestamps(&data, end, value_count, &timestamps)) {
+    return false;
+  }
+
+  auto min_and_max = std::minmax_element(timestamps.begin(), timestamps.end());
+  *min_timestamp = *min_and_max.first;
+  *max_timestamp = *min_and_max.second;
+  return true;
+}
+
+void DecodedChunk::RemovePrefix(size_t count) {
+  timestamps.erase(timestamps.begin(), timestamps.begin() + count);
+  if (type == PBManifestEntry::DOUBLE) {
+    double_values.erase(double_values.begin(), double_values.begin() + count);
+  } else {
+    integer_values.erase(integer_values.begin(),
+                         integer_values.begin() + count);
+  }
+}
+
+void DecodedChunk::ToProtobuf(size_t i, PBMetricEntry* out) const {
+  out->set_timestamp(timestamps[i]);
+  switch (type) {
+    case PBManifestEntry::UINT32:
+      out->set_uint32_value(integer_values[i]);
+      break;
+    case PBManifestEntry::UINT64:
+      out->set_uint64_value(integer_values[i]);
+      break;
+    case PBManifestEntry::BOOL:
+      out->set_bool_value(integer_values[i] != 0);
+      break;
+    case PBManifestEntry::DOUBLE:
+      out->set_double_value(double_values[i]);
+      break;
+    default:
+      LOG(FATAL) << "Bad chunk type " << type;
+  }
+}
+
+}  // namespace metrics
+}  // namespace ncode
@@ -0,0 +1,88 @@
+#ifndef NCODE_METRICS_CHUNK_H
+#define NCODE_METRICS_CHUNK_H
+
+#include <stddef.h>
+#include <cstdint>
+#include <limits>
+#include <string>
+#include <vector>
+
+#include "metrics.pb.h"
+
+namespace ncode {
+namespace metrics {
+
+// A chunk stores a series of values of a single numeric (or boolean) metric
+// column by column, instead of as one PBMetricEntry per value:
+//
+// - timestamps: the first timestamp as a varint, followed by the difference
+//   between consecutive deltas (delta-of-delta), zig-zag encoded as varints.
+//   Values that are added periodically take a single byte.
+// - integer and boolean values: the first value as a varint, followed by the
+//   zig-zag encoded differences between consecutive values.
+// - double values: the first value as 64 raw bits, followed by the XOR of
+//   each value with the previous one, in a bit stream (as in Facebook's
+//   Gorilla). A value that did not change takes a single bit.
+//
+// The chunk ends with a footer: a byte with the type of the metric (a
+// PBManifestEntry::Type), the number of values and the index of the
+// metric in the manifest as two little-endian 32-bit integers. The footer is
+// written last, once all values are encoded.
+
+// Chunks are stored in block-format files as regular records, preceded by
+// this manifest index instead of the index of their metric.
+static constexpr uint32_t kChunkRecordIndex =
+    std::numeric_limits<uint32_t>::max() - 1;
+
+static constexpr size_t kChunkFooterSize = 9;
+
+// The columns of a decoded chunk.
+struct DecodedChunk {
+  PBManifestEntry::Type type;
+  uint32_t manifest_index;
+  std::vector<uint64_t> timestamps;
+
+  // Populated for UINT32, UINT64 and BOOL metrics.
+  std::vector<uint64_t> integer_values;
+
+  // Populated for DOUBLE metrics.
+  std::vector<double> double_values;
+
+  // Number of values in the chunk.
+  size_t size() const { return timestamps.size(); }
+
+  // Removes the first 'count' values.
+  void RemovePrefix(size_t count);
+
+  // Populates a protobuf with the i-th value.
+  void ToProtobuf(size_t i, PBMetricEntry* out) const;
+};
+
+// Encodes the values of a UINT32, UINT64 or BOOL metric. 'timestamps' and
+// 'values' should be of the same non-zero size.
+void EncodeIntegerChunk(PBManifestEntry::Type type, uint32_t manifest_index,
+                        const std::vector<uint64_t>& timestamps,
+                        const std::vector<uint64_t>& values, std::string* out);
+
+// Encodes the values of a DOUBLE metric.
+void EncodeDoubleChunk(uint32_t manifest_index,
+                       const std::vector<uint64_t>& timestamps,
+                       const std::vector<double>& values, std::string* out);
+
+// Reads the footer of a chunk without decoding it. Returns false if the
+// footer is not valid.
+bool ParseChunkFooter(const std::string& chunk, PBManifestEntry::Type* type,
+                      uint32_t* value_count, uint32_t* manifest_index);
+
+// Decodes a chunk. Returns false if the chunk is corrupt.
+bool DecodeChunk(const std::string& chunk, DecodedChunk* out);
+
+// Decodes only the timestamps of a chunk and returns the smallest and the
+// largest one. Returns false if the chunk is corrupt.
+bool ChunkTimestampRange(const std::string& chunk, uint64_t* min_timestamp,
+                         uint64_t* max_timestamp);
+
+}  // namespace metrics
+}  // namespace ncode
+
+#endif
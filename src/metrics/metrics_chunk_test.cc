@@ -0,0 +1,198 @@
+#include "metrics_chunk.h"
+
+#include <cmath>
+#include <limits>
+#include <random>
+
+#include "gtest/gtest.h"
+#include "../common/logging.h"
+
+namespace ncode {
+namespace metrics {
+namespace {
+
+static constexpr uint32_t kManifestIndex = 42;
+
+// Timestamps that are mostly 1000 apart, with some jitter.
+static std::vector<uint64_t> Timestamps(size_t count) {
+  std::vector<uint64_t> timestamps;
+  uint64_t timestamp = 1000000000;
+  for (size_t i = 0; i < count; ++i) {
+    timestamp += 1000 + (i % 3);
+    timestamps.emplace_back(timestamp);
+  }
+  return timestamps;
+}
+
+static DecodedChunk DecodeOrDie(const std::string& chunk) {
+  DecodedChunk decoded;
+  CHECK(DecodeChunk(chunk, &decoded));
+  return decoded;
+}
+
+TEST(Chunk, Integers) {
+  std::vector<uint64_t> timestamps = Timestamps(100);
+  std::vector<uint64_t> values;
+  for (size_t i = 0; i < timestamps.size(); ++i) {
+    values.emplace_back(i * i);
+  }
+
+  std::string chunk;
+  EncodeIntegerChunk(PBManifestEntry::UINT64, kManifestIndex, timestamps,
+                     values, &chunk);
+
+  // Timestamps and values take 2 bytes per value at most.
+  ASSERT_GT(4 * values.size() + kChunkFooterSize, chunk.size());
+
+  DecodedChunk decoded = DecodeOrDie(chunk);
+  ASSERT_EQ(PBManifestEntry::UINT64, decoded.type);
+  ASSERT_EQ(kManifestIndex, decoded.manifest_index);
+  ASSERT_EQ(timestamps, decoded.timestamps);
+  ASSERT_EQ(values, decoded.integer_values);
+  ASSERT_TRUE(decoded.double_values.empty());
+}
+
+TEST(Chunk, IntegersOutOfOrder) {
+  uint64_t max = std::numeric_limits<uint64_t>::max();
+  std::vector<uint64_t> timestamps = {10, 5, max, 0, 0, 7};
+  std::vector<uint64_t> values = {max, 0, 1, max - 1, 5, 5};
+
+  std::string chunk;
+  EncodeIntegerChunk(PBManifestEntry::UINT64, kManifestIndex, timestamps,
+                     values, &chunk);
+  DecodedChunk decoded = DecodeOrDie(chunk);
+  ASSERT_EQ(timestamps, decoded.timestamps);
+  ASSERT_EQ(values, decoded.integer_values);
+}
+
+TEST(Chunk, SingleValue) {
+  std::string chunk;
+  EncodeIntegerChunk(PBManifestEntry::BOOL, kManifestIndex, {5}, {1}, &chunk);
+  DecodedChunk decoded = DecodeOrDie(chunk);
+  ASSERT_EQ(PBManifestEntry::BOOL, decoded.type);
+  ASSERT_EQ(std::vector<uint64_t>({5}), decoded.timestamps);
+  ASSERT_EQ(std::vector<uint64_t>({1}), decoded.integer_values);
+
+  PBMetricEntry entry;
+  decoded.ToProtobuf(0, &entry);
+  ASSERT_EQ(5ul, entry.timestamp());
+  ASSERT_TRUE(entry.bool_value());
+}
+
+TEST(Chunk, Doubles) {
+  std::vector<double> values = {0.0, 0.0, 1.5, 1.5, -1.5, 1e300, 1e-300,
+                                std::numeric_limits<double>::infinity(),
+                                std::numeric_limits<double>::max(), 3.0};
+  std::mt19937 rnd(1);
+  std::uniform_real_distribution<double> dist(0, 1000);
+  for (size_t i = 0; i < 1000; ++i) {
+    values.emplace_back(dist(rnd));
+  }
+  std::vector<uint64_t> timestamps = Timestamps(values.size());
+
+  std::string chunk;
+  EncodeDoubleChunk(kManifestIndex, timestamps, values, &chunk);
+  DecodedChunk decoded = DecodeOrDie(chunk);
+  ASSERT_EQ(PBManifestEntry::DOUBLE, decoded.type);
+  ASSERT_EQ(timestamps, decoded.timestamps);
+  ASSERT_EQ(values, decoded.double_values);
+  ASSERT_TRUE(decoded.integer_values.empty());
+}
+
+TEST(Chunk, DoublesNaN) {
+  double nan = std::numeric_limits<double>::quiet_NaN();
+  std::string chunk;
+  EncodeDoubleChunk(kManifestIndex, {1, 2, 3}, {nan, 1.0, nan}, &chunk);
+  DecodedChunk decoded = DecodeOrDie(chunk);
+  ASSERT_TRUE(std::isnan(decoded.double_values[0]));
+  ASSERT_EQ(1.0, decoded.double_values[1]);
+  ASSERT_TRUE(std::isnan(decoded.double_values[2]));
+}
+
+// A value that does not change takes a bit.
+TEST(Chunk, DoublesConstant) {
+  std::vector<double> values(800, 0.25);
+  std::vector<uint64_t> timestamps = Timestamps(values.size());
+
+  std::string chunk;
+  EncodeDoubleChunk(kManifestIndex, timestamps, values, &chunk);
+  std::string timestamps_only;
+  EncodeIntegerChunk(PBManifestEntry::UINT64, kManifestIndex, timestamps,
+                     std::vector<uint64_t>(values.size(), 0),
+                     &timestamps_only);
+  ASSERT_GT(timestamps_only.size(), chunk.size());
+
+  DecodedChunk decoded = DecodeOrDie(chunk);
+  ASSERT_EQ(values, decoded.double_values);
+}
+
+TEST(Chunk, RemovePrefix) {
+  std::string chunk;
+  EncodeDoubleChunk(kManifestIndex, {1, 2, 3}, {1.0, 2.0, 3.0}, &chunk);
+  DecodedChunk decoded = DecodeOrDie(chunk);
+  decoded.RemovePrefix(2);
+  ASSERT_EQ(1ul, decoded.size());
+  ASSERT_EQ(3ul, decoded.timestamps[0]);
+  ASSERT_EQ(3.0, decoded.double_values[0]);
+}
+
+TEST(Chunk, Footer) {
+  std::string chunk;
+  EncodeIntegerChunk(PBManifestEntry::UINT32, kManifestIndex, {1, 2, 3},
+                     {1, 2, 3}, &chunk);
+
+  PBManifestEntry::Type type;
+  uint32_t value_count;
+  uint32_t manifest_index;
+  ASSERT_TRUE(ParseChunkFooter(chunk, &type, &value_count, &manifest_index));
+  ASSERT_EQ(PBManifestEntry::UINT32, type);
+  ASSERT_EQ(3ul, value_count);
+  ASSERT_EQ(kManifestIndex, manifest_index);
+}
+
+TEST(Chunk, Corrupt) {
+  std::string chunk;
+  EncodeIntegerChunk(PBManifestEntry::UINT64, kManifestIndex, {1, 2, 3},
+                     {1000, 2000, 3000}, &chunk);
+
+  DecodedChunk decoded;
+  ASSERT_FALSE(DecodeChunk("", &decoded));
+
+  // Values are missing.
+  std::string truncated = chunk.substr(0, 4) +
+                          chunk.substr(chunk.size() - kChunkFooterSize);
+  ASSERT_FALSE(DecodeChunk(truncated, &decoded));
+
+  // Bad type.
+  std::string bad_type = chunk;
+  bad_type[chunk.size() - kChunkFooterSize] = PBManifestEntry::STRING;
+  ASSERT_FALSE(DecodeChunk(bad_type, &decoded));
+
+  // Too many values.
+  std::string bad_count = chunk;
+  bad_count[chunk.size() - kChunkFooterSize + 4] = 1;
+  ASSERT_FALSE(DecodeChunk(bad_count, &decoded));
+}
+
+TEST(Chunk, CorruptDoubles) {
+  std::string chunk;
+  EncodeDoubleChunk(kManifestIndex, {1, 2, 3}, {1.0, 1.0, 1.0}, &chunk);
+  std::string footer = chunk.substr(chunk.size() - kChunkFooterSize);
+  std::string body = chunk.substr(0, chunk.size() - kChunkFooterSize);
+
+  DecodedChunk decoded;
+  ASSERT_TRUE(DecodeChunk(body + footer, &decoded));
+
+  // Trailing garbage after the values.
+  ASSERT_FALSE(DecodeChunk(body + '\x01' + footer, &decoded));
+
+  // Garbage in the padding bits of the last byte. The two repeated values
+  // take one bit each, so the last byte has six bits of padding.
+  std::string bad_padding = body;
+  bad_padding.back() |= 1;
+  ASSERT_FALSE(DecodeChunk(bad_padding + footer, &decoded));
+}
+
+}  // namespace
+}  // namespace metrics
+}  // namespace ncode
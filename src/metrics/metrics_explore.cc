@@ -1,4 +1,5 @@
 #include <gflags/gflags.h>
+#include <algorithm>
 #include <cstdio>
 #include <iostream>
 #include <memory>
@@ -14,6 +15,7 @@
 #include "../common/strutil.h"
 #include "../common/file.h"
 #include "../common/logging.h"
+#include "../common/thread_runner.h"
 #include "../grapher/grapher.h"
 #include "../web/web_page.h"
 #include "metrics_parser.h"
@@ -96,12 +98,27 @@ class ServerState {
       files.emplace_back(file_or_dir);
     }
 
-    for (const std::string& file : files) {
+    // Per-metric files are parsed in parallel. If there are fewer files than
+    // threads each file is also split between multiple threads.
+    CHECK(!files.empty()) << "No metrics files in " << file_or_dir;
+    size_t thread_count = metrics::parser::ParseThreadCount();
+    size_t file_thread_count =
+        std::max<size_t>(1, thread_count / files.size());
+    std::vector<std::unique_ptr<metrics::parser::Manifest>> manifests(
+        files.size());
+    RunInParallel<std::string>(
+        files, [&manifests, file_thread_count](const std::string& file,
+                                               size_t i) {
+          manifests[i] = make_unique<metrics::parser::Manifest>(
+              metrics::parser::ParseManifestInParallel(file,
+                                                       file_thread_count));
+          LOG(INFO) << "Parsed " << file;
+        }, std::min(thread_count, files.size()));
+
+    for (size_t i = 0; i < files.size(); ++i) {
+      const std::string& file = files[i];
       uint64_t file_size_mb = ncode::File::FileSizeOrDie(file) / 1000 / 1000;
-
-      metrics::parser::MetricsParser parser(file);
-      files_.emplace_back(file, file_size_mb, parser.ParseManifest());
-      LOG(INFO) << "Parsed " << file;
+      files_.emplace_back(file, file_size_mb, std::move(*manifests[i]));
     }
   }
 
@@ -0,0 +1,44 @@
+// Adds an index to metrics files that were written without one, or that were
+// cut short. Files in the old format are converted to block format.
+
+#include <gflags/gflags.h>
+#include <string>
+#include <vector>
+
+#include "../common/common.h"
+#include "../common/file.h"
+#include "../common/logging.h"
+#include "../common/strutil.h"
+#include "metrics.h"
+
+DEFINE_string(input, "",
+              "The metrics file or directory of metrics files to index.");
+
+using namespace ncode;
+
+static void IndexFile(const std::string& file) {
+  if (metrics::AddIndexToFile(file)) {
+    LOG(INFO) << "Indexed " << file;
+  } else {
+    LOG(ERROR) << "Unable to index " << file;
+  }
+}
+
+int main(int argc, char** argv) {
+  gflags::ParseCommandLineFlags(&argc, &argv, true);
+  CHECK(!FLAGS_input.empty()) << "Empty input file";
+
+  bool is_dir;
+  CHECK(File::FileOrDirectory(FLAGS_input, &is_dir));
+
+  std::vector<std::string> files;
+  if (is_dir) {
+    files = Glob(StrCat(FLAGS_input, "/*"));
+  } else {
+    files.emplace_back(FLAGS_input);
+  }
+
+  for (const std::string& file : files) {
+    IndexFile(file);
+  }
+}
@@ -2,15 +2,23 @@
 
 #include <stddef.h>
 #include <stdlib.h>
+#include <algorithm>
 #include <cassert>
 #include <cstring>
 #include <iomanip>
 #include <limits>
+#include <thread>
 
+#include "gflags/gflags.h"
 #include "../common/strutil.h"
 #include "../common/substitute.h"
+#include "../common/thread_runner.h"
 #include "../web/web_page.h"
 
+DEFINE_uint64(metrics_parse_threads, 0,
+              "Number of threads to parse metrics files with. If 0 will use "
+              "one thread per core.");
+
 namespace ncode {
 namespace metrics {
 namespace parser {
@@ -202,30 +210,147 @@ bool FieldsMatcher::Matches(const FieldList& fields) const {
   return true;
 }
 
+void MetricProcessor::ProcessChunk(const DecodedChunk& chunk,
+                                   const PBManifestEntry& manifest_entry,
+                                   uint32_t manifest_index) {
+  PBMetricEntry entry;
+  for (size_t i = 0; i < chunk.size(); ++i) {
+    chunk.ToProtobuf(i, &entry);
+    ProcessEntry(entry, manifest_entry, manifest_index);
+  }
+}
+
+// Offsets of the blocks that have manifest entries.
+static std::set<uint64_t> ManifestBlockOffsets(const PBMetricsIndex& index) {
+  std::set<uint64_t> offsets;
+  for (const auto& metric_extents : index.metrics()) {
+    if (metric_extents.manifest_index() ==
+        MetricBase::kManifestEntryMetaIndex) {
+      for (const auto& extent : metric_extents.extents()) {
+        offsets.emplace(extent.offset());
+      }
+    }
+  }
+
+  return offsets;
+}
+
+// Splits block offsets into 'part_count' runs of consecutive blocks and returns
+// the run of part 'part_index'. Each part gets about the same number of blocks.
+static std::vector<uint64_t> PartOffsets(const std::set<uint64_t>& offsets,
+                                         size_t part_index,
+                                         size_t part_count) {
+  std::vector<uint64_t> all_offsets(offsets.begin(), offsets.end());
+  size_t from = all_offsets.size() * part_index / part_count;
+  size_t to = all_offsets.size() * (part_index + 1) / part_count;
+  return std::vector<uint64_t>(all_offsets.begin() + from,
+                               all_offsets.begin() + to);
+}
+
 void MetricsParser::Parse() {
   InputStream input_stream(metrics_file_);
+  PBMetricsIndex index;
+  if (input_stream.ReadIndex(&index)) {
+    ParseWithIndex(index, &input_stream);
+    return;
+  }
 
-  // This vector contains a map from the indices of manifests seen so far to the
-  // list of processors that are interested in those manifests.
-  std::vector<std::vector<MetricProcessor*>> manifest_index_to_processors;
+  if (part_index_ != 0) {
+    return;
+  }
 
-  // Manifest entries.
-  std::vector<std::unique_ptr<PBManifestEntry>> manifest_entries;
+  if (part_count_ > 1) {
+    LOG(INFO) << "No index in " << metrics_file_
+              << ", will parse it in a single part. Run metrics_index on it "
+                 "to parse it in parallel.";
+  }
+
+  ParseState state;
+  ParseEntries(true, true, &input_stream, &state);
+}
+
+void MetricsParser::ParseWithIndex(const PBMetricsIndex& index,
+                                   InputStream* input_stream) {
+  ParseState state;
+
+  // All manifest entries are read first, to know which metrics are
+  // interesting. The index has them in the order they are in the file, so
+  // they get the same indices as they would if the file was read
+  // sequentially. Indices built before manifest entries were added to them
+  // only have the blocks with manifest entries, which are read in order.
+  if (index.manifest_entries_size() > 0) {
+    for (const PBManifestEntry& manifest_entry : index.manifest_entries()) {
+      AddManifestEntry(make_unique<PBManifestEntry>(manifest_entry), &state);
+    }
+  } else {
+    for (uint64_t offset : ManifestBlockOffsets(index)) {
+      input_stream->SeekToBlock(offset);
+      ParseEntries(true, false, input_stream, &state);
+    }
+  }
+
+  std::set<uint64_t> offsets;
+  for (const auto& metric_extents : index.metrics()) {
+    uint32_t manifest_index = metric_extents.manifest_index();
+    if (manifest_index >= state.manifest_index_to_processors.size() ||
+        state.manifest_index_to_processors[manifest_index].empty()) {
+      continue;
+    }
 
+    for (const auto& extent : metric_extents.extents()) {
+      if (extent.max_timestamp() >= min_timestamp_ &&
+          extent.min_timestamp() < max_timestamp_) {
+        offsets.emplace(extent.offset());
+      }
+    }
+  }
+
+  for (uint64_t offset : PartOffsets(offsets, part_index_, part_count_)) {
+    input_stream->SeekToBlock(offset);
+    ParseEntries(false, true, input_stream, &state);
+  }
+}
+
+void MetricsParser::AddManifestEntry(
+    std::unique_ptr<PBManifestEntry> manifest_entry, ParseState* state) {
+  std::vector<std::vector<MetricProcessor*>>& manifest_index_to_processors =
+      state->manifest_index_to_processors;
+  std::vector<MetricProcessor*> interested;
+  for (const auto& processor : processors_) {
+    if (processor->InterestedIn(*manifest_entry,
+                                manifest_index_to_processors.size())) {
+      interested.emplace_back(processor.get());
+    }
+  }
+
+  manifest_index_to_processors.emplace_back(interested);
+  state->manifest_entries.emplace_back(std::move(manifest_entry));
+}
+
+void MetricsParser::ParseEntries(bool manifest_entries, bool values,
+                                 InputStream* input_stream,
+                                 ParseState* state) {
+  std::vector<std::vector<MetricProcessor*>>& manifest_index_to_processors =
+      state->manifest_index_to_processors;
+  PBMetricEntry& entry = state->entry;
   uint32_t manifest_index;
-  PBMetricEntry entry;
   while (true) {
-    if (!input_stream.ReadDelimitedHeaderFrom(&manifest_index)) {
+    if (!input_stream->ReadDelimitedHeaderFrom(&manifest_index)) {
       break;
     }
 
     if (manifest_index == MetricBase::kManifestEntryMetaIndex) {
-      // The following entry contains a manifest entry. Will read it in and pass
-      // it to all processors to see if anyone is interested. A new vector will
-      // be added to the back of manifest_index_to_processors and all interested
-      // processors will be added to it.
+      if (!manifest_entries) {
+        if (!input_stream->SkipMessage()) {
+          LOG(INFO) << "Unable to skip manifest entry";
+          break;
+        }
+        continue;
+      }
 
-      if (!input_stream.ReadDelimitedFrom(&entry)) {
+      // The following entry contains a manifest entry. Will read it in and pass
+      // it to all processors to see if anyone is interested.
+      if (!input_stream->ReadDelimitedFrom(&entry)) {
         LOG(INFO) << "Unable to read in manifest entry";
         break;
       }
@@ -233,19 +358,19 @@ void MetricsParser::Parse() {
       CHECK(entry.has_manifest_entry())
           << "Wrong manifest index for manifest entry";
 
-      std::vector<MetricProcessor*> interested;
-      for (const auto& processor : processors_) {
-        if (processor->InterestedIn(entry.manifest_entry(),
-                                    manifest_index_to_processors.size())) {
-          interested.emplace_back(processor.get());
-        }
-      }
-
-      manifest_index_to_processors.emplace_back(interested);
+      AddManifestEntry(
+          std::unique_ptr<PBManifestEntry>(entry.release_manifest_entry()),
+          state);
+      continue;
+    }
 
-      auto manifest_entry_ptr =
-          std::unique_ptr<PBManifestEntry>(entry.release_manifest_entry());
-      manifest_entries.emplace_back(std::move(manifest_entry_ptr));
+    if (!values) {
+      if (input_stream->InChunk()) {
+        input_stream->SkipChunk();
+      } else if (!input_stream->SkipMessage()) {
+        LOG(INFO) << "Unable to skip entry";
+        break;
+      }
       continue;
     }
 
@@ -254,9 +379,28 @@ void MetricsParser::Parse() {
 
     const std::vector<MetricProcessor*>& interested_processors =
         manifest_index_to_processors[manifest_index];
+    const PBManifestEntry& manifest_entry =
+        *state->manifest_entries[manifest_index];
+    if (input_stream->InChunk()) {
+      // Values in chunks are processed all at once.
+      if (interested_processors.empty()) {
+        input_stream->SkipChunk();
+        continue;
+      }
+
+      if (!input_stream->ReadChunk(&state->chunk)) {
+        break;
+      }
+
+      for (MetricProcessor* processor : interested_processors) {
+        processor->ProcessChunk(state->chunk, manifest_entry, manifest_index);
+      }
+      continue;
+    }
+
     if (interested_processors.empty()) {
       // No one is interested
-      if (!input_stream.SkipMessage()) {
+      if (!input_stream->SkipMessage()) {
         LOG(INFO) << "Unable to skip entry";
         break;
       }
@@ -264,13 +408,12 @@ void MetricsParser::Parse() {
     }
 
     // Have to read in the entire entry.
-    if (!input_stream.ReadDelimitedFrom(&entry)) {
+    if (!input_stream->ReadDelimitedFrom(&entry)) {
       LOG(INFO) << "Unable to read entry";
     }
 
     for (MetricProcessor* processor : interested_processors) {
-      processor->ProcessEntry(entry, *manifest_entries[manifest_index],
-                              manifest_index);
+      processor->ProcessEntry(entry, manifest_entry, manifest_index);
     }
 
     entry.Clear();
@@ -311,54 +454,156 @@ void WrappedEntry::ChildEntry(bool numeric, double value) {
   }
 }
 
-Manifest MetricsParser::ParseManifest() const {
-  InputStream input_stream(metrics_file_);
+void WrappedEntry::MergeFrom(const WrappedEntry& other) {
+  CHECK(manifest_index_ == other.manifest_index_) << "Manifest index mismatch";
+  num_entries_ += other.num_entries_;
+  num_non_zero_entries_ += other.num_non_zero_entries_;
+  sum_ += other.sum_;
+}
 
-  // Manifest entries.
-  std::vector<WrappedEntry> all_entries;
+void Manifest::MergeFrom(Manifest* other) {
+  for (auto& id_and_entries : other->entries_) {
+    std::vector<WrappedEntry>& other_entries = id_and_entries.second;
+    auto it = entries_.find(id_and_entries.first);
+    if (it == entries_.end()) {
+      entries_.emplace(id_and_entries.first, std::move(other_entries));
+      continue;
+    }
 
+    std::vector<WrappedEntry>& entries = it->second;
+    CHECK(entries.size() == other_entries.size())
+        << "Manifests of different files";
+    for (size_t i = 0; i < entries.size(); ++i) {
+      entries[i].MergeFrom(other_entries[i]);
+    }
+  }
+  other->entries_.clear();
+}
+
+// Reads entries from a stream until the end. Manifest entries are added to
+// 'all_entries' if 'manifest_entries' is true and values are counted if
+// 'values' is true, the rest are skipped.
+static void ParseManifestEntries(bool manifest_entries, bool values,
+                                 InputStream* input_stream,
+                                 std::vector<WrappedEntry>* all_entries) {
   uint32_t manifest_index;
   PBMetricEntry entry;
+  DecodedChunk chunk;
   while (true) {
-    if (!input_stream.ReadDelimitedHeaderFrom(&manifest_index)) {
+    if (!input_stream->ReadDelimitedHeaderFrom(&manifest_index)) {
       break;
     }
 
     if (manifest_index == MetricBase::kManifestEntryMetaIndex) {
+      if (!manifest_entries) {
+        if (!input_stream->SkipMessage()) {
+          LOG(ERROR) << "Unable to skip manifest entry";
+          break;
+        }
+        continue;
+      }
+
       // The following entry contains a manifest entry.
-      CHECK(input_stream.ReadDelimitedFrom(&entry))
+      CHECK(input_stream->ReadDelimitedFrom(&entry))
           << "Unable to read in manifest entry";
       CHECK(entry.has_manifest_entry())
           << "Wrong manifest index for manifest entry";
 
       auto manifest_entry_ptr =
           std::unique_ptr<PBManifestEntry>(entry.release_manifest_entry());
-      all_entries.emplace_back(all_entries.size(),
-                               std::move(manifest_entry_ptr));
+      all_entries->emplace_back(all_entries->size(),
+                                std::move(manifest_entry_ptr));
+      continue;
+    }
+
+    if (!values) {
+      if (input_stream->InChunk()) {
+        input_stream->SkipChunk();
+      } else if (!input_stream->SkipMessage()) {
+        LOG(ERROR) << "Unable to skip entry";
+        break;
+      }
+      continue;
+    }
+
+    CHECK(manifest_index < all_entries->size())
+        << "Unknown manifest index " << manifest_index
+        << " only know indices up to " << all_entries->size();
+    WrappedEntry& wrapped_entry = (*all_entries)[manifest_index];
+    if (input_stream->InChunk()) {
+      if (!input_stream->ReadChunk(&chunk)) {
+        break;
+      }
+
+      bool numeric = IsNumeric(wrapped_entry);
+      for (size_t i = 0; i < chunk.size(); ++i) {
+        double value = chunk.type == PBManifestEntry::DOUBLE
+                           ? chunk.double_values[i]
+                           : chunk.integer_values[i];
+        wrapped_entry.ChildEntry(numeric, value);
+      }
+      continue;
+    }
+
+    bool numeric;
+    double value;
+    if ((numeric = IsNumeric(wrapped_entry))) {
+      if (!input_stream->ReadDelimitedFrom(&entry)) {
+        LOG(ERROR) << "Unable to read entry";
+        break;
+      }
+      value = ExtractNumericValueOrDie(wrapped_entry.manifest_entry().type(),
+                                       entry);
     } else {
-      CHECK(manifest_index < all_entries.size())
-          << "Unknown manifest index " << manifest_index
-          << " only know indices up to " << all_entries.size();
-      WrappedEntry& wrapped_entry = all_entries[manifest_index];
-
-      bool numeric;
-      double value;
-      if ((numeric = IsNumeric(wrapped_entry))) {
-        if (!input_stream.ReadDelimitedFrom(&entry)) {
-          LOG(ERROR) << "Unable to read entry";
-          break;
-        }
-        value = ExtractNumericValueOrDie(wrapped_entry.manifest_entry().type(),
-                                         entry);
-      } else {
-        if (!input_stream.SkipMessage()) {
-          LOG(ERROR) << "Unable to skip entry";
-          break;
-        }
+      if (!input_stream->SkipMessage()) {
+        LOG(ERROR) << "Unable to skip entry";
+        break;
       }
+    }
+
+    wrapped_entry.ChildEntry(numeric, value);
+  }
+}
+
+Manifest MetricsParser::ParseManifest() const {
+  InputStream input_stream(metrics_file_);
+
+  // Manifest entries.
+  std::vector<WrappedEntry> all_entries;
+
+  PBMetricsIndex index;
+  if (input_stream.ReadIndex(&index)) {
+    // See ParseWithIndex.
+    for (const PBManifestEntry& manifest_entry : index.manifest_entries()) {
+      all_entries.emplace_back(all_entries.size(),
+                               make_unique<PBManifestEntry>(manifest_entry));
+    }
 
-      wrapped_entry.ChildEntry(numeric, value);
+    if (index.manifest_entries_size() == 0) {
+      for (uint64_t offset : ManifestBlockOffsets(index)) {
+        input_stream.SeekToBlock(offset);
+        ParseManifestEntries(true, false, &input_stream, &all_entries);
+      }
     }
+
+    std::set<uint64_t> offsets;
+    for (const auto& metric_extents : index.metrics()) {
+      if (metric_extents.manifest_index() ==
+          MetricBase::kManifestEntryMetaIndex) {
+        continue;
+      }
+
+      for (const auto& extent : metric_extents.extents()) {
+        offsets.emplace(extent.offset());
+      }
+    }
+
+    for (uint64_t offset : PartOffsets(offsets, part_index_, part_count_)) {
+      input_stream.SeekToBlock(offset);
+      ParseManifestEntries(false, true, &input_stream, &all_entries);
+    }
+  } else if (part_index_ == 0) {
+    ParseManifestEntries(true, true, &input_stream, &all_entries);
   }
 
   std::map<std::string, std::vector<WrappedEntry>> id_to_manifest;
@@ -370,6 +615,29 @@ Manifest MetricsParser::ParseManifest() const {
   return {std::move(id_to_manifest)};
 }
 
+Manifest ParseManifestInParallel(const std::string& metrics_file,
+                                 size_t thread_count) {
+  std::vector<std::unique_ptr<MetricsParser>> parsers;
+  std::vector<std::unique_ptr<Manifest>> manifests(thread_count);
+  for (size_t i = 0; i < thread_count; ++i) {
+    parsers.emplace_back(make_unique<MetricsParser>(metrics_file));
+    parsers.back()->SetPart(i, thread_count);
+  }
+
+  RunInParallel<std::unique_ptr<MetricsParser>>(
+      parsers, [&manifests](const std::unique_ptr<MetricsParser>& parser,
+                            size_t i) {
+        manifests[i] = make_unique<Manifest>(parser->ParseManifest());
+      }, thread_count);
+
+  Manifest manifest = std::move(*manifests.front());
+  for (size_t i = 1; i < thread_count; ++i) {
+    manifest.MergeFrom(manifests[i].get());
+  }
+
+  return manifest;
+}
+
 static constexpr char kMetricIdColumnName[] = "Metric Id";
 static constexpr char kTypeColumnName[] = "Type";
 static constexpr char kFieldsColumnName[] = "Fields";
@@ -558,7 +826,67 @@ uint64_t Manifest::TotalEntryCount() const {
 }
 
 MetricsParser::MetricsParser(const std::string& metrics_file)
-    : metrics_file_(metrics_file) {}
+    : metrics_file_(metrics_file),
+      min_timestamp_(0),
+      max_timestamp_(std::numeric_limits<uint64_t>::max()),
+      part_index_(0),
+      part_count_(1) {}
+
+void ParseInParallel(const std::vector<MetricsParser*>& parsers,
+                     size_t thread_count) {
+  if (parsers.size() == 1 || thread_count == 1) {
+    for (MetricsParser* parser : parsers) {
+      parser->Parse();
+    }
+    return;
+  }
+
+  RunInParallel<MetricsParser*>(
+      parsers, [](MetricsParser* parser, size_t i) {
+        Unused(i);
+        parser->Parse();
+      }, std::min(thread_count, parsers.size()));
+}
+
+size_t ParseThreadCount() {
+  if (FLAGS_metrics_parse_threads != 0) {
+    return FLAGS_metrics_parse_threads;
+  }
+
+  return std::max(1u, std::thread::hardware_concurrency());
+}
+
+// Parses a file in ParseThreadCount() parts in parallel. Each part has its
+// own handle, 'add_processors' should add processors that populate the handle
+// to the parser of the part. The handles of all parts are then merged into
+// 'handle'.
+template <typename Handle>
+static void ParseInParts(
+    const std::string& metrics_file, uint64_t min_timestamp,
+    uint64_t max_timestamp, uint64_t limiting_timestamp,
+    std::function<void(Handle*, MetricsParser*)> add_processors,
+    Handle* handle) {
+  size_t part_count = ParseThreadCount();
+  std::vector<std::unique_ptr<Handle>> handles;
+  std::vector<std::unique_ptr<MetricsParser>> parsers;
+  std::vector<MetricsParser*> parser_ptrs;
+  for (size_t i = 0; i < part_count; ++i) {
+    handles.emplace_back(make_unique<Handle>());
+    parsers.emplace_back(make_unique<MetricsParser>(metrics_file));
+
+    MetricsParser* parser = parsers.back().get();
+    parser->SetTimestampRange(min_timestamp, max_timestamp);
+    parser->SetPart(i, part_count);
+    add_processors(handles.back().get(), parser);
+    parser_ptrs.emplace_back(parser);
+  }
+
+  ParseInParallel(parser_ptrs, part_count);
+  for (const auto& part_handle : handles) {
+    handle->MergeFrom(part_handle.get(), limiting_timestamp);
+  }
+  handle->Sort();
+}
 
 void NumericMetricsResultHandle::CopyInto(uint64_t* timestamps_out,
                                           double* values_out) {
@@ -636,50 +964,55 @@ SimpleParseNumericData(const std::string& metrics_file,
       IdCallbackProcessor<uint64_t, PBManifestEntry::UINT64>;
 
   auto handle = make_unique<NumericMetricsResultHandle>();
-  DoubleProcessor::Callback double_callback = [&handle, min_timestamp,
-                                               max_timestamp,
-                                               limiting_timestamp](
-      const Entry<double>& entry, const PBManifestEntry& manifest_entry,
-      uint32_t manifest_index) {
-    if (entry.timestamp < max_timestamp && entry.timestamp >= min_timestamp) {
-      handle->Update(entry.timestamp, entry.value, manifest_index,
-                     manifest_entry, limiting_timestamp);
-    }
-  };
-
-  Uint32Processor::Callback uint32_callback = [&handle, min_timestamp,
-                                               max_timestamp,
-                                               limiting_timestamp](
-      const Entry<uint32_t>& entry, const PBManifestEntry& manifest_entry,
-      uint32_t manifest_index) {
-    if (entry.timestamp < max_timestamp && entry.timestamp >= min_timestamp) {
-      handle->Update(entry.timestamp, static_cast<double>(entry.value),
-                     manifest_index, manifest_entry, limiting_timestamp);
-    }
-  };
+  auto add_processors = [&ids, min_timestamp, max_timestamp,
+                         limiting_timestamp](
+      NumericMetricsResultHandle* part_handle, MetricsParser* parser) {
+    DoubleProcessor::Callback double_callback = [part_handle, min_timestamp,
+                                                 max_timestamp,
+                                                 limiting_timestamp](
+        const Entry<double>& entry, const PBManifestEntry& manifest_entry,
+        uint32_t manifest_index) {
+      if (entry.timestamp < max_timestamp &&
+          entry.timestamp >= min_timestamp) {
+        part_handle->Update(entry.timestamp, entry.value, manifest_index,
+                            manifest_entry, limiting_timestamp);
+      }
+    };
+
+    Uint32Processor::Callback uint32_callback = [part_handle, min_timestamp,
+                                                 max_timestamp,
+                                                 limiting_timestamp](
+        const Entry<uint32_t>& entry, const PBManifestEntry& manifest_entry,
+        uint32_t manifest_index) {
+      if (entry.timestamp < max_timestamp &&
+          entry.timestamp >= min_timestamp) {
+        part_handle->Update(entry.timestamp, static_cast<double>(entry.value),
+                            manifest_index, manifest_entry,
+                            limiting_timestamp);
+      }
+    };
+
+    Uint64Processor::Callback uint64_callback = [part_handle, min_timestamp,
+                                                 max_timestamp,
+                                                 limiting_timestamp](
+        const Entry<uint64_t>& entry, const PBManifestEntry& manifest_entry,
+        int32_t manifest_index) {
+      if (entry.timestamp < max_timestamp &&
+          entry.timestamp >= min_timestamp) {
+        part_handle->Update(entry.timestamp, static_cast<double>(entry.value),
+                            manifest_index, manifest_entry,
+                            limiting_timestamp);
+      }
+    };
 
-  Uint64Processor::Callback uint64_callback = [&handle, min_timestamp,
-                                               max_timestamp,
-                                               limiting_timestamp](
-      const Entry<uint64_t>& entry, const PBManifestEntry& manifest_entry,
-      int32_t manifest_index) {
-    if (entry.timestamp < max_timestamp && entry.timestamp >= min_timestamp) {
-      handle->Update(entry.timestamp, static_cast<double>(entry.value),
-                     manifest_index, manifest_entry, limiting_timestamp);
-    }
+    parser->AddProcessor(make_unique<DoubleProcessor>(ids, double_callback));
+    parser->AddProcessor(make_unique<Uint32Processor>(ids, uint32_callback));
+    parser->AddProcessor(make_unique<Uint64Processor>(ids, uint64_callback));
   };
 
-  auto double_processor = make_unique<DoubleProcessor>(ids, double_callback);
-  auto uint32_processor = make_unique<Uint32Processor>(ids, uint32_callback);
-  auto uint64_processor = make_unique<Uint64Processor>(ids, uint64_callback);
-
-  MetricsParser parser(metrics_file);
-  parser.AddProcessor(std::move(double_processor));
-  parser.AddProcessor(std::move(uint32_processor));
-  parser.AddProcessor(std::move(uint64_processor));
-
-  parser.Parse();
-  handle->Sort();
+  ParseInParts<NumericMetricsResultHandle>(metrics_file, min_timestamp,
+                                           max_timestamp, limiting_timestamp,
+                                           add_processors, handle.get());
 
   std::map<std::pair<std::string, std::string>,
            std::vector<std::pair<uint64_t, double>>> out;
@@ -706,61 +1039,69 @@ NumericMetricsResultHandle* MetricsParserParse(const char* metrics_file,
   using Uint64Processor =
       QueryCallbackProcessor<uint64_t, PBManifestEntry::UINT64>;
 
-  NumericMetricsResultHandle* return_handle = new NumericMetricsResultHandle;
-
-  DoubleProcessor::Callback double_callback = [return_handle, min_timestamp,
-                                               max_timestamp,
-                                               limiting_timestamp](
-      const Entry<double>& entry, const PBManifestEntry& manifest_entry,
-      uint32_t manifest_index) {
-    if (entry.timestamp < max_timestamp && entry.timestamp >= min_timestamp) {
-      return_handle->Update(entry.timestamp, entry.value, manifest_index,
-                            manifest_entry, limiting_timestamp);
-    }
-  };
-
-  Uint32Processor::Callback uint32_callback = [return_handle, min_timestamp,
-                                               max_timestamp,
-                                               limiting_timestamp](
-      const Entry<uint32_t>& entry, const PBManifestEntry& manifest_entry,
-      uint32_t manifest_index) {
-    if (entry.timestamp < max_timestamp && entry.timestamp >= min_timestamp) {
-      return_handle->Update(entry.timestamp, static_cast<double>(entry.value),
-                            manifest_index, manifest_entry, limiting_timestamp);
-    }
-  };
-
-  Uint64Processor::Callback uint64_callback = [return_handle, min_timestamp,
-                                               max_timestamp,
-                                               limiting_timestamp](
-      const Entry<uint64_t>& entry, const PBManifestEntry& manifest_entry,
-      int32_t manifest_index) {
-    if (entry.timestamp < max_timestamp && entry.timestamp >= min_timestamp) {
-      return_handle->Update(entry.timestamp, static_cast<double>(entry.value),
-                            manifest_index, manifest_entry, limiting_timestamp);
-    }
-  };
-
   FieldsMatcher matcher({});
   if (!FieldsMatcher::FromString(fields_to_match, &matcher)) {
     return nullptr;
   }
-  auto double_processor = make_unique<DoubleProcessor>(
-      metric_regex, std::move(matcher), double_callback);
-  FieldsMatcher::FromString(fields_to_match, &matcher);
-  auto uint32_processor = make_unique<Uint32Processor>(
-      metric_regex, std::move(matcher), uint32_callback);
-  FieldsMatcher::FromString(fields_to_match, &matcher);
-  auto uint64_processor = make_unique<Uint64Processor>(
-      metric_regex, std::move(matcher), uint64_callback);
 
-  MetricsParser parser(metrics_file);
-  parser.AddProcessor(std::move(double_processor));
-  parser.AddProcessor(std::move(uint32_processor));
-  parser.AddProcessor(std::move(uint64_processor));
+  std::string metric_regex_string = metric_regex;
+  std::string fields_to_match_string = fields_to_match;
+  auto add_processors = [&metric_regex_string, &fields_to_match_string,
+                         min_timestamp, max_timestamp, limiting_timestamp](
+      NumericMetricsResultHandle* part_handle, MetricsParser* parser) {
+    DoubleProcessor::Callback double_callback = [part_handle, min_timestamp,
+                                                 max_timestamp,
+                                                 limiting_timestamp](
+        const Entry<double>& entry, const PBManifestEntry& manifest_entry,
+        uint32_t manifest_index) {
+      if (entry.timestamp < max_timestamp &&
+          entry.timestamp >= min_timestamp) {
+        part_handle->Update(entry.timestamp, entry.value, manifest_index,
+                            manifest_entry, limiting_timestamp);
+      }
+    };
+
+    Uint32Processor::Callback uint32_callback = [part_handle, min_timestamp,
+                                                 max_timestamp,
+                                                 limiting_timestamp](
+        const Entry<uint32_t>& entry, const PBManifestEntry& manifest_entry,
+        uint32_t manifest_index) {
+      if (entry.timestamp < max_timestamp &&
+          entry.timestamp >= min_timestamp) {
+        part_handle->Update(entry.timestamp, static_cast<double>(entry.value),
+                            manifest_index, manifest_entry,
+                            limiting_timestamp);
+      }
+    };
+
+    Uint64Processor::Callback uint64_callback = [part_handle, min_timestamp,
+                                                 max_timestamp,
+                                                 limiting_timestamp](
+        const Entry<uint64_t>& entry, const PBManifestEntry& manifest_entry,
+        int32_t manifest_index) {
+      if (entry.timestamp < max_timestamp &&
+          entry.timestamp >= min_timestamp) {
+        part_handle->Update(entry.timestamp, static_cast<double>(entry.value),
+                            manifest_index, manifest_entry,
+                            limiting_timestamp);
+      }
+    };
+
+    parser->AddProcessor(make_unique<DoubleProcessor>(
+        metric_regex_string, FieldsMatcher::FromString(fields_to_match_string),
+        double_callback));
+    parser->AddProcessor(make_unique<Uint32Processor>(
+        metric_regex_string, FieldsMatcher::FromString(fields_to_match_string),
+        uint32_callback));
+    parser->AddProcessor(make_unique<Uint64Processor>(
+        metric_regex_string, FieldsMatcher::FromString(fields_to_match_string),
+        uint64_callback));
+  };
 
-  parser.Parse();
-  return_handle->Sort();
+  NumericMetricsResultHandle* return_handle = new NumericMetricsResultHandle;
+  ParseInParts<NumericMetricsResultHandle>(metrics_file, min_timestamp,
+                                           max_timestamp, limiting_timestamp,
+                                           add_processors, return_handle);
   return return_handle;
 }
 
@@ -775,46 +1116,53 @@ BytesMetricsResultHandle* MetricsParserBytesParse(const char* metrics_file,
   using DistProcessor = QueryCallbackProcessor<Distribution<double>,
                                                PBManifestEntry::DISTRIBUTION>;
 
-  BytesMetricsResultHandle* return_handle = new BytesMetricsResultHandle;
-  BytesProcessor::Callback bytes_callback = [return_handle, min_timestamp,
-                                             max_timestamp, limiting_timestamp](
-      const Entry<BytesBlob>& entry, const PBManifestEntry& manifest_entry,
-      uint32_t manifest_index) {
-    if (entry.timestamp < max_timestamp && entry.timestamp >= min_timestamp) {
-      return_handle->Update(entry.timestamp, entry.value.bytes_value(),
-                            manifest_index, manifest_entry, limiting_timestamp);
-    }
-  };
-
-  DistProcessor::Callback dist_callback = [return_handle, min_timestamp,
-                                           max_timestamp, limiting_timestamp](
-      const Entry<Distribution<double>>& entry,
-      const PBManifestEntry& manifest_entry, uint32_t manifest_index) {
-    if (entry.timestamp < max_timestamp && entry.timestamp >= min_timestamp) {
-      // This is ugly -- will serialize the just-deserialized Entry so that it
-      // is a chunk of bytes. The alternative is to create a custom parser for
-      // common::Distribution<double>.
-      std::string entry_serialized =
-          DistributionToProtobuf(entry.value).SerializeAsString();
-      return_handle->Update(entry.timestamp, entry_serialized, manifest_index,
+  std::string metric_regex_string = metric_regex;
+  std::string fields_to_match_string = fields_to_match;
+  auto add_processors = [&metric_regex_string, &fields_to_match_string,
+                         min_timestamp, max_timestamp, limiting_timestamp](
+      BytesMetricsResultHandle* part_handle, MetricsParser* parser) {
+    BytesProcessor::Callback bytes_callback = [part_handle, min_timestamp,
+                                               max_timestamp,
+                                               limiting_timestamp](
+        const Entry<BytesBlob>& entry, const PBManifestEntry& manifest_entry,
+        uint32_t manifest_index) {
+      if (entry.timestamp < max_timestamp &&
+          entry.timestamp >= min_timestamp) {
+        part_handle->Update(entry.timestamp, entry.value.bytes_value(),
+                            manifest_index, manifest_entry,
+                            limiting_timestamp);
+      }
+    };
+
+    DistProcessor::Callback dist_callback = [part_handle, min_timestamp,
+                                             max_timestamp,
+                                             limiting_timestamp](
+        const Entry<Distribution<double>>& entry,
+        const PBManifestEntry& manifest_entry, uint32_t manifest_index) {
+      if (entry.timestamp < max_timestamp &&
+          entry.timestamp >= min_timestamp) {
+        // This is ugly -- will serialize the just-deserialized Entry so that
+        // it is a chunk of bytes. The alternative is to create a custom parser
+        // for common::Distribution<double>.
+        std::string entry_serialized =
+            DistributionToProtobuf(entry.value).SerializeAsString();
+        part_handle->Update(entry.timestamp, entry_serialized, manifest_index,
                             manifest_entry, limiting_timestamp);
-    }
+      }
+    };
+
+    parser->AddProcessor(make_unique<BytesProcessor>(
+        metric_regex_string, FieldsMatcher::FromString(fields_to_match_string),
+        bytes_callback));
+    parser->AddProcessor(make_unique<DistProcessor>(
+        metric_regex_string, FieldsMatcher::FromString(fields_to_match_string),
+        dist_callback));
   };
 
-  FieldsMatcher bytes_matcher = FieldsMatcher::FromString(fields_to_match);
-  auto bytes_processor = make_unique<BytesProcessor>(
-      metric_regex, std::move(bytes_matcher), bytes_callback);
-
-  FieldsMatcher dist_matcher = FieldsMatcher::FromString(fields_to_match);
-  auto dist_processor = make_unique<DistProcessor>(
-      metric_regex, std::move(dist_matcher), dist_callback);
-
-  MetricsParser parser(metrics_file);
-  parser.AddProcessor(std::move(bytes_processor));
-  parser.AddProcessor(std::move(dist_processor));
-
-  parser.Parse();
-  return_handle->Sort();
+  BytesMetricsResultHandle* return_handle = new BytesMetricsResultHandle;
+  ParseInParts<BytesMetricsResultHandle>(metrics_file, min_timestamp,
+                                         max_timestamp, limiting_timestamp,
+                                         add_processors, return_handle);
   return return_handle;
 }
 
@@ -138,6 +138,12 @@ class MetricProcessor {
                             const PBManifestEntry& manifest_entry,
                             uint32_t manifest_index) = 0;
 
+  // Processes all values of a chunk. By default each value is converted to a
+  // protobuf and passed to ProcessEntry.
+  virtual void ProcessChunk(const DecodedChunk& chunk,
+                            const PBManifestEntry& manifest_entry,
+                            uint32_t manifest_index);
+
  protected:
   DISALLOW_COPY_AND_ASSIGN(MetricProcessor);
 };
@@ -162,6 +168,15 @@ class CallbackProcessor : public MetricProcessor {
     callback_(scratch_entry_, manifest_entry, manifest_index);
   }
 
+  void ProcessChunk(const DecodedChunk& chunk,
+                    const PBManifestEntry& manifest_entry,
+                    uint32_t manifest_index) override {
+    for (size_t i = 0; i < chunk.size(); ++i) {
+      ParseEntryFromChunk(chunk, i, &scratch_entry_);
+      callback_(scratch_entry_, manifest_entry, manifest_index);
+    }
+  }
+
  private:
   // A callback to call when an entry is processed. The first argument is the
   // entry, the second is the id.
@@ -263,6 +278,10 @@ class WrappedEntry {
   // Called for each entry that belongs to this manifest entry.
   void ChildEntry(bool numeric, double value);
 
+  // Adds the entries of the same manifest entry, counted in another part of
+  // the file.
+  void MergeFrom(const WrappedEntry& other);
+
  private:
   uint64_t manifest_index_;
 
@@ -307,6 +326,10 @@ class Manifest {
   // The total number of entries across all child entries.
   uint64_t TotalEntryCount() const;
 
+  // Adds the counts from the manifest of another part of the same file. The
+  // other manifest is left empty.
+  void MergeFrom(Manifest* other);
+
  private:
   // Entries, grouped by metric id.
   std::map<std::string, std::vector<WrappedEntry>> entries_;
@@ -324,23 +347,99 @@ class MetricsParser {
     processors_.push_back(std::move(processor_ptr));
   }
 
+  // Only values with timestamps in [min_timestamp, max_timestamp) are of
+  // interest. If the file has an index, blocks that have no such values of
+  // metrics that processors are interested in are not read. Processors still
+  // get all values of the blocks that are read, and should filter out values
+  // that are out of range.
+  void SetTimestampRange(uint64_t min_timestamp, uint64_t max_timestamp) {
+    min_timestamp_ = min_timestamp;
+    max_timestamp_ = max_timestamp;
+  }
+
+  // Only parses part 'part_index' of 'part_count' parts of the file, so that a
+  // large file can be parsed by multiple parsers in parallel, each with its
+  // own processors. Parts are runs of consecutive blocks, all values in part i
+  // are before those in part i + 1 in the file. All parts get the manifest
+  // entries from the index. Only files with an index can be split, if the
+  // file has no index part 0 is the entire file and the other parts are
+  // empty. Files in the old format, or cut short, can be indexed with the
+  // metrics_index tool.
+  void SetPart(size_t part_index, size_t part_count) {
+    CHECK(part_index < part_count) << "Bad part " << part_index << " of "
+                                   << part_count;
+    part_index_ = part_index;
+    part_count_ = part_count;
+  }
+
   // Parses the metrics file, passing entries to the processors that are
   // interested in them.
   void Parse();
 
   // Parses the metrics file, returning information about the metrics contained
-  // in it.
+  // in it. If a part is set only values in the part are counted.
   Manifest ParseManifest() const;
 
   void ClearProcessors() { processors_.clear(); }
 
  private:
+  // State that is kept while parsing a file.
+  struct ParseState {
+    // Maps the indices of manifests seen so far to the list of processors
+    // that are interested in them.
+    std::vector<std::vector<MetricProcessor*>> manifest_index_to_processors;
+
+    // Manifest entries.
+    std::vector<std::unique_ptr<PBManifestEntry>> manifest_entries;
+
+    // Scratch space for entries and chunks.
+    PBMetricEntry entry;
+    DecodedChunk chunk;
+  };
+
+  // Adds the next manifest entry and the processors that are interested in
+  // it.
+  void AddManifestEntry(std::unique_ptr<PBManifestEntry> manifest_entry,
+                        ParseState* state);
+
+  // Reads entries from a stream until the end. Manifest entries are only
+  // processed if 'manifest_entries' is true and values only if 'values' is
+  // true, the rest are skipped.
+  void ParseEntries(bool manifest_entries, bool values,
+                    InputStream* input_stream, ParseState* state);
+
+  // Parses only the blocks of the file that the index says may be of
+  // interest.
+  void ParseWithIndex(const PBMetricsIndex& index, InputStream* input_stream);
+
   const std::string metrics_file_;
 
+  uint64_t min_timestamp_;
+  uint64_t max_timestamp_;
+
+  // The part of the file to parse, see SetPart.
+  size_t part_index_;
+  size_t part_count_;
+
   // When a processor is added this class takes ownership and stores it here.
   std::vector<std::unique_ptr<MetricProcessor>> processors_;
 };
 
+// Calls Parse on all parsers, using up to 'thread_count' threads. Parsers can
+// be of different files, or of different parts of the same file, but should
+// not share processors.
+void ParseInParallel(const std::vector<MetricsParser*>& parsers,
+                     size_t thread_count);
+
+// Parses the manifest of a file in 'thread_count' parts in parallel and merges
+// the results.
+Manifest ParseManifestInParallel(const std::string& metrics_file,
+                                 size_t thread_count);
+
+// The number of threads to parse metrics with, set by --metrics_parse_threads.
+// If the flag is not set this is the number of cores.
+size_t ParseThreadCount();
+
 // The rest of this file defines a very simple external API that can be used by
 // code that only understands C. Only numeric and binary blob metrics types are
 // handled. All external functions are prefixed by 'MetricsParser'.
@@ -387,6 +486,23 @@ class MetricsResultHandleBase {
     }
   }
 
+  // Adds all values from another handle, as if they were added with Update
+  // after the values already in this one. Used to combine the results of
+  // handles that were populated in parallel.
+  void MergeFrom(MetricsResultHandleBase<T>* other,
+                 uint64_t limiting_timestamp) {
+    for (auto& id_and_values : other->id_to_values_) {
+      ValuesAndManifest<T>& values_and_manifest = id_and_values.second;
+      for (auto& timestamp_and_value : values_and_manifest.values) {
+        Update(timestamp_and_value.first, std::move(timestamp_and_value.second),
+               id_and_values.first, values_and_manifest.manifest_entry,
+               limiting_timestamp);
+      }
+    }
+    other->id_to_values_.clear();
+    other->next_it_ = other->id_to_values_.end();
+  }
+
   // Adds a new set of values to the internal map.
   void Update(uint64_t timestamp, T value, uint32_t manifest_index,
               const PBManifestEntry& manifest_entry,
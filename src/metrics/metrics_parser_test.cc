@@ -3,11 +3,14 @@
 #include <stddef.h>
 #include <numeric>
 
+#include "gflags/gflags.h"
 #include "gtest/gtest.h"
 #include "../common/map_util.h"
 #include "../common/substitute.h"
 #include "metrics_test_util.h"
 
+DECLARE_uint64(metrics_parse_threads);
+
 using namespace ncode::metrics::parser;
 
 namespace ncode {
@@ -240,6 +243,264 @@ TEST_F(MetricFixture, DoubleParser) {
   }
 }
 
+// A processor that only knows how to process entries one by one.
+class EntryProcessor : public MetricProcessor {
+ public:
+  bool InterestedIn(const PBManifestEntry& manifest_entry,
+                    uint32_t manifest_index) override {
+    Unused(manifest_entry);
+    Unused(manifest_index);
+    return true;
+  }
+
+  void ProcessEntry(const PBMetricEntry& entry,
+                    const PBManifestEntry& manifest_entry,
+                    uint32_t manifest_index) override {
+    Unused(manifest_entry);
+    Unused(manifest_index);
+    values.emplace_back(entry.uint32_value());
+  }
+
+  std::vector<uint32_t> values;
+};
+
+// Values that are persisted in chunks are passed to processors that do not
+// handle chunks one at a time.
+TEST_F(MetricFixture, ChunkToEntries) {
+  auto* metric = metric_manager_->GetUnsafeMetric<uint32_t>(kMetricComonentId,
+                                                            kMetricDesc);
+  auto* handle = metric->GetHandle();
+  for (size_t i = 0; i < 1000; ++i) {
+    handle->AddValue(i);
+  }
+  metric_manager_.reset();
+
+  auto processor = make_unique<EntryProcessor>();
+  EntryProcessor* processor_ptr = processor.get();
+  MetricsParser parser(kTestOutput);
+  parser.AddProcessor(std::move(processor));
+  parser.Parse();
+
+  ASSERT_EQ(1000ul, processor_ptr->values.size());
+  for (size_t i = 0; i < 1000; ++i) {
+    ASSERT_EQ(i, processor_ptr->values[i]);
+  }
+}
+
+// Writes an indexed file with a single UINT64 metric. Values are equal to
+// their timestamps.
+static void WriteIndexedFile(size_t value_count) {
+  OutputStream output_stream(kTestOutput, 0);
+  PBMetricEntry entry;
+  entry.mutable_manifest_entry()->set_id("metric");
+  entry.mutable_manifest_entry()->set_type(PBManifestEntry::UINT64);
+  output_stream.WriteSingle(entry, MetricBase::kManifestEntryMetaIndex);
+
+  entry.Clear();
+  for (size_t i = 0; i < value_count; ++i) {
+    entry.set_timestamp(i);
+    entry.set_uint64_value(i);
+    output_stream.WriteSingle(entry, 0);
+  }
+}
+
+// With an index and a timestamp range only the blocks that overlap the range
+// are parsed.
+TEST(MetricsParser, IndexTimestampRange) {
+  size_t block_size = OutputStream::kEntriesPerBlock;
+  WriteIndexedFile(block_size * 4);
+
+  // The first block starts with the manifest entry, the third block has the
+  // values from 2 * block_size - 1 onwards.
+  std::vector<uint64_t> values;
+  auto processor =
+      make_unique<IdCallbackProcessor<uint64_t, PBManifestEntry::UINT64>>(
+          std::set<uint32_t>({0}),
+          [&values](const Entry<uint64_t>& entry,
+                    const PBManifestEntry& manifest_entry,
+                    uint32_t manifest_index) {
+            Unused(manifest_entry);
+            Unused(manifest_index);
+            values.emplace_back(entry.value);
+          });
+
+  MetricsParser parser(kTestOutput);
+  parser.AddProcessor(std::move(processor));
+  parser.SetTimestampRange(block_size * 2, block_size * 2 + 10);
+  parser.Parse();
+  ASSERT_EQ(block_size, values.size());
+  ASSERT_EQ(block_size * 2 - 1, values.front());
+
+  auto id_and_values = SimpleParseNumericData(kTestOutput, {0}, block_size * 2,
+                                              block_size * 2 + 10, 0);
+  ASSERT_EQ(1ul, id_and_values.size());
+  const std::vector<std::pair<uint64_t, double>>& parsed_values =
+      id_and_values.begin()->second;
+  ASSERT_EQ(10ul, parsed_values.size());
+  ASSERT_EQ(block_size * 2, parsed_values.front().first);
+  std::remove(kTestOutput);
+}
+
+// Parts of a file can be parsed in parallel, values of each part come after
+// those of the previous part.
+TEST(MetricsParser, Parts) {
+  size_t value_count = OutputStream::kEntriesPerBlock * 5;
+  WriteIndexedFile(value_count);
+
+  size_t part_count = 3;
+  std::vector<std::vector<uint64_t>> part_values(part_count);
+  std::vector<std::unique_ptr<MetricsParser>> parsers;
+  std::vector<MetricsParser*> parser_ptrs;
+  for (size_t i = 0; i < part_count; ++i) {
+    std::vector<uint64_t>* values = &part_values[i];
+    auto processor =
+        make_unique<IdCallbackProcessor<uint64_t, PBManifestEntry::UINT64>>(
+            std::set<uint32_t>({0}),
+            [values](const Entry<uint64_t>& entry,
+                     const PBManifestEntry& manifest_entry,
+                     uint32_t manifest_index) {
+              Unused(manifest_entry);
+              Unused(manifest_index);
+              values->emplace_back(entry.value);
+            });
+
+    parsers.emplace_back(make_unique<MetricsParser>(kTestOutput));
+    parsers.back()->AddProcessor(std::move(processor));
+    parsers.back()->SetPart(i, part_count);
+    parser_ptrs.emplace_back(parsers.back().get());
+  }
+  ParseInParallel(parser_ptrs, part_count);
+
+  std::vector<uint64_t> all_values;
+  for (const std::vector<uint64_t>& values : part_values) {
+    ASSERT_FALSE(values.empty());
+    all_values.insert(all_values.end(), values.begin(), values.end());
+  }
+
+  std::vector<uint64_t> model(value_count);
+  std::iota(model.begin(), model.end(), 0);
+  ASSERT_EQ(model, all_values);
+  std::remove(kTestOutput);
+}
+
+// Manifest entries that are spread across blocks are in the index, in the
+// order in which they are in the file.
+TEST(MetricsParser, ManifestEntriesInManyBlocks) {
+  size_t block_size = OutputStream::kEntriesPerBlock;
+  size_t metric_count = 4;
+  {
+    OutputStream output_stream(kTestOutput, 0);
+    PBMetricEntry entry;
+    for (size_t i = 0; i < metric_count; ++i) {
+      entry.Clear();
+      entry.mutable_manifest_entry()->set_id(StrCat("metric_", i));
+      entry.mutable_manifest_entry()->set_type(PBManifestEntry::UINT64);
+      output_stream.WriteSingle(entry, MetricBase::kManifestEntryMetaIndex);
+
+      entry.Clear();
+      for (size_t j = 0; j < block_size; ++j) {
+        entry.set_timestamp(i * block_size + j);
+        entry.set_uint64_value(i * block_size + j);
+        output_stream.WriteSingle(entry, i);
+      }
+    }
+  }
+
+  PBMetricsIndex index;
+  {
+    InputStream input_stream(kTestOutput);
+    ASSERT_TRUE(input_stream.ReadIndex(&index));
+  }
+  ASSERT_EQ(static_cast<int>(metric_count), index.manifest_entries_size());
+  for (size_t i = 0; i < metric_count; ++i) {
+    ASSERT_EQ(StrCat("metric_", i), index.manifest_entries(i).id());
+  }
+
+  size_t part_count = 3;
+  std::vector<std::vector<uint64_t>> part_values(part_count);
+  std::vector<std::unique_ptr<MetricsParser>> parsers;
+  std::vector<MetricsParser*> parser_ptrs;
+  for (size_t i = 0; i < part_count; ++i) {
+    std::vector<uint64_t>* values = &part_values[i];
+    auto processor =
+        make_unique<IdCallbackProcessor<uint64_t, PBManifestEntry::UINT64>>(
+            std::set<uint32_t>({2}),
+            [values](const Entry<uint64_t>& entry,
+                     const PBManifestEntry& manifest_entry,
+                     uint32_t manifest_index) {
+              ASSERT_EQ("metric_2", manifest_entry.id());
+              ASSERT_EQ(2ul, manifest_index);
+              values->emplace_back(entry.value);
+            });
+
+    parsers.emplace_back(make_unique<MetricsParser>(kTestOutput));
+    parsers.back()->AddProcessor(std::move(processor));
+    parsers.back()->SetPart(i, part_count);
+    parser_ptrs.emplace_back(parsers.back().get());
+  }
+  ParseInParallel(parser_ptrs, part_count);
+
+  std::vector<uint64_t> all_values;
+  for (const std::vector<uint64_t>& values : part_values) {
+    all_values.insert(all_values.end(), values.begin(), values.end());
+  }
+
+  std::vector<uint64_t> model(block_size);
+  std::iota(model.begin(), model.end(), 2 * block_size);
+  ASSERT_EQ(model, all_values);
+
+  MetricsParser parser(kTestOutput);
+  Manifest manifest = parser.ParseManifest();
+  ASSERT_EQ(metric_count * block_size, manifest.TotalEntryCount());
+  ASSERT_EQ(manifest.FullToString(),
+            ParseManifestInParallel(kTestOutput, part_count).FullToString());
+  std::remove(kTestOutput);
+}
+
+// Results do not depend on how many threads parse the file.
+TEST(MetricsParser, ParseThreads) {
+  WriteIndexedFile(OutputStream::kEntriesPerBlock * 5);
+
+  uint64_t max = std::numeric_limits<uint64_t>::max();
+  FLAGS_metrics_parse_threads = 1;
+  auto values = SimpleParseNumericData(kTestOutput, {0}, 100, max, 0);
+  auto last_value = SimpleParseNumericData(kTestOutput, {0}, 0, max, max);
+
+  FLAGS_metrics_parse_threads = 4;
+  ASSERT_EQ(values, SimpleParseNumericData(kTestOutput, {0}, 100, max, 0));
+  ASSERT_EQ(last_value, SimpleParseNumericData(kTestOutput, {0}, 0, max, max));
+  FLAGS_metrics_parse_threads = 0;
+
+  ASSERT_EQ(1ul, last_value.size());
+  const std::vector<std::pair<uint64_t, double>>& limiting_values =
+      last_value.begin()->second;
+  ASSERT_EQ(1ul, limiting_values.size());
+  ASSERT_EQ(OutputStream::kEntriesPerBlock * 5 - 1,
+            limiting_values.front().first);
+  std::remove(kTestOutput);
+}
+
+// The manifest of a file is the same when parsed in parts.
+TEST(MetricsParser, ManifestParts) {
+  size_t value_count = OutputStream::kEntriesPerBlock * 5;
+  WriteIndexedFile(value_count);
+
+  MetricsParser parser(kTestOutput);
+  Manifest manifest = parser.ParseManifest();
+  ASSERT_EQ(value_count, manifest.TotalEntryCount());
+
+  Manifest parallel_manifest = ParseManifestInParallel(kTestOutput, 3);
+  ASSERT_EQ(value_count, parallel_manifest.TotalEntryCount());
+  ASSERT_EQ(manifest.FullToString(), parallel_manifest.FullToString());
+
+  MetricsParser part_parser(kTestOutput);
+  part_parser.SetPart(1, 3);
+  Manifest part_manifest = part_parser.ParseManifest();
+  ASSERT_LT(0ul, part_manifest.TotalEntryCount());
+  ASSERT_GT(value_count, part_manifest.TotalEntryCount());
+  std::remove(kTestOutput);
+}
+
 TEST_F(MetricFixture, ExternalNoMetrics) {
   auto* metric = metric_manager_->GetUnsafeMetric<uint64_t, std::string>(
       kMetricComonentId, kMetricDesc, kMetricFieldOneDesc);
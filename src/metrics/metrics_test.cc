@@ -1,12 +1,14 @@
 #include "metrics.h"
 
 #include <cstdint>
+#include <cstdio>
 #include <limits>
 #include <vector>
 #include <thread>
 #include "metrics_test_util.h"
 
 #include "gtest/gtest.h"
+#include "../common/file.h"
 #include "../common/substitute.h"
 
 namespace ncode {
@@ -304,6 +306,497 @@ TEST_F(MetricFixture, MultiThreadGetHandle) {
   }
 }
 
+static std::vector<PBMetricEntry> EntriesFromFile(const std::string& file) {
+  std::vector<PBMetricEntry> entries;
+  ProcessEntriesFromFile(file, [&entries](const PBMetricEntry& entry) {
+    entries.emplace_back(entry);
+  });
+  return entries;
+}
+
+class OutputStreamTest : public ::testing::TestWithParam<size_t> {
+ protected:
+  void TearDown() override { std::remove(kTestOutput); }
+};
+
+// Entries should be read back in order, from many blocks.
+TEST_P(OutputStreamTest, ManyBlocks) {
+  // One entry on its own and the rest in groups of 10, in five blocks.
+  size_t count = 1 + OutputStream::kEntriesPerBlock / 2 * 10;
+  {
+    OutputStream output_stream(kTestOutput, GetParam());
+    PBMetricEntry entry;
+    entry.set_uint64_value(0);
+    output_stream.WriteSingle(entry, 0);
+    for (size_t i = 1; i < count; i += 10) {
+      std::vector<PBMetricEntry> entries(10);
+      for (size_t j = 0; j < 10; ++j) {
+        entries[j].set_uint64_value(i + j);
+      }
+      output_stream.WriteBulk(&entries, 1);
+      ASSERT_TRUE(entries.empty());
+    }
+  }
+
+  std::vector<PBMetricEntry> entries = EntriesFromFile(kTestOutput);
+  ASSERT_EQ(count, entries.size());
+  for (size_t i = 0; i < count; ++i) {
+    ASSERT_EQ(i, entries[i].uint64_value());
+  }
+
+  // Values that are close to each other should compress well.
+  size_t file_size = File::FileSizeOrDie(kTestOutput);
+  ASSERT_GT(count * 2, file_size);
+}
+
+INSTANTIATE_TEST_CASE_P(WriterThreads, OutputStreamTest,
+                        ::testing::Values(0, 1, 4));
+
+// Writes 'count' entries in the format used before blocks, the i-th entry
+// has value i and manifest index kManifestEntryMetaIndex - i, or i if
+// 'descending' is false.
+static void WriteOldFormatFile(const std::string& file, size_t count,
+                               bool descending) {
+  google::protobuf::io::FileOutputStream file_output(
+      open(file.c_str(), O_WRONLY | O_TRUNC | O_CREAT, S_IREAD | S_IWRITE));
+  file_output.SetCloseOnDelete(true);
+  google::protobuf::io::CodedOutputStream coded_output(&file_output);
+  for (size_t i = 0; i < count; ++i) {
+    PBMetricEntry entry;
+    entry.set_uint64_value(i);
+    coded_output.WriteVarint32(
+        descending ? MetricBase::kManifestEntryMetaIndex - i : i);
+    coded_output.WriteVarint32(entry.ByteSize());
+    entry.SerializeWithCachedSizes(&coded_output);
+  }
+}
+
+TEST(InputStream, OldFormat) {
+  WriteOldFormatFile(kTestOutput, 100, true);
+
+  InputStream input_stream(kTestOutput);
+  for (size_t i = 0; i < 100; ++i) {
+    uint32_t manifest_index;
+    PBMetricEntry entry;
+    ASSERT_TRUE(input_stream.ReadDelimitedHeaderFrom(&manifest_index));
+    ASSERT_EQ(MetricBase::kManifestEntryMetaIndex - i, manifest_index);
+    if (i % 2) {
+      ASSERT_TRUE(input_stream.SkipMessage());
+    } else {
+      ASSERT_TRUE(input_stream.ReadDelimitedFrom(&entry));
+      ASSERT_EQ(i, entry.uint64_value());
+    }
+  }
+
+  uint32_t manifest_index;
+  ASSERT_FALSE(input_stream.ReadDelimitedHeaderFrom(&manifest_index));
+  std::remove(kTestOutput);
+}
+
+// A file that is cut short should be read up to the last complete block.
+TEST(InputStream, Truncated) {
+  size_t count = OutputStream::kEntriesPerBlock * 2;
+  {
+    OutputStream output_stream(kTestOutput, 0);
+    for (size_t i = 0; i < count; ++i) {
+      PBMetricEntry entry;
+      entry.set_uint64_value(i);
+      output_stream.WriteSingle(entry, 0);
+    }
+  }
+
+  // Cuts the file in the middle of the last block, before the index.
+  std::string contents = File::ReadFileToStringOrDie(kTestOutput);
+  uint64_t index_offset;
+  google::protobuf::io::CodedInputStream::ReadLittleEndian64FromArray(
+      reinterpret_cast<const uint8_t*>(contents.data()) + contents.size() -
+          OutputStream::kIndexFooterSize,
+      &index_offset);
+  ASSERT_EQ(0, truncate(kTestOutput, index_offset - 1));
+
+  std::vector<PBMetricEntry> entries = EntriesFromFile(kTestOutput);
+  ASSERT_EQ(OutputStream::kEntriesPerBlock, entries.size());
+  std::remove(kTestOutput);
+}
+
+static PBMetricsIndex IndexFromFile(const std::string& file) {
+  InputStream input_stream(file);
+  PBMetricsIndex index;
+  CHECK(input_stream.ReadIndex(&index));
+  return index;
+}
+
+TEST(InputStream, Index) {
+  size_t count = OutputStream::kEntriesPerBlock * 2;
+  {
+    OutputStream output_stream(kTestOutput, 0);
+    PBMetricEntry entry;
+    entry.mutable_manifest_entry()->set_id("metric");
+    output_stream.WriteSingle(entry, MetricBase::kManifestEntryMetaIndex);
+    for (size_t i = 0; i < count; ++i) {
+      entry.set_timestamp(i);
+      entry.set_uint64_value(i);
+      output_stream.WriteSingle(entry, 0);
+    }
+
+    std::string chunk;
+    EncodeIntegerChunk(PBManifestEntry::UINT64, 1, {1, 5, 3}, {1, 2, 3},
+                       &chunk);
+    output_stream.WriteChunk(&chunk);
+  }
+
+  PBMetricsIndex index = IndexFromFile(kTestOutput);
+  // Metrics are in the order in which they first appear in the file.
+  ASSERT_EQ(3, index.metrics_size());
+
+  const PBMetricsIndex::MetricExtents& manifest = index.metrics(1);
+  uint32_t manifest_meta_index = MetricBase::kManifestEntryMetaIndex;
+  ASSERT_EQ(manifest_meta_index, manifest.manifest_index());
+  ASSERT_EQ(1, manifest.extents_size());
+  ASSERT_EQ(OutputStream::kBlockFormatMagicSize, manifest.extents(0).offset());
+
+  // The manifest entry takes up one entry in the first block.
+  const PBMetricsIndex::MetricExtents& metric = index.metrics(0);
+  ASSERT_EQ(0ul, metric.manifest_index());
+  ASSERT_EQ(3, metric.extents_size());
+  ASSERT_EQ(OutputStream::kEntriesPerBlock - 1, metric.extents(0).count());
+  ASSERT_EQ(0ul, metric.extents(0).min_timestamp());
+  ASSERT_EQ(OutputStream::kEntriesPerBlock - 2,
+            metric.extents(0).max_timestamp());
+  ASSERT_EQ(OutputStream::kEntriesPerBlock, metric.extents(1).count());
+  ASSERT_EQ(1ul, metric.extents(2).count());
+  ASSERT_LT(metric.extents(0).offset(), metric.extents(1).offset());
+
+  // The chunk's values are in the last block.
+  const PBMetricsIndex::MetricExtents& chunk_metric = index.metrics(2);
+  ASSERT_EQ(1ul, chunk_metric.manifest_index());
+  ASSERT_EQ(1, chunk_metric.extents_size());
+  ASSERT_EQ(3ul, chunk_metric.extents(0).count());
+  ASSERT_EQ(1ul, chunk_metric.extents(0).min_timestamp());
+  ASSERT_EQ(5ul, chunk_metric.extents(0).max_timestamp());
+  ASSERT_EQ(metric.extents(2).offset(), chunk_metric.extents(0).offset());
+
+  // Each block can be read on its own.
+  InputStream input_stream(kTestOutput);
+  input_stream.SeekToBlock(metric.extents(2).offset());
+  uint32_t manifest_index;
+  PBMetricEntry entry;
+  ASSERT_TRUE(input_stream.ReadDelimitedHeaderFrom(&manifest_index));
+  ASSERT_EQ(0ul, manifest_index);
+  ASSERT_TRUE(input_stream.ReadDelimitedFrom(&entry));
+  ASSERT_EQ(count - 1, entry.uint64_value());
+  ASSERT_TRUE(input_stream.ReadDelimitedHeaderFrom(&manifest_index));
+  ASSERT_EQ(1ul, manifest_index);
+  input_stream.SkipChunk();
+  ASSERT_FALSE(input_stream.ReadDelimitedHeaderFrom(&manifest_index));
+
+  input_stream.SeekToBlock(metric.extents(1).offset());
+  ASSERT_TRUE(input_stream.ReadDelimitedHeaderFrom(&manifest_index));
+  ASSERT_TRUE(input_stream.ReadDelimitedFrom(&entry));
+  ASSERT_EQ(OutputStream::kEntriesPerBlock - 1, entry.uint64_value());
+  std::remove(kTestOutput);
+}
+
+static size_t error_count_ = 0;
+
+static void CountErrors(LogLevel level, const char* filename, int line,
+                        const std::string& message, LogColor color) {
+  Unused(filename);
+  Unused(line);
+  Unused(message);
+  Unused(color);
+  if (level >= LOGLEVEL_ERROR) {
+    ++error_count_;
+  }
+}
+
+// Reading past the last block of an indexed file does not try to read the
+// index as a block.
+TEST(InputStream, IndexedEOF) {
+  {
+    OutputStream output_stream(kTestOutput, 0);
+    PBMetricEntry entry;
+    for (size_t i = 0; i < 10; ++i) {
+      entry.set_uint64_value(i);
+      output_stream.WriteSingle(entry, 0);
+    }
+  }
+
+  error_count_ = 0;
+  LogHandler* old_handler = SetLogHandler(&CountErrors);
+  {
+    InputStream input_stream(kTestOutput);
+    uint32_t manifest_index;
+    PBMetricEntry entry;
+    for (size_t i = 0; i < 10; ++i) {
+      ASSERT_TRUE(input_stream.ReadDelimitedHeaderFrom(&manifest_index));
+      ASSERT_TRUE(input_stream.ReadDelimitedFrom(&entry));
+    }
+    ASSERT_FALSE(input_stream.ReadDelimitedHeaderFrom(&manifest_index));
+    ASSERT_FALSE(input_stream.ReadDelimitedHeaderFrom(&manifest_index));
+  }
+  SetLogHandler(old_handler);
+
+  ASSERT_EQ(0ul, error_count_);
+  std::remove(kTestOutput);
+}
+
+// The index can be added to files that do not have one.
+TEST(InputStream, AddIndex) {
+  {
+    OutputStream output_stream(kTestOutput, 0);
+    for (size_t i = 0; i < OutputStream::kEntriesPerBlock * 3; ++i) {
+      PBMetricEntry entry;
+      entry.set_timestamp(i);
+      entry.set_uint64_value(i);
+      output_stream.WriteSingle(entry, i % 5);
+    }
+  }
+
+  PBMetricsIndex index = IndexFromFile(kTestOutput);
+  uint64_t index_offset =
+      index.metrics(0).extents(2).offset() + OutputStream::kBlockHeaderSize;
+
+  // Removes the index and leaves only part of the last block.
+  ASSERT_EQ(0, truncate(kTestOutput, index_offset));
+  {
+    InputStream input_stream(kTestOutput);
+    PBMetricsIndex no_index;
+    ASSERT_FALSE(input_stream.ReadIndex(&no_index));
+  }
+
+  ASSERT_TRUE(AddIndexToFile(kTestOutput));
+  PBMetricsIndex new_index = IndexFromFile(kTestOutput);
+  ASSERT_EQ(5, new_index.metrics_size());
+  for (const auto& metric_extents : new_index.metrics()) {
+    ASSERT_EQ(2, metric_extents.extents_size());
+  }
+
+  std::vector<PBMetricEntry> entries = EntriesFromFile(kTestOutput);
+  ASSERT_EQ(OutputStream::kEntriesPerBlock * 2, entries.size());
+
+  // Indexing again does not change the file.
+  int file_size = File::FileSizeOrDie(kTestOutput);
+  ASSERT_TRUE(AddIndexToFile(kTestOutput));
+  ASSERT_EQ(file_size, File::FileSizeOrDie(kTestOutput));
+  ASSERT_EQ(new_index.SerializeAsString(),
+            IndexFromFile(kTestOutput).SerializeAsString());
+  std::remove(kTestOutput);
+}
+
+// Files in the old format are converted to block format when indexed.
+TEST(InputStream, AddIndexOldFormat) {
+  size_t count = OutputStream::kEntriesPerBlock + 100;
+  WriteOldFormatFile(kTestOutput, count, false);
+  ASSERT_TRUE(AddIndexToFile(kTestOutput));
+
+  PBMetricsIndex index = IndexFromFile(kTestOutput);
+  ASSERT_EQ(static_cast<int>(count), index.metrics_size());
+
+  InputStream input_stream(kTestOutput);
+  for (size_t i = 0; i < count; ++i) {
+    uint32_t manifest_index;
+    PBMetricEntry entry;
+    ASSERT_TRUE(input_stream.ReadDelimitedHeaderFrom(&manifest_index));
+    ASSERT_EQ(i, manifest_index);
+    ASSERT_TRUE(input_stream.ReadDelimitedFrom(&entry));
+    ASSERT_EQ(i, entry.uint64_value());
+  }
+
+  uint32_t manifest_index;
+  ASSERT_FALSE(input_stream.ReadDelimitedHeaderFrom(&manifest_index));
+  std::remove(kTestOutput);
+}
+
+// Files that are still being written to, or that have no records, are left
+// alone.
+TEST(InputStream, AddIndexRefused) {
+  {
+    OutputStream output_stream(kTestOutput, 0);
+    PBMetricEntry entry;
+    entry.set_uint64_value(1);
+    output_stream.WriteSingle(entry, 0);
+    ASSERT_FALSE(AddIndexToFile(kTestOutput));
+    ASSERT_EQ(static_cast<int>(OutputStream::kBlockFormatMagicSize),
+              File::FileSizeOrDie(kTestOutput));
+  }
+  ASSERT_EQ(1ul, EntriesFromFile(kTestOutput).size());
+
+  WriteOldFormatFile(kTestOutput, 0, false);
+  ASSERT_FALSE(AddIndexToFile(kTestOutput));
+  ASSERT_EQ(0, File::FileSizeOrDie(kTestOutput));
+  ASSERT_FALSE(File::Exists(StrCat(kTestOutput, ".index_tmp")));
+  std::remove(kTestOutput);
+}
+
+// Values in chunks can be read one at a time, or all at once.
+TEST(InputStream, Chunks) {
+  {
+    OutputStream output_stream(kTestOutput, 0);
+    std::string chunk;
+    EncodeIntegerChunk(PBManifestEntry::UINT64, 5, {1, 2, 3, 4},
+                       {10, 20, 30, 40}, &chunk);
+    output_stream.WriteChunk(&chunk);
+    ASSERT_TRUE(chunk.empty());
+
+    PBMetricEntry entry;
+    entry.set_uint64_value(50);
+    output_stream.WriteSingle(entry, 6);
+    EncodeDoubleChunk(7, {5, 6}, {1.0, 2.0}, &chunk);
+    output_stream.WriteChunk(&chunk);
+  }
+
+  InputStream input_stream(kTestOutput);
+  uint32_t manifest_index;
+  PBMetricEntry entry;
+  ASSERT_TRUE(input_stream.ReadDelimitedHeaderFrom(&manifest_index));
+  ASSERT_EQ(5ul, manifest_index);
+  ASSERT_TRUE(input_stream.InChunk());
+  ASSERT_TRUE(input_stream.ReadDelimitedFrom(&entry));
+  ASSERT_EQ(1ul, entry.timestamp());
+  ASSERT_EQ(10ul, entry.uint64_value());
+  ASSERT_TRUE(input_stream.ReadDelimitedHeaderFrom(&manifest_index));
+  ASSERT_EQ(5ul, manifest_index);
+  ASSERT_TRUE(input_stream.SkipMessage());
+
+  // The rest of the chunk.
+  ASSERT_TRUE(input_stream.ReadDelimitedHeaderFrom(&manifest_index));
+  DecodedChunk chunk;
+  ASSERT_TRUE(input_stream.ReadChunk(&chunk));
+  ASSERT_EQ(std::vector<uint64_t>({3, 4}), chunk.timestamps);
+  ASSERT_EQ(std::vector<uint64_t>({30, 40}), chunk.integer_values);
+  ASSERT_FALSE(input_stream.InChunk());
+
+  ASSERT_TRUE(input_stream.ReadDelimitedHeaderFrom(&manifest_index));
+  ASSERT_EQ(6ul, manifest_index);
+  ASSERT_FALSE(input_stream.InChunk());
+  ASSERT_TRUE(input_stream.ReadDelimitedFrom(&entry));
+  ASSERT_EQ(50ul, entry.uint64_value());
+
+  ASSERT_TRUE(input_stream.ReadDelimitedHeaderFrom(&manifest_index));
+  ASSERT_EQ(7ul, manifest_index);
+  input_stream.SkipChunk();
+  ASSERT_FALSE(input_stream.ReadDelimitedHeaderFrom(&manifest_index));
+  std::remove(kTestOutput);
+}
+
+// Numeric values are persisted in chunks, which take less space than
+// entries.
+TEST_F(MetricFixture, ChunkSize) {
+  std::string metric_file = std::string(kTestOutput);
+  auto* metric = metric_manager_->GetUnsafeMetric<uint64_t>(kMetricComonentId,
+                                                             kMetricDesc);
+  auto* handle = metric->GetHandle();
+  for (size_t i = 0; i < 10000; ++i) {
+    handle->AddValue(i);
+  }
+  metric_manager_.reset();
+
+  std::vector<PBMetricEntry> entries = EntriesFromFile(metric_file);
+  ASSERT_EQ(10001ul, entries.size());
+  for (size_t i = 1; i < entries.size(); ++i) {
+    ASSERT_EQ(i - 1, entries[i].uint64_value());
+  }
+
+  size_t entries_size = 0;
+  for (const PBMetricEntry& entry : entries) {
+    entries_size += entry.ByteSize() + 2;
+  }
+
+  // Files are compressed, but entries would take more space even if they
+  // were not.
+  int file_size = File::FileSizeOrDie(metric_file);
+  ASSERT_GT(entries_size / 5, static_cast<size_t>(file_size));
+  std::remove(kTestOutput);
+}
+
+TEST_F(MetricFixture, SingleQueryThreadSafe) {
+  auto* metric = metric_manager_->GetThreadSafeMetric<double>(
+      kMetricComonentId, kMetricDesc);
+  auto* handle = metric->GetHandle();
+  handle->AddValue(5.0);
+  handle->AddValue(6.0);
+
+  // The values are still buffered, but should be visible.
+  Entry<double> entry;
+  ASSERT_TRUE(handle->MostRecentEntryInMem(&entry));
+  ASSERT_EQ(6.0, entry.value);
+  ASSERT_EQ(2ul, handle->NumEntriesInMem());
+}
+
+// Values added from a single thread should be persisted in order, even if
+// they do not fit in the thread's buffer.
+TEST_F(MetricFixture, ThreadSafeOrder) {
+  std::string metric_file = std::string(kTestOutput);
+  auto* metric = metric_manager_->GetThreadSafeMetric<uint64_t>(
+      kMetricComonentId, kMetricDesc);
+  auto* handle = metric->GetHandle();
+
+  std::thread t1([handle] {
+    for (size_t i = 0; i < 10000; ++i) {
+      handle->AddValue(i);
+    }
+  });
+  t1.join();
+
+  metric_manager_.reset();
+  std::vector<uint64_t> values;
+  ProcessEntriesFromFile(metric_file, [&values](const PBMetricEntry& entry) {
+    if (!entry.has_manifest_entry()) {
+      values.emplace_back(entry.uint64_value());
+    }
+  });
+
+  ASSERT_EQ(10000ul, values.size());
+  for (size_t i = 0; i < values.size(); ++i) {
+    ASSERT_EQ(i, values[i]);
+  }
+}
+
+// Buffered entries from different threads are merged by timestamp.
+TEST(ThreadBuffers, Merge) {
+  SomethingWithThreadBuffers<uint64_t, true> buffers;
+  std::atomic<size_t> done(0);
+  auto add = [&buffers, &done](uint64_t first_timestamp) {
+    for (uint64_t i = 0; i < 100; ++i) {
+      uint64_t timestamp = first_timestamp + 2 * i;
+      buffers.TryBuffer({timestamp, timestamp});
+    }
+
+    // Both threads should be running at the same time, or the second one may
+    // get the first one's buffer.
+    ++done;
+    while (done != 2) {
+      std::this_thread::yield();
+    }
+  };
+
+  std::thread t1(add, 0);
+  std::thread t2(add, 1);
+  t1.join();
+  t2.join();
+
+  std::vector<Entry<uint64_t>> entries;
+  buffers.DrainBuffers(&entries);
+  ASSERT_EQ(200ul, entries.size());
+  for (uint64_t i = 0; i < 200; ++i) {
+    ASSERT_EQ(i, entries[i].timestamp);
+  }
+
+  entries.clear();
+  buffers.DrainBuffers(&entries);
+  ASSERT_TRUE(entries.empty());
+}
+
+TEST(ThreadBuffers, Full) {
+  using Buffers = SomethingWithThreadBuffers<uint64_t, true>;
+  Buffers buffers;
+  for (uint64_t i = 0; i < Buffers::kEntriesInBuffer; ++i) {
+    ASSERT_EQ(i + 1, buffers.TryBuffer({i, i}));
+  }
+  ASSERT_EQ(0ul, buffers.TryBuffer({0, 0}));
+}
+
 TEST_F(SingleFilePerMetricFixture, PerMetricFileOutput) {
   std::string metric_id_one = "metric_one";
   std::string metric_id_two = "metric_two";
@@ -1,18 +1,25 @@
 #include "algorithm.h"
 
 #include <chrono>
+#include <cmath>
 #include <cstdbool>
 
+#include "../common/heap.h"
 #include "../common/perfect_hash.h"
+#include "../common/thread_runner.h"
 
 namespace ncode {
 namespace net {
 
 constexpr Delay AllPairShortestPath::kMaxDistance;
+constexpr Delay AllPairShortestPath::kUnreachable;
+constexpr size_t AllPairShortestPath::kBlockSize;
+constexpr Delay DynamicShortestPath::kMaxDistance;
 
 DirectedGraph::DirectedGraph(const GraphStorage* parent)
     : graph_storage_(parent) {
   ConstructAdjacencyList();
+  ConstructCompressedAdjacency();
 }
 
 void DirectedGraph::ConstructAdjacencyList() {
@@ -34,23 +41,277 @@ void DirectedGraph::ConstructAdjacencyList() {
   }
 }
 
+void DirectedGraph::ConstructCompressedAdjacency() {
+  size_t node_count = graph_storage_->NodeCount();
+  size_t link_count = graph_storage_->LinkCount();
+  CompressedAdjacencyList& csr = compressed_adjacency_;
+  csr.offsets.reserve(node_count + 1);
+  csr.links.reserve(link_count);
+  csr.dst_nodes.reserve(link_count);
+  csr.delays.reserve(link_count);
+
+  for (size_t i = 0; i < node_count; ++i) {
+    csr.offsets.emplace_back(csr.links.size());
+
+    GraphNodeIndex node(i);
+    if (!adjacency_list_.HasValue(node)) {
+      continue;
+    }
+
+    for (GraphLinkIndex link : adjacency_list_.UnsafeAccess(node)) {
+      const GraphLink* link_ptr = graph_storage_->GetLink(link);
+      csr.links.emplace_back(link);
+      csr.dst_nodes.emplace_back(link_ptr->dst());
+      csr.delays.emplace_back(link_ptr->delay());
+      csr.max_delay = std::max(csr.max_delay, link_ptr->delay());
+    }
+  }
+  csr.offsets.emplace_back(csr.links.size());
+
+  CompressedAdjacencyList& reverse_csr = reverse_compressed_adjacency_;
+  reverse_csr.offsets.assign(node_count + 1, 0);
+  reverse_csr.links.resize(link_count);
+  reverse_csr.dst_nodes.resize(link_count);
+  reverse_csr.delays.resize(link_count);
+  reverse_csr.max_delay = csr.max_delay;
+
+  // Counts the links that enter each node, then turns the counts into offsets
+  // and places each link at the next free position of its destination.
+  for (GraphNodeIndex dst : csr.dst_nodes) {
+    ++reverse_csr.offsets[dst + 1];
+  }
+
+  for (size_t i = 0; i < node_count; ++i) {
+    reverse_csr.offsets[i + 1] += reverse_csr.offsets[i];
+  }
+
+  std::vector<uint32_t> next_free(reverse_csr.offsets.begin(),
+                                  reverse_csr.offsets.end() - 1);
+  for (size_t i = 0; i < node_count; ++i) {
+    for (size_t j = csr.offsets[i]; j < csr.offsets[i + 1]; ++j) {
+      uint32_t position = next_free[csr.dst_nodes[j]]++;
+      reverse_csr.links[position] = csr.links[j];
+      reverse_csr.dst_nodes[position] = GraphNodeIndex(i);
+      reverse_csr.delays[position] = csr.delays[j];
+    }
+  }
+}
+
 GraphSearchAlgorithm::GraphSearchAlgorithm(
     const GraphSearchAlgorithmConfig& config, const DirectedGraph* graph)
     : graph_(graph), config_(config) {}
 
+// Graphs with fewer nodes than this use the d-ary heap. The radix heap's
+// buckets have a fixed cost that does not pay off for small graphs.
+static constexpr size_t kRadixHeapMinNodes = 128;
+
+// If a path can be longer than this many microseconds the d-ary heap is
+// used. Each item in the radix heap is moved once for each bit of the
+// distance range, for large ranges this is more than the log of the node
+// count that the d-ary heap costs.
+static constexpr size_t kRadixHeapMaxDistanceBits = 32;
+
+// Queues used by Dijkstra runs. Kept per thread so that repeated runs do not
+// allocate.
+struct DijkstraQueues {
+  IndexedDaryHeap<Delay> dary_heap;
+  RadixHeap<uint32_t> radix_heap;
+};
+
+static DijkstraQueues* GetDijkstraQueues() {
+  static thread_local DijkstraQueues queues;
+  return &queues;
+}
+
+// Adapts the two queues to the same interface. Stale entries are skipped by
+// the Dijkstra loop, which makes the lazy radix heap and the decrease-key
+// d-ary heap interchangeable.
+class DaryDijkstraQueue {
+ public:
+  DaryDijkstraQueue(IndexedDaryHeap<Delay>* heap, size_t node_count)
+      : heap_(heap) {
+    heap_->Reset(node_count);
+  }
+
+  bool empty() const { return heap_->empty(); }
+
+  void Push(Delay distance, GraphNodeIndex node) {
+    heap_->PushOrDecrease(node, distance);
+  }
+
+  std::pair<Delay, GraphNodeIndex> PopMin() {
+    std::pair<Delay, uint32_t> min = heap_->PopMin();
+    return {min.first, GraphNodeIndex(min.second)};
+  }
+
+ private:
+  IndexedDaryHeap<Delay>* heap_;
+};
+
+class RadixDijkstraQueue {
+ public:
+  RadixDijkstraQueue(RadixHeap<uint32_t>* heap) : heap_(heap) {
+    heap_->Reset();
+  }
+
+  bool empty() const { return heap_->empty(); }
+
+  void Push(Delay distance, GraphNodeIndex node) {
+    heap_->Push(distance.count(), node);
+  }
+
+  std::pair<Delay, GraphNodeIndex> PopMin() {
+    std::pair<uint64_t, uint32_t> min = heap_->PopMin();
+    return {Delay(min.first), GraphNodeIndex(min.second)};
+  }
+
+ private:
+  RadixHeap<uint32_t>* heap_;
+};
+
+// Runs Dijkstra's algorithm from 'src' over the CSR form of the graph.
+// 'distances' should have one element per node, all set to a value larger
+// than any path. Every time a shorter path to a node is found 'on_relax' is
+// called with the node, the node that precedes it and the link between them.
+template <typename Queue, typename RelaxCallback>
+static void DijkstraCore(const GraphSearchAlgorithmConfig& config,
+                         const CompressedAdjacencyList& csr,
+                         GraphNodeIndex src, Queue* queue, Delay* distances,
+                         RelaxCallback on_relax) {
+  distances[src] = Delay::zero();
+  queue->Push(Delay::zero(), src);
+
+  while (!queue->empty()) {
+    Delay distance;
+    GraphNodeIndex current;
+    std::tie(distance, current) = queue->PopMin();
+
+    // Nodes added to the graph after the CSR was built are not in it.
+    CHECK(current + 1 < csr.offsets.size()) << "Node not in graph snapshot";
+    if (distance > distances[current]) {
+      // Bogus leftover node, since we never delete nodes from the heap.
+      continue;
+    }
+
+    for (size_t i = csr.offsets[current]; i < csr.offsets[current + 1]; ++i) {
+      GraphLinkIndex out_link = csr.links[i];
+      if (config.CanExcludeLink(out_link)) {
+        continue;
+      }
+
+      GraphNodeIndex neighbor_node = csr.dst_nodes[i];
+      if (config.CanExcludeNode(neighbor_node)) {
+        continue;
+      }
+
+      Delay distance_via_neighbor = distance + csr.delays[i];
+      if (distance_via_neighbor < distances[neighbor_node]) {
+        distances[neighbor_node] = distance_via_neighbor;
+        on_relax(neighbor_node, current, out_link);
+        queue->Push(distance_via_neighbor, neighbor_node);
+      }
+    }
+  }
+}
+
+// Returns true if a radix heap should be used to search the graph, based on
+// its size and the range of delays.
+static bool UseRadixHeap(const CompressedAdjacencyList& csr) {
+  size_t node_count = csr.offsets.size() - 1;
+
+  // No path can be longer than the longest link times the number of hops.
+  double max_distance =
+      static_cast<double>(csr.max_delay.count()) * node_count;
+  return node_count >= kRadixHeapMinNodes &&
+         max_distance < std::ldexp(1.0, kRadixHeapMaxDistanceBits);
+}
+
+// Picks a queue and runs Dijkstra's algorithm with it.
+template <typename RelaxCallback>
+static void Dijkstra(const GraphSearchAlgorithmConfig& config,
+                     const CompressedAdjacencyList& csr, GraphNodeIndex src,
+                     Delay* distances, RelaxCallback on_relax) {
+  DijkstraQueues* queues = GetDijkstraQueues();
+  if (UseRadixHeap(csr)) {
+    RadixDijkstraQueue queue(&queues->radix_heap);
+    DijkstraCore(config, csr, src, &queue, distances, on_relax);
+  } else {
+    DaryDijkstraQueue queue(&queues->dary_heap, csr.offsets.size() - 1);
+    DijkstraCore(config, csr, src, &queue, distances, on_relax);
+  }
+}
+
+// Like DijkstraCore, but stops once 'dst' is reached and visits nodes in order
+// of their distance from 'src' plus their distance to 'dst' (A*). The
+// distances to 'dst' should be exact in a graph that contains this one, which
+// makes them consistent -- each node is settled at most once and nodes that
+// lead away from 'dst' are never expanded. Nodes that cannot reach 'dst' are
+// skipped. Only the distances of nodes added to 'touched' are modified.
+template <typename Queue>
+static bool GoalDirectedCore(const GraphSearchAlgorithmConfig& config,
+                             const CompressedAdjacencyList& csr,
+                             GraphNodeIndex src, GraphNodeIndex dst,
+                             const Delay* distances_to_dst, Queue* queue,
+                             Delay* distances, GraphLinkIndex* previous,
+                             std::vector<GraphNodeIndex>* touched) {
+  distances[src] = Delay::zero();
+  touched->emplace_back(src);
+  queue->Push(distances_to_dst[src], src);
+
+  while (!queue->empty()) {
+    Delay estimate;
+    GraphNodeIndex current;
+    std::tie(estimate, current) = queue->PopMin();
+    if (current == dst) {
+      return true;
+    }
+
+    Delay distance = distances[current];
+    if (estimate > distance + distances_to_dst[current]) {
+      continue;
+    }
+
+    for (size_t i = csr.offsets[current]; i < csr.offsets[current + 1]; ++i) {
+      GraphLinkIndex out_link = csr.links[i];
+      GraphNodeIndex neighbor_node = csr.dst_nodes[i];
+      if (distances_to_dst[neighbor_node] == Delay::max() ||
+          config.CanExcludeLink(out_link) ||
+          config.CanExcludeNode(neighbor_node)) {
+        continue;
+      }
+
+      Delay distance_via_neighbor = distance + csr.delays[i];
+      Delay& neighbor_distance = distances[neighbor_node];
+      if (distance_via_neighbor < neighbor_distance) {
+        if (neighbor_distance == Delay::max()) {
+          touched->emplace_back(neighbor_node);
+        }
+
+        neighbor_distance = distance_via_neighbor;
+        previous[neighbor_node] = out_link;
+        queue->Push(distance_via_neighbor + distances_to_dst[neighbor_node],
+                    neighbor_node);
+      }
+    }
+  }
+
+  return false;
+}
+
 net::LinkSequence AllPairShortestPath::GetPath(GraphNodeIndex src,
                                                GraphNodeIndex dst) const {
-  Delay dist = data_[src][dst].distance;
+  Delay dist = GetDistance(src, dst);
   if (dist == kMaxDistance) {
     return {};
   }
 
+  const GraphStorage* graph_storage = graph_->graph_storage();
   Links links;
   GraphNodeIndex next = src;
   while (next != dst) {
-    const SPData& datum = data_[next][dst];
-    links.emplace_back(datum.next_link);
-    next = datum.next_node;
+    GraphLinkIndex next_link = next_links_[MatrixOffset(next, dst)];
+    links.emplace_back(next_link);
+    next = graph_storage->GetLink(next_link)->dst();
   }
 
   return {links, dist};
@@ -58,20 +319,37 @@ net::LinkSequence AllPairShortestPath::GetPath(GraphNodeIndex src,
 
 Delay AllPairShortestPath::GetDistance(GraphNodeIndex src,
                                        GraphNodeIndex dst) const {
-  return data_[src][dst].distance;
+  CHECK(src < node_count_ && dst < node_count_);
+  Delay distance = distances_[MatrixOffset(src, dst)];
+  return distance >= kUnreachable ? kMaxDistance : distance;
+}
+
+void AllPairShortestPath::ComputePaths(Mode mode, size_t num_threads) {
+  InitMatrices();
+  switch (mode) {
+    case FLOYD_WARSHALL:
+      FloydWarshall();
+      break;
+    case BLOCKED_FLOYD_WARSHALL:
+      BlockedFloydWarshall(num_threads);
+      break;
+    case PARALLEL_DIJKSTRA:
+      ParallelDijkstra(num_threads);
+      break;
+  }
 }
 
-void AllPairShortestPath::ComputePaths() {
+void AllPairShortestPath::InitMatrices() {
   const GraphStorage* graph_storage = graph_->graph_storage();
+  distances_.assign(node_count_ * node_count_, kUnreachable);
+  next_links_.assign(node_count_ * node_count_, GraphLinkIndex(0));
 
-  const GraphNodeSet nodes = graph_storage->AllNodes();
-  for (GraphNodeIndex node : nodes) {
+  for (GraphNodeIndex node : graph_storage->AllNodes()) {
     if (config_.CanExcludeNode(node)) {
       continue;
     }
 
-    SPData& node_data = data_[node][node];
-    node_data.distance = Delay::zero();
+    distances_[MatrixOffset(node, node)] = Delay::zero();
   }
 
   for (GraphLinkIndex link : graph_storage->AllLinks()) {
@@ -80,39 +358,172 @@ void AllPairShortestPath::ComputePaths() {
     }
 
     const GraphLink* link_ptr = graph_storage->GetLink(link);
-    Delay distance = link_ptr->delay();
+    if (config_.CanExcludeNode(link_ptr->src()) ||
+        config_.CanExcludeNode(link_ptr->dst())) {
+      continue;
+    }
 
-    SPData& sp_data = data_[link_ptr->src()][link_ptr->dst()];
-    sp_data.distance = distance;
-    sp_data.next_link = link;
-    sp_data.next_node = link_ptr->dst();
+    size_t offset = MatrixOffset(link_ptr->src(), link_ptr->dst());
+    distances_[offset] = link_ptr->delay();
+    next_links_[offset] = link;
   }
+}
 
-  for (GraphNodeIndex k : nodes) {
-    for (GraphNodeIndex i : nodes) {
-      for (GraphNodeIndex j : nodes) {
-        Delay i_k = data_[i][k].distance;
-        Delay k_j = data_[k][j].distance;
+void AllPairShortestPath::FloydWarshall() {
+  for (size_t k = 0; k < node_count_; ++k) {
+    for (size_t i = 0; i < node_count_; ++i) {
+      Delay i_k = distances_[MatrixOffset(i, k)];
+      if (i_k == kUnreachable) {
+        continue;
+      }
 
-        bool any_max = (i_k == kMaxDistance || k_j == kMaxDistance);
-        Delay alt_distance = any_max ? kMaxDistance : i_k + k_j;
+      for (size_t j = 0; j < node_count_; ++j) {
+        Delay alt_distance = i_k + distances_[MatrixOffset(k, j)];
+        size_t i_j = MatrixOffset(i, j);
+        if (alt_distance < distances_[i_j]) {
+          distances_[i_j] = alt_distance;
+          next_links_[i_j] = next_links_[MatrixOffset(i, k)];
+        }
+      }
+    }
+  }
+}
 
-        SPData& i_j_data = data_[i][j];
-        if (alt_distance < i_j_data.distance) {
-          i_j_data.distance = alt_distance;
+void AllPairShortestPath::UpdateTile(size_t k_tile, Tile to_update) {
+  size_t k_from = k_tile * kBlockSize;
+  size_t k_to = std::min(k_from + kBlockSize, node_count_);
+  size_t i_from = to_update.first * kBlockSize;
+  size_t i_to = std::min(i_from + kBlockSize, node_count_);
+  size_t j_from = to_update.second * kBlockSize;
+  size_t j_to = std::min(j_from + kBlockSize, node_count_);
+
+  Delay* distances = distances_.data();
+  GraphLinkIndex* next_links = next_links_.data();
+  for (size_t k = k_from; k < k_to; ++k) {
+    const Delay* k_row = distances + MatrixOffset(k, 0);
+    for (size_t i = i_from; i < i_to; ++i) {
+      Delay i_k = distances[MatrixOffset(i, k)];
+      if (i_k == kUnreachable) {
+        continue;
+      }
 
-          const SPData& i_k_data = data_[i][k];
-          i_j_data.next_link = i_k_data.next_link;
-          i_j_data.next_node = i_k_data.next_node;
+      GraphLinkIndex i_k_next = next_links[MatrixOffset(i, k)];
+      Delay* i_row = distances + MatrixOffset(i, 0);
+      GraphLinkIndex* i_next_row = next_links + MatrixOffset(i, 0);
+      for (size_t j = j_from; j < j_to; ++j) {
+        Delay alt_distance = i_k + k_row[j];
+        if (alt_distance < i_row[j]) {
+          i_row[j] = alt_distance;
+          i_next_row[j] = i_k_next;
         }
       }
     }
   }
 }
 
+void AllPairShortestPath::BlockedFloydWarshall(size_t num_threads) {
+  size_t tile_count = (node_count_ + kBlockSize - 1) / kBlockSize;
+  if (tile_count < 2) {
+    FloydWarshall();
+    return;
+  }
+
+  // Only worth having threads around if there are independent tiles.
+  std::unique_ptr<ThreadBatchProcessor<Tile>> processor;
+  if (num_threads > 1) {
+    processor = make_unique<ThreadBatchProcessor<Tile>>(num_threads);
+  }
+
+  auto update_tiles = [this, &processor](size_t k_tile,
+                                         const std::vector<Tile>& tiles) {
+    if (!processor) {
+      for (const Tile& tile : tiles) {
+        UpdateTile(k_tile, tile);
+      }
+      return;
+    }
+
+    processor->RunInParallel(
+        tiles, [this, k_tile](const Tile& tile, size_t i, size_t thread_index) {
+          Unused(i);
+          Unused(thread_index);
+          UpdateTile(k_tile, tile);
+        });
+  };
+
+  std::vector<Tile> tiles;
+  for (size_t k_tile = 0; k_tile < tile_count; ++k_tile) {
+    // Phase 1: the tile on the diagonal depends only on itself.
+    UpdateTile(k_tile, {k_tile, k_tile});
+
+    // Phase 2: the tiles in the same row and column as the diagonal tile
+    // depend only on themselves and on the diagonal tile.
+    tiles.clear();
+    for (size_t i = 0; i < tile_count; ++i) {
+      if (i != k_tile) {
+        tiles.emplace_back(k_tile, i);
+        tiles.emplace_back(i, k_tile);
+      }
+    }
+    update_tiles(k_tile, tiles);
+
+    // Phase 3: all other tiles depend only on tiles from phase 2.
+    tiles.clear();
+    for (size_t i = 0; i < tile_count; ++i) {
+      for (size_t j = 0; j < tile_count; ++j) {
+        if (i != k_tile && j != k_tile) {
+          tiles.emplace_back(i, j);
+        }
+      }
+    }
+    update_tiles(k_tile, tiles);
+  }
+}
+
+void AllPairShortestPath::DijkstraFromSource(GraphNodeIndex src) {
+  if (config_.CanExcludeNode(src)) {
+    return;
+  }
+
+  Delay* distances = distances_.data() + MatrixOffset(src, 0);
+  GraphLinkIndex* next_links = next_links_.data() + MatrixOffset(src, 0);
+
+  // The row was initialized with the links that leave the source, since they
+  // may not be shortest paths Dijkstra needs to start from scratch.
+  std::fill(distances, distances + node_count_, kUnreachable);
+  Dijkstra(config_, graph_->CompressedAdjacency(), src, distances,
+           [src, next_links](GraphNodeIndex node, GraphNodeIndex via,
+                             GraphLinkIndex link) {
+             // The first link of the path to the node is the same as the
+             // first link of the path to the node before it.
+             next_links[node] = via == src ? link : next_links[via];
+           });
+}
+
+void AllPairShortestPath::ParallelDijkstra(size_t num_threads) {
+  std::vector<GraphNodeIndex> sources;
+  for (GraphNodeIndex node : graph_->graph_storage()->AllNodes()) {
+    sources.emplace_back(node);
+  }
+
+  if (num_threads == 1) {
+    for (GraphNodeIndex src : sources) {
+      DijkstraFromSource(src);
+    }
+    return;
+  }
+
+  // Each run only writes to the row of its source.
+  RunInParallel<GraphNodeIndex>(
+      sources, [this](const GraphNodeIndex& src, size_t i) {
+        Unused(i);
+        DijkstraFromSource(src);
+      }, num_threads);
+}
+
 DFS::DFS(const GraphSearchAlgorithmConfig& config, const DirectedGraph* graph,
          bool prune_distance)
-    : GraphSearchAlgorithm(config, graph), storage_(graph->graph_storage()) {
+    : GraphSearchAlgorithm(config, graph) {
   if (prune_distance) {
     all_pair_sp_ = make_unique<AllPairShortestPath>(config, graph_);
   }
@@ -154,25 +565,24 @@ void DFS::PathsRecursive(Delay max_distance, size_t max_hops, GraphNodeIndex at,
   }
   nodes_seen->Insert(at);
 
-  const auto& adjacency_list = graph_->AdjacencyList();
-  const std::vector<GraphLinkIndex>& outgoing_links = adjacency_list[at];
-
-  for (GraphLinkIndex out_link : outgoing_links) {
+  const CompressedAdjacencyList& csr = graph_->CompressedAdjacency();
+  for (size_t i = csr.offsets[at]; i < csr.offsets[at + 1]; ++i) {
+    GraphLinkIndex out_link = csr.links[i];
     if (config_.CanExcludeLink(out_link)) {
       continue;
     }
 
-    const GraphLink* next_link = storage_->GetLink(out_link);
-    GraphNodeIndex next_hop = next_link->dst();
+    GraphNodeIndex next_hop = csr.dst_nodes[i];
     if (config_.CanExcludeNode(next_hop)) {
       continue;
     }
 
+    Delay link_delay = csr.delays[i];
     current->push_back(out_link);
-    *total_distance += next_link->delay();
+    *total_distance += link_delay;
     PathsRecursive(max_distance, max_hops, next_hop, dst, path_callback,
                    nodes_seen, current, total_distance);
-    *total_distance -= next_link->delay();
+    *total_distance -= link_delay;
     current->pop_back();
   }
 
@@ -186,16 +596,13 @@ void DFS::ReachableNodesRecursive(GraphNodeIndex at,
   }
   nodes_seen->Insert(at);
 
-  const auto& adjacency_list = graph_->AdjacencyList();
-  const std::vector<GraphLinkIndex>& outgoing_links = adjacency_list[at];
-
-  for (GraphLinkIndex out_link : outgoing_links) {
-    if (config_.CanExcludeLink(out_link)) {
+  const CompressedAdjacencyList& csr = graph_->CompressedAdjacency();
+  for (size_t i = csr.offsets[at]; i < csr.offsets[at + 1]; ++i) {
+    if (config_.CanExcludeLink(csr.links[i])) {
       continue;
     }
 
-    const GraphLink* next_link = storage_->GetLink(out_link);
-    GraphNodeIndex next_hop = next_link->dst();
+    GraphNodeIndex next_hop = csr.dst_nodes[i];
     if (config_.CanExcludeNode(next_hop)) {
       continue;
     }
@@ -205,15 +612,15 @@ void DFS::ReachableNodesRecursive(GraphNodeIndex at,
 }
 
 LinkSequence ShortestPath::GetPath(GraphNodeIndex dst) const {
+  if (distances_.empty() || distances_[dst] == Delay::max()) {
+    return {};
+  }
+
   const GraphStorage* graph_storage = graph_->graph_storage();
   Links links_reverse;
 
   GraphNodeIndex current = dst;
   while (current != src_) {
-    if (!previous_.HasValue(current)) {
-      return {};
-    }
-
     GraphLinkIndex link = previous_[current];
     const GraphLink* link_ptr = graph_storage->GetLink(link);
 
@@ -222,68 +629,307 @@ LinkSequence ShortestPath::GetPath(GraphNodeIndex dst) const {
   }
 
   std::reverse(links_reverse.begin(), links_reverse.end());
-  Delay distance = min_delays_[dst].distance;
-  return {links_reverse, distance};
+  return {links_reverse, distances_[dst]};
 }
 
 void ShortestPath::ComputePaths() {
-  using DelayAndIndex = std::pair<Delay, GraphNodeIndex>;
-  std::priority_queue<DelayAndIndex, std::vector<DelayAndIndex>,
-                      std::greater<DelayAndIndex>> vertex_queue;
+  if (config_.CanExcludeNode(src_)) {
+    return;
+  }
 
-  const GraphNodeMap<std::vector<GraphLinkIndex>>& adjacency_list =
-      graph_->AdjacencyList();
+  size_t node_count = graph_->graph_storage()->NodeCount();
+  distances_.assign(node_count, Delay::max());
+  previous_.resize(node_count);
+
+  std::vector<GraphLinkIndex>& previous = previous_;
+  Dijkstra(config_, graph_->CompressedAdjacency(), src_, distances_.data(),
+           [&previous](GraphNodeIndex node, GraphNodeIndex via,
+                       GraphLinkIndex link) {
+             Unused(via);
+             previous[node] = link;
+           });
+}
+
+DynamicShortestPath::DynamicShortestPath(
+    const GraphSearchAlgorithmConfig& config, GraphNodeIndex src,
+    const DirectedGraph* graph)
+    : GraphSearchAlgorithm(config, graph),
+      src_(src),
+      last_update_affected_count_(0) {
   const GraphStorage* graph_storage = graph_->graph_storage();
+  size_t node_count = graph_storage->NodeCount();
+  distances_.resize(node_count, kMaxDistance);
+  previous_.resize(node_count);
+  affected_.resize(node_count, false);
+  delays_.resize(graph_storage->LinkCount());
+
+  for (GraphLinkIndex link : graph_storage->AllLinks()) {
+    const GraphLink* link_ptr = graph_storage->GetLink(link);
+    delays_[link] = link_ptr->delay();
+    if (config_.CanExcludeLink(link)) {
+      excluded_links_.Insert(link);
+    }
+
+    if (config_.CanExcludeNode(link_ptr->src()) ||
+        config_.CanExcludeNode(link_ptr->dst())) {
+      continue;
+    }
+    in_links_[link_ptr->dst()].emplace_back(link);
+  }
+
   if (config_.CanExcludeNode(src_)) {
     return;
   }
 
-  min_delays_.Resize(graph_storage->NodeCount());
-  previous_.Resize(graph_storage->NodeCount());
+  VertexQueue queue;
+  distances_[src_] = Delay::zero();
+  queue.emplace(Delay::zero(), src_);
+  last_update_affected_count_ = Propagate(&queue);
+}
+
+void DynamicShortestPath::ExcludeLink(GraphLinkIndex link) {
+  if (excluded_links_.Contains(link)) {
+    return;
+  }
+
+  excluded_links_.Insert(link);
+  LinkDelayIncreased(link);
+}
 
-  min_delays_.UnsafeAccess(src_).distance = Delay::zero();
-  vertex_queue.emplace(Delay::zero(), src_);
+void DynamicShortestPath::RestoreLink(GraphLinkIndex link) {
+  if (!excluded_links_.Contains(link)) {
+    return;
+  }
+
+  excluded_links_.Remove(link);
+  LinkDelayDecreased(link);
+}
+
+void DynamicShortestPath::SetDelay(GraphLinkIndex link, Delay delay) {
+  Delay old_delay = delays_[link];
+  delays_[link] = delay;
+  if (excluded_links_.Contains(link)) {
+    return;
+  }
+
+  if (delay < old_delay) {
+    LinkDelayDecreased(link);
+  } else if (delay > old_delay) {
+    LinkDelayIncreased(link);
+  }
+}
+
+LinkSequence DynamicShortestPath::GetPath(GraphNodeIndex dst) const {
+  Delay distance = distances_[dst];
+  if (distance == kMaxDistance) {
+    return {};
+  }
 
-  while (!vertex_queue.empty()) {
+  const GraphStorage* graph_storage = graph_->graph_storage();
+  Links links_reverse;
+  GraphNodeIndex current = dst;
+  while (current != src_) {
+    GraphLinkIndex link = previous_[current];
+    links_reverse.emplace_back(link);
+    current = graph_storage->GetLink(link)->src();
+  }
+
+  std::reverse(links_reverse.begin(), links_reverse.end());
+  return {links_reverse, distance};
+}
+
+Delay DynamicShortestPath::DistanceVia(GraphLinkIndex link) const {
+  Delay link_delay = LinkDelay(link);
+  GraphNodeIndex link_src = graph_->graph_storage()->GetLink(link)->src();
+  Delay src_distance = distances_[link_src];
+  if (link_delay == kMaxDistance || src_distance == kMaxDistance) {
+    return kMaxDistance;
+  }
+
+  return src_distance + link_delay;
+}
+
+size_t DynamicShortestPath::Propagate(VertexQueue* queue) {
+  const CompressedAdjacencyList& csr = graph_->CompressedAdjacency();
+
+  size_t settled_count = 0;
+  while (!queue->empty()) {
     Delay distance;
     GraphNodeIndex current;
-    std::tie(distance, current) = vertex_queue.top();
-    vertex_queue.pop();
-
-    if (!adjacency_list.HasValue(current)) {
-      // A leaf.
-      continue;
-    }
+    std::tie(distance, current) = queue->top();
+    queue->pop();
 
-    if (distance > min_delays_.UnsafeAccess(current).distance) {
-      // Bogus leftover node, since we never delete nodes from the heap.
+    if (distance > distances_[current]) {
       continue;
     }
 
-    const std::vector<GraphLinkIndex>& neighbors =
-        adjacency_list.UnsafeAccess(current);
-    for (GraphLinkIndex out_link : neighbors) {
-      if (config_.CanExcludeLink(out_link)) {
+    ++settled_count;
+    for (size_t i = csr.offsets[current]; i < csr.offsets[current + 1]; ++i) {
+      GraphLinkIndex out_link = csr.links[i];
+      Delay link_delay = LinkDelay(out_link);
+      if (link_delay == kMaxDistance) {
         continue;
       }
 
-      const GraphLink* out_link_ptr = graph_storage->GetLink(out_link);
-      GraphNodeIndex neighbor_node = out_link_ptr->dst();
+      GraphNodeIndex neighbor_node = csr.dst_nodes[i];
       if (config_.CanExcludeNode(neighbor_node)) {
         continue;
       }
 
-      const Delay link_delay = out_link_ptr->delay();
-      const Delay distance_via_neighbor = distance + link_delay;
-      Delay& curr_min_distance =
-          min_delays_.UnsafeAccess(neighbor_node).distance;
+      Delay distance_via_neighbor = distance + link_delay;
+      if (distance_via_neighbor < distances_[neighbor_node]) {
+        distances_[neighbor_node] = distance_via_neighbor;
+        previous_[neighbor_node] = out_link;
+        queue->emplace(distance_via_neighbor, neighbor_node);
+      }
+    }
+  }
+
+  return settled_count;
+}
+
+void DynamicShortestPath::LinkDelayDecreased(GraphLinkIndex link) {
+  last_update_affected_count_ = 0;
+  GraphNodeIndex dst = graph_->graph_storage()->GetLink(link)->dst();
+  if (config_.CanExcludeNode(dst)) {
+    return;
+  }
+
+  // If the link now offers a shorter path to its destination the improvement
+  // is propagated to all nodes that can benefit from it.
+  Delay distance_via_link = DistanceVia(link);
+  if (distance_via_link >= distances_[dst]) {
+    return;
+  }
+
+  VertexQueue queue;
+  distances_[dst] = distance_via_link;
+  previous_[dst] = link;
+  queue.emplace(distance_via_link, dst);
+  last_update_affected_count_ = Propagate(&queue);
+}
+
+void DynamicShortestPath::LinkDelayIncreased(GraphLinkIndex link) {
+  last_update_affected_count_ = 0;
+  const GraphStorage* graph_storage = graph_->graph_storage();
+  GraphNodeIndex dst = graph_storage->GetLink(link)->dst();
+  if (dst == src_ || distances_[dst] == kMaxDistance ||
+      previous_[dst] != link) {
+    // Not part of the SP tree, nothing will change.
+    return;
+  }
+
+  // Figures out which nodes in the subtree of the link's destination are
+  // affected. A node is not affected if it can be reached at the same
+  // distance via a link from an unaffected node. The subtree is traversed in
+  // order of increasing distance so that all nodes closer to the source are
+  // classified before nodes further away. Zero-delay links are never used as
+  // alternatives, this may mark some nodes as affected unnecessarily, but
+  // avoids picking a descendant at the same distance as a new parent.
+  const CompressedAdjacencyList& csr = graph_->CompressedAdjacency();
+  std::vector<GraphNodeIndex> affected_nodes;
+  VertexQueue candidates;
+  candidates.emplace(distances_[dst], dst);
+  while (!candidates.empty()) {
+    GraphNodeIndex candidate = candidates.top().second;
+    candidates.pop();
+
+    bool has_alternative = false;
+    if (in_links_.HasValue(candidate)) {
+      for (GraphLinkIndex in_link : in_links_.UnsafeAccess(candidate)) {
+        GraphNodeIndex in_link_src = graph_storage->GetLink(in_link)->src();
+        Delay in_link_delay = LinkDelay(in_link);
+        if (affected_[in_link_src] || in_link_delay == Delay::zero()) {
+          continue;
+        }
+
+        if (DistanceVia(in_link) == distances_[candidate]) {
+          previous_[candidate] = in_link;
+          has_alternative = true;
+          break;
+        }
+      }
+    }
+
+    if (has_alternative) {
+      continue;
+    }
+
+    affected_[candidate] = true;
+    affected_nodes.emplace_back(candidate);
+    for (size_t i = csr.offsets[candidate]; i < csr.offsets[candidate + 1];
+         ++i) {
+      GraphLinkIndex out_link = csr.links[i];
+      GraphNodeIndex child = csr.dst_nodes[i];
+      if (child != src_ && distances_[child] != kMaxDistance &&
+          previous_[child] == out_link && !affected_[child]) {
+        candidates.emplace(distances_[child], child);
+      }
+    }
+  }
+
+  // Affected nodes get their distances from the best link that connects them
+  // to an unaffected node. A Dijkstra run from those nodes then fixes up the
+  // distances within the affected region.
+  for (GraphNodeIndex node : affected_nodes) {
+    distances_[node] = kMaxDistance;
+  }
+
+  VertexQueue queue;
+  for (GraphNodeIndex node : affected_nodes) {
+    if (!in_links_.HasValue(node)) {
+      continue;
+    }
+
+    Delay& distance = distances_[node];
+    for (GraphLinkIndex in_link : in_links_.UnsafeAccess(node)) {
+      GraphNodeIndex in_link_src = graph_storage->GetLink(in_link)->src();
+      if (affected_[in_link_src]) {
+        continue;
+      }
 
-      if (distance_via_neighbor < curr_min_distance) {
-        curr_min_distance = distance_via_neighbor;
-        previous_.UnsafeAccess(neighbor_node) = out_link;
-        vertex_queue.emplace(curr_min_distance, neighbor_node);
+      Delay distance_via_link = DistanceVia(in_link);
+      if (distance_via_link < distance) {
+        distance = distance_via_link;
+        previous_[node] = in_link;
       }
     }
+
+    if (distance != kMaxDistance) {
+      queue.emplace(distance, node);
+    }
+  }
+
+  for (GraphNodeIndex node : affected_nodes) {
+    affected_[node] = false;
+  }
+
+  Propagate(&queue);
+  last_update_affected_count_ = affected_nodes.size();
+}
+
+DynamicAllPairShortestPath::DynamicAllPairShortestPath(
+    const GraphSearchAlgorithmConfig& config, const DirectedGraph* graph) {
+  for (GraphNodeIndex node : graph->graph_storage()->AllNodes()) {
+    trees_.emplace_back(make_unique<DynamicShortestPath>(config, node, graph));
+  }
+}
+
+void DynamicAllPairShortestPath::ExcludeLink(GraphLinkIndex link) {
+  for (auto& tree : trees_) {
+    tree->ExcludeLink(link);
+  }
+}
+
+void DynamicAllPairShortestPath::RestoreLink(GraphLinkIndex link) {
+  for (auto& tree : trees_) {
+    tree->RestoreLink(link);
+  }
+}
+
+void DynamicAllPairShortestPath::SetDelay(GraphLinkIndex link, Delay delay) {
+  for (auto& tree : trees_) {
+    tree->SetDelay(link, delay);
   }
 }
 
@@ -369,17 +1015,77 @@ LinkSequence WaypointShortestPath(const GraphSearchAlgorithmConfig& config,
   return LinkSequence(path, total_delay);
 }
 
+KShortestPaths::SpurSearchState::SpurSearchState(
+    const GraphSearchAlgorithmConfig& base_config)
+    : config(base_config) {
+  config.AddToExcludeLinks(&links_to_exclude);
+  config.AddToExcludeNodes(&nodes_to_exclude);
+}
+
+bool KShortestPaths::CandidateGreater::operator()(const Candidate& a,
+                                                  const Candidate& b) const {
+  if (a.delay != b.delay) {
+    return a.delay > b.delay;
+  }
+
+  // Same delay, will have to compare the links. The prefix of each candidate
+  // comes from its parent.
+  const Links& a_parent = (*k_paths_)[a.parent].first.links();
+  const Links& b_parent = (*k_paths_)[b.parent].first.links();
+  size_t a_size = a.spur_index + a.spur_links.size();
+  size_t b_size = b.spur_index + b.spur_links.size();
+  for (size_t i = 0; i < std::min(a_size, b_size); ++i) {
+    GraphLinkIndex a_link = i < a.spur_index ? a_parent[i]
+                                             : a.spur_links[i - a.spur_index];
+    GraphLinkIndex b_link = i < b.spur_index ? b_parent[i]
+                                             : b.spur_links[i - b.spur_index];
+    if (a_link != b_link) {
+      return a_link > b_link;
+    }
+  }
+
+  return a_size > b_size;
+}
+
 KShortestPaths::KShortestPaths(const GraphSearchAlgorithmConfig& config,
                                const std::vector<GraphLinkIndex>& waypoints,
                                GraphNodeIndex src, GraphNodeIndex dst,
-                               const DirectedGraph* graph)
+                               const DirectedGraph* graph, size_t num_threads)
     : GraphSearchAlgorithm(config, graph),
       waypoints_(waypoints),
       src_(src),
-      dst_(dst) {}
+      dst_(dst),
+      candidates_(CandidateGreater(&k_paths_)) {
+  CHECK(num_threads > 0) << "Zero threads";
+  size_t node_count = graph_->graph_storage()->NodeCount();
+
+  // The reverse shortest path tree towards the destination. Excluding more
+  // links and nodes can only make paths longer, so these distances are lower
+  // bounds for all spur searches.
+  distances_to_dst_.assign(node_count, Delay::max());
+  if (!config_.CanExcludeNode(dst_)) {
+    Dijkstra(config_, graph_->ReverseCompressedAdjacency(), dst_,
+             distances_to_dst_.data(),
+             [](GraphNodeIndex node, GraphNodeIndex via, GraphLinkIndex link) {
+               Unused(node);
+               Unused(via);
+               Unused(link);
+             });
+  }
+
+  for (size_t i = 0; i < num_threads; ++i) {
+    auto state = make_unique<SpurSearchState>(config_);
+    state->distances.assign(node_count, Delay::max());
+    state->previous.resize(node_count);
+    search_states_.emplace_back(std::move(state));
+  }
+
+  if (num_threads > 1) {
+    processor_ = make_unique<ThreadBatchProcessor<size_t>>(num_threads);
+  }
+}
 
 LinkSequence KShortestPaths::NextPath() {
-  const GraphStorage* graph_storage = graph_->graph_storage();
   if (k_paths_.empty()) {
     LinkSequence path = WaypointShortestPath(
         config_, waypoints_.begin(), waypoints_.end(), src_, dst_, graph_);
@@ -387,68 +1093,146 @@ LinkSequence KShortestPaths::NextPath() {
     return path;
   }
 
+  // Each link of the last path starting from its start index is a possible
+  // spur. Spur searches are independent of each other.
   const PathAndStartIndex& last_path_and_start_index = k_paths_.back();
-  const LinkSequence& last_path = last_path_and_start_index.first;
-  const Links& last_path_links = last_path.links();
+  size_t path_size = last_path_and_start_index.first.size();
   size_t start_index = last_path_and_start_index.second;
 
-  GraphSearchAlgorithmConfig config_copy = config_;
-  GraphLinkSet links_to_exclude;
-  GraphNodeSet nodes_to_exclude;
-  config_copy.AddToExcludeLinks(&links_to_exclude);
-  config_copy.AddToExcludeNodes(&nodes_to_exclude);
+  std::vector<size_t> spur_indices;
+  for (size_t i = start_index; i < path_size; ++i) {
+    spur_indices.emplace_back(i);
+  }
 
-  Links root_path;
-  Links::const_iterator waypoints_from = waypoints_.begin();
-  for (size_t i = 0; i < last_path_links.size(); ++i) {
-    GraphLinkIndex link_index = last_path_links[i];
-    const GraphLink* link = graph_storage->GetLink(link_index);
-    GraphNodeIndex spur_node = link->src();
-    if (i < start_index) {
-      nodes_to_exclude.Insert(spur_node);
-      root_path.emplace_back(link_index);
+  std::vector<Candidate> spurs(spur_indices.size());
+  if (processor_) {
+    processor_->RunInParallel(
+        spur_indices, [this, &spurs](const size_t& spur_index, size_t i,
+                                     size_t thread_index) {
+          SpurPath(spur_index, search_states_[thread_index].get(), &spurs[i]);
+        });
+  } else {
+    for (size_t i = 0; i < spur_indices.size(); ++i) {
+      SpurPath(spur_indices[i], search_states_.front().get(), &spurs[i]);
+    }
+  }
 
-      if (waypoints_from != waypoints_.end() && link_index == *waypoints_from) {
-        std::advance(waypoints_from, 1);
-      }
-      continue;
+  for (Candidate& spur : spurs) {
+    if (!spur.spur_links.empty()) {
+      candidates_.emplace(std::move(spur));
     }
+  }
 
-    GetLinkExclusionSet(root_path, &links_to_exclude);
-    LinkSequence spur_path = WaypointShortestPath(
-        config_copy, waypoints_from, waypoints_.end(), spur_node, dst_, graph_);
-    if (!spur_path.empty()) {
-      const Links& spur_path_links = spur_path.links();
+  if (candidates_.empty()) {
+    return {};
+  }
 
-      Links candidate_links = root_path;
-      candidate_links.insert(candidate_links.end(), spur_path_links.begin(),
-                             spur_path_links.end());
-      LinkSequence candidate_path(
-          candidate_links, TotalDelayOfLinks(candidate_links, graph_storage));
-      candidates_.emplace(candidate_path, i);
-    }
+  // Only the path that is picked is put together from its parent.
+  const Candidate& min_candidate = candidates_.top();
+  const Links& parent_links = k_paths_[min_candidate.parent].first.links();
+  Links links(parent_links.begin(),
+              parent_links.begin() + min_candidate.spur_index);
+  links.insert(links.end(), min_candidate.spur_links.begin(),
+               min_candidate.spur_links.end());
+  LinkSequence path(links, min_candidate.delay);
+  size_t min_candidate_start_index = min_candidate.spur_index;
+  candidates_.pop();
+
+  k_paths_.emplace_back(path, min_candidate_start_index);
+  return path;
+}
+
+void KShortestPaths::SpurPath(size_t spur_index, SpurSearchState* state,
+                              Candidate* out) const {
+  const GraphStorage* graph_storage = graph_->graph_storage();
+  size_t parent = k_paths_.size() - 1;
+  const Links& parent_links = k_paths_[parent].first.links();
+
+  // Nodes of the root path cannot be part of the spur path. Also skips the
+  // waypoints that the root path already goes through.
+  Links::const_iterator waypoints_from = waypoints_.begin();
+  Delay root_delay = Delay::zero();
+  for (size_t i = 0; i < spur_index; ++i) {
+    GraphLinkIndex link_index = parent_links[i];
+    const GraphLink* link = graph_storage->GetLink(link_index);
+    state->nodes_to_exclude.Insert(link->src());
+    root_delay += link->delay();
 
-    links_to_exclude.Clear();
-    nodes_to_exclude.Insert(spur_node);
-    root_path.emplace_back(link_index);
     if (waypoints_from != waypoints_.end() && link_index == *waypoints_from) {
       std::advance(waypoints_from, 1);
     }
   }
 
-  if (candidates_.empty()) {
+  GetLinkExclusionSet(parent_links, spur_index, &state->links_to_exclude);
+  GraphNodeIndex spur_node = graph_storage->GetLink(parent_links[spur_index])
+                                 ->src();
+
+  LinkSequence spur_path;
+  if (waypoints_from == waypoints_.end()) {
+    spur_path = GoalDirectedShortestPath(spur_node, state);
+  } else {
+    spur_path = WaypointShortestPath(state->config, waypoints_from,
+                                     waypoints_.end(), spur_node, dst_, graph_);
+  }
+
+  state->links_to_exclude.Clear();
+  state->nodes_to_exclude.Clear();
+
+  out->delay = root_delay + spur_path.delay();
+  out->parent = parent;
+  out->spur_index = spur_index;
+  out->spur_links = spur_path.links();
+}
+
+LinkSequence KShortestPaths::GoalDirectedShortestPath(
+    GraphNodeIndex src, SpurSearchState* state) const {
+  const CompressedAdjacencyList& csr = graph_->CompressedAdjacency();
+  if (state->config.CanExcludeNode(src) ||
+      distances_to_dst_[src] == Delay::max()) {
     return {};
   }
 
-  PathAndStartIndex min_candidate = candidates_.top();
-  candidates_.pop();
-  k_paths_.emplace_back(min_candidate);
-  return min_candidate.first;
+  DijkstraQueues* queues = GetDijkstraQueues();
+  bool found;
+  if (UseRadixHeap(csr)) {
+    RadixDijkstraQueue queue(&queues->radix_heap);
+    found = GoalDirectedCore(state->config, csr, src, dst_,
+                             distances_to_dst_.data(), &queue,
+                             state->distances.data(), state->previous.data(),
+                             &state->touched);
+  } else {
+    DaryDijkstraQueue queue(&queues->dary_heap, csr.offsets.size() - 1);
+    found = GoalDirectedCore(state->config, csr, src, dst_,
+                             distances_to_dst_.data(), &queue,
+                             state->distances.data(), state->previous.data(),
+                             &state->touched);
+  }
+
+  LinkSequence path;
+  if (found) {
+    const GraphStorage* graph_storage = graph_->graph_storage();
+    Links links_reverse;
+    for (GraphNodeIndex current = dst_; current != src;) {
+      GraphLinkIndex link = state->previous[current];
+      links_reverse.emplace_back(link);
+      current = graph_storage->GetLink(link)->src();
+    }
+
+    std::reverse(links_reverse.begin(), links_reverse.end());
+    path = LinkSequence(links_reverse, state->distances[dst_]);
+  }
+
+  for (GraphNodeIndex node : state->touched) {
+    state->distances[node] = Delay::max();
+  }
+  state->touched.clear();
+  return path;
 }
 
-bool KShortestPaths::HasPrefix(const Links& path, const Links& prefix) {
-  CHECK(prefix.size() <= path.size()) << prefix.size() << " vs " << path.size();
-  for (size_t i = 0; i < prefix.size(); ++i) {
+bool KShortestPaths::HasPrefix(const Links& path, const Links& prefix,
+                               size_t prefix_size) {
+  CHECK(prefix_size <= path.size()) << prefix_size << " vs " << path.size();
+  for (size_t i = 0; i < prefix_size; ++i) {
     if (path[i] != prefix[i]) {
       return false;
     }
@@ -458,17 +1242,18 @@ bool KShortestPaths::HasPrefix(const Links& path, const Links& prefix) {
 }
 
 void KShortestPaths::GetLinkExclusionSet(const Links& root_path,
-                                         GraphLinkSet* out) {
+                                         size_t root_size,
+                                         GraphLinkSet* out) const {
   for (const PathAndStartIndex& k_path_and_start_index : k_paths_) {
     const LinkSequence& k_path = k_path_and_start_index.first;
-    if (k_path.size() < root_path.size()) {
+    if (k_path.size() < root_size) {
       continue;
     }
 
     const Links& k_path_links = k_path.links();
-    if (HasPrefix(k_path_links, root_path)) {
-      CHECK(k_path_links.size() > root_path.size());
-      out->Insert(k_path_links[root_path.size()]);
+    if (HasPrefix(k_path_links, root_path, root_size)) {
+      CHECK(k_path_links.size() > root_size);
+      out->Insert(k_path_links[root_size]);
     }
   }
 }
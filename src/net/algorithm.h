@@ -5,11 +5,29 @@
 #include <limits>
 #include <queue>
 
+#include "../common/thread_runner.h"
 #include "net_common.h"
 
 namespace ncode {
 namespace net {
 
+// A compressed sparse row (CSR) form of a graph's adjacency list. The links
+// that leave node n are at positions [offsets[n], offsets[n + 1]) of the other
+// vectors. Traversing the graph this way only touches sequential memory and
+// does not need to look up GraphLink instances.
+struct CompressedAdjacencyList {
+  // One element per node, plus one at the end.
+  std::vector<uint32_t> offsets;
+
+  // The index, the destination and the delay of each link.
+  std::vector<GraphLinkIndex> links;
+  std::vector<GraphNodeIndex> dst_nodes;
+  std::vector<Delay> delays;
+
+  // The largest delay of any link.
+  Delay max_delay = Delay::zero();
+};
+
 // A directed graph.
 class DirectedGraph {
  public:
@@ -20,6 +38,18 @@ class DirectedGraph {
     return adjacency_list_;
   }
 
+  // Returns the same adjacency list, but in CSR form. Links that leave each
+  // node are in the same order as in AdjacencyList.
+  const CompressedAdjacencyList& CompressedAdjacency() const {
+    return compressed_adjacency_;
+  }
+
+  // The links that enter each node, in CSR form. In this list 'dst_nodes' are
+  // the sources of the links. Useful for searching backwards from a node.
+  const CompressedAdjacencyList& ReverseCompressedAdjacency() const {
+    return reverse_compressed_adjacency_;
+  }
+
   // The parent graph. Not owned by this object.
   const GraphStorage* graph_storage() const { return graph_storage_; }
 
@@ -29,12 +59,22 @@ class DirectedGraph {
  private:
   void ConstructAdjacencyList();
 
+  // Populates compressed_adjacency_ from adjacency_list_ and
+  // reverse_compressed_adjacency_ from compressed_adjacency_.
+  void ConstructCompressedAdjacency();
+
   const GraphStorage* graph_storage_;
 
   // For each node the edges that leave the node. Some edges may lead to the
   // same neighbor if simple_ is false.
   GraphNodeMap<std::vector<GraphLinkIndex>> adjacency_list_;
 
+  // Same as adjacency_list_, but in CSR form.
+  CompressedAdjacencyList compressed_adjacency_;
+
+  // Links that enter each node in CSR form.
+  CompressedAdjacencyList reverse_compressed_adjacency_;
+
   // True if there are no multiple edges between any two nodes.
   bool simple_;
 };
@@ -175,11 +215,36 @@ class DistanceClusteredGraph : public GraphSearchAlgorithm {
 // figure out if the graph is partitioned.
 class AllPairShortestPath : public GraphSearchAlgorithm {
  public:
+  // How the paths are computed. All modes produce the same distances, but if
+  // there are multiple shortest paths between two nodes different modes may
+  // return different paths.
+  enum Mode {
+    // The textbook Floyd-Warshall triple loop. Mostly useful as a baseline.
+    FLOYD_WARSHALL,
+
+    // Floyd-Warshall over square tiles of the distance matrix. Each tile fits
+    // in cache and tiles that do not depend on each other are updated in
+    // parallel.
+    BLOCKED_FLOYD_WARSHALL,
+
+    // One Dijkstra run from each node, runs from different nodes are done in
+    // parallel. Usually the fastest option on sparse graphs.
+    PARALLEL_DIJKSTRA
+  };
+
+  // Side of the tiles that BLOCKED_FLOYD_WARSHALL uses. Three tiles of
+  // distances should comfortably fit in L1.
+  static constexpr size_t kBlockSize = 32;
+
   AllPairShortestPath(const GraphSearchAlgorithmConfig& config,
-                      const DirectedGraph* graph)
-      : GraphSearchAlgorithm(config, graph) {
+                      const DirectedGraph* graph,
+                      Mode mode = BLOCKED_FLOYD_WARSHALL,
+                      size_t num_threads = 1)
+      : GraphSearchAlgorithm(config, graph),
+        node_count_(graph->graph_storage()->NodeCount()) {
     CHECK(graph->IsSimple()) << "All pairs SP will only work on simple graphs";
-    ComputePaths();
+    CHECK(num_threads > 0) << "Zero threads";
+    ComputePaths(mode, num_threads);
   }
 
   // Returns the shortest path between src and dst. The second return value will
@@ -193,22 +258,48 @@ class AllPairShortestPath : public GraphSearchAlgorithm {
  private:
   static constexpr Delay kMaxDistance = Delay::max();
 
-  struct SPData {
-    SPData() : distance(kMaxDistance) {}
+  // Unreachable pairs are stored in the matrix with this distance. It is small
+  // enough that adding any two distances will not overflow, which keeps the
+  // inner loops free of branches.
+  static constexpr Delay kUnreachable = Delay(Delay::max().count() / 4);
 
-    // Distance between the 2 endpoints.
-    Delay distance;
+  // A (row, column) pair of tile indices.
+  using Tile = std::pair<size_t, size_t>;
 
-    // Successor in the SP.
-    GraphLinkIndex next_link;
-    GraphNodeIndex next_node;
-  };
+  // Populates distances_ and next_links_.
+  void ComputePaths(Mode mode, size_t num_threads);
 
-  // Populates data_.
-  void ComputePaths();
+  // Initializes the matrices with the links of the graph.
+  void InitMatrices();
+
+  void FloydWarshall();
+
+  void BlockedFloydWarshall(size_t num_threads);
+
+  void ParallelDijkstra(size_t num_threads);
+
+  // Relaxes all paths in the tile 'to_update' using the intermediate nodes of
+  // the k-th tile on the diagonal.
+  void UpdateTile(size_t k_tile, Tile to_update);
+
+  // Runs Dijkstra from a single source and populates the source's row.
+  void DijkstraFromSource(GraphNodeIndex src);
+
+  // Offset of the (src, dst) element in the matrices.
+  size_t MatrixOffset(size_t src, size_t dst) const {
+    return src * node_count_ + dst;
+  }
 
-  // Distances to the destination.
-  GraphNodeMap<GraphNodeMap<SPData>> data_;
+  // Number of nodes in the graph, each matrix is node_count_ x node_count_.
+  const size_t node_count_;
+
+  // Row-major matrix with the length of the shortest path between each pair
+  // of nodes.
+  std::vector<Delay> distances_;
+
+  // Row-major matrix with the first link of the shortest path between each
+  // pair of nodes. Only valid for pairs with reachable distances.
+  std::vector<GraphLinkIndex> next_links_;
 };
 
 // Single source shortest path.
@@ -224,21 +315,127 @@ class ShortestPath : public GraphSearchAlgorithm {
   LinkSequence GetPath(GraphNodeIndex dst) const;
 
  private:
-  struct DistanceFromSource {
-    DistanceFromSource() : distance(Delay::max()) {}
-    Delay distance;
-  };
-
   void ComputePaths();
 
   // The source.
   GraphNodeIndex src_;
 
-  // For each node, the link that leads to it in the SP tree.
-  GraphNodeMap<GraphLinkIndex> previous_;
+  // For each node, the link that leads to it in the SP tree. Only valid for
+  // nodes whose distance is not Delay::max().
+  std::vector<GraphLinkIndex> previous_;
+
+  // Delays from the source to each node. Empty if the source is excluded.
+  std::vector<Delay> distances_;
+};
+
+// Single source shortest paths that are maintained as links are excluded,
+// restored or change delay. Updates are incremental in the style of
+// Ramalingam and Reps -- only the part of the shortest path tree affected by a
+// change is recomputed. Nodes excluded by the config stay excluded, links
+// excluded by the config are initially excluded, but can be restored.
+class DynamicShortestPath : public GraphSearchAlgorithm {
+ public:
+  DynamicShortestPath(const GraphSearchAlgorithmConfig& config,
+                      GraphNodeIndex src, const DirectedGraph* graph);
+
+  // Removes a link from the graph. No-op if the link is already excluded.
+  void ExcludeLink(GraphLinkIndex link);
+
+  // Undoes ExcludeLink. No-op if the link is not excluded.
+  void RestoreLink(GraphLinkIndex link);
+
+  // Changes the delay of a link. If the link is excluded the new delay will
+  // take effect when it is restored.
+  void SetDelay(GraphLinkIndex link, Delay delay);
+
+  // Returns the shortest path to the destination.
+  LinkSequence GetPath(GraphNodeIndex dst) const;
+
+  // Returns the length of the shortest path to the destination, or
+  // Delay::max() if the destination is not reachable.
+  Delay GetDistance(GraphNodeIndex dst) const { return distances_[dst]; }
+
+  // Number of nodes whose distance was recomputed by the last update. Useful
+  // to figure out how local updates are.
+  size_t last_update_affected_count() const {
+    return last_update_affected_count_;
+  }
+
+ private:
+  static constexpr Delay kMaxDistance = Delay::max();
+
+  using DelayAndIndex = std::pair<Delay, GraphNodeIndex>;
+  using VertexQueue =
+      std::priority_queue<DelayAndIndex, std::vector<DelayAndIndex>,
+                          std::greater<DelayAndIndex>>;
+
+  // Current delay of a link, or kMaxDistance if the link is excluded.
+  Delay LinkDelay(GraphLinkIndex link) const {
+    return excluded_links_.Contains(link) ? kMaxDistance : delays_[link];
+  }
+
+  // Distance to a node via one of its incoming links.
+  Delay DistanceVia(GraphLinkIndex link) const;
+
+  // Runs Dijkstra from all nodes in the queue, the queue should contain nodes
+  // whose distances have been lowered. Returns the number of nodes settled.
+  size_t Propagate(VertexQueue* queue);
+
+  // Called after the delay of a link has decreased.
+  void LinkDelayDecreased(GraphLinkIndex link);
+
+  // Called after the delay of a link has increased.
+  void LinkDelayIncreased(GraphLinkIndex link);
+
+  // The source.
+  GraphNodeIndex src_;
+
+  // For each node the links that enter it.
+  GraphNodeMap<std::vector<GraphLinkIndex>> in_links_;
+
+  // Current delays of all links.
+  std::vector<Delay> delays_;
 
-  // Delays from each node to the destination.
-  GraphNodeMap<DistanceFromSource> min_delays_;
+  // Links that are currently excluded.
+  GraphLinkSet excluded_links_;
+
+  // Distance from the source to each node.
+  std::vector<Delay> distances_;
+
+  // For each reachable node other than the source the link that leads to it
+  // in the SP tree.
+  std::vector<GraphLinkIndex> previous_;
+
+  // Scratch space for LinkDelayIncreased.
+  std::vector<bool> affected_;
+
+  size_t last_update_affected_count_;
+};
+
+// All-pairs version of DynamicShortestPath. Keeps one shortest path tree per
+// node.
+class DynamicAllPairShortestPath {
+ public:
+  DynamicAllPairShortestPath(const GraphSearchAlgorithmConfig& config,
+                             const DirectedGraph* graph);
+
+  void ExcludeLink(GraphLinkIndex link);
+
+  void RestoreLink(GraphLinkIndex link);
+
+  void SetDelay(GraphLinkIndex link, Delay delay);
+
+  LinkSequence GetPath(GraphNodeIndex src, GraphNodeIndex dst) const {
+    return trees_[src]->GetPath(dst);
+  }
+
+  Delay GetDistance(GraphNodeIndex src, GraphNodeIndex dst) const {
+    return trees_[src]->GetDistance(dst);
+  }
+
+ private:
+  // One tree rooted at each node.
+  std::vector<std::unique_ptr<DynamicShortestPath>> trees_;
 };
 
 // Returns the single shortest path that goes through a series of links in the
@@ -249,12 +446,16 @@ LinkSequence WaypointShortestPath(const GraphSearchAlgorithmConfig& config,
                                   GraphNodeIndex src, GraphNodeIndex dst,
                                   const DirectedGraph* graph);
 
-// K shortest paths that optionally go through a set of waypoints.
+// K shortest paths that optionally go through a set of waypoints. Uses Yen's
+// algorithm. Once there are no more waypoints to visit spur paths are found
+// with an A* search guided by the shortest path tree towards the destination,
+// which is computed once. The spur paths of each iteration can optionally be
+// computed in parallel.
 class KShortestPaths : public GraphSearchAlgorithm {
  public:
   KShortestPaths(const GraphSearchAlgorithmConfig& config,
                  const Links& waypoints, GraphNodeIndex src, GraphNodeIndex dst,
-                 const DirectedGraph* graph);
+                 const DirectedGraph* graph, size_t num_threads = 1);
 
   // Returns the next path.
   LinkSequence NextPath();
@@ -262,12 +463,62 @@ class KShortestPaths : public GraphSearchAlgorithm {
  private:
   using PathAndStartIndex = std::pair<LinkSequence, size_t>;
 
-  // Returns true if prefix_path[0:index] == path[0:index]
-  static bool HasPrefix(const Links& path, const Links& prefix);
+  // A candidate path that is not yet one of the K shortest. Shares the first
+  // 'spur_index' links with one of the paths in k_paths_, only the rest of the
+  // links are stored.
+  struct Candidate {
+    Delay delay;
+    uint32_t parent;
+    uint32_t spur_index;
+    Links spur_links;
+  };
+
+  // Orders candidates by delay, then by links, just like LinkSequence.
+  class CandidateGreater {
+   public:
+    CandidateGreater(const std::vector<PathAndStartIndex>* k_paths)
+        : k_paths_(k_paths) {}
+
+    bool operator()(const Candidate& a, const Candidate& b) const;
+
+   private:
+    const std::vector<PathAndStartIndex>* k_paths_;
+  };
+
+  // State used to look for spur paths. There is one per thread.
+  struct SpurSearchState {
+    SpurSearchState(const GraphSearchAlgorithmConfig& base_config);
+
+    // The base config with the two sets below added.
+    GraphSearchAlgorithmConfig config;
+    GraphLinkSet links_to_exclude;
+    GraphNodeSet nodes_to_exclude;
+
+    // Per-node state of the A* search.
+    std::vector<Delay> distances;
+    std::vector<GraphLinkIndex> previous;
+    std::vector<GraphNodeIndex> touched;
+  };
+
+  // Returns true if path[0:prefix_size] == prefix[0:prefix_size]
+  static bool HasPrefix(const Links& path, const Links& prefix,
+                        size_t prefix_size);
 
   // Returns a set of links that contains: for any path in k_paths_ that starts
-  // with the same links as root_path pick the next link -- the one after.
-  void GetLinkExclusionSet(const Links& root_path, GraphLinkSet* out);
+  // with the same links as the first 'root_size' links of 'root_path' pick the
+  // next link -- the one after.
+  void GetLinkExclusionSet(const Links& root_path, size_t root_size,
+                           GraphLinkSet* out) const;
+
+  // Looks for the spur path that leaves the last path at index 'spur_index'
+  // and stores it as a candidate in 'out'. The candidate's spur links are left
+  // empty if there is no spur path.
+  void SpurPath(size_t spur_index, SpurSearchState* state,
+                Candidate* out) const;
+
+  // Shortest path from a node to the destination, via the A* search.
+  LinkSequence GoalDirectedShortestPath(GraphNodeIndex src,
+                                        SpurSearchState* state) const;
 
   // Waypoints.
   const std::vector<GraphLinkIndex> waypoints_;
@@ -278,12 +529,22 @@ class KShortestPaths : public GraphSearchAlgorithm {
   // The destination.
   GraphNodeIndex dst_;
 
+  // Distance from each node to the destination, with only the links and nodes
+  // in config_ excluded.
+  std::vector<Delay> distances_to_dst_;
+
   // Stores the K shortest paths in order.
   std::vector<PathAndStartIndex> k_paths_;
 
   // Stores candidates for K shortest paths.
-  std::priority_queue<PathAndStartIndex, std::vector<PathAndStartIndex>,
-                      std::greater<PathAndStartIndex>> candidates_;
+  std::priority_queue<Candidate, std::vector<Candidate>, CandidateGreater>
+      candidates_;
+
+  // One search state per thread.
+  std::vector<std::unique_ptr<SpurSearchState>> search_states_;
+
+  // Runs the spur searches if there is more than one thread.
+  std::unique_ptr<ThreadBatchProcessor<size_t>> processor_;
 };
 
 // Simple depth-limited DFS.
@@ -314,9 +575,6 @@ class DFS : public GraphSearchAlgorithm {
   void ReachableNodesRecursive(GraphNodeIndex at,
                                GraphNodeSet* nodes_seen) const;
 
-  // The graph storage.
-  const GraphStorage* storage_;
-
   // The shortest paths are used to prune the DFS like in A*.
   std::unique_ptr<AllPairShortestPath> all_pair_sp_;
 };
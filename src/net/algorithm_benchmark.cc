@@ -1,4 +1,8 @@
 #include <chrono>
+#include <functional>
+#include <queue>
+#include <thread>
+#include <tuple>
 
 #include "net.pb.h"
 #include "../common/common.h"
@@ -8,16 +12,54 @@
 #include "algorithm.h"
 #include "net_common.h"
 #include "net_gen.h"
+#include "path_cache.h"
 
 using namespace ncode;
 using namespace std::chrono;
 
-static void TimeMs(const std::string& msg, std::function<void()> f) {
+static milliseconds TimeMs(const std::string& msg, std::function<void()> f) {
   auto start = high_resolution_clock::now();
   f();
   auto end = high_resolution_clock::now();
   auto duration = duration_cast<milliseconds>(end - start);
   LOG(INFO) << msg << ": " << duration.count() << "ms";
+  return duration;
+}
+
+// Times all modes of AllPairShortestPath and reports the speedup of each
+// relative to the plain Floyd-Warshall.
+static void TimeAllPairShortestPath(const std::string& msg,
+                                    const net::DirectedGraph& graph) {
+  using APSP = net::AllPairShortestPath;
+  size_t num_threads = std::max(1u, std::thread::hardware_concurrency());
+
+  std::vector<std::tuple<std::string, APSP::Mode, size_t>> configs = {
+      std::make_tuple("Floyd-Warshall", APSP::FLOYD_WARSHALL, 1),
+      std::make_tuple("blocked Floyd-Warshall", APSP::BLOCKED_FLOYD_WARSHALL,
+                      1),
+      std::make_tuple("blocked Floyd-Warshall", APSP::BLOCKED_FLOYD_WARSHALL,
+                      num_threads),
+      std::make_tuple("Dijkstra", APSP::PARALLEL_DIJKSTRA, 1),
+      std::make_tuple("Dijkstra", APSP::PARALLEL_DIJKSTRA, num_threads)};
+
+  double baseline_ms = 0;
+  for (const auto& config : configs) {
+    APSP::Mode mode = std::get<1>(config);
+    size_t threads = std::get<2>(config);
+    std::string mode_msg =
+        Substitute("$0, $1 ($2 threads)", msg, std::get<0>(config), threads);
+    milliseconds duration = TimeMs(mode_msg, [&graph, mode, threads] {
+      for (size_t i = 0; i < 10; ++i) {
+        APSP all_pair_sp({}, &graph, mode, threads);
+      }
+    });
+
+    double duration_ms = std::max(1.0, static_cast<double>(duration.count()));
+    if (mode == APSP::FLOYD_WARSHALL) {
+      baseline_ms = duration_ms;
+    }
+    LOG(INFO) << mode_msg << " speedup: " << baseline_ms / duration_ms << "x";
+  }
 }
 
 static void TimeToString(std::string* out, uint32_t id, uint32_t x,
@@ -29,6 +71,203 @@ static void TimeToString(std::string* out, uint32_t id, uint32_t x,
   SubstituteAndAppend(out, "$0 $1 $2\n", id, x, duration.count());
 }
 
+using DelayAndIndex = std::pair<net::Delay, net::GraphNodeIndex>;
+using VertexQueue =
+    std::priority_queue<DelayAndIndex, std::vector<DelayAndIndex>,
+                        std::greater<DelayAndIndex>>;
+
+// Dijkstra that traverses the graph via the per-node adjacency list and
+// GraphLink objects.
+static void DijkstraAdjacencyList(const net::DirectedGraph& graph,
+                                  net::GraphNodeIndex src,
+                                  std::vector<net::Delay>* distances) {
+  const auto& adjacency_list = graph.AdjacencyList();
+  const net::GraphStorage* storage = graph.graph_storage();
+  VertexQueue queue;
+  std::fill(distances->begin(), distances->end(), net::Delay::max());
+  (*distances)[src] = net::Delay::zero();
+  queue.emplace(net::Delay::zero(), src);
+  while (!queue.empty()) {
+    DelayAndIndex top = queue.top();
+    queue.pop();
+    if (top.first > (*distances)[top.second] ||
+        !adjacency_list.HasValue(top.second)) {
+      continue;
+    }
+
+    for (net::GraphLinkIndex link : adjacency_list.UnsafeAccess(top.second)) {
+      const net::GraphLink* link_ptr = storage->GetLink(link);
+      net::Delay distance = top.first + link_ptr->delay();
+      if (distance < (*distances)[link_ptr->dst()]) {
+        (*distances)[link_ptr->dst()] = distance;
+        queue.emplace(distance, link_ptr->dst());
+      }
+    }
+  }
+}
+
+// Same as above, but traverses the compressed adjacency list.
+static void DijkstraCompressedAdjacency(const net::DirectedGraph& graph,
+                                        net::GraphNodeIndex src,
+                                        std::vector<net::Delay>* distances) {
+  const net::CompressedAdjacencyList& csr = graph.CompressedAdjacency();
+  VertexQueue queue;
+  std::fill(distances->begin(), distances->end(), net::Delay::max());
+  (*distances)[src] = net::Delay::zero();
+  queue.emplace(net::Delay::zero(), src);
+  while (!queue.empty()) {
+    DelayAndIndex top = queue.top();
+    queue.pop();
+    if (top.first > (*distances)[top.second]) {
+      continue;
+    }
+
+    for (size_t i = csr.offsets[top.second]; i < csr.offsets[top.second + 1];
+         ++i) {
+      net::Delay distance = top.first + csr.delays[i];
+      if (distance < (*distances)[csr.dst_nodes[i]]) {
+        (*distances)[csr.dst_nodes[i]] = distance;
+        queue.emplace(distance, csr.dst_nodes[i]);
+      }
+    }
+  }
+}
+
+// Times the same Dijkstra loop from all nodes over both graph layouts.
+static void TimeAdjacencyLayouts(const net::DirectedGraph& graph) {
+  const net::GraphStorage* storage = graph.graph_storage();
+  std::vector<net::Delay> distances(storage->NodeCount());
+
+  milliseconds list_duration =
+      TimeMs("100 x all nodes Dijkstra, adjacency list",
+             [&graph, storage, &distances] {
+               for (size_t i = 0; i < 100; ++i) {
+                 for (net::GraphNodeIndex src : storage->AllNodes()) {
+                   DijkstraAdjacencyList(graph, src, &distances);
+                 }
+               }
+             });
+
+  milliseconds csr_duration =
+      TimeMs("100 x all nodes Dijkstra, compressed adjacency list",
+             [&graph, storage, &distances] {
+               for (size_t i = 0; i < 100; ++i) {
+                 for (net::GraphNodeIndex src : storage->AllNodes()) {
+                   DijkstraCompressedAdjacency(graph, src, &distances);
+                 }
+               }
+             });
+
+  double csr_ms = std::max(1.0, static_cast<double>(csr_duration.count()));
+  LOG(INFO) << "Compressed adjacency list speedup: "
+            << list_duration.count() / csr_ms << "x";
+}
+
+// Times ShortestPath, which picks a radix or a d-ary heap and reuses it across
+// calls, against the std::priority_queue loop above.
+static void TimeShortestPathQueues(const net::DirectedGraph& graph) {
+  const net::GraphStorage* storage = graph.graph_storage();
+  std::vector<net::Delay> distances(storage->NodeCount());
+
+  milliseconds priority_queue_duration =
+      TimeMs("100 x all nodes Dijkstra, std::priority_queue",
+             [&graph, storage, &distances] {
+               for (size_t i = 0; i < 100; ++i) {
+                 for (net::GraphNodeIndex src : storage->AllNodes()) {
+                   DijkstraCompressedAdjacency(graph, src, &distances);
+                 }
+               }
+             });
+
+  milliseconds sp_duration =
+      TimeMs("100 x all nodes ShortestPath", [&graph, storage] {
+        for (size_t i = 0; i < 100; ++i) {
+          for (net::GraphNodeIndex src : storage->AllNodes()) {
+            net::ShortestPath sp({}, src, &graph);
+          }
+        }
+      });
+
+  double sp_ms = std::max(1.0, static_cast<double>(sp_duration.count()));
+  LOG(INFO) << "ShortestPath speedup: "
+            << priority_queue_duration.count() / sp_ms << "x";
+}
+
+// Excludes each link of the graph in turn and times how long it takes to get
+// the all-pairs shortest paths with the link excluded, both by computing them
+// from scratch and by updating them incrementally.
+static void TimeLinkFailureSweep(const std::string& msg,
+                                 const net::PBNet& net) {
+  net::GraphStorage storage(net);
+  net::DirectedGraph graph(&storage);
+  net::GraphLinkSet all_links = storage.AllLinks();
+
+  milliseconds full_duration = TimeMs(
+      Substitute("$0, link failure sweep, full recomputation", msg),
+      [&graph, &all_links] {
+        for (net::GraphLinkIndex link : all_links) {
+          net::GraphLinkSet to_exclude = {link};
+          net::GraphSearchAlgorithmConfig config;
+          config.AddToExcludeLinks(&to_exclude);
+          net::AllPairShortestPath all_pair_sp(
+              config, &graph, net::AllPairShortestPath::PARALLEL_DIJKSTRA);
+        }
+      });
+
+  net::DynamicAllPairShortestPath dynamic_sp({}, &graph);
+  milliseconds incremental_duration = TimeMs(
+      Substitute("$0, link failure sweep, incremental", msg),
+      [&dynamic_sp, &all_links] {
+        for (net::GraphLinkIndex link : all_links) {
+          dynamic_sp.ExcludeLink(link);
+          dynamic_sp.RestoreLink(link);
+        }
+      });
+
+  double incremental_ms =
+      std::max(1.0, static_cast<double>(incremental_duration.count()));
+  LOG(INFO) << msg << ", link failure sweep speedup: "
+            << full_duration.count() / incremental_ms << "x";
+}
+
+// Times how long it takes to get the first few paths of all pairs of a
+// 200-node network with different numbers of threads.
+static void TimePathCachePrewarm() {
+  std::mt19937 rnd(1);
+  net::Bandwidth bw = net::Bandwidth::FromBitsPerSecond(1000000);
+  net::PBNet net = net::GenerateRandom(200, 0.02, net::Delay(100),
+                                       net::Delay(10000), bw, bw, &rnd);
+  net::GraphStorage storage(net);
+
+  std::vector<net::NodePair> pairs;
+  for (net::GraphNodeIndex src : storage.AllNodes()) {
+    for (net::GraphNodeIndex dst : storage.AllNodes()) {
+      if (src != dst) {
+        pairs.emplace_back(src, dst, 0ul);
+      }
+    }
+  }
+
+  size_t max_threads = std::max(1u, std::thread::hardware_concurrency());
+  milliseconds single_thread_duration;
+  for (size_t threads = 1; threads <= max_threads; threads *= 2) {
+    std::string msg = Substitute("Pre-warm $0 pairs with 3 paths, $1 threads",
+                                 pairs.size(), threads);
+    milliseconds duration = TimeMs(msg, [&storage, &pairs, threads] {
+      net::PathCache cache(&storage);
+      cache.NodePairCaches(pairs, 3, threads);
+    });
+
+    if (threads == 1) {
+      single_thread_duration = duration;
+    }
+
+    double ms = std::max(1.0, static_cast<double>(duration.count()));
+    LOG(INFO) << msg << " speedup: " << single_thread_duration.count() / ms
+              << "x";
+  }
+}
+
 int main(int argc, char** argv) {
   Unused(argc);
   Unused(argv);
@@ -46,8 +285,12 @@ int main(int argc, char** argv) {
              << clustered_graph.clustered_storage()->AllNodes().Count() << " "
              << clustered_graph.clustered_storage()->AllLinks().Count();
 
-  TimeMs("All pair shortest path",
-         [&graph] { net::AllPairShortestPath all_pair_sp({}, &graph); });
+  TimeAllPairShortestPath("10 x all pair shortest path", graph);
+  TimeAdjacencyLayouts(graph);
+  TimeShortestPathQueues(graph);
+  TimePathCachePrewarm();
+  TimeLinkFailureSweep("Sprint", net);
+  TimeLinkFailureSweep("NTT", net::GenerateNTT());
 
   net::GraphNodeIndex london_node =
       path_storage.NodeFromStringOrDie("London4045");
@@ -61,6 +304,21 @@ int main(int argc, char** argv) {
     }
   });
 
+  TimeMs("DFS, paths up to 10 hops within 10ms of the shortest one",
+         [&graph, &london_node, &tokyo_node] {
+           net::DFS dfs({}, &graph);
+           net::ShortestPath sp({}, london_node, &graph);
+           net::Delay max_delay = sp.GetPath(tokyo_node).delay() +
+                                  duration_cast<net::Delay>(milliseconds(10));
+           size_t path_count = 0;
+           dfs.Paths(london_node, tokyo_node, max_delay, 10,
+                     [&path_count](const net::LinkSequence& path) {
+                       Unused(path);
+                       ++path_count;
+                     });
+           LOG(INFO) << "DFS found " << path_count << " paths";
+         });
+
   //  std::vector<net::LinkSequence> paths;
   //  paths.reserve(10000000);
   //  TimeMs("DFS, all paths between a pair of endpoints", [&graph,
@@ -84,6 +342,14 @@ int main(int argc, char** argv) {
     }
   });
 
+  TimeMs("1000 shortest paths, 4 threads", [&graph, &london_node,
+                                            &tokyo_node] {
+    net::KShortestPaths ksp({}, {}, london_node, tokyo_node, &graph, 4);
+    for (size_t i = 0; i < 1000; ++i) {
+      ksp.NextPath();
+    }
+  });
+
   //  for (size_t i = 0; i < 1000; ++i) {
   //    CHECK(k_paths[i] == paths[i]) << i << "th shortest path differs";
   //  }
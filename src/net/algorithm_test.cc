@@ -2,6 +2,8 @@
 
 #include <cstdint>
 #include <limits>
+#include <random>
+#include <set>
 #include <vector>
 #include <thread>
 
@@ -25,6 +27,36 @@ TEST(SimpleGraph, DoubleEdge) {
   ASSERT_FALSE(graph.IsSimple());
 }
 
+TEST(SimpleGraph, CompressedAdjacency) {
+  PBNet net = GenerateSprint(kBw);
+  GraphStorage graph_storage(net);
+  DirectedGraph graph(&graph_storage);
+
+  const CompressedAdjacencyList& csr = graph.CompressedAdjacency();
+  ASSERT_EQ(graph_storage.NodeCount() + 1, csr.offsets.size());
+  ASSERT_EQ(graph_storage.LinkCount(), csr.links.size());
+  ASSERT_EQ(graph_storage.LinkCount(), csr.dst_nodes.size());
+  ASSERT_EQ(graph_storage.LinkCount(), csr.delays.size());
+
+  for (GraphNodeIndex node : graph_storage.AllNodes()) {
+    Links model;
+    if (graph.AdjacencyList().HasValue(node)) {
+      model = graph.AdjacencyList()[node];
+    }
+
+    Links links;
+    for (size_t i = csr.offsets[node]; i < csr.offsets[node + 1]; ++i) {
+      const GraphLink* link_ptr = graph_storage.GetLink(csr.links[i]);
+      ASSERT_EQ(node, link_ptr->src());
+      ASSERT_EQ(link_ptr->dst(), csr.dst_nodes[i]);
+      ASSERT_EQ(link_ptr->delay(), csr.delays[i]);
+      links.emplace_back(csr.links[i]);
+    }
+
+    ASSERT_EQ(model, links);
+  }
+}
+
 TEST(Cluster, SingleLink) {
   PBNet net;
   AddEdgeToGraph("A", "B", Delay(100), kBw, &net);
@@ -205,6 +237,253 @@ TEST(AllPairShortestPath, ShortPathMask) {
   ASSERT_EQ(model, all_pair_sp.GetPath(node_b, node_c).links());
 }
 
+// Checks that all modes of AllPairShortestPath agree on distances and that the
+// paths they return are consistent with the distances.
+static void CheckAllPairShortestPathModes(
+    const GraphSearchAlgorithmConfig& config, GraphStorage* graph_storage) {
+  DirectedGraph graph(graph_storage);
+  AllPairShortestPath model(config, &graph,
+                            AllPairShortestPath::FLOYD_WARSHALL);
+
+  std::vector<std::unique_ptr<AllPairShortestPath>> to_check;
+  to_check.emplace_back(make_unique<AllPairShortestPath>(
+      config, &graph, AllPairShortestPath::BLOCKED_FLOYD_WARSHALL));
+  to_check.emplace_back(make_unique<AllPairShortestPath>(
+      config, &graph, AllPairShortestPath::BLOCKED_FLOYD_WARSHALL, 4));
+  to_check.emplace_back(make_unique<AllPairShortestPath>(
+      config, &graph, AllPairShortestPath::PARALLEL_DIJKSTRA));
+  to_check.emplace_back(make_unique<AllPairShortestPath>(
+      config, &graph, AllPairShortestPath::PARALLEL_DIJKSTRA, 4));
+
+  for (GraphNodeIndex src : graph_storage->AllNodes()) {
+    for (GraphNodeIndex dst : graph_storage->AllNodes()) {
+      Delay model_distance = model.GetDistance(src, dst);
+      for (const auto& all_pair_sp : to_check) {
+        ASSERT_EQ(model_distance, all_pair_sp->GetDistance(src, dst));
+
+        LinkSequence path = all_pair_sp->GetPath(src, dst);
+        if (src == dst || model_distance == Delay::max()) {
+          ASSERT_TRUE(path.empty());
+          continue;
+        }
+
+        ASSERT_EQ(model_distance, path.delay());
+        ASSERT_EQ(model_distance,
+                  TotalDelayOfLinks(path.links(), graph_storage));
+        ASSERT_EQ(src, path.FirstHop(graph_storage));
+        ASSERT_EQ(dst, path.LastHop(graph_storage));
+      }
+    }
+  }
+}
+
+TEST(AllPairShortestPath, ModesRandom) {
+  std::mt19937 rnd(1);
+  PBNet net = GenerateRandom(100, 0.05, Delay(10), Delay(1000), kBw, kBw, &rnd);
+  GraphStorage graph_storage(net);
+  CheckAllPairShortestPathModes({}, &graph_storage);
+}
+
+TEST(AllPairShortestPath, ModesRandomMask) {
+  std::mt19937 rnd(1);
+  PBNet net = GenerateRandom(70, 0.1, Delay(10), Delay(1000), kBw, kBw, &rnd);
+  GraphStorage graph_storage(net);
+
+  GraphLinkSet links_to_exclude;
+  GraphNodeSet nodes_to_exclude;
+  for (GraphLinkIndex link : graph_storage.AllLinks()) {
+    if (link % 3 == 0) {
+      links_to_exclude.Insert(link);
+    }
+  }
+  for (GraphNodeIndex node : graph_storage.AllNodes()) {
+    if (node % 10 == 0) {
+      nodes_to_exclude.Insert(node);
+    }
+  }
+
+  GraphSearchAlgorithmConfig config;
+  config.AddToExcludeLinks(&links_to_exclude);
+  config.AddToExcludeNodes(&nodes_to_exclude);
+  CheckAllPairShortestPathModes(config, &graph_storage);
+}
+
+TEST(AllPairShortestPath, ModesSprint) {
+  PBNet net = GenerateSprint(kBw);
+  GraphStorage graph_storage(net);
+  CheckAllPairShortestPathModes({}, &graph_storage);
+}
+
+TEST(DynamicShortestPath, ExcludeRestore) {
+  PBNet net;
+  AddEdgeToGraph("A", "B", Delay(100), kBw, &net);
+  AddEdgeToGraph("B", "C", Delay(100), kBw, &net);
+  AddEdgeToGraph("A", "C", Delay(300), kBw, &net);
+
+  GraphStorage graph_storage(net);
+  GraphNodeIndex node_a = graph_storage.NodeFromStringOrDie("A");
+  GraphNodeIndex node_c = graph_storage.NodeFromStringOrDie("C");
+  GraphLinkIndex link_ab = graph_storage.LinkOrDie("A", "B");
+  GraphLinkIndex link_bc = graph_storage.LinkOrDie("B", "C");
+  GraphLinkIndex link_ac = graph_storage.LinkOrDie("A", "C");
+
+  DirectedGraph graph(&graph_storage);
+  DynamicShortestPath sp({}, node_a, &graph);
+
+  Links model = {link_ab, link_bc};
+  ASSERT_EQ(model, sp.GetPath(node_c).links());
+  ASSERT_EQ(Delay(200), sp.GetDistance(node_c));
+
+  sp.ExcludeLink(link_bc);
+  model = {link_ac};
+  ASSERT_EQ(model, sp.GetPath(node_c).links());
+  ASSERT_EQ(Delay(300), sp.GetDistance(node_c));
+
+  sp.ExcludeLink(link_ac);
+  ASSERT_TRUE(sp.GetPath(node_c).empty());
+  ASSERT_EQ(Delay::max(), sp.GetDistance(node_c));
+
+  sp.RestoreLink(link_ac);
+  sp.SetDelay(link_ac, Delay(50));
+  ASSERT_EQ(model, sp.GetPath(node_c).links());
+  ASSERT_EQ(Delay(50), sp.GetDistance(node_c));
+
+  sp.SetDelay(link_ac, Delay(500));
+  sp.RestoreLink(link_bc);
+  model = {link_ab, link_bc};
+  ASSERT_EQ(model, sp.GetPath(node_c).links());
+}
+
+// Bellman-Ford from a source using the given delays and excluded links.
+static std::vector<Delay> ReferenceDistances(const GraphStorage& graph_storage,
+                                             const std::vector<Delay>& delays,
+                                             const GraphLinkSet& excluded,
+                                             GraphNodeIndex src) {
+  std::vector<Delay> distances(graph_storage.NodeCount(), Delay::max());
+  distances[src] = Delay::zero();
+  for (size_t i = 0; i < graph_storage.NodeCount(); ++i) {
+    for (GraphLinkIndex link : graph_storage.AllLinks()) {
+      const GraphLink* link_ptr = graph_storage.GetLink(link);
+      if (excluded.Contains(link) ||
+          distances[link_ptr->src()] == Delay::max()) {
+        continue;
+      }
+
+      Delay distance = distances[link_ptr->src()] + delays[link];
+      if (distance < distances[link_ptr->dst()]) {
+        distances[link_ptr->dst()] = distance;
+      }
+    }
+  }
+
+  return distances;
+}
+
+// Checks ShortestPath from every node against Bellman-Ford.
+static void CheckShortestPathRandom(size_t node_count, Delay max_delay) {
+  std::mt19937 rnd(1);
+  PBNet net = GenerateRandom(node_count, 0.05, Delay(10), max_delay, kBw, kBw,
+                             &rnd);
+  GraphStorage graph_storage(net);
+  DirectedGraph graph(&graph_storage);
+
+  std::vector<Delay> delays(graph_storage.LinkCount());
+  for (GraphLinkIndex link : graph_storage.AllLinks()) {
+    delays[link] = graph_storage.GetLink(link)->delay();
+  }
+
+  for (GraphNodeIndex src : graph_storage.AllNodes()) {
+    std::vector<Delay> model =
+        ReferenceDistances(graph_storage, delays, {}, src);
+
+    ShortestPath sp({}, src, &graph);
+    for (GraphNodeIndex dst : graph_storage.AllNodes()) {
+      LinkSequence path = sp.GetPath(dst);
+      if (src == dst || model[dst] == Delay::max()) {
+        ASSERT_TRUE(path.empty());
+        continue;
+      }
+
+      ASSERT_EQ(model[dst], path.delay());
+      ASSERT_EQ(model[dst], TotalDelayOfLinks(path.links(), &graph_storage));
+      ASSERT_EQ(src, path.FirstHop(&graph_storage));
+      ASSERT_EQ(dst, path.LastHop(&graph_storage));
+    }
+  }
+}
+
+// Small graphs use a d-ary heap.
+TEST(ShortestPath, RandomSmall) { CheckShortestPathRandom(50, Delay(1000)); }
+
+// Large graphs with short links use a radix heap.
+TEST(ShortestPath, RandomLarge) { CheckShortestPathRandom(200, Delay(1000)); }
+
+// Large graphs with a large delay range use a d-ary heap.
+TEST(ShortestPath, RandomLargeLongLinks) {
+  CheckShortestPathRandom(200, Delay(100000000));
+}
+
+TEST(DynamicShortestPath, RandomUpdates) {
+  std::mt19937 rnd(1);
+  PBNet net = GenerateRandom(40, 0.1, Delay(10), Delay(100), kBw, kBw, &rnd);
+  GraphStorage graph_storage(net);
+  DirectedGraph graph(&graph_storage);
+
+  std::vector<Delay> delays;
+  for (GraphLinkIndex link : graph_storage.AllLinks()) {
+    delays.emplace_back(graph_storage.GetLink(link)->delay());
+  }
+
+  GraphLinkSet excluded;
+  DynamicAllPairShortestPath all_pair_sp({}, &graph);
+
+  std::uniform_int_distribution<size_t> link_dist(
+      0, graph_storage.LinkCount() - 1);
+  std::uniform_int_distribution<size_t> delay_dist(0, 100);
+  for (size_t i = 0; i < 200; ++i) {
+    GraphLinkIndex link(link_dist(rnd));
+    switch (i % 3) {
+      case 0:
+        excluded.Insert(link);
+        all_pair_sp.ExcludeLink(link);
+        break;
+      case 1:
+        excluded.Remove(link);
+        all_pair_sp.RestoreLink(link);
+        break;
+      case 2:
+        // Some links will end up with zero delay.
+        delays[link] = Delay(delay_dist(rnd));
+        all_pair_sp.SetDelay(link, delays[link]);
+        break;
+    }
+
+    for (GraphNodeIndex src : graph_storage.AllNodes()) {
+      std::vector<Delay> model =
+          ReferenceDistances(graph_storage, delays, excluded, src);
+      for (GraphNodeIndex dst : graph_storage.AllNodes()) {
+        ASSERT_EQ(model[dst], all_pair_sp.GetDistance(src, dst));
+
+        LinkSequence path = all_pair_sp.GetPath(src, dst);
+        if (src == dst || model[dst] == Delay::max()) {
+          ASSERT_TRUE(path.empty());
+          continue;
+        }
+
+        Delay total_delay = Delay::zero();
+        for (GraphLinkIndex link_in_path : path.links()) {
+          ASSERT_FALSE(excluded.Contains(link_in_path));
+          total_delay += delays[link_in_path];
+        }
+
+        ASSERT_EQ(model[dst], total_delay);
+        ASSERT_EQ(src, path.FirstHop(&graph_storage));
+        ASSERT_EQ(dst, path.LastHop(&graph_storage));
+      }
+    }
+  }
+}
+
 TEST(DFS, SingleLink) {
   PBNet net;
   AddEdgeToGraph("A", "B", Delay(100), kBw, &net);
@@ -307,6 +586,75 @@ TEST(KShortest, Braess) {
   ASSERT_TRUE(ksp.NextPath().empty());
 }
 
+// Enumerates all paths with DFS and checks that KShortestPaths returns them in
+// order of delay, each of them once.
+TEST(KShortest, RandomAllPaths) {
+  std::mt19937 rnd(1);
+  PBNet net = GenerateRandom(12, 0.2, Delay(10), Delay(1000), kBw, kBw, &rnd);
+  GraphStorage graph_storage(net);
+  DirectedGraph graph(&graph_storage);
+  DFS dfs({}, &graph, false);
+
+  for (GraphNodeIndex src : graph_storage.AllNodes()) {
+    for (GraphNodeIndex dst : graph_storage.AllNodes()) {
+      if (src == dst) {
+        continue;
+      }
+
+      std::set<Links> model;
+      std::vector<Delay> model_delays;
+      dfs.Paths(src, dst, Delay::max(), graph_storage.NodeCount(),
+                [&model, &model_delays](const LinkSequence& path) {
+                  model.emplace(path.links());
+                  model_delays.emplace_back(path.delay());
+                });
+      std::sort(model_delays.begin(), model_delays.end());
+
+      KShortestPaths ksp({}, {}, src, dst, &graph);
+      std::set<Links> paths;
+      for (size_t i = 0; i < model_delays.size(); ++i) {
+        LinkSequence path = ksp.NextPath();
+        ASSERT_EQ(model_delays[i], path.delay());
+        ASSERT_EQ(path.delay(),
+                  TotalDelayOfLinks(path.links(), &graph_storage));
+        ASSERT_TRUE(paths.emplace(path.links()).second);
+      }
+
+      ASSERT_EQ(model, paths);
+      ASSERT_TRUE(ksp.NextPath().empty());
+    }
+  }
+}
+
+// Spur paths computed in parallel should not change the result.
+TEST(KShortest, Parallel) {
+  PBNet net = GenerateSprint(kBw);
+  GraphStorage graph_storage(net);
+  DirectedGraph graph(&graph_storage);
+
+  std::vector<GraphNodeIndex> nodes;
+  for (GraphNodeIndex node : graph_storage.AllNodes()) {
+    nodes.emplace_back(node);
+  }
+
+  std::mt19937 rnd(1);
+  for (size_t i = 0; i < 10; ++i) {
+    std::shuffle(nodes.begin(), nodes.end(), rnd);
+    GraphNodeIndex src = nodes[0];
+    GraphNodeIndex dst = nodes[1];
+
+    KShortestPaths ksp({}, {}, src, dst, &graph);
+    KShortestPaths ksp_parallel({}, {}, src, dst, &graph, 4);
+    for (size_t k = 0; k < 50; ++k) {
+      LinkSequence path = ksp.NextPath();
+      ASSERT_EQ(path, ksp_parallel.NextPath());
+      if (path.empty()) {
+        break;
+      }
+    }
+  }
+}
+
 net::PBNet GenerateWaypointGraph(Bandwidth bw) {
   using namespace std::chrono;
   PBNet net;
@@ -4,6 +4,7 @@
 #include <arpa/inet.h>
 #include <sstream>
 #include <fstream>
+#include <limits>
 #include <stdexcept>
 #include <utility>
 
@@ -73,7 +74,7 @@ std::chrono::microseconds TotalDelayOfLinks(const Links& links,
   return total;
 }
 
-GraphStorage::GraphStorage(const PBNet& graph) : tag_generator_(0) {
+GraphStorage::GraphStorage(const PBNet& graph) {
   empty_path_ = make_unique<GraphPath>(this);
   for (const auto& link_pb : graph.links()) {
     LinkFromProtobuf(link_pb);
@@ -437,27 +438,42 @@ bool operator==(const LinkSequence& lhs, const LinkSequence& rhs) {
 }
 
 std::string GraphPath::ToString() const {
-  return link_sequence_.ToString(storage_);
+  return link_sequence().ToString(storage_);
 }
 
 std::string GraphPath::ToStringNoPorts() const {
   using namespace std::chrono;
   double delay_ms = duration<double, milliseconds::period>(delay()).count();
-  return Substitute("$0 $1ms", link_sequence_.ToStringNoPorts(storage_),
+  return Substitute("$0 $1ms", link_sequence().ToStringNoPorts(storage_),
                     delay_ms);
 }
 
+LinkSequence GraphPath::link_sequence() const {
+  const GraphLinkIndex* begin = links_begin();
+  return {Links(begin, begin + size_), delay_};
+}
+
+GraphLinkIndex GraphPath::link(size_t i) const {
+  DCHECK(i < size_);
+  return storage_->path_arena_[offset_ + i];
+}
+
 GraphNodeIndex GraphPath::FirstHop() const {
-  return link_sequence_.FirstHop(storage_);
+  DCHECK(size_ > 0);
+  return storage_->GetLink(link(0))->src();
 }
 
 GraphNodeIndex GraphPath::LastHop() const {
-  return link_sequence_.LastHop(storage_);
+  DCHECK(size_ > 0);
+  return storage_->GetLink(link(size_ - 1))->dst();
 }
 
-void GraphPath::Populate(LinkSequence link_sequence, uint32_t tag) {
-  link_sequence_ = link_sequence;
-  tag_ = tag;
+size_t GraphPath::InMemBytesEstimate() const {
+  return sizeof(*this) + size_ * sizeof(GraphLinkIndex) + 2 * sizeof(uint32_t);
+}
+
+const GraphLinkIndex* GraphPath::links_begin() const {
+  return storage_->path_arena_.data() + offset_;
 }
 
 LinkSequence GraphStorage::LinkSequenceFromStringOrDie(
@@ -500,27 +516,83 @@ const GraphPath* GraphStorage::PathFromStringOrDie(
   return PathFromLinksOrDie(link_sequence, cookie);
 }
 
+uint64_t GraphStorage::PathHash(uint64_t cookie, const GraphLinkIndex* links,
+                                size_t size) {
+  // FNV-1a over the cookie and the links.
+  uint64_t hash = 14695981039346656037ul ^ cookie;
+  for (size_t i = 0; i < size; ++i) {
+    hash ^= links[i];
+    hash *= 1099511628211ul;
+  }
+
+  // The low bits pick the slot, mix the high bits into them.
+  return hash ^ (hash >> 32);
+}
+
+bool GraphStorage::PathEquals(const GraphPath& path, uint64_t cookie,
+                              const GraphLinkIndex* links, size_t size) const {
+  if (path.cookie() != cookie || path.size() != size) {
+    return false;
+  }
+
+  return std::equal(links, links + size, path.links_begin());
+}
+
+void GraphStorage::IndexPath(const GraphPath& path) {
+  size_t mask = path_index_.size() - 1;
+  size_t slot = PathHash(path.cookie(), path.links_begin(), path.size()) & mask;
+  while (path_index_[slot] != 0) {
+    slot = (slot + 1) & mask;
+  }
+
+  path_index_[slot] = path.tag();
+}
+
+void GraphStorage::GrowPathIndex() {
+  size_t new_size = std::max(static_cast<size_t>(16), path_index_.size() * 2);
+  path_index_.assign(new_size, 0);
+  for (const GraphPath& path : paths_) {
+    IndexPath(path);
+  }
+}
+
 const GraphPath* GraphStorage::PathFromLinksOrDie(
     const LinkSequence& link_sequence, uint64_t cookie) {
   if (link_sequence.empty()) {
     return empty_path_.get();
   }
 
-  const GraphPath* return_path;
-  std::map<Links, GraphPath>& path_map = cookie_to_paths_[cookie];
-  auto iterator_and_added = path_map.emplace(
-      std::piecewise_construct, std::forward_as_tuple(link_sequence.links()),
-      std::forward_as_tuple(this));
-  if (iterator_and_added.second) {
-    auto& it = iterator_and_added.first;
-    it->second.Populate(link_sequence, ++tag_generator_);
-    return_path = &(it->second);
-  } else {
-    auto& it = iterator_and_added.first;
-    return_path = &(it->second);
+  const Links& links = link_sequence.links();
+  if (path_index_.size() < 2 * (paths_.size() + 1)) {
+    GrowPathIndex();
   }
 
-  return return_path;
+  size_t mask = path_index_.size() - 1;
+  size_t slot = PathHash(cookie, links.data(), links.size()) & mask;
+  while (path_index_[slot] != 0) {
+    const GraphPath& path = paths_[path_index_[slot] - 1];
+    if (PathEquals(path, cookie, links.data(), links.size())) {
+      return &path;
+    }
+
+    slot = (slot + 1) & mask;
+  }
+
+  // Not found, the path is added to the end of the arena and 'slot' is free.
+  CHECK(path_arena_.size() + links.size() <=
+        std::numeric_limits<uint32_t>::max())
+      << "Path arena full";
+  CHECK(paths_.size() < std::numeric_limits<uint32_t>::max())
+      << "Too many paths";
+
+  uint32_t offset = path_arena_.size();
+  path_arena_.insert(path_arena_.end(), links.begin(), links.end());
+
+  uint32_t tag = paths_.size() + 1;
+  paths_.emplace_back(this, offset, links.size(), link_sequence.delay(), tag,
+                      cookie);
+  path_index_[slot] = tag;
+  return &paths_.back();
 }
 
 const GraphPath* GraphStorage::PathFromProtobufOrDie(
@@ -555,36 +627,22 @@ std::string GraphStorage::DumpPaths() const {
   using namespace std::chrono;
 
   static std::stringstream out;
-  for (const auto& cookie_and_path_map : cookie_to_paths_) {
-    const std::map<Links, GraphPath>& links_to_path =
-        cookie_and_path_map.second;
-
-    for (const auto& links_and_path : links_to_path) {
-      const GraphPath& path = links_and_path.second;
-      double delay_ms =
-          duration<double, milliseconds::period>(path.delay()).count();
-      out << Substitute("$0|$1|$2|$3\n", path.ToStringNoPorts(), path.tag(),
-                        cookie_and_path_map.first, delay_ms);
-    }
+  for (const GraphPath& path : paths_) {
+    double delay_ms =
+        duration<double, milliseconds::period>(path.delay()).count();
+    out << Substitute("$0|$1|$2|$3\n", path.ToStringNoPorts(), path.tag(),
+                      path.cookie(), delay_ms);
   }
 
   return out.str();
 }
 
 const GraphPath* GraphStorage::FindPathByTagOrNull(uint32_t tag) const {
-  for (const auto& cookie_and_path_map : cookie_to_paths_) {
-    const std::map<Links, GraphPath>& links_to_path =
-        cookie_and_path_map.second;
-
-    for (const auto& links_and_path : links_to_path) {
-      const GraphPath& path = links_and_path.second;
-      if (path.tag() == tag) {
-        return &path;
-      }
-    }
+  if (tag == 0 || tag > paths_.size()) {
+    return nullptr;
   }
 
-  return nullptr;
+  return &paths_[tag - 1];
 }
 
 bool IsInPaths(const std::string& needle,
@@ -593,7 +651,7 @@ bool IsInPaths(const std::string& needle,
   const GraphPath* path = storage->PathFromStringOrDie(needle, 0);
 
   for (const LinkSequence& path_in_haystack : haystack) {
-    if (path_in_haystack.links() == path->link_sequence().links()) {
+    if (path_in_haystack == path->link_sequence()) {
       return true;
     }
   }
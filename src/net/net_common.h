@@ -5,6 +5,7 @@
 #include <stddef.h>
 #include <cassert>
 #include <cstdint>
+#include <deque>
 #include <map>
 #include <memory>
 #include <set>
@@ -291,8 +292,11 @@ class LinkSequence {
   Delay delay_;
 };
 
-// GraphPaths are heavier versions of LinkSequence that are assigned ids and are
-// managed by a PathStorage instance.
+// GraphPaths are interned versions of LinkSequence that are assigned ids and
+// are managed by a GraphStorage instance. The links of all paths live in a
+// single arena in the storage, the path itself only knows where its links
+// start and how many there are. Paths do not share links in the arena, even
+// if they have the same links and differ only in cookie.
 class GraphPath {
  public:
   // String representation in the form [A:p1->B:p2, B:p3->C:p3]
@@ -301,17 +305,20 @@ class GraphPath {
   // String representation in the form A -> B -> C
   std::string ToStringNoPorts() const;
 
-  // The underlying link sequence.
-  const LinkSequence& link_sequence() const { return link_sequence_; }
+  // Returns a new link sequence with the links of this path.
+  LinkSequence link_sequence() const;
+
+  // The i-th link of the path.
+  GraphLinkIndex link(size_t i) const;
 
   // Delay of the path.
-  Delay delay() const { return link_sequence_.delay(); }
+  Delay delay() const { return delay_; }
 
   // True if path is empty.
-  bool empty() const { return link_sequence_.links().empty(); }
+  bool empty() const { return size_ == 0; }
 
   // Number of links.
-  uint32_t size() const { return link_sequence_.links().size(); }
+  uint32_t size() const { return size_; }
 
   // The storage object that keeps track of all paths.
   GraphStorage* storage() const { return storage_; }
@@ -320,28 +327,57 @@ class GraphPath {
   // same memory location.
   uint32_t tag() const { return tag_; }
 
+  // The aggregate cookie the path was created with.
+  uint64_t cookie() const { return cookie_; }
+
   // Id of the first node along the path.
   GraphNodeIndex FirstHop() const;
 
   // Id of the last node along the path.
   GraphNodeIndex LastHop() const;
 
-  // Constructs an initially empty path.
-  GraphPath(GraphStorage* storage) : tag_(0), storage_(storage) {}
+  // Rough estimate of the number of bytes of memory this path uses, including
+  // its links in the storage's arena and its slot in the lookup table.
+  size_t InMemBytesEstimate() const;
 
-  // Populates this object.
-  void Populate(LinkSequence link_sequence, uint32_t tag);
+  // Constructs an initially empty path.
+  GraphPath(GraphStorage* storage)
+      : GraphPath(storage, 0, 0, Delay::zero(), 0, 0) {}
+
+  // Constructs a path whose links are at [offset, offset + size) of the
+  // storage's arena. Only GraphStorage should call this.
+  GraphPath(GraphStorage* storage, uint32_t offset, uint32_t size, Delay delay,
+            uint32_t tag, uint64_t cookie)
+      : storage_(storage),
+        delay_(delay),
+        cookie_(cookie),
+        offset_(offset),
+        size_(size),
+        tag_(tag) {}
 
  private:
-  // The sequence of links that form this path.
-  LinkSequence link_sequence_;
-
-  // A number uniquely identifying the path.
-  uint32_t tag_;
+  // Pointer to the first link of the path in the arena. Invalidated when the
+  // arena grows.
+  const GraphLinkIndex* links_begin() const;
 
   // The parent storage.
   GraphStorage* storage_;
 
+  // Total delay of the links.
+  Delay delay_;
+
+  // The aggregate cookie.
+  uint64_t cookie_;
+
+  // Where the links of the path start in the storage's arena and how many
+  // there are.
+  uint32_t offset_;
+  uint32_t size_;
+
+  // A number uniquely identifying the path.
+  uint32_t tag_;
+
+  friend class GraphStorage;
   DISALLOW_COPY_AND_ASSIGN(GraphPath);
 };
 
@@ -473,15 +509,30 @@ class GraphStorage {
   // Finds a path given its tag.
   const GraphPath* FindPathByTagOrNull(uint32_t tag) const;
 
+  // Number of non-empty paths stored.
+  size_t PathCount() const { return paths_.size(); }
+
  private:
   using LinkStore =
       PerfectHashStore<std::unique_ptr<GraphLink>, uint16_t, GraphLink>;
   using NodeStore =
       PerfectHashStore<std::unique_ptr<GraphNode>, uint16_t, GraphNode>;
 
-  GraphStorage() : tag_generator_(0) {
-    empty_path_ = make_unique<GraphPath>(this);
-  }
+  GraphStorage() { empty_path_ = make_unique<GraphPath>(this); }
+
+  // Hash of a path's cookie and links.
+  static uint64_t PathHash(uint64_t cookie, const GraphLinkIndex* links,
+                           size_t size);
+
+  // Returns true if the path has the given cookie and links.
+  bool PathEquals(const GraphPath& path, uint64_t cookie,
+                  const GraphLinkIndex* links, size_t size) const;
+
+  // Inserts the tag of a path in path_index_, which should have room for it.
+  void IndexPath(const GraphPath& path);
+
+  // Doubles the size of path_index_ and re-inserts all paths.
+  void GrowPathIndex();
 
   std::string GetClusterName(const GraphNodeSet& nodes) const;
 
@@ -501,18 +552,25 @@ class GraphStorage {
   LinkStore link_store_;
   NodeStore node_store_;
 
-  // Non-empty paths. Grouped by aggregate cookie and then by links in the path.
-  std::map<uint64_t, std::map<Links, GraphPath>> cookie_to_paths_;
+  // Links of all non-empty paths, back to back.
+  Links path_arena_;
+
+  // Non-empty paths. The path with tag t is at index t - 1. A deque does not
+  // move its elements when it grows.
+  std::deque<GraphPath> paths_;
+
+  // Open addressing hash table from cookie and links to the tag of a path.
+  // Empty slots are 0. The size is a power of 2 and is kept at least double
+  // the number of paths.
+  std::vector<uint32_t> path_index_;
 
   // There is only one empty path instance.
   std::unique_ptr<GraphPath> empty_path_;
 
-  // Path tags come from here.
-  uint32_t tag_generator_;
-
   // Regions, each node should be contained in at most one.
   std::vector<GraphNodeSet> regions_;
 
+  friend class GraphPath;
   DISALLOW_COPY_AND_ASSIGN(GraphStorage);
 };
 
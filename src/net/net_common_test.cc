@@ -448,6 +448,38 @@ TEST_F(PathStorageTest, FindByTag) {
 
   ASSERT_EQ(path_one, storage_.FindPathByTagOrNull(path_one->tag()));
   ASSERT_EQ(path_two, storage_.FindPathByTagOrNull(path_two->tag()));
+  ASSERT_EQ(nullptr, storage_.FindPathByTagOrNull(0));
+  ASSERT_EQ(nullptr, storage_.FindPathByTagOrNull(path_two->tag() + 1));
+}
+
+TEST_F(PathStorageTest, ManyPaths) {
+  const GraphLinkIndex ab = storage_.LinkOrDie("A", "B");
+  const GraphLinkIndex bc = storage_.LinkOrDie("B", "C");
+  const Links links = {ab, bc};
+
+  // Enough paths for the path index to be grown a few times.
+  std::vector<const GraphPath*> paths;
+  for (uint64_t cookie = 0; cookie < 1000; ++cookie) {
+    const GraphPath* path =
+        storage_.PathFromLinksOrDie(LinkSequence(links, &storage_), cookie);
+    ASSERT_EQ(cookie, path->cookie());
+    ASSERT_EQ(2ul, path->size());
+    ASSERT_EQ(ab, path->link(0));
+    ASSERT_EQ(bc, path->link(1));
+    ASSERT_EQ(storage_.NodeFromStringOrDie("A"), path->FirstHop());
+    ASSERT_EQ(LinkSequence(links, &storage_), path->link_sequence());
+    paths.emplace_back(path);
+  }
+
+  ASSERT_EQ(1000ul, storage_.PathCount());
+  for (uint64_t cookie = 0; cookie < 1000; ++cookie) {
+    const GraphPath* path = paths[cookie];
+    ASSERT_EQ(path, storage_.PathFromLinksOrDie(LinkSequence(links, &storage_),
+                                                cookie));
+    ASSERT_EQ(path, storage_.FindPathByTagOrNull(path->tag()));
+  }
+
+  ASSERT_EQ(1000ul, storage_.PathCount());
 }
 
 class FiveTupleTest : public ::testing::Test {
@@ -1,14 +1,24 @@
 #include "path_cache.h"
 
 #include <cstdbool>
+#include <limits>
 
 #include "../common/logging.h"
 #include "../common/perfect_hash.h"
+#include "../common/thread_runner.h"
 #include "algorithm.h"
 
 namespace ncode {
 namespace net {
 
+constexpr size_t PathCache::kDefaultMaxNumPathsPerPair;
+constexpr size_t PathCache::kShardCount;
+
+// Memory used by a single cached path.
+static size_t PathBytes(const LinkSequence& path) {
+  return sizeof(std::unique_ptr<LinkSequence>) + path.InMemBytesEstimate();
+}
+
 LinkSequence NodePairPathCache::KthShortestPath(
     size_t k, const GraphLinkSet* to_exclude) const {
   std::unique_ptr<ShortestPathGenerator> generator = PathGenerator(to_exclude);
@@ -81,6 +91,9 @@ const LinkSequence* NodePairPathCache::GetPathAtIndexOrNull(size_t i) {
     return nullptr;
   }
 
+  // Paths are never removed, so pointers to them stay valid after the lock
+  // is released even if paths_ grows.
+  std::lock_guard<std::mutex> lock(mu_);
   while (i >= paths_.size()) {
     auto next_path = make_unique<LinkSequence>(path_generator_->NextPath());
     if (next_path->empty()) {
@@ -88,12 +101,35 @@ const LinkSequence* NodePairPathCache::GetPathAtIndexOrNull(size_t i) {
       return nullptr;
     }
 
+    size_t path_bytes = PathBytes(*next_path);
+    bytes_ += path_bytes;
+    if (memory_counter_ != nullptr) {
+      *memory_counter_ += path_bytes;
+    }
+
     paths_.emplace_back(std::move(next_path));
   }
 
   return paths_[i].get();
 }
 
+size_t NodePairPathCache::InMemBytesEstimate() const {
+  std::lock_guard<std::mutex> lock(mu_);
+  return bytes_;
+}
+
+void NodePairPathCache::SetMemoryCounter(std::atomic<size_t>* counter) {
+  std::lock_guard<std::mutex> lock(mu_);
+  if (memory_counter_ != nullptr) {
+    *memory_counter_ -= bytes_;
+  }
+
+  memory_counter_ = counter;
+  if (memory_counter_ != nullptr) {
+    *memory_counter_ += bytes_;
+  }
+}
+
 std::vector<LinkSequence> NodePairPathCache::PathsKHopsFromShortest(
     size_t k) const {
   size_t shortest_path_hop_count = PathGenerator(nullptr)->NextPath().size();
@@ -129,20 +165,50 @@ NodePairPathCache::NodePairPathCache(const NodePair& key, size_t max_num_paths,
       graph_(graph),
       graph_storage_(path_storage),
       constraint_(std::move(constraint)),
-      max_num_paths_(max_num_paths) {
+      max_num_paths_(max_num_paths),
+      bytes_(sizeof(*this)),
+      memory_counter_(nullptr) {
   path_generator_ = PathGenerator(nullptr);
 }
 
+size_t PathCache::NodePairHash::operator()(const NodePair& node_pair) const {
+  size_t hash = std::get<0>(node_pair);
+  hash = hash * 31 + std::get<1>(node_pair);
+  hash = hash * 31 + std::hash<uint64_t>()(std::get<2>(node_pair));
+  return hash;
+}
+
+PathCache::Shard::Shard()
+    : LRUCache<NodePair, NodePairPathCache*, NodePairHash>(
+          std::numeric_limits<size_t>::max()) {}
+
+void PathCache::Shard::ItemEvicted(const NodePair& key,
+                                   std::unique_ptr<NodePairPathCache*> value) {
+  Unused(value);
+  auto it = caches.find(key);
+  CHECK(it != caches.end());
+
+  it->second->SetMemoryCounter(nullptr);
+  evicted.emplace_back(std::move(it->second));
+  caches.erase(it);
+  last_used.erase(key);
+}
+
 PathCache::PathCache(const GraphLinkSet& links_to_exclude,
-                     GraphStorage* graph_storage, size_t max_num_paths_per_pair)
+                     GraphStorage* graph_storage, size_t max_num_paths_per_pair,
+                     size_t memory_budget_bytes)
     : graph_(graph_storage),
       graph_storage_(graph_storage),
       links_to_exclude_(links_to_exclude),
-      max_num_paths_per_pair_(max_num_paths_per_pair) {}
+      max_num_paths_per_pair_(max_num_paths_per_pair),
+      memory_budget_bytes_(memory_budget_bytes),
+      memory_used_(0),
+      clock_(0) {}
 
 PathCache::PathCache(GraphStorage* graph_storage, size_t max_num_paths_per_pair,
-                     ConstraintMap* constraint_map)
-    : PathCache({}, graph_storage, max_num_paths_per_pair) {
+                     ConstraintMap* constraint_map, size_t memory_budget_bytes)
+    : PathCache({}, graph_storage, max_num_paths_per_pair,
+                memory_budget_bytes) {
   if (constraint_map) {
     for (auto& key_and_constraint : *constraint_map) {
       const NodePair& ie_key = key_and_constraint.first;
@@ -150,41 +216,148 @@ PathCache::PathCache(GraphStorage* graph_storage, size_t max_num_paths_per_pair,
           std::move(key_and_constraint.second);
       CHECK(constraint) << "No constraint";
 
-      std::unique_ptr<NodePairPathCache>& ie_cache_ptr = ie_caches_[ie_key];
-      ie_cache_ptr = std::unique_ptr<NodePairPathCache>(new NodePairPathCache(
-          ie_key, max_num_paths_per_pair_, std::move(constraint), &graph_,
-          graph_storage_));
+      auto ie_cache = std::unique_ptr<NodePairPathCache>(
+          new NodePairPathCache(ie_key, max_num_paths_per_pair_,
+                                std::move(constraint), &graph_,
+                                graph_storage_));
+
+      Shard* shard = ShardForKey(ie_key);
+      std::lock_guard<std::mutex> lock(shard->mu);
+      AddToShard(ie_key, std::move(ie_cache), shard);
+    }
+  }
+}
+
+PathCache::Shard* PathCache::ShardForKey(const NodePair& key) {
+  // Node indices are small and dense, the multiplication spreads them over the
+  // high bits.
+  uint64_t hash = NodePairHash()(key) * 0x9E3779B97F4A7C15ul;
+  return &shards_[(hash >> 32) % kShardCount];
+}
+
+NodePairPathCache* PathCache::AddToShard(
+    const NodePair& key, std::unique_ptr<NodePairPathCache> node_pair_cache,
+    Shard* shard) {
+  NodePairPathCache* raw_ptr = node_pair_cache.get();
+  raw_ptr->SetMemoryCounter(&memory_used_);
+  shard->InsertNew(key, raw_ptr);
+  shard->caches[key] = std::move(node_pair_cache);
+  shard->last_used[key] = clock_++;
+  return raw_ptr;
+}
+
+void PathCache::EvictIfOverBudget() {
+  if (memory_budget_bytes_ == 0) {
+    return;
+  }
+
+  while (memory_used_ > memory_budget_bytes_) {
+    // Finds the shard whose least recently used pair is the oldest. Shards are
+    // locked one at a time, so the pair may be used again before it is
+    // evicted, in which case the search is repeated.
+    Shard* oldest_shard = nullptr;
+    uint64_t oldest_last_used = std::numeric_limits<uint64_t>::max();
+    for (Shard& shard : shards_) {
+      std::lock_guard<std::mutex> lock(shard.mu);
+      if (shard.size() == 0) {
+        continue;
+      }
+
+      uint64_t last_used = shard.last_used.at(shard.OldestKey());
+      if (last_used < oldest_last_used) {
+        oldest_shard = &shard;
+        oldest_last_used = last_used;
+      }
+    }
+
+    if (oldest_shard == nullptr || oldest_last_used + 1 >= clock_) {
+      return;
+    }
+
+    std::lock_guard<std::mutex> lock(oldest_shard->mu);
+    if (oldest_shard->size() > 0 &&
+        oldest_shard->last_used.at(oldest_shard->OldestKey()) ==
+            oldest_last_used) {
+      oldest_shard->EvictOldest();
     }
   }
 }
 
 NodePairPathCache* PathCache::NodePairCache(const NodePair& ie_key) {
-  std::unique_ptr<NodePairPathCache>& ie_cache_ptr = ie_caches_[ie_key];
-  if (!ie_cache_ptr) {
-    ie_cache_ptr = std::unique_ptr<NodePairPathCache>(new NodePairPathCache(
-        ie_key, max_num_paths_per_pair_, &graph_, graph_storage_));
-    if (!links_to_exclude_.Empty()) {
-      ie_cache_ptr = ie_cache_ptr->ExcludeLinks(links_to_exclude_);
+  Shard* shard = ShardForKey(ie_key);
+  NodePairPathCache* ie_cache_ptr;
+  {
+    std::lock_guard<std::mutex> lock(shard->mu);
+    NodePairPathCache** cached = shard->FindOrNull(ie_key);
+    if (cached != nullptr) {
+      ie_cache_ptr = *cached;
+      shard->last_used[ie_key] = clock_++;
+    } else {
+      auto ie_cache = std::unique_ptr<NodePairPathCache>(new NodePairPathCache(
+          ie_key, max_num_paths_per_pair_, &graph_, graph_storage_));
+      if (!links_to_exclude_.Empty()) {
+        ie_cache = ie_cache->ExcludeLinks(links_to_exclude_);
+      }
+
+      ie_cache_ptr = AddToShard(ie_key, std::move(ie_cache), shard);
     }
   }
 
-  return ie_cache_ptr.get();
+  EvictIfOverBudget();
+  return ie_cache_ptr;
+}
+
+std::vector<NodePairPathCache*> PathCache::NodePairCaches(
+    const std::vector<NodePair>& keys, size_t num_paths, size_t num_threads) {
+  std::vector<NodePairPathCache*> out;
+  for (const NodePair& key : keys) {
+    out.emplace_back(NodePairCache(key));
+  }
+
+  if (num_paths == 0) {
+    return out;
+  }
+
+  RunInParallel<NodePairPathCache*>(
+      out, [num_paths](NodePairPathCache* const& node_pair_cache, size_t i) {
+        Unused(i);
+        node_pair_cache->PathsRange(0, num_paths);
+      }, num_threads);
+
+  // The caches grew after they were last touched.
+  EvictIfOverBudget();
+
+  return out;
 }
 
 std::unique_ptr<PathCache> PathCache::ExcludeLinks(
     const GraphLinkSet& links) const {
   GraphLinkSet all_links = links_to_exclude_;
   all_links.InsertAll(links);
-  auto out = std::unique_ptr<PathCache>(
-      new PathCache(all_links, graph_storage_, max_num_paths_per_pair_));
-  for (const auto& node_pair_and_cache : ie_caches_) {
-    const NodePair node_pair = node_pair_and_cache.first;
-    out->ie_caches_[node_pair] =
-        node_pair_and_cache.second->ExcludeLinks(links);
+  auto out = std::unique_ptr<PathCache>(new PathCache(
+      all_links, graph_storage_, max_num_paths_per_pair_,
+      memory_budget_bytes_));
+  for (const Shard& shard : shards_) {
+    std::lock_guard<std::mutex> lock(shard.mu);
+    for (const auto& node_pair_and_cache : shard.caches) {
+      const NodePair& node_pair = node_pair_and_cache.first;
+      Shard* out_shard = out->ShardForKey(node_pair);
+      std::lock_guard<std::mutex> out_lock(out_shard->mu);
+      out->AddToShard(node_pair,
+                      node_pair_and_cache.second->ExcludeLinks(links),
+                      out_shard);
+    }
   }
 
   return out;
 }
 
+void PathCache::ReleaseEvicted() {
+  for (Shard& shard : shards_) {
+    std::lock_guard<std::mutex> lock(shard.mu);
+    shard.evicted.clear();
+  }
+}
+
 }  // namespace net
 }  // namespace ncode
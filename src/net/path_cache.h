@@ -2,14 +2,17 @@
 #define NCODE_NET_PATH_CACHE_H
 
 #include <stddef.h>
+#include <atomic>
 #include <chrono>
 #include <map>
 #include <memory>
+#include <mutex>
 #include <type_traits>
 #include <utility>
 #include <vector>
 
 #include "../common/common.h"
+#include "../common/lru_cache.h"
 #include "constraint.h"
 #include "net_common.h"
 
@@ -18,7 +21,8 @@ namespace net {
 
 using NodePair = std::tuple<GraphNodeIndex, GraphNodeIndex, uint64_t>;
 
-// Caches paths between two nodes in the graph.
+// Caches paths between two nodes in the graph. Paths are generated lazily,
+// multiple threads can query the same instance.
 class NodePairPathCache {
  public:
   // Returns the paths between start_k (including) and the first  path that
@@ -55,6 +59,9 @@ class NodePairPathCache {
   std::unique_ptr<NodePairPathCache> ExcludeLinks(
       const GraphLinkSet& links) const;
 
+  // Rough estimate of the number of bytes of memory this cache uses.
+  size_t InMemBytesEstimate() const;
+
  private:
   NodePairPathCache(const NodePair& key, size_t max_num_paths,
                     std::unique_ptr<Constraint> constraint,
@@ -73,6 +80,10 @@ class NodePairPathCache {
   // path if no path at index i exists.
   const LinkSequence* GetPathAtIndexOrNull(size_t i);
 
+  // Sets the counter that will track the memory used by this cache, or stops
+  // tracking if 'counter' is null. Adds the current estimate to the counter.
+  void SetMemoryCounter(std::atomic<size_t>* counter);
+
   const NodePair key_;
   const DirectedGraph* graph_;
   GraphStorage* graph_storage_;
@@ -80,6 +91,9 @@ class NodePairPathCache {
   // Constraint.
   std::unique_ptr<Constraint> constraint_;
 
+  // Protects path_generator_, paths_, bytes_ and memory_counter_.
+  mutable std::mutex mu_;
+
   // Generates paths in order.
   std::unique_ptr<ShortestPathGenerator> path_generator_;
 
@@ -91,22 +105,39 @@ class NodePairPathCache {
   // The cache will not grow above this number of paths.
   size_t max_num_paths_;
 
+  // Estimate of the memory used by this cache.
+  size_t bytes_;
+
+  // Shared counter of the memory used by all caches of a PathCache. Not owned
+  // by this object, can be null.
+  std::atomic<size_t>* memory_counter_;
+
   friend class PathCache;
   DISALLOW_COPY_AND_ASSIGN(NodePairPathCache);
 };
 
 // An entity that can be queried for paths and will cache paths between a source
-// and a destination.
+// and a destination. The cache can be used by multiple threads. Caches for
+// different pairs are split among shards, each with its own lock, and each
+// pair cache has its own lock as well.
 class PathCache {
  public:
   static constexpr size_t kDefaultMaxNumPathsPerPair = 1000;
 
+  // Number of shards that pair caches are split into.
+  static constexpr size_t kShardCount = 16;
+
   using ConstraintMap = std::map<NodePair, std::unique_ptr<Constraint>>;
 
-  // Creates a new cache.
+  // Creates a new cache. If 'memory_budget_bytes' is not 0 the caches of
+  // pairs that have not been used recently will be evicted to keep the
+  // estimated memory used by all paths within the budget. Evicted caches no
+  // longer count towards the budget, but their memory is only freed when
+  // ReleaseEvicted is called.
   PathCache(GraphStorage* path_storage,
             size_t max_num_paths_per_pair = kDefaultMaxNumPathsPerPair,
-            ConstraintMap* constraint_map = nullptr);
+            ConstraintMap* constraint_map = nullptr,
+            size_t memory_budget_bytes = 0);
 
   // The graph.
   const DirectedGraph* graph() const { return &graph_; }
@@ -114,16 +145,67 @@ class PathCache {
   // Path storage.
   GraphStorage* graph_storage() { return graph_storage_; }
 
-  // Returns the cache between two nodes.
+  // Returns the cache between two nodes. The returned cache and all paths from
+  // it stay valid until the pair is evicted and ReleaseEvicted is called.
   NodePairPathCache* NodePairCache(const NodePair& key);
 
+  // Returns the caches for a number of pairs, in the same order as 'keys'.
+  // The first 'num_paths' paths of each pair are generated (if not already
+  // cached) in parallel by up to 'num_threads' threads. If the memory budget
+  // is exceeded once all paths are generated some of the returned caches may
+  // be evicted.
+  std::vector<NodePairPathCache*> NodePairCaches(
+      const std::vector<NodePair>& keys, size_t num_paths,
+      size_t num_threads = 1);
+
   // Returns a new path cache with constraints that exclude the given links. The
   // cache will contain no paths.
   std::unique_ptr<PathCache> ExcludeLinks(const GraphLinkSet& links) const;
 
+  // Estimate of the memory used by all cached paths, not including evicted
+  // caches that are not yet released.
+  size_t InMemBytesEstimate() const { return memory_used_; }
+
+  // Frees the memory of pair caches that were evicted. No thread should be
+  // using pointers from evicted pair caches when this is called.
+  void ReleaseEvicted();
+
  private:
+  struct NodePairHash {
+    size_t operator()(const NodePair& node_pair) const;
+  };
+
+  // Owns the pair caches of a shard. The LRU order is kept in the base
+  // class, evicted caches are moved to 'evicted'. 'last_used' has the value
+  // of the cache's clock when each pair was last used, so that the least
+  // recently used pairs of different shards can be compared.
+  class Shard : public LRUCache<NodePair, NodePairPathCache*, NodePairHash> {
+   public:
+    Shard();
+
+    void ItemEvicted(const NodePair& key,
+                     std::unique_ptr<NodePairPathCache*> value) override;
+
+    mutable std::mutex mu;
+    std::map<NodePair, std::unique_ptr<NodePairPathCache>> caches;
+    std::map<NodePair, uint64_t> last_used;
+    std::vector<std::unique_ptr<NodePairPathCache>> evicted;
+  };
+
   PathCache(const GraphLinkSet& links_to_exclude, GraphStorage* graph_storage,
-            size_t max_num_paths_per_pair);
+            size_t max_num_paths_per_pair, size_t memory_budget_bytes);
+
+  Shard* ShardForKey(const NodePair& key);
+
+  // Adds a pair cache to a shard. The shard's lock should be held.
+  NodePairPathCache* AddToShard(
+      const NodePair& key, std::unique_ptr<NodePairPathCache> node_pair_cache,
+      Shard* shard);
+
+  // Evicts the least recently used pairs, from any shard, until the memory
+  // used is within budget. Never evicts the most recently used pair. No
+  // shard's lock should be held.
+  void EvictIfOverBudget();
 
   const DirectedGraph graph_;
   GraphStorage* graph_storage_;
@@ -135,8 +217,17 @@ class PathCache {
   // Each NodePair cache will have at most this many paths.
   size_t max_num_paths_per_pair_;
 
-  // Stores cached between a source and a destination.
-  std::map<NodePair, std::unique_ptr<NodePairPathCache>> ie_caches_;
+  // Budget for memory_used_, 0 if there is no limit.
+  size_t memory_budget_bytes_;
+
+  // Estimated memory used by all pair caches that are not evicted.
+  std::atomic<size_t> memory_used_;
+
+  // Incremented every time a pair is used.
+  std::atomic<uint64_t> clock_;
+
+  // Stores caches between a source and a destination.
+  Shard shards_[kShardCount];
 
   DISALLOW_COPY_AND_ASSIGN(PathCache);
 };
@@ -1,5 +1,6 @@
 #include "path_cache.h"
 
+#include <thread>
 #include "gtest/gtest.h"
 #include "constraint.h"
 #include "net_gen.h"
@@ -118,5 +119,117 @@ TEST_F(PathUtilsTest, PathsSkip) {
   ASSERT_EQ(3ul, i);
 }
 
+class PathCacheConcurrentTest : public ::testing::Test {
+ protected:
+  static constexpr size_t kPathsPerPair = 5;
+
+  PathCacheConcurrentTest() : graph_storage_(GenerateNTT()) {
+    for (GraphNodeIndex src : graph_storage_.AllNodes()) {
+      for (GraphNodeIndex dst : graph_storage_.AllNodes()) {
+        if (src != dst) {
+          pairs_.emplace_back(src, dst, 0ul);
+        }
+      }
+    }
+  }
+
+  // The first paths of each pair, from a cache used by a single thread.
+  std::vector<std::vector<LinkSequence>> ModelPaths() {
+    PathCache cache(&graph_storage_);
+    std::vector<std::vector<LinkSequence>> out;
+    for (const NodePair& pair : pairs_) {
+      out.emplace_back(PairPaths(cache.NodePairCache(pair)));
+    }
+
+    return out;
+  }
+
+  static std::vector<LinkSequence> PairPaths(NodePairPathCache* pair_cache) {
+    std::vector<LinkSequence> out;
+    for (const LinkSequence* path : pair_cache->PathsRange(0, kPathsPerPair)) {
+      out.emplace_back(*path);
+    }
+
+    return out;
+  }
+
+  GraphStorage graph_storage_;
+  std::vector<NodePair> pairs_;
+};
+
+constexpr size_t PathCacheConcurrentTest::kPathsPerPair;
+
+TEST_F(PathCacheConcurrentTest, Bulk) {
+  std::vector<std::vector<LinkSequence>> model = ModelPaths();
+
+  PathCache cache(&graph_storage_);
+  std::vector<NodePairPathCache*> pair_caches =
+      cache.NodePairCaches(pairs_, kPathsPerPair, 4);
+  ASSERT_EQ(pairs_.size(), pair_caches.size());
+  for (size_t i = 0; i < pairs_.size(); ++i) {
+    ASSERT_EQ(pair_caches[i], cache.NodePairCache(pairs_[i]));
+    ASSERT_EQ(model[i], PairPaths(pair_caches[i]));
+  }
+}
+
+TEST_F(PathCacheConcurrentTest, SamePairsFromManyThreads) {
+  std::vector<std::vector<LinkSequence>> model = ModelPaths();
+
+  PathCache cache(&graph_storage_);
+  std::vector<std::vector<std::vector<LinkSequence>>> outputs(4);
+  std::vector<std::thread> threads;
+  for (size_t thread_index = 0; thread_index < outputs.size();
+       ++thread_index) {
+    threads.emplace_back([this, &cache, &outputs, thread_index] {
+      for (const NodePair& pair : pairs_) {
+        outputs[thread_index].emplace_back(
+            PairPaths(cache.NodePairCache(pair)));
+      }
+    });
+  }
+
+  for (std::thread& thread : threads) {
+    thread.join();
+  }
+
+  for (const auto& output : outputs) {
+    ASSERT_EQ(model, output);
+  }
+}
+
+TEST_F(PathCacheConcurrentTest, MemoryBudget) {
+  std::vector<std::vector<LinkSequence>> model = ModelPaths();
+
+  PathCache unlimited_cache(&graph_storage_);
+  unlimited_cache.NodePairCaches(pairs_, kPathsPerPair);
+  size_t total_bytes = unlimited_cache.InMemBytesEstimate();
+
+  // A cache that can only fit about a quarter of all paths.
+  size_t budget = total_bytes / 4;
+  PathCache cache(&graph_storage_, PathCache::kDefaultMaxNumPathsPerPair,
+                  nullptr, budget);
+  std::vector<NodePairPathCache*> pair_caches =
+      cache.NodePairCaches(pairs_, kPathsPerPair);
+
+  // Evicted caches are still usable until they are released.
+  for (size_t i = 0; i < pairs_.size(); ++i) {
+    ASSERT_EQ(model[i], PairPaths(pair_caches[i]));
+  }
+
+  // Pairs are evicted from all shards until the cache is within budget.
+  ASSERT_LE(cache.InMemBytesEstimate(), budget);
+
+  // The least recently used pair was evicted, the most recently used one was
+  // not.
+  ASSERT_NE(pair_caches.front(), cache.NodePairCache(pairs_.front()));
+  ASSERT_EQ(pair_caches.back(), cache.NodePairCache(pairs_.back()));
+  cache.ReleaseEvicted();
+
+  // Evicted pairs are computed again.
+  for (size_t i = 0; i < pairs_.size(); ++i) {
+    ASSERT_EQ(model[i], PairPaths(cache.NodePairCache(pairs_[i])));
+  }
+}
+
 }  // namespace net
 }  // namespace ncode
@@ -97,31 +97,14 @@ bool VerifyICMPHeader(const IPHeader& ip_header, uint16_t* payload_size) {
   return true;
 }
 
-// Called to handle a single packet. Will dispatch it to HandleTcp or
-// HandleUdp.This is in a free function because the pcap library expects an
-// unbound function pointer
-static void HandlePkt(u_char* d, const struct pcap_pkthdr* header,
-                      const u_char* packet) {
-  using namespace std::chrono;
-  PcapBase* data = reinterpret_cast<PcapBase*>(d);
-
-  Timestamp timestamp;
-  ExternalTimestampProvider* external_timestamp_provider =
-      data->timestamp_provider();
-  if (external_timestamp_provider) {
-    timestamp = external_timestamp_provider->NextTimestamp();
-  } else {
-    // Timestamp is assumed to have microsecond precision.
-    timestamp = seconds(header->ts.tv_sec) + microseconds(header->ts.tv_usec);
-  }
-
-  int datalink = data->datalink();
+bool DecodePacket(int datalink, const u_char* packet, size_t caplen,
+                  DecodedPacket* decoded_packet) {
   size_t offset;
   // Have to figure out what the offset is.
   switch (datalink) {
     case DLT_EN10MB: {
-      if (header->caplen < 14) {
-        return;
+      if (caplen < 14) {
+        return false;
       }
       // Only handle IP and 802.1Q VLAN tagged packets
       if (packet[12] == 8 && packet[13] == 0) {
@@ -132,7 +115,7 @@ static void HandlePkt(u_char* d, const struct pcap_pkthdr* header,
         offset = kSizeEthernetDotOneQ;
       } else {
         LOG(ERROR) << "Non-IP frame";
-        return;
+        return false;
       }
       break;
     }
@@ -154,73 +137,132 @@ static void HandlePkt(u_char* d, const struct pcap_pkthdr* header,
 
     default: {
       LOG(FATAL) << "Unknown datalink " << datalink;
-      return;
+      return false;
     }
   }
 
+  if (caplen < offset + sizeof(IPHeader)) {
+    return false;
+  }
+
   const IPHeader* ip_header =
       reinterpret_cast<const IPHeader*>(packet + offset);
 
   uint16_t off = ntohs(ip_header->ip_off);
   if (off && !(off & IP_DF)) {
     // Don't know how to deal with fragments yet.
-    return;
+    return false;
   }
 
   if (off & IP_RF) {
     // Reserved bit set -- rfc3541
     LOG(INFO) << "Packet with evil bit";
-    return;
+    return false;
   }
 
   size_t size_ip = ip_header->ip_hl * 4;
   if (size_ip < 20) {
     LOG(INFO) << Substitute(
-        "Invalid IP header length: $0 bytes, pcap header len: $1", size_ip,
-        header->len);
+        "Invalid IP header length: $0 bytes, captured len: $1", size_ip,
+        caplen);
 
-    return;
+    return false;
   }
 
-  PacketHandler* handler = data->handler();
-  uint16_t payload_len;
+  // The headers after the IP header have to have been captured.
+  size_t l4_offset = offset + size_ip;
+  decoded_packet->ip_header = ip_header;
+  decoded_packet->l4_header = packet + l4_offset;
   switch (ip_header->ip_p) {
     case IPPROTO_TCP: {
       const TCPHeader* tcp_header =
-          reinterpret_cast<const TCPHeader*>(packet + offset + size_ip);
-      if (!VerifyTCPHeader(*ip_header, *tcp_header, &payload_len)) {
-        return;
+          reinterpret_cast<const TCPHeader*>(packet + l4_offset);
+      if (caplen < l4_offset + sizeof(TCPHeader) ||
+          !VerifyTCPHeader(*ip_header, *tcp_header,
+                           &decoded_packet->payload_len)) {
+        return false;
       }
 
-      handler->HandleTCP(timestamp, *ip_header, *tcp_header, payload_len);
+      decoded_packet->kind = DecodedPacket::TCP;
       break;
     }
     case IPPROTO_UDP: {
-      const UDPHeader* udp_header =
-          reinterpret_cast<const UDPHeader*>(packet + offset + size_ip);
-      if (!VerifyUDPHeader(*ip_header, &payload_len)) {
-        return;
+      if (caplen < l4_offset + sizeof(UDPHeader) ||
+          !VerifyUDPHeader(*ip_header, &decoded_packet->payload_len)) {
+        return false;
       }
 
-      handler->HandleUDP(timestamp, *ip_header, *udp_header, payload_len);
+      decoded_packet->kind = DecodedPacket::UDP;
       break;
     }
     case IPPROTO_ICMP: {
-      const ICMPHeader* icmp_header =
-          reinterpret_cast<const ICMPHeader*>(packet + offset + size_ip);
-      if (!VerifyICMPHeader(*ip_header, &payload_len)) {
-        return;
+      if (caplen < l4_offset + kSizeICMP ||
+          !VerifyICMPHeader(*ip_header, &decoded_packet->payload_len)) {
+        return false;
       }
 
-      handler->HandleICMP(timestamp, *ip_header, *icmp_header, payload_len);
+      decoded_packet->kind = DecodedPacket::ICMP;
       break;
     }
     default: {
       // This will be off, but we don't know what the protocol is.
-      payload_len = ntohs(ip_header->ip_len) - ip_header->ip_hl * 4;
-      handler->HandleUnknownIP(timestamp, *ip_header, payload_len);
+      decoded_packet->payload_len =
+          ntohs(ip_header->ip_len) - ip_header->ip_hl * 4;
+      decoded_packet->l4_header = nullptr;
+      decoded_packet->kind = DecodedPacket::UNKNOWN_IP;
     }
   }
+
+  return true;
+}
+
+void DispatchPacket(const DecodedPacket& packet, PacketHandler* handler) {
+  switch (packet.kind) {
+    case DecodedPacket::TCP:
+      handler->HandleTCP(packet.timestamp, *packet.ip_header,
+                         *static_cast<const TCPHeader*>(packet.l4_header),
+                         packet.payload_len);
+      break;
+    case DecodedPacket::UDP:
+      handler->HandleUDP(packet.timestamp, *packet.ip_header,
+                         *static_cast<const UDPHeader*>(packet.l4_header),
+                         packet.payload_len);
+      break;
+    case DecodedPacket::ICMP:
+      handler->HandleICMP(packet.timestamp, *packet.ip_header,
+                          *static_cast<const ICMPHeader*>(packet.l4_header),
+                          packet.payload_len);
+      break;
+    case DecodedPacket::UNKNOWN_IP:
+      handler->HandleUnknownIP(packet.timestamp, *packet.ip_header,
+                               packet.payload_len);
+      break;
+  }
+}
+
+// Called to handle a single packet. Will dispatch it to HandleTcp or
+// HandleUdp.This is in a free function because the pcap library expects an
+// unbound function pointer
+static void HandlePkt(u_char* d, const struct pcap_pkthdr* header,
+                      const u_char* packet) {
+  using namespace std::chrono;
+  PcapBase* data = reinterpret_cast<PcapBase*>(d);
+
+  DecodedPacket decoded_packet;
+  ExternalTimestampProvider* external_timestamp_provider =
+      data->timestamp_provider();
+  if (external_timestamp_provider) {
+    decoded_packet.timestamp = external_timestamp_provider->NextTimestamp();
+  } else {
+    // Timestamp is assumed to have microsecond precision.
+    decoded_packet.timestamp =
+        seconds(header->ts.tv_sec) + microseconds(header->ts.tv_usec);
+  }
+
+  if (DecodePacket(data->datalink(), packet, header->caplen,
+                   &decoded_packet)) {
+    DispatchPacket(decoded_packet, data->handler());
+  }
 }
 
 int PcapBase::datalink() const {
@@ -79,6 +79,27 @@ bool VerifyICMPHeader(const IPHeader& ip_header, uint16_t* payload_size);
 // All timestamps are in nanoseconds.
 using Timestamp = std::chrono::nanoseconds;
 
+// The headers of a packet that passed the checks above. The pointers point to
+// the packet's captured data and are only valid for as long as it is.
+struct DecodedPacket {
+  enum Kind : uint8_t { TCP, UDP, ICMP, UNKNOWN_IP };
+
+  Timestamp timestamp;
+  const IPHeader* ip_header;
+
+  // A TCPHeader, UDPHeader or ICMPHeader, depending on the kind of the
+  // packet. Null for UNKNOWN_IP packets.
+  const void* l4_header;
+  uint16_t payload_len;
+  Kind kind;
+};
+
+// Finds the IP header (and the TCP/UDP/ICMP header after it) in a captured
+// frame of the given datalink type and verifies them. Returns false if the
+// packet should be skipped. Does not set the timestamp.
+bool DecodePacket(int datalink, const u_char* packet, size_t caplen,
+                  DecodedPacket* decoded_packet);
+
 // An interface for a class that knows how to handle incoming packets. Only the
 // headers are included.
 class PacketHandler {
@@ -95,6 +116,9 @@ class PacketHandler {
                                uint16_t payload_len);
 };
 
+// Calls the method of the handler that corresponds to the packet's kind.
+void DispatchPacket(const DecodedPacket& packet, PacketHandler* handler);
+
 // A class that knows how to provide timetamps.
 class ExternalTimestampProvider {
  public:
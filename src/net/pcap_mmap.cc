@@ -0,0 +1,386 @@
+#include "pcap_mmap.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cstring>
+
+#include "../common/logging.h"
+
+namespace ncode {
+namespace pcap {
+
+// Magic numbers of classic pcap files, with microsecond and nanosecond
+// timestamps.
+static constexpr uint32_t kPcapMagic = 0xa1b2c3d4;
+static constexpr uint32_t kPcapNanoMagic = 0xa1b23c4d;
+static constexpr size_t kPcapHeaderLen = 24;
+static constexpr size_t kPcapRecordHeaderLen = 16;
+static constexpr uint64_t kNanosPerSecond = 1000000000;
+
+// Block types and the byte-order magic of pcapng files.
+static constexpr uint32_t kSectionHeaderBlock = 0x0a0d0d0a;
+static constexpr uint32_t kInterfaceBlock = 1;
+static constexpr uint32_t kEnhancedPacketBlock = 6;
+static constexpr uint32_t kByteOrderMagic = 0x1a2b3c4d;
+static constexpr size_t kBlockOverheadLen = 12;
+static constexpr size_t kEnhancedPacketHeaderLen = 28;
+static constexpr uint16_t kTimestampResolutionOption = 9;
+
+// Link types that are stored in files differently than the DLT_ values
+// libpcap uses.
+static constexpr uint32_t kLinkTypeRaw = 101;
+static constexpr uint32_t kLinkTypeIPv4 = 228;
+
+static int LinkTypeToDatalink(uint32_t link_type) {
+  if (link_type == kLinkTypeRaw || link_type == kLinkTypeIPv4) {
+    return DLT_RAW;
+  }
+
+  return link_type;
+}
+
+static uint32_t Swap32(uint32_t value) { return __builtin_bswap32(value); }
+
+static uint32_t RawRead32(const uint8_t* ptr) {
+  uint32_t value;
+  memcpy(&value, ptr, sizeof(value));
+  return value;
+}
+
+static Timestamp ToTimestamp(uint64_t time, uint64_t units_per_second) {
+  uint64_t fraction = time % units_per_second;
+  uint64_t fraction_nanos;
+  if (kNanosPerSecond % units_per_second == 0) {
+    fraction_nanos = fraction * (kNanosPerSecond / units_per_second);
+  } else {
+    fraction_nanos = static_cast<double>(fraction) * kNanosPerSecond /
+                     units_per_second;
+  }
+
+  return std::chrono::seconds(time / units_per_second) +
+         Timestamp(fraction_nanos);
+}
+
+MappedFile::MappedFile(const std::string& filename)
+    : fd_(-1), data_(nullptr), size_(0) {
+  fd_ = open(filename.c_str(), O_RDONLY);
+  CHECK(fd_ != -1) << "Unable to open " << filename;
+
+  struct stat file_stat;
+  CHECK(fstat(fd_, &file_stat) != -1) << "Unable to stat " << filename;
+  size_ = file_stat.st_size;
+  if (size_ == 0) {
+    return;
+  }
+
+  void* data = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd_, 0);
+  CHECK(data != MAP_FAILED) << "Unable to map " << filename;
+
+  // Files are read front to back, the kernel should read ahead aggressively.
+  madvise(data, size_, MADV_SEQUENTIAL);
+  data_ = static_cast<const uint8_t*>(data);
+}
+
+MappedFile::~MappedFile() {
+  if (data_ != nullptr) {
+    munmap(const_cast<uint8_t*>(data_), size_);
+  }
+  close(fd_);
+}
+
+constexpr size_t MmapOfflinePcap::kBatchSize;
+
+MmapOfflinePcap::MmapOfflinePcap(std::unique_ptr<OfflineSourceProvider> source,
+                                 size_t thread_count)
+    : source_(std::move(source)),
+      timestamp_provider_(nullptr),
+      offset_(0),
+      pcapng_(false),
+      swapped_(false),
+      datalink_(0),
+      units_per_second_(0),
+      thread_count_(std::max(thread_count, static_cast<size_t>(1))) {
+  records_.reserve(kBatchSize);
+  if (thread_count_ > 1) {
+    processor_ = make_unique<ThreadBatchProcessor<std::pair<size_t, size_t>>>(
+        thread_count_);
+    range_packets_.resize(thread_count_);
+  }
+}
+
+uint16_t MmapOfflinePcap::Read16(const uint8_t* ptr) const {
+  uint16_t value;
+  memcpy(&value, ptr, sizeof(value));
+  return swapped_ ? __builtin_bswap16(value) : value;
+}
+
+uint32_t MmapOfflinePcap::Read32(const uint8_t* ptr) const {
+  uint32_t value = RawRead32(ptr);
+  return swapped_ ? Swap32(value) : value;
+}
+
+bool MmapOfflinePcap::OpenNextSource() {
+  file_.reset();
+  filename_ = source_->NextSource();
+  if (filename_.empty()) {
+    return false;
+  }
+
+  file_ = make_unique<MappedFile>(filename_);
+  LOG(INFO) << "Will start reading from " << filename_;
+  CHECK(file_->size() >= sizeof(uint32_t)) << "Source too short: "
+                                           << filename_;
+
+  uint32_t magic = RawRead32(file_->data());
+  interfaces_.clear();
+  swapped_ = false;
+  if (magic == kSectionHeaderBlock) {
+    // The byte order is set when the section header block is parsed.
+    pcapng_ = true;
+    offset_ = 0;
+    return true;
+  }
+
+  pcapng_ = false;
+  if (magic == Swap32(kPcapMagic) || magic == Swap32(kPcapNanoMagic)) {
+    swapped_ = true;
+    magic = Swap32(magic);
+  }
+
+  CHECK(magic == kPcapMagic || magic == kPcapNanoMagic)
+      << "Not a pcap or pcapng file: " << filename_;
+  CHECK(file_->size() >= kPcapHeaderLen) << "Source too short: " << filename_;
+  units_per_second_ = magic == kPcapMagic ? 1000000 : kNanosPerSecond;
+  datalink_ = LinkTypeToDatalink(Read32(file_->data() + 20));
+  offset_ = kPcapHeaderLen;
+  return true;
+}
+
+bool MmapOfflinePcap::NextRecord(Record* record) {
+  return pcapng_ ? NextPcapngRecord(record) : NextPcapRecord(record);
+}
+
+bool MmapOfflinePcap::NextPcapRecord(Record* record) {
+  size_t remaining = file_->size() - offset_;
+  if (remaining == 0) {
+    return false;
+  }
+
+  const uint8_t* header = file_->data() + offset_;
+  if (remaining < kPcapRecordHeaderLen ||
+      remaining - kPcapRecordHeaderLen < Read32(header + 8)) {
+    LOG(ERROR) << "Truncated record at offset " << offset_ << " in "
+               << filename_;
+    offset_ = file_->size();
+    return false;
+  }
+
+  uint64_t time = static_cast<uint64_t>(Read32(header)) * units_per_second_ +
+                  Read32(header + 4);
+  record->timestamp = ToTimestamp(time, units_per_second_);
+  record->caplen = Read32(header + 8);
+  record->data = header + kPcapRecordHeaderLen;
+  record->datalink = datalink_;
+  offset_ += kPcapRecordHeaderLen + record->caplen;
+  return true;
+}
+
+bool MmapOfflinePcap::NextPcapngRecord(Record* record) {
+  while (true) {
+    size_t remaining = file_->size() - offset_;
+    if (remaining == 0) {
+      return false;
+    }
+
+    const uint8_t* block = file_->data() + offset_;
+    if (remaining < kBlockOverheadLen) {
+      LOG(ERROR) << "Truncated block at offset " << offset_ << " in "
+                 << filename_;
+      offset_ = file_->size();
+      return false;
+    }
+
+    uint32_t block_type = Read32(block);
+    if (block_type == kSectionHeaderBlock) {
+      uint32_t byte_order_magic = RawRead32(block + 8);
+      if (byte_order_magic != kByteOrderMagic &&
+          byte_order_magic != Swap32(kByteOrderMagic)) {
+        LOG(ERROR) << "Bad byte-order magic at offset " << offset_ << " in "
+                   << filename_;
+        offset_ = file_->size();
+        return false;
+      }
+
+      swapped_ = byte_order_magic != kByteOrderMagic;
+      interfaces_.clear();
+    }
+
+    uint32_t block_len = Read32(block + 4);
+    if (block_len < kBlockOverheadLen || block_len % 4 != 0 ||
+        block_len > remaining) {
+      LOG(ERROR) << "Bad block length " << block_len << " at offset "
+                 << offset_ << " in " << filename_;
+      offset_ = file_->size();
+      return false;
+    }
+    offset_ += block_len;
+
+    if (block_type == kInterfaceBlock) {
+      ParseInterface(block, block_len);
+      continue;
+    }
+
+    // Other blocks, including simple packet blocks which have no timestamp,
+    // are skipped.
+    if (block_type != kEnhancedPacketBlock) {
+      continue;
+    }
+
+    uint32_t interface_id = Read32(block + 8);
+    uint32_t caplen = Read32(block + 20);
+    if (block_len < kEnhancedPacketHeaderLen + 4 ||
+        block_len - kEnhancedPacketHeaderLen - 4 < caplen ||
+        interface_id >= interfaces_.size()) {
+      LOG(ERROR) << "Bad packet block at offset " << offset_ - block_len
+                 << " in " << filename_;
+      offset_ = file_->size();
+      return false;
+    }
+
+    const Interface& interface = interfaces_[interface_id];
+    uint64_t time = (static_cast<uint64_t>(Read32(block + 12)) << 32) |
+                    Read32(block + 16);
+    record->timestamp = ToTimestamp(time, interface.units_per_second);
+    record->caplen = caplen;
+    record->data = block + kEnhancedPacketHeaderLen;
+    record->datalink = interface.datalink;
+    return true;
+  }
+}
+
+void MmapOfflinePcap::ParseInterface(const uint8_t* block,
+                                     uint32_t block_len) {
+  Interface interface;
+  interface.datalink = LinkTypeToDatalink(Read16(block + 8));
+
+  // Timestamps are in microseconds unless there is an option that says
+  // otherwise.
+  interface.units_per_second = 1000000;
+  size_t offset = 16;
+  while (offset + 4 <= block_len - 4) {
+    uint16_t code = Read16(block + offset);
+    uint16_t len = Read16(block + offset + 2);
+    if (code == 0 || offset + 4 + len > block_len - 4) {
+      break;
+    }
+
+    if (code == kTimestampResolutionOption && len >= 1) {
+      // The most significant bit says whether the rest of the value is a
+      // negative power of 2 or of 10.
+      uint8_t resolution = block[offset + 4];
+      uint8_t exponent = resolution & 0x7f;
+      uint64_t units = 1;
+      for (uint8_t i = 0; i < exponent && units <= kNanosPerSecond; ++i) {
+        units *= (resolution & 0x80) ? 2 : 10;
+      }
+      interface.units_per_second = units;
+    }
+
+    // Option values are padded to 32 bits.
+    offset += 4 + ((len + 3) & ~3);
+  }
+
+  interfaces_.emplace_back(interface);
+}
+
+void MmapOfflinePcap::DecodeRange(size_t from, size_t to,
+                                  std::vector<DecodedPacket>* packets) const {
+  for (size_t i = from; i < to; ++i) {
+    const Record& record = records_[i];
+    DecodedPacket decoded_packet;
+    decoded_packet.timestamp = record.timestamp;
+    if (DecodePacket(record.datalink, record.data, record.caplen,
+                     &decoded_packet)) {
+      packets->emplace_back(decoded_packet);
+    }
+  }
+}
+
+void MmapOfflinePcap::Decode(std::vector<DecodedPacket>* packets) {
+  if (!processor_) {
+    DecodeRange(0, records_.size(), packets);
+    return;
+  }
+
+  size_t range_size = (records_.size() + thread_count_ - 1) / thread_count_;
+  ranges_.clear();
+  for (size_t from = 0; from < records_.size(); from += range_size) {
+    ranges_.emplace_back(from, std::min(from + range_size, records_.size()));
+  }
+
+  processor_->RunInParallel(
+      ranges_, [this](const std::pair<size_t, size_t>& range, size_t i,
+                      size_t thread_index) {
+        Unused(thread_index);
+        range_packets_[i].clear();
+        DecodeRange(range.first, range.second, &range_packets_[i]);
+      });
+
+  // Ranges are in the order of the records, so are their packets.
+  for (size_t i = 0; i < ranges_.size(); ++i) {
+    packets->insert(packets->end(), range_packets_[i].begin(),
+                    range_packets_[i].end());
+  }
+}
+
+bool MmapOfflinePcap::NextBatch(std::vector<DecodedPacket>* packets) {
+  packets->clear();
+  while (packets->empty()) {
+    // The previous batch may still point into the current source, so it is
+    // only unmapped here, once it is exhausted.
+    records_.clear();
+    if (!file_ && !OpenNextSource()) {
+      return false;
+    }
+
+    Record record;
+    while (records_.size() < kBatchSize && NextRecord(&record)) {
+      if (timestamp_provider_ != nullptr) {
+        record.timestamp = timestamp_provider_->NextTimestamp();
+      }
+      records_.emplace_back(record);
+    }
+
+    if (records_.empty()) {
+      LOG(INFO) << "Done reading from " << filename_;
+      file_.reset();
+      continue;
+    }
+
+    Decode(packets);
+  }
+
+  return true;
+}
+
+void MmapOfflinePcap::Run(BatchPacketHandler* handler) {
+  std::vector<DecodedPacket> packets;
+  while (NextBatch(&packets)) {
+    handler->HandleBatch(packets);
+  }
+}
+
+void MmapOfflinePcap::Run(PacketHandler* handler) {
+  std::vector<DecodedPacket> packets;
+  while (NextBatch(&packets)) {
+    for (const DecodedPacket& packet : packets) {
+      DispatchPacket(packet, handler);
+    }
+  }
+}
+
+}  // namespace pcap
+}  // namespace ncode
@@ -0,0 +1,155 @@
+// Reads .pcap and .pcapng traces without going through libpcap. Each file is
+// mapped in memory and the headers of its packets are decoded in place, a
+// batch at a time. Decoding a batch can be split among a number of threads;
+// the decoded packets are always delivered in the order they appear in the
+// trace. There is no BPF filter -- packets that are not IP are skipped, which
+// is what OfflinePcap's default filter does.
+
+#ifndef NCODE_PCAP_MMAP_H
+#define NCODE_PCAP_MMAP_H
+
+#include <stddef.h>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "../common/common.h"
+#include "../common/thread_runner.h"
+#include "pcap.h"
+
+namespace ncode {
+namespace pcap {
+
+// A read-only, private memory mapping of an entire file.
+class MappedFile {
+ public:
+  // Will die if the file cannot be opened or mapped.
+  explicit MappedFile(const std::string& filename);
+  ~MappedFile();
+
+  const uint8_t* data() const { return data_; }
+  size_t size() const { return size_; }
+
+ private:
+  int fd_;
+  const uint8_t* data_;
+  size_t size_;
+
+  DISALLOW_COPY_AND_ASSIGN(MappedFile);
+};
+
+// An interface for a class that handles packets a batch at a time.
+class BatchPacketHandler {
+ public:
+  virtual ~BatchPacketHandler() {}
+
+  // The headers of the packets point into the trace and are only valid for
+  // the duration of the call.
+  virtual void HandleBatch(const std::vector<DecodedPacket>& packets) = 0;
+};
+
+class MmapOfflinePcap {
+ public:
+  // Max number of records that are decoded at once.
+  static constexpr size_t kBatchSize = 4096;
+
+  // If 'thread_count' is more than 1 batches will be decoded by that many
+  // threads.
+  MmapOfflinePcap(std::unique_ptr<OfflineSourceProvider> source,
+                  size_t thread_count = 1);
+
+  // Same as PcapBase::set_timestamp_provider.
+  void set_timestamp_provider(ExternalTimestampProvider* timestamp_provider) {
+    timestamp_provider_ = timestamp_provider;
+  }
+
+  // Decodes the next batch of packets into 'packets'. The headers point into
+  // the trace and remain valid until the next call. Returns false when all
+  // sources have been read. A batch is never empty and never spans sources.
+  bool NextBatch(std::vector<DecodedPacket>* packets);
+
+  // Reads all sources, handing each batch to the handler.
+  void Run(BatchPacketHandler* handler);
+
+  // Reads all sources, handing each packet to the handler.
+  void Run(PacketHandler* handler);
+
+ private:
+  // A captured packet in the trace, not decoded yet.
+  struct Record {
+    const uint8_t* data;
+    uint32_t caplen;
+    int datalink;
+    Timestamp timestamp;
+  };
+
+  // A pcapng interface.
+  struct Interface {
+    int datalink;
+    uint64_t units_per_second;
+  };
+
+  // Maps the next source and parses its header. Returns false if there are
+  // no more sources.
+  bool OpenNextSource();
+
+  // Parses the next record of the current source. Returns false at the end of
+  // the source. If the source is corrupt the rest of it is skipped.
+  bool NextRecord(Record* record);
+  bool NextPcapRecord(Record* record);
+  bool NextPcapngRecord(Record* record);
+
+  // Parses a pcapng interface description block of the given length.
+  void ParseInterface(const uint8_t* block, uint32_t block_len);
+
+  // Decodes all records in 'records_' into 'packets'.
+  void Decode(std::vector<DecodedPacket>* packets);
+
+  // Decodes a range of 'records_', appending to 'packets'.
+  void DecodeRange(size_t from, size_t to,
+                   std::vector<DecodedPacket>* packets) const;
+
+  // Integers in the current source, in host byte order.
+  uint16_t Read16(const uint8_t* ptr) const;
+  uint32_t Read32(const uint8_t* ptr) const;
+
+  std::unique_ptr<OfflineSourceProvider> source_;
+  ExternalTimestampProvider* timestamp_provider_;
+
+  // The current source, null if none is open.
+  std::unique_ptr<MappedFile> file_;
+  std::string filename_;
+
+  // Offset of the next record or block in the current source.
+  size_t offset_;
+
+  // Whether the current source is pcapng or classic pcap.
+  bool pcapng_;
+
+  // True if the source was written on a host with a different byte order.
+  bool swapped_;
+
+  // Datalink and time units per second of a classic pcap source.
+  int datalink_;
+  uint64_t units_per_second_;
+
+  // Interfaces of the current pcapng section.
+  std::vector<Interface> interfaces_;
+
+  std::vector<Record> records_;
+
+  // Only set if there is more than one thread. Each thread decodes a range of
+  // 'records_' into its own vector, the vectors are then concatenated.
+  std::unique_ptr<ThreadBatchProcessor<std::pair<size_t, size_t>>> processor_;
+  std::vector<std::pair<size_t, size_t>> ranges_;
+  std::vector<std::vector<DecodedPacket>> range_packets_;
+  size_t thread_count_;
+
+  DISALLOW_COPY_AND_ASSIGN(MmapOfflinePcap);
+};
+
+}  // namespace pcap
+}  // namespace ncode
+
+#endif /* NCODE_PCAP_MMAP_H */
@@ -0,0 +1,331 @@
+#include "pcap_mmap.h"
+
+#include <arpa/inet.h>
+#include <cstring>
+
+#include "../common/file.h"
+#include "gtest/gtest.h"
+
+namespace ncode {
+namespace pcap {
+namespace {
+
+using namespace std::chrono;
+
+static constexpr uint16_t kEthernetLinkType = 1;
+
+// Appends an integer to a string, optionally with its bytes swapped.
+template <typename T>
+static void Append(T value, bool swap, std::string* out) {
+  char bytes[sizeof(T)];
+  memcpy(bytes, &value, sizeof(T));
+  if (swap) {
+    std::reverse(bytes, bytes + sizeof(T));
+  }
+  out->append(bytes, sizeof(T));
+}
+
+// An Ethernet frame with an IP packet with a TCP or a UDP header in it.
+static std::string Frame(uint8_t protocol, uint16_t src_port,
+                         uint16_t payload_len) {
+  size_t l4_len =
+      protocol == IPPROTO_TCP ? sizeof(TCPHeader) : sizeof(UDPHeader);
+  std::string frame(kSizeEthernet + sizeof(IPHeader) + l4_len + payload_len,
+                    0);
+  frame[12] = 8;
+
+  IPHeader ip_header;
+  memset(&ip_header, 0, sizeof(ip_header));
+  ip_header.ip_v = 4;
+  ip_header.ip_hl = 5;
+  ip_header.ip_len = htons(sizeof(IPHeader) + l4_len + payload_len);
+  ip_header.ip_off = htons(IP_DF);
+  ip_header.ip_p = protocol;
+  memcpy(&frame[kSizeEthernet], &ip_header, sizeof(ip_header));
+
+  char* l4 = &frame[kSizeEthernet + sizeof(IPHeader)];
+  if (protocol == IPPROTO_TCP) {
+    TCPHeader tcp_header;
+    memset(&tcp_header, 0, sizeof(tcp_header));
+    tcp_header.th_sport = htons(src_port);
+    tcp_header.th_off = 5;
+    memcpy(l4, &tcp_header, sizeof(tcp_header));
+  } else {
+    UDPHeader udp_header;
+    memset(&udp_header, 0, sizeof(udp_header));
+    udp_header.uh_sport = htons(src_port);
+    memcpy(l4, &udp_header, sizeof(udp_header));
+  }
+
+  return frame;
+}
+
+// An ARP frame, which should be skipped.
+static std::string NonIPFrame() {
+  std::string frame(42, 0);
+  frame[12] = 8;
+  frame[13] = 6;
+  return frame;
+}
+
+struct TestPacket {
+  uint64_t seconds;
+  uint64_t fraction;
+  std::string frame;
+};
+
+// A classic pcap file. The fractions are in nanoseconds if 'nanos' is set and
+// in microseconds otherwise.
+static std::string PcapFile(const std::vector<TestPacket>& packets, bool swap,
+                            bool nanos) {
+  std::string out;
+  Append<uint32_t>(nanos ? 0xa1b23c4d : 0xa1b2c3d4, swap, &out);
+  Append<uint16_t>(2, swap, &out);
+  Append<uint16_t>(4, swap, &out);
+  Append<uint32_t>(0, swap, &out);
+  Append<uint32_t>(0, swap, &out);
+  Append<uint32_t>(65535, swap, &out);
+  Append<uint32_t>(kEthernetLinkType, swap, &out);
+  for (const TestPacket& packet : packets) {
+    Append<uint32_t>(packet.seconds, swap, &out);
+    Append<uint32_t>(packet.fraction, swap, &out);
+    Append<uint32_t>(packet.frame.size(), swap, &out);
+    Append<uint32_t>(packet.frame.size(), swap, &out);
+    out += packet.frame;
+  }
+
+  return out;
+}
+
+// Appends a pcapng block with the given body, padding it to 32 bits.
+static void AppendBlock(uint32_t type, std::string body, bool swap,
+                        std::string* out) {
+  body.resize((body.size() + 3) & ~3, 0);
+  uint32_t len = body.size() + 12;
+  Append<uint32_t>(type, swap, out);
+  Append<uint32_t>(len, swap, out);
+  *out += body;
+  Append<uint32_t>(len, swap, out);
+}
+
+// A pcapng file with a single interface. The fractions are in units of
+// 10^-'resolution' seconds.
+static std::string PcapngFile(const std::vector<TestPacket>& packets,
+                              bool swap, uint8_t resolution) {
+  std::string out;
+  std::string section_header;
+  Append<uint32_t>(0x1a2b3c4d, swap, &section_header);
+  Append<uint16_t>(1, swap, &section_header);
+  Append<uint16_t>(0, swap, &section_header);
+  Append<uint64_t>(-1, swap, &section_header);
+  AppendBlock(0x0a0d0d0a, section_header, swap, &out);
+
+  // A block of an unknown type, should be skipped.
+  AppendBlock(0x0badbeef, "whatever", swap, &out);
+
+  std::string interface;
+  Append<uint16_t>(kEthernetLinkType, swap, &interface);
+  Append<uint16_t>(0, swap, &interface);
+  Append<uint32_t>(65535, swap, &interface);
+  Append<uint16_t>(9, swap, &interface);
+  Append<uint16_t>(1, swap, &interface);
+  interface += std::string(1, resolution) + std::string(3, 0);
+  Append<uint32_t>(0, swap, &interface);
+  AppendBlock(1, interface, swap, &out);
+
+  uint64_t units = 1;
+  for (uint8_t i = 0; i < resolution; ++i) {
+    units *= 10;
+  }
+
+  for (const TestPacket& packet : packets) {
+    uint64_t time = packet.seconds * units + packet.fraction;
+    std::string body;
+    Append<uint32_t>(0, swap, &body);
+    Append<uint32_t>(time >> 32, swap, &body);
+    Append<uint32_t>(time, swap, &body);
+    Append<uint32_t>(packet.frame.size(), swap, &body);
+    Append<uint32_t>(packet.frame.size(), swap, &body);
+    body += packet.frame;
+    AppendBlock(6, body, swap, &out);
+  }
+
+  return out;
+}
+
+static std::vector<TestPacket> SomePackets() {
+  return {{10, 1, Frame(IPPROTO_TCP, 100, 1000)},
+          {10, 2, NonIPFrame()},
+          {11, 3, Frame(IPPROTO_UDP, 200, 50)}};
+}
+
+static std::unique_ptr<OfflineSourceProvider> Write(
+    const std::vector<std::string>& contents) {
+  std::vector<std::string> filenames;
+  for (size_t i = 0; i < contents.size(); ++i) {
+    filenames.emplace_back(File::WorkingDirectoryOrDie() + "/pcap_mmap_test_" +
+                           std::to_string(i));
+    File::WriteStringToFileOrDie(contents[i], filenames.back());
+  }
+
+  return make_unique<DefaultOfflineSourceProvider>(filenames);
+}
+
+static uint16_t SrcPort(const DecodedPacket& packet) {
+  if (packet.kind == DecodedPacket::TCP) {
+    return ntohs(static_cast<const TCPHeader*>(packet.l4_header)->th_sport);
+  }
+
+  return ntohs(static_cast<const UDPHeader*>(packet.l4_header)->uh_sport);
+}
+
+// The fields of a decoded packet that tests check. Headers are not valid
+// after the batch they are in.
+struct ReadPacket {
+  DecodedPacket::Kind kind;
+  uint16_t src_port;
+  uint16_t payload_len;
+  Timestamp timestamp;
+};
+
+static std::vector<ReadPacket> ReadAll(
+    std::unique_ptr<OfflineSourceProvider> source, size_t thread_count = 1) {
+  MmapOfflinePcap mmap_pcap(std::move(source), thread_count);
+  std::vector<ReadPacket> all_packets;
+  std::vector<DecodedPacket> packets;
+  while (mmap_pcap.NextBatch(&packets)) {
+    EXPECT_FALSE(packets.empty());
+    for (const DecodedPacket& packet : packets) {
+      all_packets.push_back({packet.kind, SrcPort(packet), packet.payload_len,
+                             packet.timestamp});
+    }
+  }
+
+  return all_packets;
+}
+
+// Checks the packets read from a file with SomePackets in it.
+static void CheckSomePackets(const std::vector<ReadPacket>& packets,
+                             nanoseconds fraction_unit) {
+  ASSERT_EQ(2ul, packets.size());
+  ASSERT_EQ(DecodedPacket::TCP, packets[0].kind);
+  ASSERT_EQ(100, packets[0].src_port);
+  ASSERT_EQ(1000, packets[0].payload_len);
+  ASSERT_EQ(seconds(10) + fraction_unit, packets[0].timestamp);
+
+  // VerifyUDPHeader assumes the UDP header is kSizeUDP bytes.
+  ASSERT_EQ(DecodedPacket::UDP, packets[1].kind);
+  ASSERT_EQ(200, packets[1].src_port);
+  ASSERT_EQ(50 + sizeof(UDPHeader) - kSizeUDP, packets[1].payload_len);
+  ASSERT_EQ(seconds(11) + 3 * fraction_unit, packets[1].timestamp);
+}
+
+TEST(MmapPcap, Pcap) {
+  std::string contents = PcapFile(SomePackets(), false, false);
+  CheckSomePackets(ReadAll(Write({contents})), microseconds(1));
+}
+
+TEST(MmapPcap, PcapSwappedNanos) {
+  std::string contents = PcapFile(SomePackets(), true, true);
+  CheckSomePackets(ReadAll(Write({contents})), nanoseconds(1));
+}
+
+TEST(MmapPcap, Pcapng) {
+  std::string contents = PcapngFile(SomePackets(), false, 6);
+  CheckSomePackets(ReadAll(Write({contents})), microseconds(1));
+}
+
+TEST(MmapPcap, PcapngSwappedNanos) {
+  std::string contents = PcapngFile(SomePackets(), true, 9);
+  CheckSomePackets(ReadAll(Write({contents})), nanoseconds(1));
+}
+
+TEST(MmapPcap, Truncated) {
+  std::string contents = PcapFile(SomePackets(), false, false);
+  contents.resize(contents.size() - 1);
+  std::vector<ReadPacket> packets = ReadAll(Write({contents}));
+  ASSERT_EQ(1ul, packets.size());
+  ASSERT_EQ(100, packets[0].src_port);
+}
+
+TEST(MmapPcap, Empty) {
+  std::string contents = PcapFile({}, false, false);
+  ASSERT_TRUE(ReadAll(Write({contents, contents})).empty());
+}
+
+// Packets from many sources and batches should come out in order, no matter
+// how many threads decode them.
+TEST(MmapPcap, ManyPackets) {
+  std::vector<std::string> contents;
+  for (size_t file = 0; file < 3; ++file) {
+    std::vector<TestPacket> packets;
+    for (size_t i = 0; i < 2 * MmapOfflinePcap::kBatchSize + 1; ++i) {
+      uint16_t port = file * 10000 + i;
+      packets.push_back({file, i, Frame(IPPROTO_TCP, port, 10)});
+    }
+    contents.emplace_back(file % 2 ? PcapFile(packets, false, false)
+                                   : PcapngFile(packets, false, 6));
+  }
+
+  std::vector<ReadPacket> single_thread = ReadAll(Write(contents));
+  std::vector<ReadPacket> many_threads = ReadAll(Write(contents), 3);
+  ASSERT_EQ(3 * (2 * MmapOfflinePcap::kBatchSize + 1), single_thread.size());
+  ASSERT_EQ(single_thread.size(), many_threads.size());
+  for (size_t i = 0; i < single_thread.size(); ++i) {
+    size_t file = i / (2 * MmapOfflinePcap::kBatchSize + 1);
+    size_t index = i % (2 * MmapOfflinePcap::kBatchSize + 1);
+    ASSERT_EQ(file * 10000 + index, single_thread[i].src_port);
+    ASSERT_EQ(single_thread[i].src_port, many_threads[i].src_port);
+    ASSERT_EQ(seconds(file) + microseconds(index),
+              many_threads[i].timestamp);
+  }
+}
+
+class CountingTimestampProvider : public ExternalTimestampProvider {
+ public:
+  CountingTimestampProvider() : count_(0) {}
+
+  Timestamp NextTimestamp() override { return Timestamp(++count_); }
+
+ private:
+  uint64_t count_;
+};
+
+class CountingHandler : public PacketHandler {
+ public:
+  void HandleTCP(Timestamp timestamp, const IPHeader& ip_header,
+                 const TCPHeader& tcp_header, uint16_t payload_len) override {
+    Unused(ip_header);
+    Unused(tcp_header);
+    Unused(payload_len);
+    timestamps.emplace_back(timestamp);
+  }
+
+  void HandleUDP(Timestamp timestamp, const IPHeader& ip_header,
+                 const UDPHeader& udp_header, uint16_t payload_len) override {
+    Unused(ip_header);
+    Unused(udp_header);
+    Unused(payload_len);
+    timestamps.emplace_back(timestamp);
+  }
+
+  std::vector<Timestamp> timestamps;
+};
+
+TEST(MmapPcap, TimestampProvider) {
+  std::string contents = PcapFile(SomePackets(), false, false);
+  CountingTimestampProvider timestamp_provider;
+  CountingHandler handler;
+
+  MmapOfflinePcap mmap_pcap(Write({contents}));
+  mmap_pcap.set_timestamp_provider(&timestamp_provider);
+  mmap_pcap.Run(&handler);
+
+  // The provider is called for the non-IP frame too.
+  std::vector<Timestamp> model = {Timestamp(1), Timestamp(3)};
+  ASSERT_EQ(model, handler.timestamps);
+}
+
+}  // namespace
+}  // namespace pcap
+}  // namespace ncode
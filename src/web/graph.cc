@@ -114,17 +114,17 @@ void GraphToHTML(const std::vector<EdgeData>& edges,
     path_data_helper.legend_label = path_data.legend_label;
 
     const net::GraphPath* path = path_data.path;
-    path_data_helper.node_indices.reserve(path->link_sequence().size() + 1);
+    path_data_helper.node_indices.reserve(path->size() + 1);
 
-    const net::Links& links_on_path = path->link_sequence().links();
-    for (net::GraphLinkIndex link : links_on_path) {
+    for (size_t i = 0; i < path->size(); ++i) {
+      net::GraphLinkIndex link = path->link(i);
       net::GraphNodeIndex src_index = storage->GetLink(link)->src();
       net::GraphNodeIndex dst_index = storage->GetLink(link)->dst();
 
       // Each source will be added to the path's nodes, as well as the
       // destination of the last link.
       path_data_helper.node_indices.emplace_back(src_index);
-      if (link == links_on_path.back()) {
+      if (i == path->size() - 1) {
         path_data_helper.node_indices.emplace_back(dst_index);
       }
     }